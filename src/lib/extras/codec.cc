@@ -5,6 +5,10 @@
 
 #include "lib/extras/codec.h"
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
 #include "jxl/decode.h"
 #include "jxl/types.h"
 #include "lib/extras/packed_image.h"
@@ -27,6 +31,7 @@
 #include "lib/extras/packed_image_convert.h"
 #include "lib/jxl/base/file_io.h"
 #include "lib/jxl/image_bundle.h"
+#include "lib/jxl/image_ops.h"
 
 namespace jxl {
 namespace {
@@ -34,21 +39,65 @@ namespace {
 // Any valid encoding is larger (ensures codecs can read the first few bytes)
 constexpr size_t kMinBytes = 9;
 
-}  // namespace
+// Crops the images of the main frame of `io` to rows [y0, y1).
+Status CropRows(size_t y0, size_t y1, CodecInOut* io) {
+  ImageBundle& ib = io->Main();
+  y1 = std::min(y1, ib.ysize());
+  if (y0 >= y1) return JXL_FAILURE("No rows are needed");
+  const Rect rows(0, y0, ib.xsize(), y1 - y0);
+  Image3F color(rows.xsize(), rows.ysize());
+  CopyImageTo(rows, *ib.color(), &color);
+  std::vector<ImageF> extra_channels;
+  for (const ImageF& plane : ib.extra_channels()) {
+    extra_channels.emplace_back(rows.xsize(), rows.ysize());
+    CopyImageTo(rows, plane, &extra_channels.back());
+  }
+  const ColorEncoding c_current = ib.c_current();
+  ib.ClearExtraChannels();
+  ib.SetFromImage(std::move(color), c_current);
+  ib.SetExtraChannels(std::move(extra_channels));
+  return true;
+}
 
-Status SetFromBytes(const Span<const uint8_t> bytes,
-                    const extras::ColorHints& color_hints, CodecInOut* io,
-                    ThreadPool* pool, extras::Codec* orig_codec) {
+// Shared implementation of SetFromBytes, SetRowsFromBytes and
+// SetStripFromBytes.
+Status DecodeRows(const Span<const uint8_t> bytes,
+                  const extras::ColorHints& color_hints,
+                  const extras::NeededRowsFunc& needed_rows,
+                  bool only_needed_rows, CodecInOut* io, ThreadPool* pool,
+                  extras::Codec* orig_codec) {
   if (bytes.size() < kMinBytes) return JXL_FAILURE("Too few bytes");
 
+  // Codecs with a row-wise decoder convert straight into io.
+  extras::CodecInOutRowSink sink(pool, io);
+  if (needed_rows) sink.SetNeededRows(needed_rows);
+  if (only_needed_rows) sink.KeepOnlyNeededRows();
+  if (extras::StreamBytes(bytes, color_hints, io->constraints, &sink,
+                          orig_codec)) {
+    return true;
+  }
+
   extras::PackedPixelFile ppf;
   if (extras::DecodeBytes(bytes, color_hints, io->constraints, &ppf,
                           orig_codec)) {
-    return ConvertPackedPixelFileToCodecInOut(ppf, pool, io);
+    JXL_RETURN_IF_ERROR(ConvertPackedPixelFileToCodecInOut(ppf, pool, io));
+    if (!only_needed_rows) return true;
+    size_t y0, y1;
+    needed_rows(io->xsize(), io->ysize(), &y0, &y1);
+    return CropRows(y0, y1, io);
   }
   return JXL_FAILURE("Codecs failed to decode");
 }
 
+}  // namespace
+
+Status SetFromBytes(const Span<const uint8_t> bytes,
+                    const extras::ColorHints& color_hints, CodecInOut* io,
+                    ThreadPool* pool, extras::Codec* orig_codec) {
+  return DecodeRows(bytes, color_hints, extras::NeededRowsFunc(),
+                    /*only_needed_rows=*/false, io, pool, orig_codec);
+}
+
 Status SetFromFile(const std::string& pathname,
                    const extras::ColorHints& color_hints, CodecInOut* io,
                    ThreadPool* pool, extras::Codec* orig_codec) {
@@ -59,6 +108,60 @@ Status SetFromFile(const std::string& pathname,
   return true;
 }
 
+Status SetRowsFromBytes(const Span<const uint8_t> bytes,
+                        const extras::ColorHints& color_hints, size_t y0,
+                        size_t y1, CodecInOut* io, ThreadPool* pool) {
+  return SetRowsFromBytes(
+      bytes, color_hints,
+      [y0, y1](size_t, size_t, size_t* rows_y0, size_t* rows_y1) {
+        *rows_y0 = y0;
+        *rows_y1 = y1;
+      },
+      io, pool);
+}
+
+Status SetRowsFromBytes(const Span<const uint8_t> bytes,
+                        const extras::ColorHints& color_hints,
+                        const extras::NeededRowsFunc& needed_rows,
+                        CodecInOut* io, ThreadPool* pool) {
+  return DecodeRows(bytes, color_hints, needed_rows,
+                    /*only_needed_rows=*/false, io, pool,
+                    /*orig_codec=*/nullptr);
+}
+
+Status SetStripFromBytes(const Span<const uint8_t> bytes,
+                         const extras::ColorHints& color_hints, size_t y0,
+                         size_t y1, CodecInOut* io, ThreadPool* pool) {
+  return DecodeRows(
+      bytes, color_hints,
+      [y0, y1](size_t, size_t, size_t* rows_y0, size_t* rows_y1) {
+        *rows_y0 = y0;
+        *rows_y1 = y1;
+      },
+      /*only_needed_rows=*/true, io, pool, /*orig_codec=*/nullptr);
+}
+
+Status SetRowsFromFile(const std::string& pathname,
+                       const extras::ColorHints& color_hints, size_t y0,
+                       size_t y1, CodecInOut* io, ThreadPool* pool) {
+  std::vector<uint8_t> encoded;
+  JXL_RETURN_IF_ERROR(ReadFile(pathname, &encoded));
+  JXL_RETURN_IF_ERROR(SetRowsFromBytes(Span<const uint8_t>(encoded),
+                                       color_hints, y0, y1, io, pool));
+  return true;
+}
+
+Status SetRowsFromFile(const std::string& pathname,
+                       const extras::ColorHints& color_hints,
+                       const extras::NeededRowsFunc& needed_rows,
+                       CodecInOut* io, ThreadPool* pool) {
+  std::vector<uint8_t> encoded;
+  JXL_RETURN_IF_ERROR(ReadFile(pathname, &encoded));
+  JXL_RETURN_IF_ERROR(SetRowsFromBytes(Span<const uint8_t>(encoded),
+                                       color_hints, needed_rows, io, pool));
+  return true;
+}
+
 Status Encode(const CodecInOut& io, const extras::Codec codec,
               const ColorEncoding& c_desired, size_t bits_per_sample,
               std::vector<uint8_t>* bytes, ThreadPool* pool) {
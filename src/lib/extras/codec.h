@@ -15,6 +15,7 @@
 
 #include "lib/extras/dec/color_hints.h"
 #include "lib/extras/dec/decode.h"
+#include "lib/extras/dec/row_sink.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/padded_bytes.h"
@@ -45,6 +46,39 @@ Status SetFromFile(const std::string& pathname,
                    ThreadPool* pool = nullptr,
                    extras::Codec* orig_codec = nullptr);
 
+// Same as SetFromBytes, but only rows [y0, y1) are needed (y1 may exceed the
+// image height). PNG and JPEG decoders skip the other rows where possible and
+// leave them uninitialized in io.
+Status SetRowsFromBytes(Span<const uint8_t> bytes,
+                        const extras::ColorHints& color_hints, size_t y0,
+                        size_t y1, CodecInOut* io, ThreadPool* pool = nullptr);
+
+// Reads from file and calls SetRowsFromBytes.
+Status SetRowsFromFile(const std::string& pathname,
+                       const extras::ColorHints& color_hints, size_t y0,
+                       size_t y1, CodecInOut* io, ThreadPool* pool = nullptr);
+
+// Same as SetRowsFromBytes, but the needed rows are given by `needed_rows`
+// once the image size is known.
+Status SetRowsFromBytes(Span<const uint8_t> bytes,
+                        const extras::ColorHints& color_hints,
+                        const extras::NeededRowsFunc& needed_rows,
+                        CodecInOut* io, ThreadPool* pool = nullptr);
+
+// Reads from file and calls SetRowsFromBytes.
+Status SetRowsFromFile(const std::string& pathname,
+                       const extras::ColorHints& color_hints,
+                       const extras::NeededRowsFunc& needed_rows,
+                       CodecInOut* io, ThreadPool* pool = nullptr);
+
+// Same as SetRowsFromBytes, but the images of io only hold rows [y0, y1),
+// which must not be empty after clamping to the image height, while
+// io->xsize() and io->ysize() are those of the whole image. Only PNG and JPEG
+// decode row by row; other codecs decode the whole image before cropping it.
+Status SetStripFromBytes(Span<const uint8_t> bytes,
+                         const extras::ColorHints& color_hints, size_t y0,
+                         size_t y1, CodecInOut* io, ThreadPool* pool = nullptr);
+
 // Replaces "bytes" with an encoding of pixels transformed from c_current
 // color space to c_desired.
 Status Encode(const CodecInOut& io, extras::Codec codec,
@@ -7,6 +7,8 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <zlib.h>
 
 #include <algorithm>
 #include <sstream>
@@ -14,10 +16,12 @@
 #include <utility>
 #include <vector>
 
+#include "lib/extras/dec/apng.h"
 #include "lib/extras/dec/pgx.h"
 #include "lib/extras/dec/pnm.h"
 #include "lib/extras/enc/encode.h"
 #include "lib/extras/packed_image_convert.h"
+#include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/random.h"
 #include "lib/jxl/base/thread_pool_internal.h"
@@ -25,6 +29,7 @@
 #include "lib/jxl/enc_color_management.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
+#include "lib/jxl/image_ops.h"
 #include "lib/jxl/image_test_utils.h"
 #include "lib/jxl/test_utils.h"
 #include "lib/jxl/testdata.h"
@@ -266,6 +271,33 @@ void TestRoundTrip(const TestImageParams& params, ThreadPool* pool) {
   VerifySameImage(ppf_in.frames[0].color, ppf_in.info.bits_per_sample,
                   ppf_out.frames[0].color, ppf_out.info.bits_per_sample,
                   /*lossless=*/params.codec != Codec::kJPG);
+
+  if (params.codec == Codec::kPNG || params.codec == Codec::kJPG) {
+    // Row-wise decoding must give the same result as full-frame decoding.
+    CodecInOut io_full;
+    ASSERT_TRUE(ConvertPackedPixelFileToCodecInOut(ppf_out, pool, &io_full));
+    CodecInOut io_rows;
+    CodecInOutRowSink sink(pool, &io_rows);
+    ASSERT_TRUE(StreamBytes(Span<const uint8_t>(encoded.bitstreams[0]),
+                            ColorHints(), SizeConstraints(), &sink));
+    EXPECT_EQ(io_full.metadata.m.bit_depth.bits_per_sample,
+              io_rows.metadata.m.bit_depth.bits_per_sample);
+    EXPECT_EQ(io_full.Main().HasAlpha(), io_rows.Main().HasAlpha());
+    VerifyEqual(*io_full.Main().color(), *io_rows.Main().color());
+    if (io_full.Main().HasAlpha()) {
+      VerifyEqual(*io_full.Main().alpha(), *io_rows.Main().alpha());
+    }
+
+    // Decoding only some rows must give the same values for these rows.
+    const size_t y0 = params.ysize / 4;
+    const size_t y1 = params.ysize - 1;
+    CodecInOut io_part;
+    ASSERT_TRUE(SetRowsFromBytes(Span<const uint8_t>(encoded.bitstreams[0]),
+                                 ColorHints(), y0, y1, &io_part, pool));
+    const Rect rows(0, y0, params.xsize, y1 - y0);
+    VerifyEqual(CopyImage(rows, *io_full.Main().color()),
+                CopyImage(rows, *io_part.Main().color()));
+  }
 }
 
 TEST(CodecTest, TestRoundTrip) {
@@ -551,6 +583,98 @@ TEST(CodecTest, EncodeToPNG) {
                   decoded_ppf.info.bits_per_sample);
 }
 
+// Returns a PNG chunk of type `type` with the big-endian `values` as payload.
+std::vector<uint8_t> PNGChunk(const char* type,
+                              const std::vector<uint32_t>& values) {
+  std::vector<uint8_t> chunk(12 + 4 * values.size());
+  StoreBE32(4 * values.size(), chunk.data());
+  memcpy(chunk.data() + 4, type, 4);
+  for (size_t i = 0; i < values.size(); ++i) {
+    StoreBE32(values[i], chunk.data() + 8 + 4 * i);
+  }
+  const size_t crc_pos = chunk.size() - 4;
+  StoreBE32(crc32(0, chunk.data() + 4, crc_pos - 4), chunk.data() + crc_pos);
+  return chunk;
+}
+
+// Keeps what Begin receives.
+class HeaderRowSink : public RowSink {
+ public:
+  Status Begin(const PackedPixelFile& ppf,
+               const JxlPixelFormat& format) override {
+    info = ppf.info;
+    color_encoding = ppf.color_encoding;
+    icc = ppf.icc;
+    exif = ppf.metadata.exif;
+    return true;
+  }
+  Status Rows(size_t y0, size_t num_rows, const void* pixels,
+              size_t stride) override {
+    return true;
+  }
+
+  JxlBasicInfo info;
+  JxlColorEncoding color_encoding;
+  std::vector<uint8_t> icc;
+  std::vector<uint8_t> exif;
+};
+
+TEST(CodecTest, PNGColorChunksSameWhenStreamed) {
+  PackedPixelFile ppf_in;
+  CreateTestImage({Codec::kPNG, 7, 5, 8, /*is_gray=*/false,
+                   /*add_alpha=*/false, /*big_endian=*/true},
+                  &ppf_in);
+  EncodedImage encoded;
+  auto encoder = Encoder::FromExtension(".png");
+  ASSERT_TRUE(encoder.get());
+  ASSERT_TRUE(encoder->Encode(ppf_in, &encoded, nullptr));
+  ASSERT_EQ(encoded.bitstreams.size(), 1);
+
+  // Adds gAMA, cHRM and eXIf after IHDR (at 8 + 25) to the iCCP the encoder
+  // wrote.
+  std::vector<uint8_t> png = encoded.bitstreams[0];
+  const std::vector<uint8_t> gama = PNGChunk("gAMA", {45455});
+  const std::vector<uint8_t> chrm = PNGChunk(
+      "cHRM", {31270, 32900, 68000, 32000, 26500, 69000, 15000, 6000});
+  const std::vector<uint8_t> exif = PNGChunk("eXIf", {0x4D4D002A, 8});
+  ASSERT_EQ(memcmp(png.data() + 12, "IHDR", 4), 0);
+  for (const auto* chunk : {&exif, &chrm, &gama}) {
+    png.insert(png.begin() + 33, chunk->begin(), chunk->end());
+  }
+
+  PackedPixelFile ppf;
+  ASSERT_TRUE(DecodeImageAPNG(Span<const uint8_t>(png), ColorHints(),
+                              SizeConstraints(), &ppf));
+  HeaderRowSink sink;
+  ASSERT_TRUE(StreamImagePNG(Span<const uint8_t>(png), ColorHints(),
+                             SizeConstraints(), &sink));
+
+  EXPECT_EQ(ppf.icc, ppf_in.icc);
+  EXPECT_EQ(ppf.color_encoding.transfer_function, JXL_TRANSFER_FUNCTION_GAMMA);
+  EXPECT_EQ(ppf.color_encoding.primaries, JXL_PRIMARIES_CUSTOM);
+  EXPECT_EQ(ppf.metadata.exif.size(), 8);
+
+  EXPECT_EQ(sink.icc, ppf.icc);
+  EXPECT_EQ(sink.exif, ppf.metadata.exif);
+  EXPECT_EQ(sink.info.bits_per_sample, ppf.info.bits_per_sample);
+  EXPECT_EQ(sink.info.num_color_channels, ppf.info.num_color_channels);
+  EXPECT_EQ(sink.info.alpha_bits, ppf.info.alpha_bits);
+  const JxlColorEncoding& c = sink.color_encoding;
+  const JxlColorEncoding& expected = ppf.color_encoding;
+  EXPECT_EQ(c.color_space, expected.color_space);
+  EXPECT_EQ(c.white_point, expected.white_point);
+  EXPECT_EQ(c.primaries, expected.primaries);
+  EXPECT_EQ(c.transfer_function, expected.transfer_function);
+  EXPECT_EQ(c.rendering_intent, expected.rendering_intent);
+  EXPECT_EQ(c.gamma, expected.gamma);
+  for (size_t i = 0; i < 2; ++i) {
+    EXPECT_EQ(c.white_point_xy[i], expected.white_point_xy[i]);
+    EXPECT_EQ(c.primaries_red_xy[i], expected.primaries_red_xy[i]);
+    EXPECT_EQ(c.primaries_green_xy[i], expected.primaries_green_xy[i]);
+    EXPECT_EQ(c.primaries_blue_xy[i], expected.primaries_blue_xy[i]);
+  }
+}
+
 }  // namespace
 }  // namespace extras
 }  // namespace jxl
@@ -39,6 +39,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -402,8 +403,291 @@ int processing_finish(png_structp png_ptr, png_infop info_ptr,
   return 0;
 }
 
+void read_from_memory(png_structp png_ptr, png_bytep data, png_size_t length) {
+  Reader* r = static_cast<Reader*>(png_get_io_ptr(png_ptr));
+  if (!r->Read(data, length)) png_error(png_ptr, "Unexpected end of PNG data");
+}
+
+// Returns whether an acTL chunk precedes the first IDAT chunk.
+bool IsAnimated(const Span<const uint8_t> bytes) {
+  size_t pos = 8;
+  while (pos + 8 <= bytes.size()) {
+    const uint32_t size = png_get_uint_32(bytes.data() + pos);
+    const uint32_t id = LoadLE32(bytes.data() + pos + 4);
+    if (id == kId_acTL) return true;
+    if (id == kId_IDAT || size > kMaxPNGChunkSize) return false;
+    pos += size + 12;
+  }
+  return false;
+}
+
+// Chunks that PNGHeaderDecoder decodes itself, which libpng is not to
+// interpret in its own way when it reads the whole header.
+const png_byte kPngChunksDecodedFromBytes[] = {
+    115, 82, 71, 66, '\0', /* sRGB */
+    103, 65, 77, 65, '\0', /* gAMA */
+    99,  72, 82, 77, '\0', /* cHRM */
+    101, 88, 73, 102, '\0' /* eXIf */
+};
+
+// Interprets the header and the color chunks of a PNG image into `ppf` the
+// same way for DecodeImageAPNG and StreamImagePNG: sRGB, gAMA, cHRM and eXIf
+// from the chunks themselves, in the order in which they appear, and the ICC
+// profile and image info as libpng read them.
+class PNGHeaderDecoder {
+ public:
+  // Sets the defaults that apply unless the chunks say otherwise.
+  explicit PNGHeaderDecoder(PackedPixelFile* ppf) : ppf_(ppf) {
+    ppf_->info.exponent_bits_per_sample = 0;
+    ppf_->info.alpha_exponent_bits = 0;
+    ppf_->info.orientation = JXL_ORIENT_IDENTITY;
+    // default settings in case e.g. only gAMA is given
+    ppf_->color_encoding.color_space = JXL_COLOR_SPACE_RGB;
+    ppf_->color_encoding.white_point = JXL_WHITE_POINT_D65;
+    ppf_->color_encoding.primaries = JXL_PRIMARIES_SRGB;
+    ppf_->color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_SRGB;
+  }
+
+  // Returns whether Chunk decodes chunks of type `id`.
+  static bool Decodes(const uint32_t id) {
+    return id == kId_sRGB || id == kId_gAMA || id == kId_cHRM ||
+           id == kId_eXIf;
+  }
+
+  // Decodes `chunk` of `size` bytes (including length, type and CRC), whose
+  // type is one that Decodes returns true for.
+  Status Chunk(const uint8_t* chunk, const size_t size) {
+    const uint32_t id = LoadLE32(chunk + 4);
+    const uint8_t* payload = chunk + 8;
+    const size_t payload_size = size - 12;
+    if (id == kId_sRGB) {
+      JXL_RETURN_IF_ERROR(
+          DecodeSRGB(payload, payload_size, &ppf_->color_encoding));
+      have_srgb_ = true;
+      have_color_ = true;
+    } else if (id == kId_gAMA) {
+      JXL_RETURN_IF_ERROR(
+          DecodeGAMA(payload, payload_size, &ppf_->color_encoding));
+      have_color_ = true;
+    } else if (id == kId_cHRM) {
+      JXL_RETURN_IF_ERROR(
+          DecodeCHRM(payload, payload_size, &ppf_->color_encoding));
+      have_color_ = true;
+    } else if (id == kId_eXIf) {
+      ppf_->metadata.exif.assign(payload, payload + payload_size);
+    }
+    return true;
+  }
+
+  // Decodes the chunks before the first IDAT chunk of `bytes` that Decodes
+  // returns true for.
+  Status ChunksBeforeIDAT(const Span<const uint8_t> bytes) {
+    size_t pos = 8;
+    while (pos + 12 <= bytes.size()) {
+      const uint32_t size = png_get_uint_32(bytes.data() + pos);
+      const uint32_t id = LoadLE32(bytes.data() + pos + 4);
+      if (id == kId_IDAT || size > bytes.size() - pos - 12) break;
+      if (Decodes(id)) {
+        JXL_RETURN_IF_ERROR(Chunk(bytes.data() + pos, size + 12));
+      }
+      pos += size + 12;
+    }
+    return true;
+  }
+
+  // Takes the ICC profile that libpng read from the iCCP chunk, if any.
+  void ICC(png_structp png_ptr, png_infop info_ptr) {
+    // TODO(jon): catch special case of PQ and synthesize color encoding
+    // in that case
+    int compression_type;
+    png_bytep profile;
+    png_charp name;
+    png_uint_32 proflen = 0;
+    auto ok = png_get_iCCP(png_ptr, info_ptr, &name, &compression_type,
+                           &profile, &proflen);
+    if (ok && proflen) {
+      ppf_->icc.assign(profile, profile + proflen);
+      have_color_ = true;
+    } else {
+      // TODO(eustas): JXL_WARNING?
+    }
+  }
+
+  // Decodes the image info from the IHDR, sBIT and tRNS chunks as libpng read
+  // them.
+  Status Info(png_structp png_ptr, png_infop info_ptr,
+              const SizeConstraints& constraints) {
+    const png_uint_32 w = png_get_image_width(png_ptr, info_ptr);
+    const png_uint_32 h = png_get_image_height(png_ptr, info_ptr);
+    int colortype = png_get_color_type(png_ptr, info_ptr);
+    ppf_->info.bits_per_sample = png_get_bit_depth(png_ptr, info_ptr);
+    png_color_8p sigbits = NULL;
+    png_get_sBIT(png_ptr, info_ptr, &sigbits);
+    if (colortype & 1) {
+      // palette will actually be 8-bit regardless of the index bitdepth
+      ppf_->info.bits_per_sample = 8;
+    }
+    if (colortype & 2) {
+      ppf_->info.num_color_channels = 3;
+      if (sigbits && sigbits->red == sigbits->green &&
+          sigbits->green == sigbits->blue)
+        ppf_->info.bits_per_sample = sigbits->red;
+    } else {
+      ppf_->info.num_color_channels = 1;
+      if (sigbits) ppf_->info.bits_per_sample = sigbits->gray;
+    }
+    if (colortype & 4 || png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+      ppf_->info.alpha_bits = ppf_->info.bits_per_sample;
+      if (sigbits) {
+        if (sigbits->alpha && sigbits->alpha != ppf_->info.bits_per_sample) {
+          return JXL_FAILURE("Unsupported alpha bit-depth");
+        }
+        ppf_->info.alpha_bits = sigbits->alpha;
+      }
+    } else {
+      ppf_->info.alpha_bits = 0;
+    }
+    ppf_->color_encoding.color_space =
+        (ppf_->info.num_color_channels == 1 ? JXL_COLOR_SPACE_GRAY
+                                            : JXL_COLOR_SPACE_RGB);
+    ppf_->info.xsize = w;
+    ppf_->info.ysize = h;
+    return VerifyDimensions(&constraints, w, h);
+  }
+
+  // Completes the color encoding once all chunks before the image data have
+  // been decoded.
+  Status Finish(const ColorHints& color_hints) {
+    if (have_srgb_) {
+      ppf_->color_encoding.white_point = JXL_WHITE_POINT_D65;
+      ppf_->color_encoding.primaries = JXL_PRIMARIES_SRGB;
+      ppf_->color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_SRGB;
+      ppf_->color_encoding.rendering_intent = JXL_RENDERING_INTENT_PERCEPTUAL;
+    }
+    return ApplyColorHints(color_hints, have_color_,
+                           ppf_->info.num_color_channels == 1, ppf_);
+  }
+
+ private:
+  PackedPixelFile* ppf_;
+  bool have_color_ = false;
+  bool have_srgb_ = false;
+};
+
 }  // namespace
 
+Status StreamImagePNG(const Span<const uint8_t> bytes,
+                      const ColorHints& color_hints,
+                      const SizeConstraints& constraints, RowSink* sink) {
+  // Not a PNG => not an error
+  unsigned char png_signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  if (bytes.size() < 8 || memcmp(bytes.data(), png_signature, 8) != 0) {
+    return false;
+  }
+  // Animations need the frame compositing of DecodeImageAPNG.
+  if (IsAnimated(bytes)) return false;
+
+  Reader r = {bytes.data(), bytes.data() + bytes.size()};
+  PackedPixelFile ppf;
+  PNGHeaderDecoder header(&ppf);
+  std::vector<uint8_t> pixels;
+  std::vector<png_bytep> rows;
+  png_structp png_ptr =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : nullptr;
+
+  // Make sure png memory is released in any case.
+  auto scope_guard = MakeScopeGuard([&]() {
+    png_destroy_read_struct(&png_ptr, &info_ptr, 0);
+    png_ptr = nullptr;
+    info_ptr = nullptr;
+  });
+  if (!png_ptr || !info_ptr) return JXL_FAILURE("Failed to create PNG reader");
+
+  // All locals with non-trivial destructors are declared above, so that
+  // longjmp does not skip them.
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    return JXL_FAILURE("Failed to decode PNG");
+  }
+  png_set_keep_unknown_chunks(png_ptr, 1, kIgnoredPngChunks,
+                              (int)sizeof(kIgnoredPngChunks) / 5);
+  // Like DecodeImageAPNG, which does not pass them to libpng.
+  png_set_keep_unknown_chunks(png_ptr, 1, kPngChunksDecodedFromBytes,
+                              (int)sizeof(kPngChunksDecodedFromBytes) / 5);
+  png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+  png_set_read_fn(png_ptr, &r, read_from_memory);
+  png_read_info(png_ptr, info_ptr);
+
+  const png_uint_32 w = png_get_image_width(png_ptr, info_ptr);
+  const png_uint_32 h = png_get_image_height(png_ptr, info_ptr);
+  if (w > cMaxPNGSize || h > cMaxPNGSize) {
+    return false;
+  }
+  JXL_RETURN_IF_ERROR(header.Info(png_ptr, info_ptr, constraints));
+  ppf.info.uses_original_profile = true;
+  JXL_RETURN_IF_ERROR(header.ChunksBeforeIDAT(bytes));
+  header.ICC(png_ptr, info_ptr);
+  JXL_RETURN_IF_ERROR(header.Finish(color_hints));
+  // XMP and Exif of the text chunks before the image data.
+  png_textp text_ptr;
+  int num_text = 0;
+  png_get_text(png_ptr, info_ptr, &text_ptr, &num_text);
+  for (int i = 0; i < num_text; i++) {
+    (void)BlobsReaderPNG::Decode(text_ptr[i], &ppf.metadata);
+  }
+
+  png_set_expand(png_ptr);
+  png_set_palette_to_rgb(png_ptr);
+  png_set_tRNS_to_alpha(png_ptr);
+  const int passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  const uint32_t num_channels =
+      ppf.info.num_color_channels + (ppf.info.alpha_bits ? 1 : 0);
+  const JxlPixelFormat format = {
+      /*num_channels=*/num_channels,
+      /*data_type=*/ppf.info.bits_per_sample > 8 ? JXL_TYPE_UINT16
+                                                 : JXL_TYPE_UINT8,
+      /*endianness=*/JXL_BIG_ENDIAN,
+      /*align=*/0,
+  };
+  const size_t bytes_per_pixel =
+      num_channels * (format.data_type == JXL_TYPE_UINT16 ? 2 : 1);
+  const size_t rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+  if (rowbytes != w * bytes_per_pixel) {
+    return JXL_FAILURE("Unexpected PNG row size");
+  }
+  JXL_RETURN_IF_ERROR(sink->Begin(ppf, format));
+  size_t y0, y1;
+  sink->NeededRows(&y0, &y1);
+  y1 = std::min<size_t>(y1, h);
+  y0 = std::min(y0, y1);
+
+  if (passes == 1) {
+    // Rows are final as soon as libpng returns them. The rows before y0 still
+    // have to be decompressed, but there is no need to read beyond y1.
+    pixels.resize(rowbytes);
+    for (size_t y = 0; y < y1; ++y) {
+      png_read_row(png_ptr, pixels.data(), NULL);
+      if (y < y0) continue;
+      JXL_RETURN_IF_ERROR(sink->Rows(y, 1, pixels.data(), rowbytes));
+    }
+    if (y1 == h) png_read_end(png_ptr, NULL);
+  } else {
+    // Interlaced images only have final rows after the last pass.
+    pixels.resize(rowbytes * h);
+    rows.resize(h);
+    for (size_t y = 0; y < h; ++y) rows[y] = pixels.data() + y * rowbytes;
+    png_read_image(png_ptr, rows.data());
+    if (y1 > y0) {
+      JXL_RETURN_IF_ERROR(
+          sink->Rows(y0, y1 - y0, pixels.data() + y0 * rowbytes, rowbytes));
+    }
+    png_read_end(png_ptr, NULL);
+  }
+  return sink->End();
+}
+
 Status DecodeImageAPNG(const Span<const uint8_t> bytes,
                        const ColorHints& color_hints,
                        const SizeConstraints& constraints,
@@ -451,13 +735,10 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
   }
   id = read_chunk(&r, &chunkIHDR);
 
-  ppf->info.exponent_bits_per_sample = 0;
-  ppf->info.alpha_exponent_bits = 0;
-  ppf->info.orientation = JXL_ORIENT_IDENTITY;
+  PNGHeaderDecoder header(ppf);
 
   ppf->frames.clear();
 
-  bool have_color = false, have_srgb = false;
   bool errorstate = true;
   if (id == kId_IHDR && chunkIHDR.size() == 25) {
     x0 = 0;
@@ -473,12 +754,6 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
       return false;
     }
 
-    // default settings in case e.g. only gAMA is given
-    ppf->color_encoding.color_space = JXL_COLOR_SPACE_RGB;
-    ppf->color_encoding.white_point = JXL_WHITE_POINT_D65;
-    ppf->color_encoding.primaries = JXL_PRIMARIES_SRGB;
-    ppf->color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_SRGB;
-
     if (!processing_start(png_ptr, info_ptr, (void*)&frameRaw, hasInfo,
                           chunkIHDR, chunksInfo)) {
       while (!r.Eof()) {
@@ -547,44 +822,7 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
           hasInfo = true;
           JXL_CHECK(w == png_get_image_width(png_ptr, info_ptr));
           JXL_CHECK(h == png_get_image_height(png_ptr, info_ptr));
-          int colortype = png_get_color_type(png_ptr, info_ptr);
-          ppf->info.bits_per_sample = png_get_bit_depth(png_ptr, info_ptr);
-          png_color_8p sigbits = NULL;
-          png_get_sBIT(png_ptr, info_ptr, &sigbits);
-          if (colortype & 1) {
-            // palette will actually be 8-bit regardless of the index bitdepth
-            ppf->info.bits_per_sample = 8;
-          }
-          if (colortype & 2) {
-            ppf->info.num_color_channels = 3;
-            ppf->color_encoding.color_space = JXL_COLOR_SPACE_RGB;
-            if (sigbits && sigbits->red == sigbits->green &&
-                sigbits->green == sigbits->blue)
-              ppf->info.bits_per_sample = sigbits->red;
-          } else {
-            ppf->info.num_color_channels = 1;
-            ppf->color_encoding.color_space = JXL_COLOR_SPACE_GRAY;
-            if (sigbits) ppf->info.bits_per_sample = sigbits->gray;
-          }
-          if (colortype & 4 ||
-              png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
-            ppf->info.alpha_bits = ppf->info.bits_per_sample;
-            if (sigbits) {
-              if (sigbits->alpha &&
-                  sigbits->alpha != ppf->info.bits_per_sample) {
-                return JXL_FAILURE("Unsupported alpha bit-depth");
-              }
-              ppf->info.alpha_bits = sigbits->alpha;
-            }
-          } else {
-            ppf->info.alpha_bits = 0;
-          }
-          ppf->color_encoding.color_space =
-              (ppf->info.num_color_channels == 1 ? JXL_COLOR_SPACE_GRAY
-                                                 : JXL_COLOR_SPACE_RGB);
-          ppf->info.xsize = w;
-          ppf->info.ysize = h;
-          JXL_RETURN_IF_ERROR(VerifyDimensions(&constraints, w, h));
+          JXL_RETURN_IF_ERROR(header.Info(png_ptr, info_ptr, constraints));
           num_channels =
               ppf->info.num_color_channels + (ppf->info.alpha_bits ? 1 : 0);
           format = {
@@ -619,37 +857,9 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
             break;
           }
 
-          // TODO(jon): catch special case of PQ and synthesize color encoding
-          // in that case
-          int compression_type;
-          png_bytep profile;
-          png_charp name;
-          png_uint_32 proflen = 0;
-          auto ok = png_get_iCCP(png_ptr, info_ptr, &name, &compression_type,
-                                 &profile, &proflen);
-          if (ok && proflen) {
-            ppf->icc.assign(profile, profile + proflen);
-            have_color = true;
-          } else {
-            // TODO(eustas): JXL_WARNING?
-          }
-        } else if (id == kId_sRGB) {
-          JXL_RETURN_IF_ERROR(DecodeSRGB(chunk.data() + 8, chunk.size() - 12,
-                                         &ppf->color_encoding));
-          have_srgb = true;
-          have_color = true;
-        } else if (id == kId_gAMA) {
-          JXL_RETURN_IF_ERROR(DecodeGAMA(chunk.data() + 8, chunk.size() - 12,
-                                         &ppf->color_encoding));
-          have_color = true;
-        } else if (id == kId_cHRM) {
-          JXL_RETURN_IF_ERROR(DecodeCHRM(chunk.data() + 8, chunk.size() - 12,
-                                         &ppf->color_encoding));
-          have_color = true;
-        } else if (id == kId_eXIf) {
-          ppf->metadata.exif.resize(chunk.size() - 12);
-          memcpy(ppf->metadata.exif.data(), chunk.data() + 8,
-                 chunk.size() - 12);
+          header.ICC(png_ptr, info_ptr);
+        } else if (PNGHeaderDecoder::Decodes(id)) {
+          JXL_RETURN_IF_ERROR(header.Chunk(chunk.data(), chunk.size()));
         } else if (!isAbc(chunk[4]) || !isAbc(chunk[5]) || !isAbc(chunk[6]) ||
                    !isAbc(chunk[7])) {
           break;
@@ -665,14 +875,7 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
       }
     }
 
-    if (have_srgb) {
-      ppf->color_encoding.white_point = JXL_WHITE_POINT_D65;
-      ppf->color_encoding.primaries = JXL_PRIMARIES_SRGB;
-      ppf->color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_SRGB;
-      ppf->color_encoding.rendering_intent = JXL_RENDERING_INTENT_PERCEPTUAL;
-    }
-    JXL_RETURN_IF_ERROR(ApplyColorHints(
-        color_hints, have_color, ppf->info.num_color_channels == 1, ppf));
+    JXL_RETURN_IF_ERROR(header.Finish(color_hints));
   }
 
   if (errorstate) return false;
@@ -11,6 +11,7 @@
 #include <stdint.h>
 
 #include "lib/extras/dec/color_hints.h"
+#include "lib/extras/dec/row_sink.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/padded_bytes.h"
@@ -26,6 +27,14 @@ Status DecodeImageAPNG(Span<const uint8_t> bytes, const ColorHints& color_hints,
                        const SizeConstraints& constraints,
                        PackedPixelFile* ppf);
 
+// Decodes a non-animated PNG in `bytes` and passes the pixels to `sink` as
+// libpng produces them: row by row, or all at once for interlaced images.
+// Returns false without calling `sink` for animated PNGs. The header is
+// interpreted as by DecodeImageAPNG, but only the metadata chunks before the
+// image data reach `sink`.
+Status StreamImagePNG(Span<const uint8_t> bytes, const ColorHints& color_hints,
+                      const SizeConstraints& constraints, RowSink* sink);
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -124,5 +124,30 @@ Status DecodeBytes(const Span<const uint8_t> bytes,
   return true;
 }
 
+Status StreamBytes(const Span<const uint8_t> bytes,
+                   const ColorHints& color_hints,
+                   const SizeConstraints& constraints, RowSink* sink,
+                   Codec* orig_codec) {
+  if (bytes.size() < kMinBytes) return JXL_FAILURE("Too few bytes");
+
+  Codec codec;
+#if JPEGXL_ENABLE_APNG
+  if (StreamImagePNG(bytes, color_hints, constraints, sink)) {
+    codec = Codec::kPNG;
+  } else
+#endif
+#if JPEGXL_ENABLE_JPEG
+      if (StreamImageJPG(bytes, color_hints, constraints, sink)) {
+    codec = Codec::kJPG;
+  } else
+#endif
+  {
+    return false;
+  }
+  if (orig_codec) *orig_codec = codec;
+
+  return true;
+}
+
 }  // namespace extras
 }  // namespace jxl
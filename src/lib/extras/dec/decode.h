@@ -15,6 +15,7 @@
 #include <vector>
 
 #include "lib/extras/dec/color_hints.h"
+#include "lib/extras/dec/row_sink.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/codec_in_out.h"
@@ -46,6 +47,14 @@ Status DecodeBytes(Span<const uint8_t> bytes, const ColorHints& color_hints,
                    const SizeConstraints& constraints,
                    extras::PackedPixelFile* ppf, Codec* orig_codec = nullptr);
 
+// Decodes "bytes" and passes the pixels to *sink as the decoder produces them,
+// so that consumers can start working before the whole image is decoded.
+// Only codecs with a row-wise decoder (non-animated PNG, JPEG) are tried;
+// returns false for other inputs, which callers should pass to DecodeBytes.
+Status StreamBytes(Span<const uint8_t> bytes, const ColorHints& color_hints,
+                   const SizeConstraints& constraints, RowSink* sink,
+                   Codec* orig_codec = nullptr);
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -160,12 +160,11 @@ void MyOutputMessage(j_common_ptr cinfo) {
 #endif
 }
 
-}  // namespace
-
-Status DecodeImageJPG(const Span<const uint8_t> bytes,
-                      const ColorHints& color_hints,
-                      const SizeConstraints& constraints,
-                      PackedPixelFile* ppf) {
+// Decodes the header into `ppf` and the pixels either into a new frame of
+// `ppf` or, if `sink` is non-null, to `sink` one scanline at a time.
+Status DecodeJPG(const Span<const uint8_t> bytes, const ColorHints& color_hints,
+                 const SizeConstraints& constraints, PackedPixelFile* ppf,
+                 RowSink* sink) {
   // Don't do anything for non-JPEG files (no need to report an error)
   if (!IsJPG(bytes)) return false;
 
@@ -262,6 +261,40 @@ Status DecodeImageJPG(const Span<const uint8_t> bytes,
         /*align=*/0,
     };
     ppf->frames.clear();
+    if (sink != nullptr) {
+      const size_t row_size =
+          sizeof(JSAMPLE) * cinfo.output_components * cinfo.image_width;
+      if (!sink->Begin(*ppf, format)) {
+        return failure("row sink rejected the header");
+      }
+      size_t y0, y1;
+      sink->NeededRows(&y0, &y1);
+      y1 = std::min<size_t>(y1, cinfo.image_height);
+      y0 = std::min(y0, y1);
+      row.reset(new JSAMPLE[cinfo.output_components * cinfo.image_width]);
+      size_t y = 0;
+#ifdef LIBJPEG_TURBO_VERSION_NUMBER
+      // Skips the entropy decoding of whole iMCU rows where possible.
+      y = jpeg_skip_scanlines(&cinfo, y0);
+#endif
+      for (; y < y1; ++y) {
+        JSAMPROW rows[] = {row.get()};
+        jpeg_read_scanlines(&cinfo, rows, 1);
+        if (y < y0) continue;
+        msan::UnpoisonMemory(rows[0], row_size);
+        if (!sink->Rows(y, 1, rows[0], row_size)) {
+          return failure("row sink failed");
+        }
+      }
+      if (y1 == cinfo.image_height) {
+        jpeg_finish_decompress(&cinfo);
+      } else {
+        // The remaining rows are not needed.
+        jpeg_abort_decompress(&cinfo);
+      }
+      jpeg_destroy_decompress(&cinfo);
+      return sink->End();
+    }
     // Allocates the frame buffer.
     ppf->frames.emplace_back(cinfo.image_width, cinfo.image_height, format);
     const auto& frame = ppf->frames.back();
@@ -285,5 +318,23 @@ Status DecodeImageJPG(const Span<const uint8_t> bytes,
   return try_catch_block();
 }
 
+}  // namespace
+
+Status DecodeImageJPG(const Span<const uint8_t> bytes,
+                      const ColorHints& color_hints,
+                      const SizeConstraints& constraints,
+                      PackedPixelFile* ppf) {
+  return DecodeJPG(bytes, color_hints, constraints, ppf, /*sink=*/nullptr);
+}
+
+Status StreamImageJPG(const Span<const uint8_t> bytes,
+                      const ColorHints& color_hints,
+                      const SizeConstraints& constraints, RowSink* sink) {
+  PackedPixelFile ppf;
+  ppf.info.uses_original_profile = true;
+  ppf.info.orientation = JXL_ORIENT_IDENTITY;
+  return DecodeJPG(bytes, color_hints, constraints, &ppf, sink);
+}
+
 }  // namespace extras
 }  // namespace jxl
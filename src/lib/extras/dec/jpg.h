@@ -12,6 +12,7 @@
 
 #include "lib/extras/codec.h"
 #include "lib/extras/dec/color_hints.h"
+#include "lib/extras/dec/row_sink.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/padded_bytes.h"
 #include "lib/jxl/base/span.h"
@@ -27,6 +28,11 @@ namespace extras {
 Status DecodeImageJPG(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       const SizeConstraints& constraints, PackedPixelFile* ppf);
 
+// Same as DecodeImageJPG, but passes the pixels to `sink` one scanline at a
+// time as libjpeg produces them, without allocating a frame buffer.
+Status StreamImageJPG(Span<const uint8_t> bytes, const ColorHints& color_hints,
+                      const SizeConstraints& constraints, RowSink* sink);
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -0,0 +1,58 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_EXTRAS_DEC_ROW_SINK_H_
+#define LIB_EXTRAS_DEC_ROW_SINK_H_
+
+// Receiver for decoders that produce an image a few rows at a time.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+
+#include "jxl/types.h"
+#include "lib/extras/packed_image.h"
+#include "lib/jxl/base/status.h"
+
+namespace jxl {
+namespace extras {
+
+// Sets [*y0, *y1) to the rows that are needed of an xsize x ysize image.
+typedef std::function<void(size_t xsize, size_t ysize, size_t* y0, size_t* y1)>
+    NeededRowsFunc;
+
+// Row-wise decoders call Begin once, then Rows for consecutive row ranges in
+// top-to-bottom order, then End. Pixel buffers passed to Rows are only valid
+// for the duration of the call. Any failure aborts decoding.
+class RowSink {
+ public:
+  virtual ~RowSink() = default;
+
+  // `ppf` holds the image info, color encoding and metadata known before the
+  // first row; its frames are empty. Rows will be interleaved in `format`.
+  virtual Status Begin(const PackedPixelFile& ppf,
+                       const JxlPixelFormat& format) = 0;
+
+  // Receives rows [y0, y0 + num_rows), each `stride` bytes apart.
+  virtual Status Rows(size_t y0, size_t num_rows, const void* pixels,
+                      size_t stride) = 0;
+
+  // Called after the last row.
+  virtual Status End() { return true; }
+
+  // Returns the rows [*y0, *y1) that are needed, once Begin has been called.
+  // Decoders may skip the other rows and not pass them to Rows, and may stop
+  // decoding after *y1 - 1. By default, all rows are needed.
+  virtual void NeededRows(size_t* y0, size_t* y1) const {
+    *y0 = 0;
+    *y1 = SIZE_MAX;
+  }
+};
+
+}  // namespace extras
+}  // namespace jxl
+
+#endif  // LIB_EXTRAS_DEC_ROW_SINK_H_
@@ -5,6 +5,7 @@
 
 #include "lib/extras/packed_image_convert.h"
 
+#include <algorithm>
 #include <cstdint>
 
 #include "jxl/color_encoding.h"
@@ -74,10 +75,13 @@ Status ConvertPackedFrameToImageBundle(const JxlBasicInfo& info,
   return true;
 }
 
-Status ConvertPackedPixelFileToCodecInOut(const PackedPixelFile& ppf,
-                                          ThreadPool* pool, CodecInOut* io) {
+namespace {
+
+// Converts everything but the frames.
+Status ConvertPackedPixelFileMetadataToCodecInOut(const PackedPixelFile& ppf,
+                                                  ThreadPool* pool,
+                                                  CodecInOut* io) {
   const bool has_alpha = ppf.info.alpha_bits != 0;
-  JXL_ASSERT(!ppf.frames.empty());
   if (has_alpha) {
     JXL_ASSERT(ppf.info.alpha_bits == ppf.info.bits_per_sample);
     JXL_ASSERT(ppf.info.alpha_exponent_bits ==
@@ -106,7 +110,6 @@ Status ConvertPackedPixelFileToCodecInOut(const PackedPixelFile& ppf,
   io->metadata.m.orientation = ppf.info.orientation;
 
   // Convert animation metadata
-  JXL_ASSERT(ppf.frames.size() == 1 || ppf.info.have_animation);
   io->metadata.m.have_animation = ppf.info.have_animation;
   io->metadata.m.animation.tps_numerator = ppf.info.animation.tps_numerator;
   io->metadata.m.animation.tps_denominator = ppf.info.animation.tps_denominator;
@@ -170,6 +173,32 @@ Status ConvertPackedPixelFileToCodecInOut(const PackedPixelFile& ppf,
         ppf.info, *ppf.preview_frame, *io, pool, &io->preview_frame));
   }
 
+  return true;
+}
+
+// Derives the remaining metadata once the frames are in place.
+void FinalizeCodecInOut(const JxlBasicInfo& info, CodecInOut* io) {
+  if (info.exponent_bits_per_sample == 0) {
+    // uint case.
+    io->metadata.m.bit_depth.bits_per_sample = io->Main().DetectRealBitdepth();
+  }
+  if (info.intensity_target != 0) {
+    io->metadata.m.SetIntensityTarget(info.intensity_target);
+  } else {
+    SetIntensityTarget(io);
+  }
+  io->CheckMetadata();
+}
+
+}  // namespace
+
+Status ConvertPackedPixelFileToCodecInOut(const PackedPixelFile& ppf,
+                                          ThreadPool* pool, CodecInOut* io) {
+  JXL_ASSERT(!ppf.frames.empty());
+  JXL_ASSERT(ppf.frames.size() == 1 || ppf.info.have_animation);
+  JXL_RETURN_IF_ERROR(
+      ConvertPackedPixelFileMetadataToCodecInOut(ppf, pool, io));
+
   // Convert the pixels
   io->dec_pixels = 0;
   io->frames.clear();
@@ -181,16 +210,85 @@ Status ConvertPackedPixelFileToCodecInOut(const PackedPixelFile& ppf,
     io->dec_pixels += frame.color.xsize * frame.color.ysize;
   }
 
-  if (ppf.info.exponent_bits_per_sample == 0) {
-    // uint case.
-    io->metadata.m.bit_depth.bits_per_sample = io->Main().DetectRealBitdepth();
+  FinalizeCodecInOut(ppf.info, io);
+  return true;
+}
+
+Status CodecInOutRowSink::Begin(const PackedPixelFile& ppf,
+                                const JxlPixelFormat& format) {
+  JXL_ASSERT(ppf.info.num_color_channels == 1 ||
+             ppf.info.num_color_channels == 3);
+  JXL_ASSERT(1 <= format.num_channels && format.num_channels <= 4);
+  JXL_RETURN_IF_ERROR(
+      ConvertPackedPixelFileMetadataToCodecInOut(ppf, pool_, io_));
+  if (io_->metadata.m.color_encoding.IsGray() != (format.num_channels <= 2)) {
+    return JXL_FAILURE("Pixel format does not match the color encoding");
+  }
+  info_ = ppf.info;
+  format_ = format;
+  float_in_ = format.data_type == JXL_TYPE_FLOAT16 ||
+              format.data_type == JXL_TYPE_FLOAT;
+  bits_per_sample_ = float_in_ ? PackedImage::BitsPerChannel(format.data_type)
+                               : ppf.info.bits_per_sample;
+  JXL_ASSERT(bits_per_sample_ != 0);
+  io_->frames.clear();
+  io_->dec_pixels = 0;
+  size_t ysize = ppf.info.ysize;
+  rows_y0_ = 0;
+  if (only_needed_rows_) {
+    size_t y1;
+    NeededRows(&rows_y0_, &y1);
+    y1 = std::min<size_t>(y1, ppf.info.ysize);
+    if (rows_y0_ >= y1) return JXL_FAILURE("No rows are needed");
+    ysize = y1 - rows_y0_;
   }
-  if (ppf.info.intensity_target != 0) {
-    io->metadata.m.SetIntensityTarget(ppf.info.intensity_target);
+  color_ = Image3F(ppf.info.xsize, ysize);
+  const bool has_alpha = format.num_channels == 2 || format.num_channels == 4;
+  alpha_ = has_alpha && io_->metadata.m.HasAlpha()
+               ? ImageF(ppf.info.xsize, ysize)
+               : ImageF();
+  return true;
+}
+
+void CodecInOutRowSink::NeededRows(size_t* y0, size_t* y1) const {
+  if (needed_rows_) {
+    needed_rows_(info_.xsize, info_.ysize, y0, y1);
   } else {
-    SetIntensityTarget(io);
+    RowSink::NeededRows(y0, y1);
   }
-  io->CheckMetadata();
+}
+
+Status CodecInOutRowSink::Rows(size_t y0, size_t num_rows, const void* pixels,
+                               size_t stride) {
+  // Rows that are not kept are skipped.
+  const size_t begin = std::max(y0, rows_y0_);
+  const size_t end = std::min(y0 + num_rows, rows_y0_ + color_.ysize());
+  if (begin >= end) return true;
+  return ConvertRowsFromExternal(
+      static_cast<const uint8_t*>(pixels) + (begin - y0) * stride, stride,
+      color_.xsize(), end - begin, io_->metadata.m.color_encoding.Channels(),
+      format_.num_channels, bits_per_sample_, format_.endianness, float_in_,
+      begin - rows_y0_, &color_, alpha_.xsize() != 0 ? &alpha_ : nullptr);
+}
+
+Status CodecInOutRowSink::End() {
+  ImageBundle bundle(&io_->metadata.m);
+  const size_t xsize = color_.xsize();
+  const size_t ysize = color_.ysize();
+  bundle.SetFromImage(std::move(color_), io_->metadata.m.color_encoding);
+  if (io_->metadata.m.HasAlpha()) {
+    if (alpha_.xsize() == 0) {
+      // No alpha in the input, but expected: assume it is all-opaque.
+      alpha_ = ImageF(xsize, ysize);
+      FillImage(1.0f, &alpha_);
+    }
+    bundle.SetAlpha(std::move(alpha_), info_.alpha_premultiplied);
+  }
+  bundle.extra_channels().resize(io_->metadata.m.extra_channel_info.size());
+  io_->frames.push_back(std::move(bundle));
+  io_->dec_pixels = xsize * ysize;
+
+  FinalizeCodecInOut(info_, io_);
   return true;
 }
 
@@ -10,6 +10,7 @@
 // CodecInOut to help transitioning to the external types.
 
 #include "jxl/types.h"
+#include "lib/extras/dec/row_sink.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/codec_in_out.h"
@@ -29,6 +30,46 @@ Status ConvertCodecInOutToPackedPixelFile(const CodecInOut& io,
                                           const ColorEncoding& c_desired,
                                           ThreadPool* pool,
                                           PackedPixelFile* ppf);
+
+// Receives the rows of a row-wise decoder (see StreamBytes) and converts them
+// straight into the single frame of `io`, without first storing the whole
+// interleaved frame.
+class CodecInOutRowSink : public RowSink {
+ public:
+  CodecInOutRowSink(ThreadPool* pool, CodecInOut* io) : pool_(pool), io_(io) {}
+
+  // Only the rows given by `needed_rows` for the image size are needed; the
+  // other rows of `io` may be left uninitialized.
+  void SetNeededRows(const NeededRowsFunc& needed_rows) {
+    needed_rows_ = needed_rows;
+  }
+
+  // Makes the images of `io` only hold the needed rows, which must not be
+  // empty, instead of all of them.
+  void KeepOnlyNeededRows() { only_needed_rows_ = true; }
+
+  Status Begin(const PackedPixelFile& ppf,
+               const JxlPixelFormat& format) override;
+  Status Rows(size_t y0, size_t num_rows, const void* pixels,
+              size_t stride) override;
+  Status End() override;
+  void NeededRows(size_t* y0, size_t* y1) const override;
+
+ private:
+  ThreadPool* pool_;
+  CodecInOut* io_;
+  JxlBasicInfo info_;
+  JxlPixelFormat format_;
+  bool float_in_ = false;
+  size_t bits_per_sample_ = 0;
+  NeededRowsFunc needed_rows_;
+  bool only_needed_rows_ = false;
+  // Of the first row of color_ and alpha_ in the image.
+  size_t rows_y0_ = 0;
+  Image3F color_;
+  ImageF alpha_;
+};
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -24,6 +24,7 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/base/data_parallel.cc
   jxl/base/data_parallel.h
   jxl/base/file_io.h
+  jxl/base/hash.h
   jxl/base/iaca.h
   jxl/base/os_macros.h
   jxl/base/override.h
@@ -31,8 +32,8 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/base/padded_bytes.h
   jxl/base/printf_macros.h
   jxl/base/profiler.h
-#  jxl/base/random.cc
-#  jxl/base/random.h
+  jxl/base/random.cc
+  jxl/base/random.h
   jxl/base/sanitizer_definitions.h
   jxl/base/scope_guard.h
   jxl/base/span.h
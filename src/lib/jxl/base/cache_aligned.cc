@@ -8,10 +8,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "lib/jxl/base/os_macros.h"
+
 // Disabled: slower than malloc + alignment.
 #define JXL_USE_MMAP 0
 
-#if JXL_USE_MMAP
+// Arenas are mapped where possible, so that only the touched pages are
+// committed and the mapping can be aligned to huge pages.
+#if JXL_OS_LINUX || JXL_OS_MAC || JXL_OS_FREEBSD
+#define JXL_ARENA_USE_MMAP 1
+#else
+#define JXL_ARENA_USE_MMAP 0
+#endif
+
+#if JXL_USE_MMAP || JXL_ARENA_USE_MMAP
 #include <sys/mman.h>
 #endif
 
@@ -30,14 +40,71 @@ namespace {
 struct AllocationHeader {
   void* allocated;
   size_t allocated_size;
+  // Null if `allocated` came from malloc.
+  const JxlMemoryManager* memory_manager;
   uint8_t left_padding[hwy::kMaxVectorSize];
 };
 #pragma pack(pop)
 
 std::atomic<uint64_t> num_allocations{0};
+std::atomic<uint64_t> num_frees{0};
 std::atomic<uint64_t> bytes_in_use{0};
 std::atomic<uint64_t> max_bytes_in_use{0};
 
+// Of the calling thread, for CacheAligned::GetThreadStats.
+thread_local CacheAligned::Stats thread_stats = {};
+
+// Set by CacheAligned::ScopedMemoryManager and ScopedHugePages.
+thread_local const JxlMemoryManager* thread_memory_manager = nullptr;
+thread_local bool thread_huge_pages = false;
+
+void CountAllocation(const size_t allocated_size) {
+  ++thread_stats.num_allocations;
+  thread_stats.bytes_in_use += allocated_size;
+  thread_stats.max_bytes_in_use =
+      std::max(thread_stats.max_bytes_in_use, thread_stats.bytes_in_use);
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+  const uint64_t prev_bytes =
+      bytes_in_use.fetch_add(allocated_size, std::memory_order_acq_rel);
+  uint64_t expected_max = max_bytes_in_use.load(std::memory_order_acquire);
+  for (;;) {
+    const uint64_t desired =
+        std::max(expected_max, prev_bytes + allocated_size);
+    if (max_bytes_in_use.compare_exchange_strong(expected_max, desired,
+                                                 std::memory_order_acq_rel)) {
+      break;
+    }
+  }
+}
+
+void CountFree(const size_t allocated_size) {
+  ++thread_stats.num_frees;
+  thread_stats.bytes_in_use -= allocated_size;
+  num_frees.fetch_add(1, std::memory_order_relaxed);
+  // Subtract (2's complement negation).
+  bytes_in_use.fetch_add(~allocated_size + 1, std::memory_order_acq_rel);
+}
+
+uintptr_t HugePageAligned(const void* p) {
+  constexpr size_t kHugePageSize = CacheAlignedArena::kHugePageSize;
+  return (reinterpret_cast<uintptr_t>(p) + kHugePageSize - 1) &
+         ~(kHugePageSize - 1);
+}
+
+// Advises the kernel to use transparent huge pages for the huge pages within
+// [p, p + size), if enabled on this thread. Only a hint, hence errors (e.g.
+// if disabled in the kernel) are ignored.
+void AdviseHugePages(void* p, size_t size) {
+#if JXL_OS_LINUX && defined(MADV_HUGEPAGE)
+  if (!thread_huge_pages) return;
+  const uintptr_t begin = HugePageAligned(p);
+  const uintptr_t end = (reinterpret_cast<uintptr_t>(p) + size) &
+                        ~(CacheAlignedArena::kHugePageSize - 1);
+  if (begin >= end) return;
+  madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+#endif
+}
+
 }  // namespace
 
 // Avoids linker errors in pre-C++17 builds.
@@ -45,6 +112,7 @@ constexpr size_t CacheAligned::kPointerSize;
 constexpr size_t CacheAligned::kCacheLineSize;
 constexpr size_t CacheAligned::kAlignment;
 constexpr size_t CacheAligned::kAlias;
+constexpr size_t CacheAlignedArena::kHugePageSize;
 
 void CacheAligned::PrintStats() {
   fprintf(
@@ -53,6 +121,29 @@ void CacheAligned::PrintStats() {
       static_cast<double>(max_bytes_in_use.load(std::memory_order_relaxed)));
 }
 
+CacheAligned::Stats CacheAligned::GetStats() {
+  Stats stats;
+  stats.num_allocations = num_allocations.load(std::memory_order_relaxed);
+  stats.num_frees = num_frees.load(std::memory_order_relaxed);
+  stats.bytes_in_use =
+      static_cast<int64_t>(bytes_in_use.load(std::memory_order_relaxed));
+  stats.max_bytes_in_use =
+      static_cast<int64_t>(max_bytes_in_use.load(std::memory_order_relaxed));
+  return stats;
+}
+
+CacheAligned::Stats CacheAligned::GetThreadStats() { return thread_stats; }
+
+CacheAligned::ThreadPeak::ThreadPeak()
+    : outer_max_(thread_stats.max_bytes_in_use) {
+  thread_stats.max_bytes_in_use = thread_stats.bytes_in_use;
+}
+
+CacheAligned::ThreadPeak::~ThreadPeak() {
+  thread_stats.max_bytes_in_use =
+      std::max(outer_max_, thread_stats.max_bytes_in_use);
+}
+
 size_t CacheAligned::NextOffset() {
   static std::atomic<uint32_t> next{0};
   constexpr uint32_t kGroups = CacheAligned::kAlias / CacheAligned::kAlignment;
@@ -77,6 +168,8 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
   }
 
 #if JXL_USE_MMAP
+  // Memory managers are not supported.
+  const JxlMemoryManager* memory_manager = nullptr;
   const size_t allocated_size = offset + payload_size;
   const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
   void* allocated =
@@ -84,8 +177,12 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
   if (allocated == MAP_FAILED) return nullptr;
   const uintptr_t aligned = reinterpret_cast<uintptr_t>(allocated);
 #else
+  const JxlMemoryManager* memory_manager = thread_memory_manager;
   const size_t allocated_size = kAlias + offset + payload_size;
-  void* allocated = malloc(allocated_size);
+  void* allocated =
+      memory_manager
+          ? memory_manager->alloc(memory_manager->opaque, allocated_size)
+          : malloc(allocated_size);
   if (allocated == nullptr) return nullptr;
   // Always round up even if already aligned - we already asked for kAlias
   // extra bytes and there's no way to give them back.
@@ -111,17 +208,11 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
 #endif
 
   // Update statistics (#allocations and max bytes in use)
-  num_allocations.fetch_add(1, std::memory_order_relaxed);
-  const uint64_t prev_bytes =
-      bytes_in_use.fetch_add(allocated_size, std::memory_order_acq_rel);
-  uint64_t expected_max = max_bytes_in_use.load(std::memory_order_acquire);
-  for (;;) {
-    const uint64_t desired =
-        std::max(expected_max, prev_bytes + allocated_size);
-    if (max_bytes_in_use.compare_exchange_strong(expected_max, desired,
-                                                 std::memory_order_acq_rel)) {
-      break;
-    }
+  CountAllocation(allocated_size);
+
+  if (!memory_manager &&
+      allocated_size >= 2 * CacheAlignedArena::kHugePageSize) {
+    AdviseHugePages(allocated, allocated_size);
   }
 
   const uintptr_t payload = aligned + offset;  // still aligned
@@ -130,6 +221,7 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
   AllocationHeader* header = reinterpret_cast<AllocationHeader*>(payload) - 1;
   header->allocated = allocated;
   header->allocated_size = allocated_size;
+  header->memory_manager = memory_manager;
 
   return JXL_ASSUME_ALIGNED(reinterpret_cast<void*>(payload), 64);
 }
@@ -143,15 +235,139 @@ void CacheAligned::Free(const void* aligned_pointer) {
   const AllocationHeader* header =
       reinterpret_cast<const AllocationHeader*>(payload) - 1;
 
-  // Subtract (2's complement negation).
-  bytes_in_use.fetch_add(~header->allocated_size + 1,
-                         std::memory_order_acq_rel);
+  // Owned by a CacheAlignedArena, which frees it.
+  if (header->allocated == nullptr) return;
+
+  CountFree(header->allocated_size);
 
 #if JXL_USE_MMAP
   munmap(header->allocated, header->allocated_size);
 #else
-  free(header->allocated);
+  const JxlMemoryManager* memory_manager = header->memory_manager;
+  if (memory_manager) {
+    memory_manager->free(memory_manager->opaque, header->allocated);
+  } else {
+    free(header->allocated);
+  }
 #endif
 }
 
+CacheAligned::ScopedMemoryManager::ScopedMemoryManager(
+    const JxlMemoryManager* memory_manager)
+    : previous_(thread_memory_manager) {
+  thread_memory_manager = memory_manager;
+}
+
+CacheAligned::ScopedMemoryManager::~ScopedMemoryManager() {
+  thread_memory_manager = previous_;
+}
+
+CacheAligned::ScopedHugePages::ScopedHugePages(const bool enabled)
+    : previous_(thread_huge_pages) {
+  thread_huge_pages = enabled;
+}
+
+CacheAligned::ScopedHugePages::~ScopedHugePages() {
+  thread_huge_pages = previous_;
+}
+
+CacheAlignedArena::CacheAlignedArena(const size_t capacity)
+    : memory_manager_(thread_memory_manager),
+      allocated_(nullptr),
+      allocated_size_(0),
+      begin_(nullptr),
+      capacity_(0),
+      used_(0),
+      num_allocations_(0) {
+  if (capacity == 0 || capacity > std::numeric_limits<size_t>::max() / 2) {
+    return;
+  }
+  if (memory_manager_) {
+    // Memory of the host is neither rounded up to huge pages nor advised,
+    // only aligned for the staggered offsets.
+    constexpr size_t kAlias = CacheAligned::kAlias;
+    const size_t allocated_size = capacity + kAlias;
+    allocated_ =
+        memory_manager_->alloc(memory_manager_->opaque, allocated_size);
+    if (allocated_ == nullptr) return;
+    allocated_size_ = allocated_size;
+    begin_ = reinterpret_cast<uint8_t*>(
+        hwy::RoundUpTo(reinterpret_cast<uintptr_t>(allocated_), kAlias));
+    capacity_ = capacity;
+    CountAllocation(allocated_size_);
+    return;
+  }
+  const size_t size = hwy::RoundUpTo(capacity, kHugePageSize);
+  // One more huge page to align the start.
+  const size_t allocated_size = size + kHugePageSize;
+  uintptr_t begin;
+#if JXL_ARENA_USE_MMAP
+  void* allocated = mmap(nullptr, allocated_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (allocated == MAP_FAILED) return;
+  // Unmaps the parts before and after the aligned range.
+  const uintptr_t start = reinterpret_cast<uintptr_t>(allocated);
+  begin = HugePageAligned(allocated);
+  if (begin != start) munmap(allocated, begin - start);
+  const size_t tail = start + allocated_size - (begin + size);
+  if (tail != 0) munmap(reinterpret_cast<void*>(begin + size), tail);
+  allocated_ = reinterpret_cast<void*>(begin);
+  allocated_size_ = size;
+#else
+  allocated_ = malloc(allocated_size);
+  if (allocated_ == nullptr) return;
+  allocated_size_ = allocated_size;
+  begin = HugePageAligned(allocated_);
+#endif
+  begin_ = reinterpret_cast<uint8_t*>(begin);
+  capacity_ = size;
+  CountAllocation(allocated_size_);
+  AdviseHugePages(begin_, capacity_);
+}
+
+CacheAlignedArena::~CacheAlignedArena() {
+  if (allocated_ == nullptr) return;
+  CountFree(allocated_size_);
+  if (memory_manager_) {
+    memory_manager_->free(memory_manager_->opaque, allocated_);
+    return;
+  }
+#if JXL_ARENA_USE_MMAP
+  munmap(allocated_, allocated_size_);
+#else
+  free(allocated_);
+#endif
+}
+
+void* CacheAlignedArena::Allocate(const size_t payload_size) {
+  static_assert(sizeof(AllocationHeader) <= CacheAligned::kAlias,
+                "Header does not fit in BytesFor");
+  constexpr size_t kAlias = CacheAligned::kAlias;
+  // What: | unused | AllocationHeader |payload
+  // The payload is the first one after the header whose address is congruent
+  // to a cyclic offset (mod kAlias), as in CacheAligned::Allocate; begin_ is
+  // aligned to kAlias.
+  constexpr size_t kGroups = kAlias / CacheAligned::kAlignment;
+  const size_t offset =
+      CacheAligned::kAlignment * (num_allocations_ % kGroups);
+  const size_t header_end = used_ + sizeof(AllocationHeader);
+  const size_t payload =
+      header_end <= offset
+          ? offset
+          : hwy::RoundUpTo(header_end - offset, kAlias) + offset;
+  if (payload > capacity_ || payload_size > capacity_ - payload) {
+    return nullptr;
+  }
+  used_ = payload + payload_size;
+  ++num_allocations_;
+
+  // Tells CacheAligned::Free to leave it alone.
+  AllocationHeader* header =
+      reinterpret_cast<AllocationHeader*>(begin_ + payload) - 1;
+  header->allocated = nullptr;
+  header->allocated_size = 0;
+
+  return JXL_ASSUME_ALIGNED(static_cast<void*>(begin_ + payload), 64);
+}
+
 }  // namespace jxl
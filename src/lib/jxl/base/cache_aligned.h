@@ -13,6 +13,7 @@
 
 #include <memory>
 
+#include "jxl/memory_manager.h"
 #include "lib/jxl/base/compiler_specific.h"
 
 namespace jxl {
@@ -20,7 +21,37 @@ namespace jxl {
 // Functions that depend on the cache line size.
 class CacheAligned {
  public:
+  // Counts of allocations (including the padding for alignment) and frees.
+  struct Stats {
+    uint64_t num_allocations;
+    uint64_t num_frees;
+    // Negative for a thread that freed more than it allocated.
+    int64_t bytes_in_use;
+    // Since the process or thread started, or for a thread since its
+    // innermost ThreadPeak was constructed.
+    int64_t max_bytes_in_use;
+  };
+
   static void PrintStats();
+  // Of the whole process since it started.
+  static Stats GetStats();
+  // Of the calling thread only, without those of other threads at the same
+  // time.
+  static Stats GetThreadStats();
+
+  // Measures the maximum bytes in use by the calling thread during its
+  // lifetime, without forgetting the maximum from before, so that it can be
+  // nested.
+  class ThreadPeak {
+   public:
+    ThreadPeak();
+    ~ThreadPeak();
+    ThreadPeak(const ThreadPeak&) = delete;
+    ThreadPeak& operator=(const ThreadPeak&) = delete;
+
+   private:
+    int64_t outer_max_;
+  };
 
   static constexpr size_t kPointerSize = sizeof(void*);
   static constexpr size_t kCacheLineSize = 64;
@@ -44,13 +75,97 @@ class CacheAligned {
   }
 
   static void Free(const void* aligned_pointer);
+
+  // While it exists, Allocate and new CacheAlignedArenas on the thread that
+  // created it get their memory from `memory_manager` instead of malloc and
+  // mmap, unless it is null. Free returns the memory to it on any thread,
+  // hence it must stay valid until then. Scopes can be nested.
+  class ScopedMemoryManager {
+   public:
+    explicit ScopedMemoryManager(const JxlMemoryManager* memory_manager);
+    ~ScopedMemoryManager();
+
+    ScopedMemoryManager(const ScopedMemoryManager&) = delete;
+    ScopedMemoryManager& operator=(const ScopedMemoryManager&) = delete;
+
+   private:
+    const JxlMemoryManager* previous_;
+  };
+
+  // While it exists and `enabled`, the kernel is advised (madvise with
+  // MADV_HUGEPAGE, on Linux) to back the huge pages within allocations of at
+  // least two huge pages and within new CacheAlignedArenas on this thread with
+  // transparent huge pages, which reduces TLB misses. Off by default, as it can
+  // increase memory use and the latency of page faults. Memory of a
+  // ScopedMemoryManager is never advised. Scopes can be nested.
+  class ScopedHugePages {
+   public:
+    explicit ScopedHugePages(bool enabled);
+    ~ScopedHugePages();
+
+    ScopedHugePages(const ScopedHugePages&) = delete;
+    ScopedHugePages& operator=(const ScopedHugePages&) = delete;
+
+   private:
+    bool previous_;
+  };
+};
+
+// Bump-pointer arena for allocations that are all freed at the same time, e.g.
+// the planes of one computation: a single mapping, aligned to and a multiple of
+// kHugePageSize so that it can be backed by huge pages, or of the capacity
+// from the memory manager of a ScopedMemoryManager. Allocations are
+// staggered like those of CacheAligned::Allocate, and CacheAligned::Free
+// ignores them. Its pages are not touched before they are allocated, hence
+// the first thread that writes each page decides its NUMA node. Not
+// thread-safe.
+class CacheAlignedArena {
+ public:
+  static constexpr size_t kHugePageSize = size_t(2) << 20;
+
+  // Reserves at least `capacity` bytes, or none if that fails. They come from
+  // the memory manager of the current CacheAligned::ScopedMemoryManager, if
+  // any, and then exactly `capacity` bytes are reserved.
+  explicit CacheAlignedArena(size_t capacity);
+  ~CacheAlignedArena();
+
+  CacheAlignedArena(const CacheAlignedArena&) = delete;
+  CacheAlignedArena& operator=(const CacheAlignedArena&) = delete;
+
+  // Upper bound of the capacity used by Allocate(payload_size), and of the
+  // bytes used by CacheAligned::Allocate(payload_size).
+  static size_t BytesFor(const size_t payload_size) {
+    return payload_size + 2 * CacheAligned::kAlias;
+  }
+
+  // Returns null if the remaining capacity is too small, else memory that is
+  // valid until the arena is destroyed.
+  void* Allocate(size_t payload_size);
+
+  size_t capacity() const { return capacity_; }
+  size_t used() const { return used_; }
+
+ private:
+  const JxlMemoryManager* memory_manager_;
+  void* allocated_;
+  size_t allocated_size_;
+  uint8_t* begin_;
+  size_t capacity_;
+  size_t used_;
+  size_t num_allocations_;
 };
 
 // Avoids the need for a function pointer (deleter) in CacheAlignedUniquePtr.
 struct CacheAlignedDeleter {
+  // Unless `owned`, the memory belongs to someone else (e.g. a memory-mapped
+  // file) and is left alone.
+  explicit CacheAlignedDeleter(bool owned = true) : owned(owned) {}
+
   void operator()(uint8_t* aligned_pointer) const {
-    return CacheAligned::Free(aligned_pointer);
+    if (owned) CacheAligned::Free(aligned_pointer);
   }
+
+  bool owned;
 };
 
 using CacheAlignedUniquePtr = std::unique_ptr<uint8_t[], CacheAlignedDeleter>;
@@ -10,6 +10,11 @@
 
 #include <stdio.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include <list>
 #include <string>
@@ -129,6 +134,59 @@ static inline Status ReadFile(const std::string& pathname,
   return true;
 }
 
+// Read-only memory mapping of the contents of a file, so that only the pages
+// that are accessed are read, and they are shared with other processes that
+// map the same file. Map fails where mapping is not supported.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile& other) = delete;
+  MappedFile& operator=(const MappedFile& other) = delete;
+
+  ~MappedFile() {
+#ifndef _WIN32
+    if (mapping_ != nullptr) munmap(mapping_, size_);
+#endif
+  }
+
+  Status Map(const std::string& pathname) {
+    JXL_ASSERT(mapping_ == nullptr);
+#ifndef _WIN32
+    const int fd = open(pathname.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return JXL_FAILURE("Failed to open file for reading: %s",
+                         pathname.c_str());
+    }
+    struct stat s = {};
+    if (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode)) {
+      close(fd);
+      return JXL_FAILURE("Not a regular file: %s", pathname.c_str());
+    }
+    size_ = static_cast<size_t>(s.st_size);
+    if (size_ != 0) {
+      void* mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapping == MAP_FAILED) {
+        close(fd);
+        return JXL_FAILURE("Failed to map %s", pathname.c_str());
+      }
+      mapping_ = mapping;
+    }
+    close(fd);
+    return true;
+#else
+    return JXL_FAILURE("Memory mapping is not supported");
+#endif
+  }
+
+  // Page-aligned.
+  const uint8_t* data() const { return static_cast<const uint8_t*>(mapping_); }
+  size_t size() const { return size_; }
+
+ private:
+  void* mapping_ = nullptr;
+  size_t size_ = 0;
+};
+
 template <typename ContainerType>
 static inline Status WriteFile(const ContainerType& bytes,
                                const std::string& pathname) {
@@ -0,0 +1,94 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_BASE_HASH_H_
+#define LIB_JXL_BASE_HASH_H_
+
+// Fast non-cryptographic 64-bit hash (XXH64) for cache keys.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/compiler_specific.h"
+
+namespace jxl {
+namespace hash_internal {
+
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t kPrime3 = 0x165667B19E3779F9ull;
+constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ull;
+constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ull;
+
+static JXL_INLINE uint64_t RotateLeft(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+static JXL_INLINE uint64_t Round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime2;
+  return RotateLeft(acc, 31) * kPrime1;
+}
+
+static JXL_INLINE uint64_t MergeRound(uint64_t acc, uint64_t val) {
+  acc ^= Round(0, val);
+  return acc * kPrime1 + kPrime4;
+}
+
+}  // namespace hash_internal
+
+// Returns the XXH64 hash of `size` bytes. Chaining calls through `seed` hashes
+// a sequence of buffers.
+static inline uint64_t HashBytes(const void* data, size_t size,
+                                 uint64_t seed = 0) {
+  using namespace hash_internal;  // NOLINT
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  const uint8_t* const end = p + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = seed + kPrime1 + kPrime2;
+    uint64_t v2 = seed + kPrime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kPrime1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = Round(v1, LoadLE64(p));
+      v2 = Round(v2, LoadLE64(p + 8));
+      v3 = Round(v3, LoadLE64(p + 16));
+      v4 = Round(v4, LoadLE64(p + 24));
+    }
+    h = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) +
+        RotateLeft(v4, 18);
+    h = MergeRound(h, v1);
+    h = MergeRound(h, v2);
+    h = MergeRound(h, v3);
+    h = MergeRound(h, v4);
+  } else {
+    h = seed + kPrime5;
+  }
+  h += size;
+  for (; p + 8 <= end; p += 8) {
+    h ^= Round(0, LoadLE64(p));
+    h = RotateLeft(h, 27) * kPrime1 + kPrime4;
+  }
+  if (p + 4 <= end) {
+    h ^= static_cast<uint64_t>(LoadLE32(p)) * kPrime1;
+    h = RotateLeft(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= *p * kPrime5;
+    h = RotateLeft(h, 11) * kPrime1;
+  }
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_BASE_HASH_H_
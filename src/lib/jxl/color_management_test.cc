@@ -9,6 +9,7 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <cmath>
 #include <new>
 #include <string>
 #include <utility>
@@ -36,6 +37,7 @@ std::ostream& operator<<(std::ostream& os, const PrimariesCIExy& primaries) {
 namespace {
 
 using ::testing::ElementsAre;
+using ::testing::FloatEq;
 using ::testing::FloatNear;
 
 // Small enough to be fast. If changed, must update Generate*.
@@ -232,6 +234,67 @@ TEST_F(ColorManagementTest, D2700ToSRGB) {
                           FloatNear(0.601, 1e-3)));
 }
 
+TEST_F(ColorManagementTest, CachedTransformGivesSameResult) {
+  ColorEncoding p3;
+  p3.SetColorSpace(ColorSpace::kRGB);
+  p3.white_point = WhitePoint::kD65;
+  p3.primaries = Primaries::kP3;
+  p3.tf.SetTransferFunction(TransferFunction::kSRGB);
+  ASSERT_TRUE(p3.CreateICC());
+
+  const float p3_values[6] = {0.2, 0.5, 0.8, 1.0, 0.0, 0.3};
+  float expected[6];
+  {
+    ColorSpaceTransform first(GetJxlCms());
+    ASSERT_TRUE(first.Init(p3, ColorEncoding::SRGB(), kDefaultIntensityTarget,
+                           2, 1));
+    ASSERT_TRUE(first.Run(0, p3_values, expected));
+  }
+  // Same pair of profiles, but more threads: shares the transform of
+  // `first`, which has already been destroyed.
+  ColorSpaceTransform second(GetJxlCms());
+  ASSERT_TRUE(second.Init(p3, ColorEncoding::SRGB(), kDefaultIntensityTarget,
+                          2, 2));
+  float actual[6];
+  ASSERT_TRUE(second.Run(1, p3_values, actual));
+  EXPECT_THAT(actual, ElementsAre(FloatEq(expected[0]), FloatEq(expected[1]),
+                                  FloatEq(expected[2]), FloatEq(expected[3]),
+                                  FloatEq(expected[4]), FloatEq(expected[5])));
+}
+
+TEST_F(ColorManagementTest, LinearP3ToLinearSRGB) {
+  ColorEncoding linear_p3;
+  linear_p3.SetColorSpace(ColorSpace::kRGB);
+  linear_p3.white_point = WhitePoint::kD65;
+  linear_p3.primaries = Primaries::kP3;
+  linear_p3.tf.SetTransferFunction(TransferFunction::kLinear);
+  ASSERT_TRUE(linear_p3.CreateICC());
+
+  ColorSpaceTransform transform(GetJxlCms());
+  ASSERT_TRUE(transform.Init(linear_p3, ColorEncoding::LinearSRGB(),
+                             kDefaultIntensityTarget, 1, 1));
+  const float p3_values[3] = {0., 1., 0.};
+  float srgb_values[3];
+  ASSERT_TRUE(transform.Run(0, p3_values, srgb_values));
+  EXPECT_THAT(srgb_values,
+              ElementsAre(FloatNear(-0.2250, 1e-3), FloatNear(1.0421, 1e-3),
+                          FloatNear(-0.0786, 1e-3)));
+}
+
+TEST_F(ColorManagementTest, Gamma22GrayToLinear) {
+  ColorEncoding gamma22 = ColorEncoding::SRGB(/*is_gray=*/true);
+  ASSERT_TRUE(gamma22.tf.SetGamma(1 / 2.2));
+  ASSERT_TRUE(gamma22.CreateICC());
+
+  ColorSpaceTransform transform(GetJxlCms());
+  ASSERT_TRUE(transform.Init(gamma22, ColorEncoding::LinearSRGB(true),
+                             kDefaultIntensityTarget, 1, 1));
+  const float gamma22_value = 0.5f;
+  float linear_value;
+  ASSERT_TRUE(transform.Run(0, &gamma22_value, &linear_value));
+  EXPECT_THAT(linear_value, FloatNear(std::pow(0.5, 2.2), 1e-4));
+}
+
 TEST_F(ColorManagementTest, P3HlgTo2020Hlg) {
   ColorEncoding p3_hlg;
   p3_hlg.SetColorSpace(ColorSpace::kRGB);
@@ -17,9 +17,12 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/enc_color_management.cc"
@@ -28,6 +31,7 @@
 
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/hash.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/field_encodings.h"
@@ -49,9 +53,22 @@
 
 namespace jxl {
 namespace {
+struct CmsPlan;
+
+// Transfer functions that DoColorSpaceTransform evaluates without the CMS.
+enum class AnalyticTF { kLinear, kSRGB, k709, kGamma };
+
+struct AnalyticCurve {
+  AnalyticTF tf = AnalyticTF::kLinear;
+  // Only used for kGamma: encoded = linear ^ gamma.
+  float gamma = 1.0f;
+};
+
 struct JxlCms {
+  // Profile-dependent state shared with other JxlCms for the same profiles.
+  // Owns lcms_transform, and the ICC data referenced by the skcms profiles.
+  std::shared_ptr<const CmsPlan> plan;
 #if JPEGXL_ENABLE_SKCMS
-  PaddedBytes icc_src, icc_dst;
   skcms_ICCProfile profile_src, profile_dst;
 #else
   void* lcms_transform;
@@ -71,6 +88,13 @@ struct JxlCms {
   bool skip_lcms = false;
   ExtraTF preprocess = ExtraTF::kNone;
   ExtraTF postprocess = ExtraTF::kNone;
+
+  // If set, the CMS is bypassed: pixels are linearized with curve_src,
+  // multiplied by matrix (if RGB) and encoded with curve_dst.
+  bool analytic = false;
+  AnalyticCurve curve_src;
+  AnalyticCurve curve_dst;
+  std::array<float, 9> matrix;
 };
 
 Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
@@ -204,6 +228,74 @@ Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
   return true;
 }
 
+template <class D, class V>
+V LinearFromEncoded(D d, const AnalyticCurve& curve, V v) {
+  switch (curve.tf) {
+    case AnalyticTF::kLinear:
+      return v;
+    case AnalyticTF::kSRGB:
+      return TF_SRGB().DisplayFromEncoded(v);
+    case AnalyticTF::k709:
+      return TF_709().DisplayFromEncoded(d, v);
+    case AnalyticTF::kGamma: {
+      // Like LCMS, map negative values to zero.
+      const auto zero = Zero(d);
+      const auto linear = FastPowf(d, Max(v, Set(d, 1e-30f)),
+                                   Set(d, 1.0f / curve.gamma));
+      return IfThenElse(Gt(v, zero), linear, zero);
+    }
+  }
+  return v;
+}
+
+template <class D, class V>
+V EncodedFromLinear(D d, const AnalyticCurve& curve, V v) {
+  switch (curve.tf) {
+    case AnalyticTF::kLinear:
+      return v;
+    case AnalyticTF::kSRGB:
+      return TF_SRGB().EncodedFromDisplay(d, v);
+    case AnalyticTF::k709:
+      return TF_709().EncodedFromDisplay(d, v);
+    case AnalyticTF::kGamma: {
+      const auto zero = Zero(d);
+      const auto encoded =
+          FastPowf(d, Max(v, Set(d, 1e-30f)), Set(d, curve.gamma));
+      return IfThenElse(Gt(v, zero), encoded, zero);
+    }
+  }
+  return v;
+}
+
+// Replaces the CMS for matrix/shaper encodings whose transfer functions we
+// implement (see AnalyticCurve). buf_dst may equal buf_src.
+void AnalyticTransform(const JxlCms* t, const float* buf_src, float* buf_dst,
+                       size_t xsize) {
+  HWY_FULL(float) df;
+  const size_t buf_size = xsize * t->channels_src;
+  for (size_t i = 0; i < buf_size; i += Lanes(df)) {
+    const auto val = Load(df, buf_src + i);
+    Store(LinearFromEncoded(df, t->curve_src, val), df, buf_dst + i);
+  }
+  if (t->channels_src == 3) {
+    // Interleaved, hence scalar. Linear RGB is not clamped, as with LCMS.
+    const float* JXL_RESTRICT m = t->matrix.data();
+    for (size_t x = 0; x < xsize; ++x) {
+      float* JXL_RESTRICT rgb = buf_dst + 3 * x;
+      const float r = rgb[0];
+      const float g = rgb[1];
+      const float b = rgb[2];
+      rgb[0] = m[0] * r + m[1] * g + m[2] * b;
+      rgb[1] = m[3] * r + m[4] * g + m[5] * b;
+      rgb[2] = m[6] * r + m[7] * g + m[8] * b;
+    }
+  }
+  for (size_t i = 0; i < buf_size; i += Lanes(df)) {
+    const auto val = Load(df, buf_dst + i);
+    Store(EncodedFromLinear(df, t->curve_dst, val), df, buf_dst + i);
+  }
+}
+
 Status DoColorSpaceTransform(void* cms_data, const size_t thread,
                              const float* buf_src, float* buf_dst,
                              size_t xsize) {
@@ -219,7 +311,7 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
   }
 
 #if JPEGXL_ENABLE_SKCMS
-  if (t->channels_src == 1 && !t->skip_lcms) {
+  if (t->channels_src == 1 && !t->skip_lcms && !t->analytic) {
     // Expand from 1 to 3 channels, starting from the end in case
     // xform_src == t->buf_src.Row(thread).
     float* mutable_xform_src = t->buf_src.Row(thread);
@@ -252,6 +344,8 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
     if (buf_dst != xform_src) {
       memcpy(buf_dst, xform_src, xsize * t->channels_src * sizeof(*buf_dst));
     }  // else: in-place, no need to copy
+  } else if (t->analytic) {
+    AnalyticTransform(t, xform_src, buf_dst, xsize);
   } else {
 #if JPEGXL_ENABLE_SKCMS
     JXL_CHECK(
@@ -273,7 +367,7 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
 #endif
 
 #if JPEGXL_ENABLE_SKCMS
-  if (t->channels_dst == 1 && !t->skip_lcms) {
+  if (t->channels_dst == 1 && !t->skip_lcms && !t->analytic) {
     // Contract back from 3 to 1 channel, this time forward.
     float* grayscale_buf_dst = t->buf_dst.Row(thread);
     for (size_t x = 0; x < xsize; ++x) {
@@ -938,55 +1032,118 @@ void ColorEncoding::DecideIfWantICC() {
 
 namespace {
 
-void JxlCmsDestroy(void* cms_data) {
-  if (cms_data == nullptr) return;
-  JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
-#if !JPEGXL_ENABLE_SKCMS
-  TransformDeleter()(t->lcms_transform);
+// Everything JxlCmsInit derives from the pair of ICC profiles. It does not
+// depend on the image width or thread count, so it is prepared once per pair
+// of profiles and then shared (see CmsPlanCache).
+struct CmsPlan {
+#if JPEGXL_ENABLE_SKCMS
+  // Backing storage of profile_src and profile_dst.
+  PaddedBytes icc_src, icc_dst;
+  skcms_ICCProfile profile_src, profile_dst;
+#else
+  // Created with cmsFLAGS_NOCACHE, so it can be used from several threads.
+  Transform lcms_transform;
 #endif
-  delete t;
+  bool apply_hlg_ootf = false;
+  size_t hlg_ootf_num_channels = 0;
+  std::array<float, 3> hlg_ootf_luminances;
+  size_t channels_src = 0;
+  size_t channels_dst = 0;
+  bool skip_lcms = false;
+  ExtraTF preprocess = ExtraTF::kNone;
+  ExtraTF postprocess = ExtraTF::kNone;
+  bool analytic = false;
+  AnalyticCurve curve_src;
+  AnalyticCurve curve_dst;
+  std::array<float, 9> matrix;
+};
+
+// Returns whether DoColorSpaceTransform can evaluate the transfer function of
+// `c` without the CMS, and if so its parameters.
+bool GetAnalyticCurve(const ColorEncoding& c, AnalyticCurve* curve) {
+  if (!c.HaveFields() || c.IsCMYK()) return false;
+  if (c.GetColorSpace() != ColorSpace::kRGB &&
+      c.GetColorSpace() != ColorSpace::kGray) {
+    return false;
+  }
+  if (c.tf.IsGamma()) {
+    curve->tf = AnalyticTF::kGamma;
+    curve->gamma = static_cast<float>(c.tf.GetGamma());
+  } else if (c.tf.IsDCI()) {
+    curve->tf = AnalyticTF::kGamma;
+    curve->gamma = 1.0f / 2.6f;
+  } else if (c.tf.IsLinear()) {
+    curve->tf = AnalyticTF::kLinear;
+  } else if (c.tf.IsSRGB()) {
+    curve->tf = AnalyticTF::kSRGB;
+  } else if (c.tf.Is709()) {
+    curve->tf = AnalyticTF::k709;
+  } else {
+    return false;
+  }
+  return true;
 }
 
-void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
-                 const JxlColorProfile* input, const JxlColorProfile* output,
-                 float intensity_target) {
-  auto t = jxl::make_unique<JxlCms>();
+// Computes the matrix from linear RGB in c_src to linear RGB in c_dst. Both
+// are adapted to D50, as in the profiles created by MaybeCreateProfile.
+Status GetAnalyticMatrix(const ColorEncoding& c_src,
+                         const ColorEncoding& c_dst, float matrix[9]) {
+  float src_to_xyz[9];
+  float dst_to_xyz[9];
+  const ColorEncoding* encodings[2] = {&c_src, &c_dst};
+  float* to_xyz[2] = {src_to_xyz, dst_to_xyz};
+  for (size_t i = 0; i < 2; ++i) {
+    const PrimariesCIExy p = encodings[i]->GetPrimaries();
+    const CIExy w = encodings[i]->GetWhitePoint();
+    JXL_RETURN_IF_ERROR(PrimariesToXYZD50(p.r.x, p.r.y, p.g.x, p.g.y, p.b.x,
+                                          p.b.y, w.x, w.y, to_xyz[i]));
+  }
+  JXL_RETURN_IF_ERROR(Inv3x3Matrix(dst_to_xyz));
+  MatMul(dst_to_xyz, src_to_xyz, 3, 3, 3, matrix);
+  return true;
+}
+
+Status CreateCmsPlan(const JxlColorProfile* input,
+                     const JxlColorProfile* output, CmsPlan* t) {
   PaddedBytes icc_src, icc_dst;
   icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
   ColorEncoding c_src;
   if (!c_src.SetICC(std::move(icc_src))) {
     JXL_NOTIFY_ERROR("JxlCmsInit: failed to parse input ICC");
-    return nullptr;
+    return false;
   }
   icc_dst.assign(output->icc.data, output->icc.data + output->icc.size);
   ColorEncoding c_dst;
   if (!c_dst.SetICC(std::move(icc_dst))) {
     JXL_NOTIFY_ERROR("JxlCmsInit: failed to parse output ICC");
-    return nullptr;
+    return false;
   }
 #if JXL_CMS_VERBOSE
   printf("%s -> %s\n", Description(c_src).c_str(), Description(c_dst).c_str());
 #endif
 
 #if JPEGXL_ENABLE_SKCMS
-  if (!DecodeProfile(input->icc.data, input->icc.size, &t->profile_src)) {
+  // The profiles point into the ICC data, which must outlive the plan.
+  t->icc_src = c_src.ICC();
+  t->icc_dst = c_dst.ICC();
+  if (!DecodeProfile(t->icc_src.data(), t->icc_src.size(), &t->profile_src)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: skcms failed to parse input ICC");
-    return nullptr;
+    return false;
   }
-  if (!DecodeProfile(output->icc.data, output->icc.size, &t->profile_dst)) {
+  if (!DecodeProfile(t->icc_dst.data(), t->icc_dst.size(), &t->profile_dst)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: skcms failed to parse output ICC");
-    return nullptr;
+    return false;
   }
 #else   // JPEGXL_ENABLE_SKCMS
   const cmsContext context = GetContext();
   Profile profile_src, profile_dst;
   if (!DecodeProfile(context, c_src.ICC(), &profile_src)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: lcms failed to parse input ICC");
-    return nullptr;
+    return false;
   }
   if (!DecodeProfile(context, c_dst.ICC(), &profile_dst)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: lcms failed to parse output ICC");
-    return nullptr;
+    return false;
   }
 #endif  // JPEGXL_ENABLE_SKCMS
 
@@ -1006,7 +1163,7 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
         !GetPrimariesLuminances(*c_hlg, t->hlg_ootf_luminances.data())) {
       JXL_NOTIFY_ERROR(
           "JxlCmsInit: failed to compute the luminances of primaries");
-      return nullptr;
+      return false;
     }
   }
 
@@ -1051,7 +1208,7 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
         JXL_NOTIFY_ERROR(
             "Failed to create extra linear source profile, and HLG OOTF "
             "required");
-        return nullptr;
+        return false;
       }
       JXL_WARNING("Failed to create extra linear destination profile");
     }
@@ -1091,7 +1248,7 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
         JXL_NOTIFY_ERROR(
             "Failed to create extra linear destination profile, and inverse "
             "HLG OOTF required");
-        return nullptr;
+        return false;
       }
       JXL_WARNING("Failed to create extra linear destination profile");
     }
@@ -1104,12 +1261,31 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
     t->skip_lcms = true;
   }
 
+  // Matrix/shaper conversions (e.g. Display P3, Rec. 2020, Adobe RGB or gamma
+  // 2.2 to sRGB) are cheaper to evaluate directly than through the CMS.
+  // Absolute colorimetric intent is only handled if it is a no-op.
+  if (!t->skip_lcms && c_src.IsGray() == c_dst.IsGray() &&
+      (c_dst.rendering_intent != RenderingIntent::kAbsolute ||
+       c_src.SameColorSpace(c_dst)) &&
+      GetAnalyticCurve(c_src, &t->curve_src) &&
+      GetAnalyticCurve(c_dst, &t->curve_dst)) {
+    t->analytic = true;
+    if (c_src.IsGray()) {
+      t->matrix = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    } else if (!GetAnalyticMatrix(c_src, c_dst, t->matrix.data())) {
+      t->analytic = false;
+    }
+#if JXL_CMS_VERBOSE
+    if (t->analytic) printf("Analytic transform, skipping CMS\n");
+#endif
+  }
+
 #if JPEGXL_ENABLE_SKCMS
   if (!skcms_MakeUsableAsDestination(&t->profile_dst)) {
     JXL_NOTIFY_ERROR(
         "Failed to make %s usable as a color transform destination",
         Description(c_dst).c_str());
-    return nullptr;
+    return false;
   }
 #endif  // JPEGXL_ENABLE_SKCMS
 
@@ -1119,8 +1295,7 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   JXL_CHECK(channels_src == channels_dst ||
             (channels_src == 4 && channels_dst == 3));
 #if JXL_CMS_VERBOSE
-  printf("Channels: %" PRIuS "; Threads: %" PRIuS "\n", channels_src,
-         num_threads);
+  printf("Channels: %" PRIuS "\n", channels_src);
 #endif
 
 #if !JPEGXL_ENABLE_SKCMS
@@ -1132,14 +1307,119 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   // cmsDoTransform() thread-safe.
   const uint32_t flags = cmsFLAGS_NOCACHE | cmsFLAGS_BLACKPOINTCOMPENSATION |
                          cmsFLAGS_HIGHRESPRECALC;
-  t->lcms_transform =
-      cmsCreateTransformTHR(context, profile_src.get(), type_src,
-                            profile_dst.get(), type_dst, intent, flags);
-  if (t->lcms_transform == nullptr) {
-    JXL_NOTIFY_ERROR("Failed to create transform");
-    return nullptr;
+  if (!t->analytic) {
+    t->lcms_transform.reset(
+        cmsCreateTransformTHR(context, profile_src.get(), type_src,
+                              profile_dst.get(), type_dst, intent, flags));
+    if (t->lcms_transform == nullptr) {
+      JXL_NOTIFY_ERROR("Failed to create transform");
+      return false;
+    }
   }
 #endif  // !JPEGXL_ENABLE_SKCMS
+  t->channels_src = channels_src;
+  t->channels_dst = channels_dst;
+  return true;
+}
+
+// Thread-safe LRU cache of CmsPlan, keyed by the source and destination ICC
+// profiles. Parsing the profiles and creating the lcms transform dominates
+// JxlCmsInit, while callers usually convert many images between the same few
+// profiles.
+class CmsPlanCache {
+ public:
+  static CmsPlanCache* Get() {
+    // Never destroyed, so that it can still be used during static
+    // destruction.
+    static CmsPlanCache* cache = new CmsPlanCache();
+    return cache;
+  }
+
+  std::shared_ptr<const CmsPlan> GetOrCreate(const JxlColorProfile* input,
+                                             const JxlColorProfile* output) {
+    const uint64_t key =
+        HashBytes(output->icc.data, output->icc.size,
+                  HashBytes(input->icc.data, input->icc.size));
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->Matches(key, input, output)) {
+          entries_.splice(entries_.begin(), entries_, it);
+          return entries_.front().plan;
+        }
+      }
+    }
+    // Not holding the lock while creating: concurrent misses for the same
+    // profiles only cost duplicate work.
+    auto plan = std::make_shared<CmsPlan>();
+    if (!CreateCmsPlan(input, output, plan.get())) return nullptr;
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.emplace_front();
+    Entry& entry = entries_.front();
+    entry.key = key;
+    entry.icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
+    entry.icc_dst.assign(output->icc.data, output->icc.data + output->icc.size);
+    entry.plan = std::move(plan);
+    if (entries_.size() > kCapacity) entries_.pop_back();
+    return entry.plan;
+  }
+
+ private:
+  static constexpr size_t kCapacity = 16;
+
+  struct Entry {
+    bool Matches(uint64_t other_key, const JxlColorProfile* input,
+                 const JxlColorProfile* output) const {
+      return key == other_key && icc_src.size() == input->icc.size &&
+             icc_dst.size() == output->icc.size &&
+             std::equal(icc_src.begin(), icc_src.end(), input->icc.data) &&
+             std::equal(icc_dst.begin(), icc_dst.end(), output->icc.data);
+    }
+
+    uint64_t key;
+    // Full profiles, to rule out hash collisions.
+    std::vector<uint8_t> icc_src, icc_dst;
+    std::shared_ptr<const CmsPlan> plan;
+  };
+
+  std::mutex mutex_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+};
+
+void JxlCmsDestroy(void* cms_data) {
+  if (cms_data == nullptr) return;
+  JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
+  delete t;
+}
+
+void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
+                 const JxlColorProfile* input, const JxlColorProfile* output,
+                 float intensity_target) {
+  std::shared_ptr<const CmsPlan> plan =
+      CmsPlanCache::Get()->GetOrCreate(input, output);
+  if (plan == nullptr) return nullptr;
+
+  auto t = jxl::make_unique<JxlCms>();
+#if JPEGXL_ENABLE_SKCMS
+  t->profile_src = plan->profile_src;
+  t->profile_dst = plan->profile_dst;
+#else
+  t->lcms_transform = plan->lcms_transform.get();
+#endif
+  t->apply_hlg_ootf = plan->apply_hlg_ootf;
+  t->hlg_ootf_num_channels = plan->hlg_ootf_num_channels;
+  t->hlg_ootf_luminances = plan->hlg_ootf_luminances;
+  t->skip_lcms = plan->skip_lcms;
+  t->preprocess = plan->preprocess;
+  t->postprocess = plan->postprocess;
+  t->analytic = plan->analytic;
+  t->curve_src = plan->curve_src;
+  t->curve_dst = plan->curve_dst;
+  t->matrix = plan->matrix;
+  const size_t channels_src = plan->channels_src;
+  const size_t channels_dst = plan->channels_dst;
+  t->plan = std::move(plan);
 
   // Ideally LCMS would convert directly from External to Image3. However,
   // cmsDoTransformLineStride only accepts 32-bit BytesPerPlaneIn, whereas our
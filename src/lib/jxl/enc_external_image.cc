@@ -84,6 +84,33 @@ void JXL_INLINE LoadFloatRow(float* JXL_RESTRICT row_out, const uint8_t* in,
 
 uint32_t JXL_INLINE Load8(const uint8_t* p) { return *p; }
 
+// Converts the samples of one channel of an interleaved row, starting at `in`.
+void LoadChannelRow(const uint8_t* in, size_t xsize, size_t bytes_per_pixel,
+                    size_t bits_per_sample, bool float_in, bool little_endian,
+                    float* JXL_RESTRICT row_out) {
+  if (float_in) {
+    size_t i = 0;
+    for (size_t x = 0; x < xsize; ++x) {
+      if (bits_per_sample == 16) {
+        row_out[x] = little_endian ? LoadLEFloat16(in + i)
+                                   : LoadBEFloat16(in + i);
+      } else {
+        row_out[x] = little_endian ? LoadLEFloat(in + i) : LoadBEFloat(in + i);
+      }
+      i += bytes_per_pixel;
+    }
+    return;
+  }
+  const float mul = 1. / ((1ull << bits_per_sample) - 1);
+  if (bits_per_sample <= 8) {
+    LoadFloatRow<Load8>(row_out, in, mul, xsize, bytes_per_pixel);
+  } else if (little_endian) {
+    LoadFloatRow<LoadLE16>(row_out, in, mul, xsize, bytes_per_pixel);
+  } else {
+    LoadFloatRow<LoadBE16>(row_out, in, mul, xsize, bytes_per_pixel);
+  }
+}
+
 Status PixelFormatToExternal(const JxlPixelFormat& pixel_format,
                              size_t* bitdepth, bool* float_in) {
   if (pixel_format.data_type == JXL_TYPE_FLOAT) {
@@ -388,6 +415,54 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
   return true;
 }
 
+Status ConvertRowsFromExternal(const uint8_t* rows, size_t stride,
+                               size_t xsize, size_t num_rows,
+                               size_t color_channels, size_t channels,
+                               size_t bits_per_sample, JxlEndianness endianness,
+                               bool float_in, size_t y0, Image3F* color,
+                               ImageF* alpha) {
+  JXL_CHECK(float_in ? bits_per_sample == 16 || bits_per_sample == 32
+                     : bits_per_sample > 0 && bits_per_sample <= 16);
+  if (channels < color_channels) {
+    return JXL_FAILURE("Expected %" PRIuS
+                       " color channels, received only %" PRIuS " channels",
+                       color_channels, channels);
+  }
+  if (y0 + num_rows > color->ysize() || xsize > color->xsize()) {
+    return JXL_FAILURE("Rows out of bounds");
+  }
+  const bool has_alpha = channels == 2 || channels == 4;
+  const size_t bytes_per_channel = DivCeil(bits_per_sample, jxl::kBitsPerByte);
+  const size_t bytes_per_pixel = channels * bytes_per_channel;
+  if (xsize * bytes_per_pixel > stride) {
+    return JXL_FAILURE("Stride is too small");
+  }
+  const bool little_endian =
+      endianness == JXL_LITTLE_ENDIAN ||
+      (endianness == JXL_NATIVE_ENDIAN && IsLittleEndian());
+
+  for (size_t y = 0; y < num_rows; ++y) {
+    const uint8_t* in = rows + stride * y;
+    for (size_t c = 0; c < color_channels; ++c) {
+      LoadChannelRow(in + c * bytes_per_channel, xsize, bytes_per_pixel,
+                     bits_per_sample, float_in, little_endian,
+                     color->PlaneRow(c, y0 + y));
+    }
+    if (color_channels == 1) {
+      memcpy(color->PlaneRow(1, y0 + y), color->ConstPlaneRow(0, y0 + y),
+             xsize * sizeof(float));
+      memcpy(color->PlaneRow(2, y0 + y), color->ConstPlaneRow(0, y0 + y),
+             xsize * sizeof(float));
+    }
+    if (alpha != nullptr && has_alpha) {
+      LoadChannelRow(in + (channels - 1) * bytes_per_channel, xsize,
+                     bytes_per_pixel, bits_per_sample, float_in, little_endian,
+                     alpha->Row(y0 + y));
+    }
+  }
+  return true;
+}
+
 Status BufferToImageF(const JxlPixelFormat& pixel_format, size_t xsize,
                       size_t ysize, const void* buffer, size_t size,
                       ThreadPool* pool, ImageF* channel) {
@@ -34,6 +34,18 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
                            size_t bits_per_sample, JxlEndianness endianness,
                            ThreadPool* pool, ImageBundle* ib, bool float_in,
                            size_t align);
+
+// Converts `num_rows` rows of an interleaved pixel buffer, `stride` bytes
+// apart, into rows [y0, y0 + num_rows) of `color` and, if the input has an
+// alpha channel and `alpha` is non-null, of `alpha`. Gray input is replicated
+// into all three planes. Used by row-wise decoders, which never hold the whole
+// interleaved image in memory.
+Status ConvertRowsFromExternal(const uint8_t* rows, size_t stride,
+                               size_t xsize, size_t num_rows,
+                               size_t color_channels, size_t channels,
+                               size_t bits_per_sample, JxlEndianness endianness,
+                               bool float_in, size_t y0, Image3F* color,
+                               ImageF* alpha);
 Status BufferToImageF(const JxlPixelFormat& pixel_format, size_t xsize,
                       size_t ysize, const void* buffer, size_t size,
                       ThreadPool* pool, ImageF* channel);
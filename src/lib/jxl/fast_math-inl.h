@@ -23,6 +23,7 @@ namespace HWY_NAMESPACE {
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Abs;
 using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::CopySign;
 using hwy::HWY_NAMESPACE::Eq;
 using hwy::HWY_NAMESPACE::Floor;
 using hwy::HWY_NAMESPACE::Ge;
@@ -145,6 +146,21 @@ V FastErff(const DF df, V x) {
   return BitCast(df, Xor(signbit, BitCast(du, result)));
 }
 
+// Approximates the sRGB transfer function like
+// TF_SRGB().DisplayFromEncoded, with a quartic instead of its rational
+// polynomial and linear segment. The coefficients minimize the error after
+// the cube root of XYB (of the result plus the opsin absorbance bias), at most
+// 2.2E-3 for x in [0, 1]; L1 error 6.6E-3 before it.
+template <class DF, class V>
+V FastSRGBDisplayFromEncoded(const DF df, V x) {
+  const auto abs_x = Abs(x);
+  auto poly = MulAdd(Set(df, -3.708848915e-01f), abs_x,
+                     Set(df, 9.567583290e-01f));
+  poly = MulAdd(poly, abs_x, Set(df, 3.475142185e-01f));
+  poly = MulAdd(poly, abs_x, Set(df, 6.002392478e-02f));
+  return CopySign(Mul(poly, abs_x), x);
+}
+
 inline float FastLog2f(float f) {
   HWY_CAPPED(float, 1) D;
   return GetLane(FastLog2f(D, Set(D, f)));
@@ -173,7 +189,9 @@ inline float FastErff(float f) {
 // Returns cbrt(x) + add with 6 ulp max error.
 // Modified from vectormath_exp.h, Apache 2 license.
 // https://www.agner.org/optimize/vectorclass.zip
-template <class V>
+// With fewer than the default 3 Newton-Raphson iterations, the relative error
+// is 4.3E-4 for 2 and 2.1E-2 for 1.
+template <int kIterations = 3, class V>
 V CubeRootAndAdd(const V x, const V add) {
   const HWY_FULL(float) df;
   const HWY_FULL(int32_t) di;
@@ -198,7 +216,7 @@ V CubeRootAndAdd(const V x, const V add) {
   auto r = BitCast(df, m2);
 
   // Newton-Raphson iterations
-  for (int i = 0; i < 3; i++) {
+  for (int i = 0; i < kIterations; i++) {
     const auto r2 = Mul(r, r);
     r = NegMulAdd(xa_3, Mul(r2, r2), Mul(k4_3, r));
   }
@@ -395,6 +395,77 @@ void FastGaussianVertical(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
   }
 }
 
+// Vertical pass of FastGaussianRows: continues the scans of all columns from
+// `state` up to output row `y1`, with one vector of columns at a time.
+void FastGaussianVerticalRows(
+    const hwy::AlignedUniquePtr<RecursiveGaussian>& rg, const ImageF& in,
+    const size_t in_y0, const size_t ysize, const size_t y1,
+    FastGaussianRowsState* state, ImageF* JXL_RESTRICT out) {
+  PROFILER_FUNC;
+  JXL_CHECK(SameSize(in, *out));
+  using D = HWY_FULL(float);
+  using V = Vec<D>;
+  const D d;
+  constexpr size_t kVN = MaxLanes(d);
+#if HWY_TARGET == HWY_SCALAR
+  const V d1_1 = Set(d, rg->d1[0 * 4]);
+  const V d1_3 = Set(d, rg->d1[1 * 4]);
+  const V d1_5 = Set(d, rg->d1[2 * 4]);
+  const V n2_1 = Set(d, rg->n2[0 * 4]);
+  const V n2_3 = Set(d, rg->n2[1 * 4]);
+  const V n2_5 = Set(d, rg->n2[2 * 4]);
+#else
+  const V d1_1 = LoadDup128(d, rg->d1 + 0 * 4);
+  const V d1_3 = LoadDup128(d, rg->d1 + 1 * 4);
+  const V d1_5 = LoadDup128(d, rg->d1 + 2 * 4);
+  const V n2_1 = LoadDup128(d, rg->n2 + 0 * 4);
+  const V n2_3 = LoadDup128(d, rg->n2 + 1 * 4);
+  const V n2_5 = LoadDup128(d, rg->n2 + 2 * 4);
+#endif
+
+  const ssize_t N = rg->radius;
+  const size_t num_vectors = DivCeil(in.xsize(), kVN);
+  // Same warmup as VerticalStrip for the first strip.
+  ssize_t start = state->y;
+  // One after the other in a single row, each aligned to the vector size.
+  const size_t ring_buffer_size = 3 * kVN * kMod;
+  if (state->ring_buffers.xsize() != ring_buffer_size * num_vectors) {
+    JXL_CHECK(state->y == 0);
+    state->ring_buffers = ImageF(ring_buffer_size * num_vectors, 1);
+    ZeroFillImage(&state->ring_buffers);
+    start = -N + 1;
+  }
+  HWY_ALIGN static constexpr float zero[kVN] = {0};
+  // Rows outside the image are zero, as in VerticalStrip; adding them is
+  // exact, so that the outputs do not depend on where the strips start.
+  const auto row = [&](const ssize_t y, const size_t x) -> const float* {
+    if (y < 0 || y >= static_cast<ssize_t>(ysize)) return zero;
+    JXL_DASSERT(y >= static_cast<ssize_t>(in_y0) &&
+                y < static_cast<ssize_t>(in_y0 + in.ysize()));
+    return in.ConstRow(y - in_y0) + x;
+  };
+
+  size_t ctr = state->ctr;
+  for (size_t i = 0; i < num_vectors; ++i) {
+    const size_t x = i * kVN;
+    float* ring_buffer = state->ring_buffers.Row(0) + i * ring_buffer_size;
+    ctr = state->ctr;
+    ssize_t n = start;
+    for (; n < 0; ++n) {
+      VerticalBlock<1>(d1_1, d1_3, d1_5, n2_1, n2_3, n2_5,
+                       TwoInputs(row(n - N - 1, x), row(n + N - 1, x)), ctr,
+                       ring_buffer, OutputNone(), nullptr);
+    }
+    for (; n < static_cast<ssize_t>(y1); ++n) {
+      VerticalBlock<1>(d1_1, d1_3, d1_5, n2_1, n2_3, n2_5,
+                       TwoInputs(row(n - N - 1, x), row(n + N - 1, x)), ctr,
+                       ring_buffer, OutputStore(), out->Row(n - in_y0) + x);
+    }
+  }
+  state->ctr = ctr;
+  state->y = y1;
+}
+
 // TODO(veluca): consider replacing with FastGaussian.
 ImageF ConvolveXSampleAndTranspose(const ImageF& in,
                                    const std::vector<float>& kernel,
@@ -459,7 +530,8 @@ void FastGaussian1D(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
   return HWY_DYNAMIC_DISPATCH(FastGaussian1D)(rg, in, width, out);
 }
 
-HWY_EXPORT(FastGaussianVertical);  // Local function.
+HWY_EXPORT(FastGaussianVertical);      // Local function.
+HWY_EXPORT(FastGaussianVerticalRows);  // Local function.
 
 void ExtrapolateBorders(const float* const JXL_RESTRICT row_in,
                         float* const JXL_RESTRICT row_out, const int xsize,
@@ -619,5 +691,16 @@ void FastGaussian(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
   HWY_DYNAMIC_DISPATCH(FastGaussianVertical)(rg, *temp, pool, out);
 }
 
+void FastGaussianRows(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
+                      const ImageF& in, const size_t in_y0, const size_t ysize,
+                      const size_t y1, ThreadPool* pool,
+                      ImageF* JXL_RESTRICT temp, FastGaussianRowsState* state,
+                      ImageF* JXL_RESTRICT out) {
+  JXL_CHECK(state->y <= y1 && y1 <= ysize);
+  FastGaussianHorizontal(rg, in, pool, temp);
+  HWY_DYNAMIC_DISPATCH(FastGaussianVerticalRows)
+  (rg, *temp, in_y0, ysize, y1, state, out);
+}
+
 }  // namespace jxl
 #endif  // HWY_ONCE
@@ -89,6 +89,27 @@ void FastGaussian(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
                   const ImageF& in, ThreadPool* pool, ImageF* JXL_RESTRICT temp,
                   ImageF* JXL_RESTRICT out);
 
+// Where FastGaussianRows continues the vertical scans of an image.
+struct FastGaussianRowsState {
+  // Next output row.
+  size_t y = 0;
+  // Number of rows that the scans have seen so far.
+  size_t ctr = 0;
+  // Scan states of the vectors of columns, one after the other; empty before
+  // the first strip.
+  ImageF ring_buffers;
+};
+
+// FastGaussian of output rows [state->y, y1) of an image of `ysize` rows, of
+// which `in` holds rows [in_y0, in_y0 + in.ysize()), including those within
+// rg->radius + 1 of the output rows. Writes output row y to row y - in_y0 of
+// `out`. Blurring consecutive strips of an image with the same `state` gives
+// exactly the same rows as FastGaussian of the whole image.
+void FastGaussianRows(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
+                      const ImageF& in, size_t in_y0, size_t ysize, size_t y1,
+                      ThreadPool* pool, ImageF* JXL_RESTRICT temp,
+                      FastGaussianRowsState* state, ImageF* JXL_RESTRICT out);
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_GAUSS_BLUR_H_
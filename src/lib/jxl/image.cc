@@ -73,6 +73,10 @@ size_t BytesPerRow(const size_t xsize, const size_t sizeof_t) {
 
 PlaneBase::PlaneBase(const size_t xsize, const size_t ysize,
                      const size_t sizeof_t)
+    : PlaneBase(xsize, ysize, sizeof_t, nullptr) {}
+
+PlaneBase::PlaneBase(const size_t xsize, const size_t ysize,
+                     const size_t sizeof_t, CacheAlignedArena* arena)
     : xsize_(static_cast<uint32_t>(xsize)),
       ysize_(static_cast<uint32_t>(ysize)),
       orig_xsize_(static_cast<uint32_t>(xsize)),
@@ -90,12 +94,43 @@ PlaneBase::PlaneBase(const size_t xsize, const size_t ysize,
   // if nonzero, because "zero" bytes still have padding/bookkeeping overhead.
   if (xsize != 0 && ysize != 0) {
     bytes_per_row_ = BytesPerRow(xsize, sizeof_t);
-    bytes_ = AllocateArray(bytes_per_row_ * ysize);
+    const size_t bytes = bytes_per_row_ * ysize;
+    if (arena) {
+      bytes_ = CacheAlignedUniquePtr(
+          static_cast<uint8_t*>(arena->Allocate(bytes)), CacheAlignedDeleter());
+    }
+    if (!bytes_) bytes_ = AllocateArray(bytes);
     JXL_CHECK(bytes_.get());
     InitializePadding(sizeof_t, Padding::kRoundUp);
   }
 }
 
+Status PlaneBase::View(const size_t xsize, const size_t ysize,
+                       const size_t sizeof_t, const void* bytes,
+                       const size_t bytes_per_row, PlaneBase* out) {
+  // As assumed by VoidRow and by aligned vector loads; allocated rows are
+  // aligned to more (CacheAligned::kAlignment) only for performance.
+  const size_t vec_size = VectorSize();
+  const size_t align = std::max<size_t>(vec_size, 64);
+  const size_t padding = vec_size > sizeof_t ? vec_size - sizeof_t : 0;
+  if (reinterpret_cast<uintptr_t>(bytes) % align != 0 ||
+      bytes_per_row % align != 0 ||
+      bytes_per_row < xsize * sizeof_t + padding) {
+    return JXL_FAILURE("Rows are not aligned or padded for vectors");
+  }
+  PlaneBase view;
+  view.xsize_ = view.orig_xsize_ = static_cast<uint32_t>(xsize);
+  view.ysize_ = view.orig_ysize_ = static_cast<uint32_t>(ysize);
+  if (xsize != 0 && ysize != 0) {
+    view.bytes_per_row_ = bytes_per_row;
+    view.bytes_ = CacheAlignedUniquePtr(
+        static_cast<uint8_t*>(const_cast<void*>(bytes)),
+        CacheAlignedDeleter(/*owned=*/false));
+  }
+  *out = std::move(view);
+  return true;
+}
+
 void PlaneBase::InitializePadding(const size_t sizeof_t, Padding padding) {
 #if defined(MEMORY_SANITIZER) || HWY_IDE
   if (xsize_ == 0 || ysize_ == 0) return;
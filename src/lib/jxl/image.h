@@ -35,6 +35,17 @@ struct PlaneBase {
         bytes_per_row_(0),
         bytes_(nullptr) {}
   PlaneBase(size_t xsize, size_t ysize, size_t sizeof_t);
+  // Carves the pixels out of `arena` (unless null), which must outlive the
+  // plane, or allocates them if it is full.
+  PlaneBase(size_t xsize, size_t ysize, size_t sizeof_t,
+            CacheAlignedArena* arena);
+
+  // Read-only view of `ysize` rows of `bytes_per_row` bytes at `bytes`, which
+  // must outlive the plane and is neither written nor freed by it. Fails
+  // unless the rows are aligned and padded as those of allocated planes; the
+  // padding must be initialized.
+  static Status View(size_t xsize, size_t ysize, size_t sizeof_t,
+                     const void* bytes, size_t bytes_per_row, PlaneBase* out);
 
   // Copy construction/assignment is forbidden to avoid inadvertent copies,
   // which can be very expensive. Use CopyImageTo() instead.
@@ -149,6 +160,13 @@ class Plane : public PlaneBase {
   Plane() = default;
   Plane(const size_t xsize, const size_t ysize)
       : PlaneBase(xsize, ysize, sizeof(T)) {}
+  Plane(const size_t xsize, const size_t ysize, CacheAlignedArena* arena)
+      : PlaneBase(xsize, ysize, sizeof(T), arena) {}
+
+  static Status View(const size_t xsize, const size_t ysize, const T* bytes,
+                     const size_t bytes_per_row, Plane* out) {
+    return PlaneBase::View(xsize, ysize, sizeof(T), bytes, bytes_per_row, out);
+  }
 
   void InitializePaddingForUnalignedAccesses() {
     InitializePadding(sizeof(T), Padding::kUnaligned);
@@ -383,6 +401,10 @@ class Image3 {
       : planes_{PlaneT(xsize, ysize), PlaneT(xsize, ysize),
                 PlaneT(xsize, ysize)} {}
 
+  Image3(const size_t xsize, const size_t ysize, CacheAlignedArena* arena)
+      : planes_{PlaneT(xsize, ysize, arena), PlaneT(xsize, ysize, arena),
+                PlaneT(xsize, ysize, arena)} {}
+
   Image3(Image3&& other) noexcept {
     for (size_t i = 0; i < kNumPlanes; i++) {
       planes_[i] = std::move(other.planes_[i]);
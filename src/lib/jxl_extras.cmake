@@ -18,6 +18,7 @@ set(JPEGXL_EXTRAS_SOURCES
   extras/dec/pgx.h
   extras/dec/pnm.cc
   extras/dec/pnm.h
+  extras/dec/row_sink.h
   extras/enc/encode.cc
   extras/enc/encode.h
   extras/enc/npy.cc
@@ -54,6 +55,7 @@ set(JPEGXL_EXTRAS_CODEC_SOURCES
   extras/dec/pgx.h
   extras/dec/pnm.cc
   extras/dec/pnm.h
+  extras/dec/row_sink.h
   extras/enc/encode.cc
   extras/enc/encode.h
   extras/enc/npy.cc
@@ -26,56 +26,855 @@ Design:
 
 #include <cstddef>
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "ssimulacra2.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/extras/time.h"
+#include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/cache_aligned.h"
+#include "lib/jxl/base/file_io.h"
+#include "lib/jxl/base/printf_macros.h"
+#include "lib/jxl/common.h"
 #include "lib/jxl/enc_color_management.h"
-#include "lib/jxl/enc_xyb.h"
+#include "lib/jxl/fast_math-inl.h"
 #include "lib/jxl/gauss_blur.h"
 #include "lib/jxl/image_ops.h"
+#include "lib/jxl/opsin_params.h"
+#include "lib/jxl/transfer_functions-inl.h"
+#include "ssimulacra2_stages.h"
+#include "ssimulacra2_trace.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Abs;
+using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::AllTrue;
+using hwy::HWY_NAMESPACE::And;
+using hwy::HWY_NAMESPACE::AndNot;
+using hwy::HWY_NAMESPACE::BitCast;
+using hwy::HWY_NAMESPACE::CopySign;
+using hwy::HWY_NAMESPACE::Eq;
+using hwy::HWY_NAMESPACE::IfThenElse;
+using hwy::HWY_NAMESPACE::Lt;
+using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::RebindToUnsigned;
+using hwy::HWY_NAMESPACE::Set;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::ZeroIfNegative;
+
+// Opsin absorbance matrix scaled by the intensity target, followed by the
+// negated cube roots of the bias, each broadcast to a full vector.
+void InitPremulAbsorb(float intensity_target, float* JXL_RESTRICT premul) {
+  const HWY_FULL(float) d;
+  const size_t N = Lanes(d);
+  for (size_t i = 0; i < 9; ++i) {
+    const auto absorb =
+        Set(d, kOpsinAbsorbanceMatrix[i] * (intensity_target / 255.0f));
+    Store(absorb, d, premul + i * N);
+  }
+  for (size_t i = 0; i < 3; ++i) {
+    const auto neg_bias_cbrt = Set(d, -cbrtf(kOpsinAbsorbanceBias[i]));
+    Store(neg_bias_cbrt, d, premul + (9 + i) * N);
+  }
+}
+
+// Returns the cube root of row `i` of the opsin absorbance matrix applied to
+// (r, g, b) plus the bias, minus the cube root of the bias. If kFast, the cube
+// root is approximated with fewer iterations (see SSIMULACRA2Options::fast).
+template <bool kFast, class D, class V>
+JXL_INLINE V OpsinCubeRoot(D d, size_t i, const V r, const V g, const V b,
+                           const float* JXL_RESTRICT premul) {
+  const size_t N = Lanes(d);
+  const auto mixed = MulAdd(Load(d, premul + (3 * i + 0) * N), r,
+                            MulAdd(Load(d, premul + (3 * i + 1) * N), g,
+                                   MulAdd(Load(d, premul + (3 * i + 2) * N), b,
+                                          Set(d, kOpsinAbsorbanceBias[i]))));
+  return CubeRootAndAdd<kFast ? 2 : 3>(ZeroIfNegative(mixed),
+                                       Load(d, premul + (9 + i) * N));
+}
+
+// Converts linear sRGB to XYB, with the rescaling to the 0..1 range (see
+// MakePositiveXYB in the scalar code this replaced) folded into the final
+// linear combination:
+//   X = 14 * (m0 - m1) / 2 + 0.42
+//   Y = (m0 + m1) / 2 + 0.01
+//   B = m2 - (m0 + m1) / 2 + 0.55
+template <bool kFast, class D, class V>
+JXL_INLINE void StorePositiveXYB(D d, const V r, const V g, const V b,
+                                 const float* JXL_RESTRICT premul,
+                                 float* JXL_RESTRICT row_x,
+                                 float* JXL_RESTRICT row_y,
+                                 float* JXL_RESTRICT row_b) {
+  const auto mixed0 = OpsinCubeRoot<kFast>(d, 0, r, g, b, premul);
+  const auto mixed1 = OpsinCubeRoot<kFast>(d, 1, r, g, b, premul);
+  const auto mixed2 = OpsinCubeRoot<kFast>(d, 2, r, g, b, premul);
+  const auto y = Mul(Set(d, 0.5f), Add(mixed0, mixed1));
+  Store(MulAdd(Set(d, 7.0f), Sub(mixed0, mixed1), Set(d, 0.42f)), d, row_x);
+  Store(Add(y, Set(d, 0.01f)), d, row_y);
+  Store(Add(Sub(mixed2, y), Set(d, 0.55f)), d, row_b);
+}
+
+// Only the Y plane of StorePositiveXYB.
+template <bool kFast, class D, class V>
+JXL_INLINE void StorePositiveY(D d, const V r, const V g, const V b,
+                               const float* JXL_RESTRICT premul,
+                               float* JXL_RESTRICT row_y) {
+  const auto mixed0 = OpsinCubeRoot<kFast>(d, 0, r, g, b, premul);
+  const auto mixed1 = OpsinCubeRoot<kFast>(d, 1, r, g, b, premul);
+  const auto y = Mul(Set(d, 0.5f), Add(mixed0, mixed1));
+  Store(Add(y, Set(d, 0.01f)), d, row_y);
+}
+
+// Gray version of StorePositiveXYB. The rows of the opsin absorbance matrix
+// sum to 1, hence m0 = m1 = m2 for r = g = b, and X and B are the constants
+// 0.42 and 0.55 (up to rounding): only Y is computed.
+template <bool kFast, class D, class V>
+JXL_INLINE void StorePositiveY(D d, const V v, const float* JXL_RESTRICT premul,
+                               float* JXL_RESTRICT row_y) {
+  StorePositiveY<kFast>(d, v, v, v, premul, row_y);
+}
+
+// Fills `xyb` with the positive XYB of linear sRGB `linear`.
+void PositiveXYBFromLinear(const Image3F& linear, float intensity_target,
+                           Image3F* JXL_RESTRICT xyb) {
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul[MaxLanes(d) * 12];
+  InitPremulAbsorb(intensity_target, premul);
+  for (size_t y = 0; y < linear.ysize(); ++y) {
+    const float* JXL_RESTRICT row_r = linear.ConstPlaneRow(0, y);
+    const float* JXL_RESTRICT row_g = linear.ConstPlaneRow(1, y);
+    const float* JXL_RESTRICT row_b = linear.ConstPlaneRow(2, y);
+    float* JXL_RESTRICT row_x = xyb->PlaneRow(0, y);
+    float* JXL_RESTRICT row_y = xyb->PlaneRow(1, y);
+    float* JXL_RESTRICT row_z = xyb->PlaneRow(2, y);
+    for (size_t x = 0; x < linear.xsize(); x += Lanes(d)) {
+      StorePositiveXYB</*kFast=*/false>(d, Load(d, row_r + x),
+                                        Load(d, row_g + x), Load(d, row_b + x),
+                                        premul, row_x + x, row_y + x,
+                                        row_z + x);
+    }
+  }
+}
+
+// Fills `y` with the positive Y of linear gray `linear`.
+void PositiveYFromLinear(const ImageF& linear, float intensity_target,
+                         ImageF* JXL_RESTRICT y) {
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul[MaxLanes(d) * 12];
+  InitPremulAbsorb(intensity_target, premul);
+  for (size_t iy = 0; iy < linear.ysize(); ++iy) {
+    const float* JXL_RESTRICT row_in = linear.ConstRow(iy);
+    float* JXL_RESTRICT row_y = y->Row(iy);
+    for (size_t x = 0; x < linear.xsize(); x += Lanes(d)) {
+      StorePositiveY</*kFast=*/false>(d, Load(d, row_in + x), premul,
+                                      row_y + x);
+    }
+  }
+}
+
+// Writes row `oy` of `in` box-downsampled by 2x2 to `row_out`, given rows
+// `2 * oy` and the next one (or the same, at the bottom of an odd `in`) as
+// `row0` and `row1`, replicating the last column if the size is odd.
+//
+// Highway 0.15 lacks deinterleaving loads, hence the horizontal reduction is
+// left to the compiler; it keeps the summation order of the former generic
+// Downsample(in, fx, fy).
+void DownsampleRow2x2(const float* JXL_RESTRICT row0,
+                      const float* JXL_RESTRICT row1, size_t in_xsize,
+                      size_t out_xsize, float* JXL_RESTRICT row_out) {
+  // Output pixels whose 2x2 block lies entirely within `in`.
+  const size_t full_xsize = in_xsize / 2;
+  for (size_t ox = 0; ox < full_xsize; ++ox) {
+    const size_t x = 2 * ox;
+    row_out[ox] = (row0[x] + row0[x + 1] + row1[x] + row1[x + 1]) * 0.25f;
+  }
+  if (full_xsize < out_xsize) {
+    const size_t x = in_xsize - 1;
+    row_out[full_xsize] = (row0[x] + row0[x] + row1[x] + row1[x]) * 0.25f;
+  }
+}
+
+// Returns row `y` of linear `in` as floats: the row itself for float planes,
+// else promoted to row `r` of `buffer`.
+const float* PromotedRow(const ImageF& in, size_t y, ImageF* /*buffer*/,
+                         size_t /*r*/) {
+  return in.ConstRow(y);
+}
+const float* PromotedRow(const Plane<hwy::float16_t>& in, size_t y,
+                         ImageF* buffer, size_t r) {
+  const HWY_FULL(float) d;
+  const Rebind<hwy::float16_t, decltype(d)> df16;
+  const hwy::float16_t* JXL_RESTRICT row_in = in.ConstRow(y);
+  float* JXL_RESTRICT row = buffer->Row(r);
+  for (size_t x = 0; x < in.xsize(); x += Lanes(d)) {
+    Store(PromoteTo(d, Load(df16, row_in + x)), d, row + x);
+  }
+  return row;
+}
+
+// Returns where to write row `y` of linear `out` as floats before StoreRow:
+// the row itself for float planes, else row `r` of `buffer`.
+float* RowToStore(ImageF* out, size_t y, ImageF* /*buffer*/, size_t /*r*/) {
+  return out->Row(y);
+}
+float* RowToStore(Plane<hwy::float16_t>* /*out*/, size_t /*y*/,
+                  ImageF* buffer, size_t r) {
+  return buffer->Row(r);
+}
+// Rounds `v` to the nearest half float, ties to even, as floats. DemoteTo only
+// rounds like this on some targets (others truncate), but converts these
+// values exactly on all of them, so that half float planes and thus scores do
+// not depend on the target. Finite values only; beyond the largest half float
+// they are not clamped.
+template <class D, class V>
+JXL_INLINE V RoundToF16(D d, V v) {
+  const RebindToUnsigned<D> du;
+  // Normal half floats: 13 bits fewer of mantissa, whose carry may increment
+  // the exponent.
+  const auto bits = BitCast(du, v);
+  const auto odd = And(ShiftRight<13>(bits), Set(du, 1));
+  const auto normal = BitCast(
+      d, AndNot(Set(du, 0x1FFF), Add(bits, Add(Set(du, 0xFFF), odd))));
+  // Subnormal half floats: multiples of 2^-24, the spacing of floats in
+  // [0.5, 1).
+  const auto half = Set(d, 0.5f);
+  const auto subnormal = CopySign(Sub(Add(Abs(v), half), half), v);
+  return IfThenElse(Lt(Abs(v), Set(d, 1.0f / 16384)), subnormal, normal);
+}
+
+void StoreRow(const float* /*row*/, size_t /*y*/, ImageF* /*out*/) {}
+void StoreRow(const float* JXL_RESTRICT row, size_t y,
+              Plane<hwy::float16_t>* out) {
+  const HWY_FULL(float) d;
+  const Rebind<hwy::float16_t, decltype(d)> df16;
+  hwy::float16_t* JXL_RESTRICT row_out = out->Row(y);
+  for (size_t x = 0; x < out->xsize(); x += Lanes(d)) {
+    Store(DemoteTo(df16, RoundToF16(d, Load(d, row + x))), df16, row_out + x);
+  }
+}
+
+// Box-downsamples row `oy` of `in` by 2x2 into `out`, both float or half
+// float planes, and returns it as floats. Half floats are converted in the
+// three rows of `buffer`.
+template <class LinearPlane>
+const float* DownsampleRow2x2(const LinearPlane& in, size_t oy,
+                              LinearPlane* JXL_RESTRICT out,
+                              ImageF* JXL_RESTRICT buffer) {
+  const size_t y0 = 2 * oy;
+  const size_t y1 = std::min(y0 + 1, in.ysize() - 1);
+  float* JXL_RESTRICT row = RowToStore(out, oy, buffer, 2);
+  DownsampleRow2x2(PromotedRow(in, y0, buffer, 0),
+                   PromotedRow(in, y1, buffer, 1), in.xsize(), out->xsize(),
+                   row);
+  StoreRow(row, oy, out);
+  return row;
+}
+
+// Box-downsamples linear sRGB `in` by 2x2 into `out` (see DownsampleRow2x2),
+// and converts each output row to positive XYB in `xyb` while it is still in
+// cache. `out` and `xyb` must already have the downsampled size. `buffer` (of
+// the width of `in` and 3 rows) is only used if they are half float.
+template <bool kFast, class Linear>
+void Downsample2x2AndPositiveXYB(const Linear& in, float intensity_target,
+                                 Linear* JXL_RESTRICT out,
+                                 Image3F* JXL_RESTRICT xyb,
+                                 Image3F* JXL_RESTRICT buffer) {
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul[MaxLanes(d) * 12];
+  InitPremulAbsorb(intensity_target, premul);
+  for (size_t oy = 0; oy < out->ysize(); ++oy) {
+    const float* JXL_RESTRICT rows[3];
+    for (size_t c = 0; c < 3; ++c) {
+      rows[c] = DownsampleRow2x2(in.Plane(c), oy, &out->Plane(c),
+                                 buffer ? &buffer->Plane(c) : nullptr);
+    }
+    float* JXL_RESTRICT row_x = xyb->PlaneRow(0, oy);
+    float* JXL_RESTRICT row_y = xyb->PlaneRow(1, oy);
+    float* JXL_RESTRICT row_z = xyb->PlaneRow(2, oy);
+    for (size_t x = 0; x < out->xsize(); x += Lanes(d)) {
+      StorePositiveXYB<kFast>(d, Load(d, rows[0] + x), Load(d, rows[1] + x),
+                              Load(d, rows[2] + x), premul, row_x + x,
+                              row_y + x, row_z + x);
+    }
+  }
+}
+
+// Gray version of Downsample2x2AndPositiveXYB.
+template <bool kFast, class LinearPlane>
+void Downsample2x2AndPositiveY(const LinearPlane& in, float intensity_target,
+                               LinearPlane* JXL_RESTRICT out,
+                               ImageF* JXL_RESTRICT y,
+                               ImageF* JXL_RESTRICT buffer) {
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul[MaxLanes(d) * 12];
+  InitPremulAbsorb(intensity_target, premul);
+  for (size_t oy = 0; oy < out->ysize(); ++oy) {
+    const float* JXL_RESTRICT row_in = DownsampleRow2x2(in, oy, out, buffer);
+    float* JXL_RESTRICT row_y = y->Row(oy);
+    for (size_t x = 0; x < out->xsize(); x += Lanes(d)) {
+      StorePositiveY<kFast>(d, Load(d, row_in + x), premul, row_y + x);
+    }
+  }
+}
+
+void Downsample2x2F32AndPositiveXYB(const Image3F& in, float intensity_target,
+                                    Image3F* JXL_RESTRICT out,
+                                    Image3F* JXL_RESTRICT xyb,
+                                    Image3F* JXL_RESTRICT buffer,
+                                    bool fast) {
+  if (fast) {
+    Downsample2x2AndPositiveXYB<true>(in, intensity_target, out, xyb, buffer);
+  } else {
+    Downsample2x2AndPositiveXYB<false>(in, intensity_target, out, xyb, buffer);
+  }
+}
+
+void Downsample2x2F16AndPositiveXYB(const Image3<hwy::float16_t>& in,
+                                    float intensity_target,
+                                    Image3<hwy::float16_t>* JXL_RESTRICT out,
+                                    Image3F* JXL_RESTRICT xyb,
+                                    Image3F* JXL_RESTRICT buffer,
+                                    bool fast) {
+  if (fast) {
+    Downsample2x2AndPositiveXYB<true>(in, intensity_target, out, xyb, buffer);
+  } else {
+    Downsample2x2AndPositiveXYB<false>(in, intensity_target, out, xyb, buffer);
+  }
+}
+
+void Downsample2x2F32AndPositiveY(const ImageF& in, float intensity_target,
+                                  ImageF* JXL_RESTRICT out,
+                                  ImageF* JXL_RESTRICT y,
+                                  ImageF* JXL_RESTRICT buffer,
+                                  bool fast) {
+  if (fast) {
+    Downsample2x2AndPositiveY<true>(in, intensity_target, out, y, buffer);
+  } else {
+    Downsample2x2AndPositiveY<false>(in, intensity_target, out, y, buffer);
+  }
+}
+
+void Downsample2x2F16AndPositiveY(const Plane<hwy::float16_t>& in,
+                                  float intensity_target,
+                                  Plane<hwy::float16_t>* JXL_RESTRICT out,
+                                  ImageF* JXL_RESTRICT y,
+                                  ImageF* JXL_RESTRICT buffer,
+                                  bool fast) {
+  if (fast) {
+    Downsample2x2AndPositiveY<true>(in, intensity_target, out, y, buffer);
+  } else {
+    Downsample2x2AndPositiveY<false>(in, intensity_target, out, y, buffer);
+  }
+}
+
+// Blends the encoded `v` against `bg` using the alpha at `row_a`, unless it is
+// null, and undoes the sRGB transfer function if `is_srgb`, approximately if
+// kFast.
+template <bool kFast, class D, class V>
+JXL_INLINE V BlendAndLinearize(D d, V v, const float* JXL_RESTRICT row_a,
+                               bool is_srgb, const V bg) {
+  if (row_a) {
+    const auto a = LoadU(d, row_a);
+    v = MulAdd(a, v, Mul(Sub(Set(d, 1.0f), a), bg));
+  }
+  if (!is_srgb) return v;
+  return kFast ? FastSRGBDisplayFromEncoded(d, v)
+               : TF_SRGB().DisplayFromEncoded(v);
+}
+
+// Stores linear sRGB `v` to `row`, as half floats for half float planes.
+template <class D, class V>
+JXL_INLINE void StoreLinear(D d, V v, float* JXL_RESTRICT row) {
+  Store(v, d, row);
+}
+template <class D, class V>
+JXL_INLINE void StoreLinear(D d, V v, hwy::float16_t* JXL_RESTRICT row) {
+  const Rebind<hwy::float16_t, D> df16;
+  Store(DemoteTo(df16, RoundToF16(d, v)), df16, row);
+}
+
+// Single pass over `rect` of sRGB or linear sRGB `color` (only plane 0 is read
+// if `is_gray`): blends against `bg` if `alpha` is not null, linearizes, and
+// writes the result to `linear` (float or half float) and its positive XYB,
+// computed before rounding to half float, to `xyb`. If kYOnly, only the Y
+// plane of `xyb` is written.
+template <bool kFast, bool kYOnly, class Linear>
+void BlendLinearAndPositiveXYB(const Image3F& color, const ImageF* alpha,
+                               const Rect& rect, bool is_gray, bool is_srgb,
+                               float bg, float intensity_target,
+                               Linear* JXL_RESTRICT linear,
+                               Image3F* JXL_RESTRICT xyb) {
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul[MaxLanes(d) * 12];
+  InitPremulAbsorb(intensity_target, premul);
+  const auto background = Set(d, bg);
+  for (size_t y = 0; y < rect.ysize(); ++y) {
+    const float* JXL_RESTRICT row_in0 = rect.ConstPlaneRow(color, 0, y);
+    const float* JXL_RESTRICT row_in1 =
+        rect.ConstPlaneRow(color, is_gray ? 0 : 1, y);
+    const float* JXL_RESTRICT row_in2 =
+        rect.ConstPlaneRow(color, is_gray ? 0 : 2, y);
+    const float* JXL_RESTRICT row_a =
+        alpha ? rect.ConstRow(*alpha, y) : nullptr;
+    auto* JXL_RESTRICT row_linear0 = linear->PlaneRow(0, y);
+    auto* JXL_RESTRICT row_linear1 = linear->PlaneRow(1, y);
+    auto* JXL_RESTRICT row_linear2 = linear->PlaneRow(2, y);
+    float* JXL_RESTRICT row_x = xyb->PlaneRow(0, y);
+    float* JXL_RESTRICT row_y = xyb->PlaneRow(1, y);
+    float* JXL_RESTRICT row_b = xyb->PlaneRow(2, y);
+    // Unaligned loads because rect.x0() need not be a multiple of Lanes(d).
+    for (size_t x = 0; x < rect.xsize(); x += Lanes(d)) {
+      const float* JXL_RESTRICT a = row_a ? row_a + x : nullptr;
+      const auto r = BlendAndLinearize<kFast>(d, LoadU(d, row_in0 + x), a,
+                                              is_srgb, background);
+      const auto g = BlendAndLinearize<kFast>(d, LoadU(d, row_in1 + x), a,
+                                              is_srgb, background);
+      const auto b = BlendAndLinearize<kFast>(d, LoadU(d, row_in2 + x), a,
+                                              is_srgb, background);
+      StoreLinear(d, r, row_linear0 + x);
+      StoreLinear(d, g, row_linear1 + x);
+      StoreLinear(d, b, row_linear2 + x);
+      if (kYOnly) {
+        StorePositiveY<kFast>(d, r, g, b, premul, row_y + x);
+      } else {
+        StorePositiveXYB<kFast>(d, r, g, b, premul, row_x + x, row_y + x,
+                                row_b + x);
+      }
+    }
+  }
+}
+
+// Gray version of BlendLinearAndPositiveXYB.
+template <bool kFast, class LinearPlane>
+void BlendLinearAndPositiveY(const ImageF& gray, const ImageF* alpha,
+                             const Rect& rect, bool is_srgb, float bg,
+                             float intensity_target,
+                             LinearPlane* JXL_RESTRICT linear,
+                             ImageF* JXL_RESTRICT y) {
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul[MaxLanes(d) * 12];
+  InitPremulAbsorb(intensity_target, premul);
+  const auto background = Set(d, bg);
+  for (size_t iy = 0; iy < rect.ysize(); ++iy) {
+    const float* JXL_RESTRICT row_in = rect.ConstRow(gray, iy);
+    const float* JXL_RESTRICT row_a =
+        alpha ? rect.ConstRow(*alpha, iy) : nullptr;
+    auto* JXL_RESTRICT row_linear = linear->Row(iy);
+    float* JXL_RESTRICT row_y = y->Row(iy);
+    for (size_t x = 0; x < rect.xsize(); x += Lanes(d)) {
+      const auto v = BlendAndLinearize<kFast>(d, LoadU(d, row_in + x),
+                                              row_a ? row_a + x : nullptr,
+                                              is_srgb, background);
+      StoreLinear(d, v, row_linear + x);
+      StorePositiveY<kFast>(d, v, premul, row_y + x);
+    }
+  }
+}
+
+// Calls BlendLinearAndPositiveXYB, approximately if `fast`, and then only
+// for the Y plane if `y_only`.
+template <class Linear>
+void BlendLinearAndPositiveXYB(const Image3F& color, const ImageF* alpha,
+                               const Rect& rect, bool is_gray, bool is_srgb,
+                               float bg, float intensity_target,
+                               Linear* JXL_RESTRICT linear,
+                               Image3F* JXL_RESTRICT xyb, bool fast,
+                               bool y_only) {
+  if (!fast) {
+    BlendLinearAndPositiveXYB<false, false>(color, alpha, rect, is_gray,
+                                            is_srgb, bg, intensity_target,
+                                            linear, xyb);
+  } else if (y_only) {
+    BlendLinearAndPositiveXYB<true, true>(color, alpha, rect, is_gray, is_srgb,
+                                          bg, intensity_target, linear, xyb);
+  } else {
+    BlendLinearAndPositiveXYB<true, false>(color, alpha, rect, is_gray,
+                                           is_srgb, bg, intensity_target,
+                                           linear, xyb);
+  }
+}
+
+void BlendLinearF32AndPositiveXYB(const Image3F& color, const ImageF* alpha,
+                                  const Rect& rect, bool is_gray, bool is_srgb,
+                                  float bg, float intensity_target,
+                                  Image3F* JXL_RESTRICT linear,
+                                  Image3F* JXL_RESTRICT xyb, bool fast,
+                                  bool y_only) {
+  BlendLinearAndPositiveXYB(color, alpha, rect, is_gray, is_srgb, bg,
+                            intensity_target, linear, xyb, fast, y_only);
+}
+
+void BlendLinearF16AndPositiveXYB(const Image3F& color, const ImageF* alpha,
+                                  const Rect& rect, bool is_gray, bool is_srgb,
+                                  float bg, float intensity_target,
+                                  Image3<hwy::float16_t>* JXL_RESTRICT linear,
+                                  Image3F* JXL_RESTRICT xyb, bool fast,
+                                  bool y_only) {
+  BlendLinearAndPositiveXYB(color, alpha, rect, is_gray, is_srgb, bg,
+                            intensity_target, linear, xyb, fast, y_only);
+}
+
+void BlendLinearF32AndPositiveY(const ImageF& gray, const ImageF* alpha,
+                                const Rect& rect, bool is_srgb, float bg,
+                                float intensity_target,
+                                ImageF* JXL_RESTRICT linear,
+                                ImageF* JXL_RESTRICT y, bool fast) {
+  if (fast) {
+    BlendLinearAndPositiveY<true>(gray, alpha, rect, is_srgb, bg,
+                                  intensity_target, linear, y);
+  } else {
+    BlendLinearAndPositiveY<false>(gray, alpha, rect, is_srgb, bg,
+                                   intensity_target, linear, y);
+  }
+}
+
+void BlendLinearF16AndPositiveY(const ImageF& gray, const ImageF* alpha,
+                                const Rect& rect, bool is_srgb, float bg,
+                                float intensity_target,
+                                Plane<hwy::float16_t>* JXL_RESTRICT linear,
+                                ImageF* JXL_RESTRICT y, bool fast) {
+  if (fast) {
+    BlendLinearAndPositiveY<true>(gray, alpha, rect, is_srgb, bg,
+                                  intensity_target, linear, y);
+  } else {
+    BlendLinearAndPositiveY<false>(gray, alpha, rect, is_srgb, bg,
+                                   intensity_target, linear, y);
+  }
+}
+
+// Rounds the float `in` to half float `out` of the same size.
+void DemoteToF16(const ImageF& in, Plane<hwy::float16_t>* JXL_RESTRICT out) {
+  for (size_t y = 0; y < in.ysize(); ++y) {
+    StoreRow(in.ConstRow(y), y, out);
+  }
+}
+
+// Returns the first x < xsize at which the rows differ, or xsize.
+size_t FirstDifference(const float* JXL_RESTRICT row1,
+                       const float* JXL_RESTRICT row2, size_t xsize) {
+  const HWY_FULL(float) d;
+  size_t x = 0;
+  for (; x + Lanes(d) <= xsize; x += Lanes(d)) {
+    if (!AllTrue(d, Eq(LoadU(d, row1 + x), LoadU(d, row2 + x)))) break;
+  }
+  while (x < xsize && row1[x] == row2[x]) ++x;
+  return x;
+}
+
+// Returns one past the last x in [begin, xsize) at which the rows differ,
+// given that they differ at `begin`.
+size_t EndOfDifferences(const float* JXL_RESTRICT row1,
+                        const float* JXL_RESTRICT row2, size_t begin,
+                        size_t xsize) {
+  const HWY_FULL(float) d;
+  size_t x = xsize;
+  for (; x >= begin + Lanes(d); x -= Lanes(d)) {
+    const size_t x0 = x - Lanes(d);
+    if (!AllTrue(d, Eq(LoadU(d, row1 + x0), LoadU(d, row2 + x0)))) break;
+  }
+  while (x > begin && row1[x - 1] == row2[x - 1]) --x;
+  return x;
+}
+
+// Returns the bounding box, relative to `rect`, of the pixels in `rect` that
+// differ between `a` and `b` (including NaN), or an empty rect if there are
+// none.
+Rect DifferingRect(const ImageF& a, const ImageF& b, const Rect& rect) {
+  JXL_ASSERT(SameSize(a, b) && rect.IsInside(a));
+  size_t x0 = rect.xsize();
+  size_t x1 = 0;
+  size_t y0 = rect.ysize();
+  size_t y1 = 0;
+  for (size_t y = 0; y < rect.ysize(); ++y) {
+    const float* JXL_RESTRICT row1 = rect.ConstRow(a, y);
+    const float* JXL_RESTRICT row2 = rect.ConstRow(b, y);
+    const size_t begin = FirstDifference(row1, row2, rect.xsize());
+    if (begin == rect.xsize()) continue;
+    x0 = std::min(x0, begin);
+    x1 = std::max(x1, EndOfDifferences(row1, row2, begin, rect.xsize()));
+    y0 = std::min(y0, y);
+    y1 = y + 1;
+  }
+  if (y1 == 0) return Rect();
+  return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// Taps 0..kTruncatedRadius of the impulse response of FastGaussian for sigma
+// 1.5; the rest add up to less than 1E-5.
+const size_t kTruncatedRadius = 4;
+const float kTruncatedGaussian[kTruncatedRadius + 1] = {
+    0.264624f, 0.212928f, 0.109335f, 0.036011f, 0.009414f};
+
+float TruncatedGaussianAt(const float* JXL_RESTRICT row, size_t x,
+                          size_t xsize) {
+  float sum = kTruncatedGaussian[0] * row[x];
+  for (size_t k = 1; k <= kTruncatedRadius; ++k) {
+    if (x >= k) sum += kTruncatedGaussian[k] * row[x - k];
+    if (x + k < xsize) sum += kTruncatedGaussian[k] * row[x + k];
+  }
+  return sum;
+}
+
+// Same as TruncatedGaussianAt for the vertical pass, with `rows` as there.
+float TruncatedGaussianAt(const float* JXL_RESTRICT const* rows, size_t x) {
+  const size_t r = kTruncatedRadius;
+  float sum = kTruncatedGaussian[0] * rows[r][x];
+  for (size_t k = 1; k <= r; ++k) {
+    if (rows[r - k]) sum += kTruncatedGaussian[k] * rows[r - k][x];
+    if (rows[r + k]) sum += kTruncatedGaussian[k] * rows[r + k][x];
+  }
+  return sum;
+}
+
+// Separable FIR approximation of FastGaussian, with zeros outside the image
+// like it. `temp` holds the horizontal pass. Neither pass reads or writes the
+// padding of the rows.
+void TruncatedGaussianBlur(const ImageF& in, ImageF* JXL_RESTRICT temp,
+                           ImageF* JXL_RESTRICT out) {
+  const HWY_FULL(float) d;
+  const size_t xsize = in.xsize();
+  const size_t ysize = in.ysize();
+  const size_t r = kTruncatedRadius;
+  for (size_t y = 0; y < ysize; ++y) {
+    const float* JXL_RESTRICT row_in = in.ConstRow(y);
+    float* JXL_RESTRICT row_out = temp->Row(y);
+    size_t x = 0;
+    for (; x < std::min(r, xsize); ++x) {
+      row_out[x] = TruncatedGaussianAt(row_in, x, xsize);
+    }
+    for (; x + Lanes(d) + r <= xsize; x += Lanes(d)) {
+      auto sum = Mul(Set(d, kTruncatedGaussian[0]), LoadU(d, row_in + x));
+      for (size_t k = 1; k <= r; ++k) {
+        const auto pair =
+            Add(LoadU(d, row_in + x - k), LoadU(d, row_in + x + k));
+        sum = MulAdd(Set(d, kTruncatedGaussian[k]), pair, sum);
+      }
+      StoreU(sum, d, row_out + x);
+    }
+    for (; x < xsize; ++x) {
+      row_out[x] = TruncatedGaussianAt(row_in, x, xsize);
+    }
+  }
+  // Rows outside the image are null.
+  const float* JXL_RESTRICT rows[2 * kTruncatedRadius + 1];
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t k = 0; k <= 2 * r; ++k) {
+      rows[k] = y + k >= r && y + k - r < ysize ? temp->ConstRow(y + k - r)
+                                                : nullptr;
+    }
+    float* JXL_RESTRICT row_out = out->Row(y);
+    size_t x = 0;
+    for (; x + Lanes(d) <= xsize; x += Lanes(d)) {
+      auto sum = Mul(Set(d, kTruncatedGaussian[0]), Load(d, rows[r] + x));
+      for (size_t k = 1; k <= r; ++k) {
+        const auto w = Set(d, kTruncatedGaussian[k]);
+        if (rows[r - k]) sum = MulAdd(w, Load(d, rows[r - k] + x), sum);
+        if (rows[r + k]) sum = MulAdd(w, Load(d, rows[r + k] + x), sum);
+      }
+      Store(sum, d, row_out + x);
+    }
+    for (; x < xsize; ++x) {
+      row_out[x] = TruncatedGaussianAt(rows, x);
+    }
+  }
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+namespace {
+
+HWY_EXPORT(PositiveXYBFromLinear);
+void PositiveXYBFromLinear(const Image3F& linear, float intensity_target,
+                           Image3F* JXL_RESTRICT xyb) {
+  HWY_DYNAMIC_DISPATCH(PositiveXYBFromLinear)(linear, intensity_target, xyb);
+}
+
+HWY_EXPORT(Downsample2x2F32AndPositiveXYB);
+void Downsample2x2AndPositiveXYB(const Image3F& in, float intensity_target,
+                                 Image3F* JXL_RESTRICT out,
+                                 Image3F* JXL_RESTRICT xyb,
+                                 Image3F* JXL_RESTRICT buffer, bool fast) {
+  HWY_DYNAMIC_DISPATCH(Downsample2x2F32AndPositiveXYB)
+  (in, intensity_target, out, xyb, buffer, fast);
+}
+
+HWY_EXPORT(Downsample2x2F16AndPositiveXYB);
+void Downsample2x2AndPositiveXYB(const Image3<hwy::float16_t>& in,
+                                 float intensity_target,
+                                 Image3<hwy::float16_t>* JXL_RESTRICT out,
+                                 Image3F* JXL_RESTRICT xyb,
+                                 Image3F* JXL_RESTRICT buffer, bool fast) {
+  HWY_DYNAMIC_DISPATCH(Downsample2x2F16AndPositiveXYB)
+  (in, intensity_target, out, xyb, buffer, fast);
+}
+
+HWY_EXPORT(PositiveYFromLinear);
+void PositiveYFromLinear(const ImageF& linear, float intensity_target,
+                         ImageF* JXL_RESTRICT y) {
+  HWY_DYNAMIC_DISPATCH(PositiveYFromLinear)(linear, intensity_target, y);
+}
+
+HWY_EXPORT(Downsample2x2F32AndPositiveY);
+void Downsample2x2AndPositiveY(const ImageF& in, float intensity_target,
+                               ImageF* JXL_RESTRICT out,
+                               ImageF* JXL_RESTRICT y,
+                               ImageF* JXL_RESTRICT buffer, bool fast) {
+  HWY_DYNAMIC_DISPATCH(Downsample2x2F32AndPositiveY)
+  (in, intensity_target, out, y, buffer, fast);
+}
+
+HWY_EXPORT(Downsample2x2F16AndPositiveY);
+void Downsample2x2AndPositiveY(const Plane<hwy::float16_t>& in,
+                               float intensity_target,
+                               Plane<hwy::float16_t>* JXL_RESTRICT out,
+                               ImageF* JXL_RESTRICT y,
+                               ImageF* JXL_RESTRICT buffer, bool fast) {
+  HWY_DYNAMIC_DISPATCH(Downsample2x2F16AndPositiveY)
+  (in, intensity_target, out, y, buffer, fast);
+}
+
+HWY_EXPORT(BlendLinearF32AndPositiveXYB);
+void BlendLinearAndPositiveXYB(const Image3F& color, const ImageF* alpha,
+                               const Rect& rect, bool is_gray, bool is_srgb,
+                               float bg, float intensity_target,
+                               Image3F* JXL_RESTRICT linear,
+                               Image3F* JXL_RESTRICT xyb, bool fast,
+                               bool y_only) {
+  HWY_DYNAMIC_DISPATCH(BlendLinearF32AndPositiveXYB)
+  (color, alpha, rect, is_gray, is_srgb, bg, intensity_target, linear, xyb,
+   fast, y_only);
+}
+
+HWY_EXPORT(BlendLinearF16AndPositiveXYB);
+void BlendLinearAndPositiveXYB(const Image3F& color, const ImageF* alpha,
+                               const Rect& rect, bool is_gray, bool is_srgb,
+                               float bg, float intensity_target,
+                               Image3<hwy::float16_t>* JXL_RESTRICT linear,
+                               Image3F* JXL_RESTRICT xyb, bool fast,
+                               bool y_only) {
+  HWY_DYNAMIC_DISPATCH(BlendLinearF16AndPositiveXYB)
+  (color, alpha, rect, is_gray, is_srgb, bg, intensity_target, linear, xyb,
+   fast, y_only);
+}
+
+HWY_EXPORT(BlendLinearF32AndPositiveY);
+void BlendLinearAndPositiveY(const ImageF& gray, const ImageF* alpha,
+                             const Rect& rect, bool is_srgb, float bg,
+                             float intensity_target,
+                             ImageF* JXL_RESTRICT linear,
+                             ImageF* JXL_RESTRICT y, bool fast) {
+  HWY_DYNAMIC_DISPATCH(BlendLinearF32AndPositiveY)
+  (gray, alpha, rect, is_srgb, bg, intensity_target, linear, y, fast);
+}
+
+HWY_EXPORT(BlendLinearF16AndPositiveY);
+void BlendLinearAndPositiveY(const ImageF& gray, const ImageF* alpha,
+                             const Rect& rect, bool is_srgb, float bg,
+                             float intensity_target,
+                             Plane<hwy::float16_t>* JXL_RESTRICT linear,
+                             ImageF* JXL_RESTRICT y, bool fast) {
+  HWY_DYNAMIC_DISPATCH(BlendLinearF16AndPositiveY)
+  (gray, alpha, rect, is_srgb, bg, intensity_target, linear, y, fast);
+}
+
+HWY_EXPORT(DemoteToF16);
+void DemoteToF16(const ImageF& in, Plane<hwy::float16_t>* JXL_RESTRICT out) {
+  HWY_DYNAMIC_DISPATCH(DemoteToF16)(in, out);
+}
+
+HWY_EXPORT(TruncatedGaussianBlur);
+void TruncatedGaussianBlur(const ImageF& in, ImageF* JXL_RESTRICT temp,
+                           ImageF* JXL_RESTRICT out) {
+  HWY_DYNAMIC_DISPATCH(TruncatedGaussianBlur)(in, temp, out);
+}
+
+HWY_EXPORT(DifferingRect);
+Rect DifferingRect(const ImageF& a, const ImageF& b, const Rect& rect) {
+  return HWY_DYNAMIC_DISPATCH(DifferingRect)(a, b, rect);
+}
+
+}  // namespace
+}  // namespace jxl
 
 namespace {
 
 using jxl::Image3F;
 using jxl::ImageF;
+// Half float planes, in which the linear sRGB images may be kept.
+using Image3F16 = jxl::Image3<hwy::float16_t>;
+using ImageF16 = jxl::Plane<hwy::float16_t>;
 
 static const float kC2 = 0.0009f;
-static const int kNumScales = 6;
+static const size_t kNumScales = 6;
 
-Image3F Downsample(const Image3F &in, size_t fx, size_t fy) {
-  const size_t out_xsize = (in.xsize() + fx - 1) / fx;
-  const size_t out_ysize = (in.ysize() + fy - 1) / fy;
-  Image3F out(out_xsize, out_ysize);
-  const float normalize = 1.0f / (fx * fy);
-  for (size_t c = 0; c < 3; ++c) {
-    for (size_t oy = 0; oy < out_ysize; ++oy) {
-      float *JXL_RESTRICT row_out = out.PlaneRow(c, oy);
-      for (size_t ox = 0; ox < out_xsize; ++ox) {
-        float sum = 0.0f;
-        for (size_t iy = 0; iy < fy; ++iy) {
-          for (size_t ix = 0; ix < fx; ++ix) {
-            const size_t x = std::min(ox * fx + ix, in.xsize() - 1);
-            const size_t y = std::min(oy * fy + iy, in.ysize() - 1);
-            sum += in.PlaneRow(c, y)[x];
-          }
-        }
-        row_out[ox] = sum * normalize;
-      }
+// Measures consecutive stages, if enabled; otherwise does not read the clock.
+class StageTimer {
+public:
+  explicit StageTimer(bool enabled)
+      : enabled_(enabled), last_(enabled ? jxl::Now() : 0.0) {}
+
+  // Adds the time since the previous call (or construction) to `*seconds`.
+  void Lap(double *seconds) {
+    if (!enabled_) return;
+    const double now = jxl::Now();
+    *seconds += now - last_;
+    last_ = now;
+  }
+
+private:
+  bool enabled_;
+  double last_;
+};
+
+void Multiply(const ImageF &a, const ImageF &b, ImageF *mul) {
+  SSIMULACRA2Trace::Span span("Multiply");
+  for (size_t y = 0; y < a.ysize(); ++y) {
+    const float *JXL_RESTRICT in1 = a.Row(y);
+    const float *JXL_RESTRICT in2 = b.Row(y);
+    float *JXL_RESTRICT out = mul->Row(y);
+    for (size_t x = 0; x < a.xsize(); ++x) {
+      out[x] = in1[x] * in2[x];
     }
   }
-  return out;
 }
 
-void Multiply(const Image3F &a, const Image3F &b, Image3F *mul) {
-  for (size_t c = 0; c < 3; ++c) {
-    for (size_t y = 0; y < a.ysize(); ++y) {
-      const float *JXL_RESTRICT in1 = a.PlaneRow(c, y);
-      const float *JXL_RESTRICT in2 = b.PlaneRow(c, y);
-      float *JXL_RESTRICT out = mul->PlaneRow(c, y);
-      for (size_t x = 0; x < a.xsize(); ++x) {
-        out[x] = in1[x] * in2[x];
-      }
+// Writes a * a + b * b to `sum`.
+void SumOfSquares(const ImageF &a, const ImageF &b, ImageF *sum) {
+  SSIMULACRA2Trace::Span span("SumOfSquares");
+  for (size_t y = 0; y < a.ysize(); ++y) {
+    const float *JXL_RESTRICT in1 = a.Row(y);
+    const float *JXL_RESTRICT in2 = b.Row(y);
+    float *JXL_RESTRICT out = sum->Row(y);
+    for (size_t x = 0; x < a.xsize(); ++x) {
+      out[x] = in1[x] * in1[x] + in2[x] * in2[x];
     }
   }
 }
@@ -83,20 +882,35 @@ void Multiply(const Image3F &a, const Image3F &b, Image3F *mul) {
 // Temporary storage for Gaussian blur, reused for multiple images.
 class Blur {
 public:
-  Blur(const size_t xsize, const size_t ysize)
-      : rg_(jxl::CreateRecursiveGaussian(1.5)), temp_(xsize, ysize) {}
+  // If `fast`, approximates the Gaussian with TruncatedGaussianBlur, whose
+  // radius is smaller than Radius(). Rows() is always exact.
+  Blur(const size_t xsize, const size_t ysize,
+       jxl::CacheAlignedArena *arena = nullptr, bool fast = false)
+      : rg_(jxl::CreateRecursiveGaussian(ssimulacra2_stages::kBlurSigma)),
+        temp_(xsize, ysize, arena), fast_(fast) {}
+
+  bool fast() const { return fast_; }
 
   void operator()(const ImageF &in, ImageF *JXL_RESTRICT out) {
+    if (fast_) {
+      SSIMULACRA2Trace::Span span("TruncatedGaussianBlur");
+      jxl::TruncatedGaussianBlur(in, &temp_, out);
+      return;
+    }
+    SSIMULACRA2Trace::Span span("FastGaussian");
     jxl::ThreadPool *null_pool = nullptr;
     FastGaussian(rg_, in, null_pool, &temp_, out);
   }
 
-  Image3F operator()(const Image3F &in) {
-    Image3F out(in.xsize(), in.ysize());
-    operator()(in.Plane(0), &out.Plane(0));
-    operator()(in.Plane(1), &out.Plane(1));
-    operator()(in.Plane(2), &out.Plane(2));
-    return out;
+  // Blurs the rows of a strip of an image of `ysize` rows, of which `in`
+  // holds rows from `in_y0` on, continuing from the previous strips in
+  // `state` up to row `y1` (see jxl::FastGaussianRows).
+  void Rows(const ImageF &in, size_t in_y0, size_t ysize, size_t y1,
+            jxl::FastGaussianRowsState *state, ImageF *JXL_RESTRICT out) {
+    SSIMULACRA2Trace::Span span("FastGaussian");
+    jxl::ThreadPool *null_pool = nullptr;
+    jxl::FastGaussianRows(rg_, in, in_y0, ysize, y1, null_pool, &temp_,
+                          state, out);
   }
 
   // Allows reusing across scales.
@@ -104,9 +918,18 @@ public:
     temp_.ShrinkTo(xsize, ysize);
   }
 
+  // Output pixels only depend on input pixels at most this far away.
+  static size_t Radius() {
+    static const size_t radius =
+        jxl::CreateRecursiveGaussian(ssimulacra2_stages::kBlurSigma)->radius +
+        1;
+    return radius;
+  }
+
 private:
   hwy::AlignedUniquePtr<jxl::RecursiveGaussian> rg_;
   ImageF temp_;
+  bool fast_;
 };
 
 double tothe4th(double x) {
@@ -114,112 +937,137 @@ double tothe4th(double x) {
   x *= x;
   return x;
 }
-void SSIMMap(const Image3F &m1, const Image3F &m2, const Image3F &s11,
-             const Image3F &s22, const Image3F &s12, double *plane_averages) {
-  const double onePerPixels = 1.0 / (m1.ysize() * m1.xsize());
-  for (size_t c = 0; c < 3; ++c) {
-    double sum1[2] = {0.0};
-    for (size_t y = 0; y < m1.ysize(); ++y) {
-      const float *JXL_RESTRICT row_m1 = m1.PlaneRow(c, y);
-      const float *JXL_RESTRICT row_m2 = m2.PlaneRow(c, y);
-      const float *JXL_RESTRICT row_s11 = s11.PlaneRow(c, y);
-      const float *JXL_RESTRICT row_s22 = s22.PlaneRow(c, y);
-      const float *JXL_RESTRICT row_s12 = s12.PlaneRow(c, y);
-      for (size_t x = 0; x < m1.xsize(); ++x) {
-        float mu1 = row_m1[x];
-        float mu2 = row_m2[x];
-        float mu11 = mu1 * mu1;
-        float mu22 = mu2 * mu2;
-        float mu12 = mu1 * mu2;
-        /* Correction applied compared to the original SSIM formula, which has:
-
-             luma_err = 2 * mu1 * mu2 / (mu1^2 + mu2^2)
-                      = 1 - (mu1 - mu2)^2 / (mu1^2 + mu2^2)
-
-           The denominator causes error in the darks (low mu1 and mu2) to weigh
-           more than error in the brights (high mu1 and mu2). This would make
-           sense if values correspond to linear luma. However, the actual values
-           are either gamma-compressed luma (which supposedly is already
-           perceptually uniform) or chroma (where weighing green more than red
-           or blue more than yellow does not make any sense at all). So it is
-           better to simply drop this denominator.
-        */
-        float num_m = 1.0 - (mu1 - mu2) * (mu1 - mu2);
-        float num_s = 2 * (row_s12[x] - mu12) + kC2;
-        float denom_s = (row_s11[x] - mu11) + (row_s22[x] - mu22) + kC2;
-
-        // Use 1 - SSIM' so it becomes an error score instead of a quality
-        // index. This makes it make sense to compute an L_4 norm.
-        double d = 1.0 - (num_m * num_s / denom_s);
-        d = std::max(d, 0.0);
-        sum1[0] += d;
-        sum1[1] += tothe4th(d);
-      }
+// Adds the sum of the SSIM' error map of one plane over `rect` and the sum of
+// its 4th powers to `sums`. If kWriteMaps, also writes the map to `out_rect`
+// of `out`; a template parameter, so that the loop without maps has no branch.
+// If kSummedSigmas, `s11` is the blurred sum of the squares of both planes,
+// which is all that SSIM needs of them, and `s22` is not read.
+template <bool kWriteMaps, bool kSummedSigmas = false>
+void SSIMMap(const ImageF &m1, const ImageF &m2, const ImageF &s11,
+             const ImageF &s22, const ImageF &s12, const jxl::Rect &rect,
+             double *sums, ImageF *out, const jxl::Rect &out_rect) {
+  SSIMULACRA2Trace::Span span("SSIMMap");
+  double sum1[2] = {0.0};
+  for (size_t y = 0; y < rect.ysize(); ++y) {
+    const float *JXL_RESTRICT row_m1 = rect.ConstRow(m1, y);
+    const float *JXL_RESTRICT row_m2 = rect.ConstRow(m2, y);
+    const float *JXL_RESTRICT row_s11 = rect.ConstRow(s11, y);
+    const float *JXL_RESTRICT row_s22 =
+        kSummedSigmas ? nullptr : rect.ConstRow(s22, y);
+    const float *JXL_RESTRICT row_s12 = rect.ConstRow(s12, y);
+    float *JXL_RESTRICT row_out = kWriteMaps ? out_rect.Row(out, y) : nullptr;
+    for (size_t x = 0; x < rect.xsize(); ++x) {
+      float mu1 = row_m1[x];
+      float mu2 = row_m2[x];
+      float mu11 = mu1 * mu1;
+      float mu22 = mu2 * mu2;
+      float mu12 = mu1 * mu2;
+      /* Correction applied compared to the original SSIM formula, which has:
+
+           luma_err = 2 * mu1 * mu2 / (mu1^2 + mu2^2)
+                    = 1 - (mu1 - mu2)^2 / (mu1^2 + mu2^2)
+
+         The denominator causes error in the darks (low mu1 and mu2) to weigh
+         more than error in the brights (high mu1 and mu2). This would make
+         sense if values correspond to linear luma. However, the actual values
+         are either gamma-compressed luma (which supposedly is already
+         perceptually uniform) or chroma (where weighing green more than red
+         or blue more than yellow does not make any sense at all). So it is
+         better to simply drop this denominator.
+      */
+      float num_m = 1.0 - (mu1 - mu2) * (mu1 - mu2);
+      float num_s = 2 * (row_s12[x] - mu12) + kC2;
+      float denom_s = kSummedSigmas
+                          ? row_s11[x] - mu11 - mu22 + kC2
+                          : (row_s11[x] - mu11) + (row_s22[x] - mu22) + kC2;
+
+      // Use 1 - SSIM' so it becomes an error score instead of a quality
+      // index. This makes it make sense to compute an L_4 norm.
+      double d = 1.0 - (num_m * num_s / denom_s);
+      d = std::max(d, 0.0);
+      if (kWriteMaps) row_out[x] = d;
+      sum1[0] += d;
+      sum1[1] += tothe4th(d);
     }
-    plane_averages[c * 2] = onePerPixels * sum1[0];
-    plane_averages[c * 2 + 1] = sqrt(sqrt(onePerPixels * sum1[1]));
   }
+  sums[0] += sum1[0];
+  sums[1] += sum1[1];
 }
 
-void EdgeDiffMap(const Image3F &img1, const Image3F &mu1, const Image3F &img2,
-                 const Image3F &mu2, double *plane_averages) {
-  const double onePerPixels = 1.0 / (img1.ysize() * img1.xsize());
-  for (size_t c = 0; c < 3; ++c) {
-    double sum1[4] = {0.0};
-    for (size_t y = 0; y < img1.ysize(); ++y) {
-      const float *JXL_RESTRICT row1 = img1.PlaneRow(c, y);
-      const float *JXL_RESTRICT row2 = img2.PlaneRow(c, y);
-      const float *JXL_RESTRICT rowm1 = mu1.PlaneRow(c, y);
-      const float *JXL_RESTRICT rowm2 = mu2.PlaneRow(c, y);
-      for (size_t x = 0; x < img1.xsize(); ++x) {
-        double d1 = (1.0 + std::abs(row2[x] - rowm2[x])) /
-                        (1.0 + std::abs(row1[x] - rowm1[x])) -
-                    1.0;
-
-        // d1 > 0: distorted has an edge where original is smooth
-        //         (indicating ringing, color banding, blockiness, etc)
-        double artifact = std::max(d1, 0.0);
-        sum1[0] += artifact;
-        sum1[1] += tothe4th(artifact);
-
-        // d1 < 0: original has an edge where distorted is smooth
-        //         (indicating smoothing, blurring, smearing, etc)
-        double detail_lost = std::max(-d1, 0.0);
-        sum1[2] += detail_lost;
-        sum1[3] += tothe4th(detail_lost);
-      }
+// Adds the sums of the ringing and blurring maps of one plane over `rect` and
+// the sums of their 4th powers to `sums`. If kWriteMaps, also writes the maps
+// to `out_rect` of `ringing` and `blurring`.
+template <bool kWriteMaps>
+void EdgeDiffMap(const ImageF &img1, const ImageF &mu1, const ImageF &img2,
+                 const ImageF &mu2, const jxl::Rect &rect, double *sums,
+                 ImageF *ringing, ImageF *blurring,
+                 const jxl::Rect &out_rect) {
+  SSIMULACRA2Trace::Span span("EdgeDiffMap");
+  double sum1[4] = {0.0};
+  for (size_t y = 0; y < rect.ysize(); ++y) {
+    const float *JXL_RESTRICT row1 = rect.ConstRow(img1, y);
+    const float *JXL_RESTRICT row2 = rect.ConstRow(img2, y);
+    const float *JXL_RESTRICT rowm1 = rect.ConstRow(mu1, y);
+    const float *JXL_RESTRICT rowm2 = rect.ConstRow(mu2, y);
+    float *JXL_RESTRICT row_ringing =
+        kWriteMaps ? out_rect.Row(ringing, y) : nullptr;
+    float *JXL_RESTRICT row_blurring =
+        kWriteMaps ? out_rect.Row(blurring, y) : nullptr;
+    for (size_t x = 0; x < rect.xsize(); ++x) {
+      double d1 = (1.0 + std::abs(row2[x] - rowm2[x])) /
+                      (1.0 + std::abs(row1[x] - rowm1[x])) -
+                  1.0;
+
+      // d1 > 0: distorted has an edge where original is smooth
+      //         (indicating ringing, color banding, blockiness, etc)
+      double artifact = std::max(d1, 0.0);
+      if (kWriteMaps) row_ringing[x] = artifact;
+      sum1[0] += artifact;
+      sum1[1] += tothe4th(artifact);
+
+      // d1 < 0: original has an edge where distorted is smooth
+      //         (indicating smoothing, blurring, smearing, etc)
+      double detail_lost = std::max(-d1, 0.0);
+      if (kWriteMaps) row_blurring[x] = detail_lost;
+      sum1[2] += detail_lost;
+      sum1[3] += tothe4th(detail_lost);
     }
-    plane_averages[c * 4] = onePerPixels * sum1[0];
-    plane_averages[c * 4 + 1] = sqrt(sqrt(onePerPixels * sum1[1]));
-    plane_averages[c * 4 + 2] = onePerPixels * sum1[2];
-    plane_averages[c * 4 + 3] = sqrt(sqrt(onePerPixels * sum1[3]));
+  }
+  for (size_t i = 0; i < 4; ++i) {
+    sums[i] += sum1[i];
   }
 }
 
-/* Get all components in more or less 0..1 range
-   Range of Rec2020 with these adjustments:
-    X: 0.017223..0.998838
-    Y: 0.010000..0.855303
-    B: 0.048759..0.989551
-   Range of sRGB:
-    X: 0.204594..0.813402
-    Y: 0.010000..0.855308
-    B: 0.272295..0.938012
-   The maximum pixel-wise difference has to be <= 1 for the ssim formula to make
-   sense.
-*/
-void MakePositiveXYB(jxl::Image3F &img) {
-  for (size_t y = 0; y < img.ysize(); ++y) {
-    float *JXL_RESTRICT rowY = img.PlaneRow(1, y);
-    float *JXL_RESTRICT rowB = img.PlaneRow(2, y);
-    float *JXL_RESTRICT rowX = img.PlaneRow(0, y);
-    for (size_t x = 0; x < img.xsize(); ++x) {
-      rowB[x] = (rowB[x] - rowY[x]) + 0.55f;
-      rowX[x] = rowX[x] * 14.f + 0.42f;
-      rowY[x] += 0.01f;
+// Sums of the error maps (for the 1-norms) and of their 4th powers (for the
+// 4-norms) over `num_pixels` pixels of one scale, laid out like MsssimScale.
+// Sums over disjoint sets of pixels can be added.
+struct MsssimSums {
+  double ssim[3 * 2];
+  double edgediff[3 * 4];
+  size_t num_pixels;
+
+  void Add(const MsssimSums &other) {
+    for (size_t i = 0; i < 3 * 2; ++i) ssim[i] += other.ssim[i];
+    for (size_t i = 0; i < 3 * 4; ++i) edgediff[i] += other.edgediff[i];
+    num_pixels += other.num_pixels;
+  }
+
+  // Returns the norms, or zero if there are no pixels.
+  MsssimScale Norms() const {
+    MsssimScale norms = {};
+    if (num_pixels == 0) return norms;
+    const double onePerPixels = 1.0 / num_pixels;
+    for (size_t i = 0; i < 3 * 2; i += 2) {
+      norms.avg_ssim[i] = onePerPixels * ssim[i];
+      norms.avg_ssim[i + 1] = sqrt(sqrt(onePerPixels * ssim[i + 1]));
+    }
+    for (size_t i = 0; i < 3 * 4; i += 2) {
+      norms.avg_edgediff[i] = onePerPixels * edgediff[i];
+      norms.avg_edgediff[i + 1] = sqrt(sqrt(onePerPixels * edgediff[i + 1]));
     }
+    return norms;
   }
-}
+};
 
 void AlphaBlend(jxl::ImageBundle &img, float bg) {
   for (size_t y = 0; y < img.ysize(); ++y) {
@@ -235,259 +1083,2309 @@ void AlphaBlend(jxl::ImageBundle &img, float bg) {
   }
 }
 
-} // namespace
-
-/*
-The final score is based on a weighted sum of 108 sub-scores:
-- for 6 scales (1:1 to 1:32, downsampled in linear RGB)
-- for 3 components (X, Y, B-Y, rescaled to 0..1 range)
-- using 2 norms (the 1-norm and the 4-norm)
-- over 3 error maps:
-    - SSIM' (SSIM without the spurious gamma correction term)
-    - "ringing" (distorted edges where there are no orig edges)
-    - "blurring" (orig edges where there are no distorted edges)
-
-The weights were obtained by running Nelder-Mead simplex search,
-optimizing to minimize MSE for the CID22 training set and to
-maximize Kendall rank correlation (and with a lower weight,
-also Pearson correlation) with the CID22 training set and the
-TID2013, Kadid10k and KonFiG-IQA datasets.
-Validation was done on the CID22 validation set.
-
-Final results after tuning (Kendall | Spearman | Pearson):
-   CID22:     0.6903 | 0.8805 | 0.8583
-   TID2013:   0.6590 | 0.8445 | 0.8471
-   KADID-10k: 0.6175 | 0.8133 | 0.8030
-   KonFiG(F): 0.7668 | 0.9194 | 0.9136
-*/
-double Msssim::Score() const {
-  double ssim = 0.0;
-  constexpr double weight[108] = {0.0,
-                                  0.0007376606707406586,
-                                  0.0,
-                                  0.0,
-                                  0.0007793481682867309,
-                                  0.0,
-                                  0.0,
-                                  0.0004371155730107379,
-                                  0.0,
-                                  1.1041726426657346,
-                                  0.00066284834129271,
-                                  0.00015231632783718752,
-                                  0.0,
-                                  0.0016406437456599754,
-                                  0.0,
-                                  1.8422455520539298,
-                                  11.441172603757666,
-                                  0.0,
-                                  0.0007989109436015163,
-                                  0.000176816438078653,
-                                  0.0,
-                                  1.8787594979546387,
-                                  10.94906990605142,
-                                  0.0,
-                                  0.0007289346991508072,
-                                  0.9677937080626833,
-                                  0.0,
-                                  0.00014003424285435884,
-                                  0.9981766977854967,
-                                  0.00031949755934435053,
-                                  0.0004550992113792063,
-                                  0.0,
-                                  0.0,
-                                  0.0013648766163243398,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  7.466890328078848,
-                                  0.0,
-                                  17.445833984131262,
-                                  0.0006235601634041466,
-                                  0.0,
-                                  0.0,
-                                  6.683678146179332,
-                                  0.00037724407979611296,
-                                  1.027889937768264,
-                                  225.20515300849274,
-                                  0.0,
-                                  0.0,
-                                  19.213238186143016,
-                                  0.0011401524586618361,
-                                  0.001237755635509985,
-                                  176.39317598450694,
-                                  0.0,
-                                  0.0,
-                                  24.43300999870476,
-                                  0.28520802612117757,
-                                  0.0004485436923833408,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  34.77906344483772,
-                                  44.835625328877896,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0008680556573291698,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0005313191874358747,
-                                  0.0,
-                                  0.00016533814161379112,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0004179171803251336,
-                                  0.0017290828234722833,
-                                  0.0,
-                                  0.0020827005846636437,
-                                  0.0,
-                                  0.0,
-                                  8.826982764996862,
-                                  23.19243343998926,
-                                  0.0,
-                                  95.1080498811086,
-                                  0.9863978034400682,
-                                  0.9834382792465353,
-                                  0.0012286405048278493,
-                                  171.2667255897307,
-                                  0.9807858872435379,
-                                  0.0,
-                                  0.0,
-                                  0.0,
-                                  0.0005130064588990679,
-                                  0.0,
-                                  0.00010854057858411537};
+// Returns `rect` of `in` as a new bundle with the same metadata.
+jxl::ImageBundle CropBundle(const jxl::ImageBundle &in, const jxl::Rect &rect) {
+  jxl::ImageBundle out(in.metadata());
+  Image3F color(rect.xsize(), rect.ysize());
+  jxl::CopyImageTo(rect, in.color(), &color);
+  out.SetFromImage(std::move(color), in.c_current());
+  std::vector<ImageF> extra_channels;
+  for (const ImageF &plane : in.extra_channels()) {
+    extra_channels.push_back(jxl::CopyImage(rect, plane));
+  }
+  out.SetExtraChannels(std::move(extra_channels));
+  return out;
+}
 
-  size_t i = 0;
-  char ch[] = "XYB";
-  const bool verbose = false;
+// Moves the linear sRGB `in` to `linear`, or rounds it to half float.
+void MoveLinear(Image3F *in, Image3F *linear) { *linear = std::move(*in); }
+void MoveLinear(ImageF *in, ImageF *linear) { *linear = std::move(*in); }
+void MoveLinear(Image3F *in, Image3F16 *linear) {
   for (size_t c = 0; c < 3; ++c) {
-    for (size_t scale = 0; scale < scales.size(); ++scale) {
-      for (size_t n = 0; n < 2; n++) {
-#ifdef SSIMULACRA2_OUTPUT_RAW_SCORES_FOR_WEIGHT_TUNING
-        printf("%.12f,%.12f,%.12f,", scales[scale].avg_ssim[c * 2 + n],
-               scales[scale].avg_edgediff[c * 4 + n],
-               scales[scale].avg_edgediff[c * 4 + 2 + n]);
-#endif
-        if (verbose) {
-          printf("%f from channel %c ssim, scale 1:%i, %zu-norm (weight %f)\n",
-                 weight[i] * std::abs(scales[scale].avg_ssim[c * 2 + n]), ch[c],
-                 1 << scale, n * 3 + 1, weight[i]);
-        }
-        ssim += weight[i++] * std::abs(scales[scale].avg_ssim[c * 2 + n]);
-        if (verbose) {
-          printf(
-              "%f from channel %c ringing, scale 1:%i, %zu-norm (weight %f)\n",
-              weight[i] * std::abs(scales[scale].avg_edgediff[c * 4 + n]),
-              ch[c], 1 << scale, n * 3 + 1, weight[i]);
-        }
-        ssim += weight[i++] * std::abs(scales[scale].avg_edgediff[c * 4 + n]);
-        if (verbose) {
-          printf("%f from channel %c blur, scale 1:%i, %zu-norm (weight %f)\n",
-                 weight[i] *
-                     std::abs(scales[scale].avg_edgediff[c * 4 + n + 2]),
-                 ch[c], 1 << scale, n * 3 + 1, weight[i]);
-        }
-        ssim +=
-            weight[i++] * std::abs(scales[scale].avg_edgediff[c * 4 + n + 2]);
-      }
-    }
+    jxl::DemoteToF16(in->Plane(c), &linear->Plane(c));
   }
+}
+void MoveLinear(ImageF *in, ImageF16 *linear) { jxl::DemoteToF16(*in, linear); }
 
-  ssim = ssim * 0.9562382616834844;
-  ssim = 2.326765642916932 * ssim - 0.020884521182843837 * ssim * ssim +
-         6.248496625763138e-05 * ssim * ssim * ssim;
-  if (ssim > 0) {
-    ssim = 100.0 - 10.0 * pow(ssim, 0.6276336467831387);
+/* Fills `linear` with `rect` of `in` blended against `bg` and converted to
+   linear sRGB, and `xyb` with its XYB, with all components in more or less
+   0..1 range.
+   Range of Rec2020 with these adjustments:
+    X: 0.017223..0.998838
+    Y: 0.010000..0.855303
+    B: 0.048759..0.989551
+   Range of sRGB:
+    X: 0.204594..0.813402
+    Y: 0.010000..0.855308
+    B: 0.272295..0.938012
+   The maximum pixel-wise difference has to be <= 1 for the ssim formula to make
+   sense.
+   Both are only allocated if they do not have the size of `rect` yet.
+   `linear` is float or half float (Image3F16); `xyb` is computed before
+   rounding to half float.
+   Adds the time spent to the first scale of `stats`, and that of TransformTo
+   to its transform, unless it is null.
+   If `fast`, sRGB and the cube roots are approximated (see
+   SSIMULACRA2Options::fast), and then only Y is written if `y_only`.
+*/
+template <typename T>
+void ToLinearAndPositiveXYB(const jxl::ImageBundle &in, const jxl::Rect &rect,
+                            float bg, jxl::Image3<T> *linear, Image3F *xyb,
+                            SSIMULACRA2Stats *stats = nullptr,
+                            bool fast = false, bool y_only = false) {
+  SSIMULACRA2Trace::Span span("ToLinearAndPositiveXYB", /*scale=*/0);
+  StageTimer timer(stats != nullptr);
+  const float intensity_target = in.metadata()->IntensityTarget();
+  const jxl::ColorEncoding &c = in.c_current();
+  if (!jxl::SameSize(rect, *linear)) {
+    *linear = jxl::Image3<T>(rect.xsize(), rect.ysize());
+  }
+  if (!jxl::SameSize(rect, *xyb)) *xyb = Image3F(rect.xsize(), rect.ysize());
+  if (!c.IsCMYK() && (c.IsSRGB() || c.IsLinearSRGB())) {
+    // Common case: no color transform needed, do everything in one pass.
+    jxl::BlendLinearAndPositiveXYB(in.color(),
+                                   in.HasAlpha() ? &in.alpha() : nullptr, rect,
+                                   in.IsGray(), c.IsSRGB(), bg,
+                                   intensity_target, linear, xyb, fast,
+                                   y_only);
+    if (stats) timer.Lap(&stats->scales[0].xyb);
+    return;
+  }
+  jxl::ImageBundle copy = CropBundle(in, rect);
+  if (in.HasAlpha())
+    AlphaBlend(copy, bg);
+  copy.ClearExtraChannels();
+  if (stats) timer.Lap(&stats->scales[0].xyb);
+  {
+    SSIMULACRA2Trace::Span transform_span("TransformTo");
+    JXL_CHECK(copy.TransformTo(jxl::ColorEncoding::LinearSRGB(copy.IsGray()),
+                               jxl::GetJxlCms()));
+  }
+  if (stats) timer.Lap(&stats->transform);
+  jxl::PositiveXYBFromLinear(*copy.color(), intensity_target, xyb);
+  MoveLinear(copy.color(), linear);
+  if (stats) timer.Lap(&stats->scales[0].xyb);
+}
+
+// Gray version of the above: `linear` is gray and `y` is the Y plane of the
+// positive XYB.
+template <typename T>
+void ToLinearAndPositiveXYB(const jxl::ImageBundle &in, const jxl::Rect &rect,
+                            float bg, jxl::Plane<T> *linear, ImageF *y,
+                            SSIMULACRA2Stats *stats = nullptr,
+                            bool fast = false, bool /*y_only*/ = false) {
+  JXL_ASSERT(in.IsGray());
+  SSIMULACRA2Trace::Span span("ToLinearAndPositiveXYB", /*scale=*/0);
+  StageTimer timer(stats != nullptr);
+  const float intensity_target = in.metadata()->IntensityTarget();
+  const jxl::ColorEncoding &c = in.c_current();
+  if (!jxl::SameSize(rect, *linear)) {
+    *linear = jxl::Plane<T>(rect.xsize(), rect.ysize());
+  }
+  if (!jxl::SameSize(rect, *y)) *y = ImageF(rect.xsize(), rect.ysize());
+  if (c.IsSRGB() || c.IsLinearSRGB()) {
+    jxl::BlendLinearAndPositiveY(in.color().Plane(0),
+                                 in.HasAlpha() ? &in.alpha() : nullptr, rect,
+                                 c.IsSRGB(), bg, intensity_target, linear, y,
+                                 fast);
+    if (stats) timer.Lap(&stats->scales[0].xyb);
+    return;
+  }
+  jxl::ImageBundle copy = CropBundle(in, rect);
+  if (in.HasAlpha())
+    AlphaBlend(copy, bg);
+  copy.ClearExtraChannels();
+  if (stats) timer.Lap(&stats->scales[0].xyb);
+  {
+    SSIMULACRA2Trace::Span transform_span("TransformTo");
+    JXL_CHECK(copy.TransformTo(
+        jxl::ColorEncoding::LinearSRGB(/*is_gray=*/true), jxl::GetJxlCms()));
+  }
+  if (stats) timer.Lap(&stats->transform);
+  jxl::PositiveYFromLinear(copy.color()->Plane(0), intensity_target, y);
+  MoveLinear(&copy.color()->Plane(0), linear);
+  if (stats) timer.Lap(&stats->scales[0].xyb);
+}
+
+// `buffer`, 3 rows of the width of `in`, is only needed for half floats. If
+// `fast`, the cube roots are approximated.
+template <typename T>
+void Downsample2x2AndPositiveXYB(const jxl::Image3<T> &in,
+                                 float intensity_target, jxl::Image3<T> *out,
+                                 Image3F *xyb, Image3F *buffer = nullptr,
+                                 bool fast = false) {
+  jxl::Downsample2x2AndPositiveXYB(in, intensity_target, out, xyb, buffer,
+                                   fast);
+}
+
+template <typename T>
+void Downsample2x2AndPositiveXYB(const jxl::Plane<T> &in,
+                                 float intensity_target, jxl::Plane<T> *out,
+                                 ImageF *y, ImageF *buffer = nullptr,
+                                 bool fast = false) {
+  jxl::Downsample2x2AndPositiveY(in, intensity_target, out, y, buffer, fast);
+}
+
+// The planes of the positive XYB images that are compared: X, Y and B for
+// Image3F, only Y for gray images (ImageF). The others are constant, so all
+// their error maps would be zero.
+size_t NumPlanes(const Image3F & /*image*/) { return 3; }
+size_t NumPlanes(const ImageF & /*image*/) { return 1; }
+const ImageF &Plane(const Image3F &image, size_t c) { return image.Plane(c); }
+const ImageF &Plane(const ImageF &image, size_t /*c*/) { return image; }
+ImageF &Plane(Image3F &image, size_t c) { return image.Plane(c); }
+ImageF &Plane(ImageF &image, size_t /*c*/) { return image; }
+size_t Channel(const Image3F & /*image*/, size_t c) { return c; }
+size_t Channel(const ImageF & /*image*/, size_t /*c*/) { return 1; }
+
+// Size of the next coarser scale; does not overflow for SIZE_MAX.
+size_t DivCeil2(size_t size) { return size / 2 + (size & 1); }
+
+// Returns `rect` at the next coarser scale: the pixels whose 2x2 blocks
+// intersect it.
+jxl::Rect Downscaled(const jxl::Rect &rect) {
+  const size_t x0 = rect.x0() / 2;
+  const size_t y0 = rect.y0() / 2;
+  return jxl::Rect(x0, y0, DivCeil2(rect.x0() + rect.xsize()) - x0,
+                   DivCeil2(rect.y0() + rect.ysize()) - y0);
+}
+
+// Returns the pixels of the next finer scale that make up `rect`.
+jxl::Rect Upscaled(const jxl::Rect &rect) {
+  return jxl::Rect(2 * rect.x0(), 2 * rect.y0(), 2 * rect.xsize(),
+                   2 * rect.ysize());
+}
+
+// Returns `rect` extended by `border` on all sides, clipped to xsize x ysize.
+jxl::Rect Extended(const jxl::Rect &rect, size_t border, size_t xsize,
+                   size_t ysize) {
+  const size_t x0 = rect.x0() > border ? rect.x0() - border : 0;
+  const size_t y0 = rect.y0() > border ? rect.y0() - border : 0;
+  const size_t x1 = std::min(rect.x0() + rect.xsize() + border, xsize);
+  const size_t y1 = std::min(rect.y0() + rect.ysize() + border, ysize);
+  return jxl::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// Returns the bounding box of `a` and `b`, either of which may be empty.
+jxl::Rect Union(const jxl::Rect &a, const jxl::Rect &b) {
+  if (a.xsize() == 0 || a.ysize() == 0) return b;
+  if (b.xsize() == 0 || b.ysize() == 0) return a;
+  const size_t x0 = std::min(a.x0(), b.x0());
+  const size_t y0 = std::min(a.y0(), b.y0());
+  const size_t x1 = std::max(a.x0() + a.xsize(), b.x0() + b.xsize());
+  const size_t y1 = std::max(a.y0() + a.ysize(), b.y0() + b.ysize());
+  return jxl::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// Where one scale is computed, in pixels of the whole image at that scale.
+struct ScaleGeometry {
+  // Of the whole image.
+  size_t xsize;
+  size_t ysize;
+  // The pixels whose errors are averaged.
+  jxl::Rect roi;
+  // The processed pixels: `roi` plus the halo that its errors depend on.
+  jxl::Rect crop;
+};
+
+// Returns the geometry of the scales that are computed for `roi` of
+// xsize x ysize images; scales smaller than 8x8 are skipped.
+std::vector<ScaleGeometry> ScaleGeometries(const jxl::Rect &roi, size_t xsize,
+                                           size_t ysize) {
+  std::vector<ScaleGeometry> scales;
+  jxl::Rect scaled_roi = roi;
+  while (scales.size() < kNumScales && xsize >= 8 && ysize >= 8) {
+    scales.push_back({xsize, ysize, scaled_roi, jxl::Rect()});
+    xsize = DivCeil2(xsize);
+    ysize = DivCeil2(ysize);
+    scaled_roi = Downscaled(scaled_roi);
+  }
+  if (scales.empty()) return scales;
+
+  // The blurred values in the roi depend on the pixels within the blur radius,
+  // which are downsampled from the previous scale.
+  jxl::Rect needed;
+  for (size_t s = scales.size(); s-- > 0;) {
+    const ScaleGeometry &g = scales[s];
+    needed = Union(Extended(g.roi, Blur::Radius(), g.xsize, g.ysize),
+                   Upscaled(needed).Crop(g.xsize, g.ysize));
+  }
+  // Aligning the origin keeps the 2x2 blocks of all scales in the same place
+  // as for the whole image.
+  const size_t align = size_t(1) << (scales.size() - 1);
+  const size_t x0 = needed.x0() / align * align;
+  const size_t y0 = needed.y0() / align * align;
+  jxl::Rect crop(x0, y0, needed.x0() + needed.xsize() - x0,
+                 needed.y0() + needed.ysize() - y0);
+  for (ScaleGeometry &g : scales) {
+    g.crop = crop;
+    crop = Downscaled(crop);
+  }
+  return scales;
+}
+
+// Square tiles of `tile_size` full-resolution pixels, of which the errors are
+// summed separately. A pixel of a coarser scale belongs to the tile of its
+// top-left full-resolution pixel. A tile_size of 0 means a single tile.
+class TileGrid {
+public:
+  TileGrid(size_t tile_size, size_t xsize, size_t ysize)
+      : tile_size_(tile_size),
+        xsize_(tile_size ? jxl::DivCeil(xsize, tile_size) : 1),
+        ysize_(tile_size ? jxl::DivCeil(ysize, tile_size) : 1) {}
+
+  // Number of tiles in each dimension.
+  size_t xsize() const { return xsize_; }
+  size_t ysize() const { return ysize_; }
+  size_t NumTiles() const { return xsize_ * ysize_; }
+
+  // Returns the pixels of tile (tx, ty) at `scale` within `bounds`, in pixels
+  // of that scale.
+  jxl::Rect TileRect(size_t tx, size_t ty, size_t scale,
+                     const jxl::Rect &bounds) const {
+    if (tile_size_ == 0) return bounds;
+    const size_t x0 = Begin(tx, scale);
+    const size_t y0 = Begin(ty, scale);
+    return jxl::Rect(x0, y0, Begin(tx + 1, scale) - x0,
+                     Begin(ty + 1, scale) - y0)
+        .Intersection(bounds);
+  }
+
+  // Returns the tiles [*tx0, *tx1) x [*ty0, *ty1) that have pixels of `rect` at
+  // `scale`, which must not be empty.
+  void TilesOf(const jxl::Rect &rect, size_t scale, size_t *tx0, size_t *tx1,
+               size_t *ty0, size_t *ty1) const {
+    *tx0 = TileOf(rect.x0(), scale);
+    *tx1 = TileOf(rect.x1() - 1, scale) + 1;
+    *ty0 = TileOf(rect.y0(), scale);
+    *ty1 = TileOf(rect.y1() - 1, scale) + 1;
+  }
+
+private:
+  // First pixel of the `t`-th tile in one dimension at `scale`.
+  size_t Begin(size_t t, size_t scale) const {
+    return jxl::DivCeil(t * tile_size_, size_t(1) << scale);
+  }
+
+  size_t TileOf(size_t pos, size_t scale) const {
+    return tile_size_ ? (pos << scale) / tile_size_ : 0;
+  }
+
+  size_t tile_size_;
+  size_t xsize_;
+  size_t ysize_;
+};
+
+// Error map sums of each tile of a TileGrid (row by row), for each scale.
+typedef std::vector<std::vector<MsssimSums>> TileSums;
+
+// Returns zero sums for the tiles of `grid`, each of which covers its pixels
+// within the roi of each scale.
+TileSums ZeroTileSums(const std::vector<ScaleGeometry> &scales,
+                      const TileGrid &grid) {
+  TileSums sums(scales.size(),
+                std::vector<MsssimSums>(grid.NumTiles(), MsssimSums()));
+  for (size_t scale = 0; scale < scales.size(); ++scale) {
+    for (size_t ty = 0; ty < grid.ysize(); ++ty) {
+      for (size_t tx = 0; tx < grid.xsize(); ++tx) {
+        const jxl::Rect rect =
+            grid.TileRect(tx, ty, scale, scales[scale].roi);
+        sums[scale][ty * grid.xsize() + tx].num_pixels =
+            rect.xsize() * rect.ysize();
+      }
+    }
+  }
+  return sums;
+}
+
+// Returns the norms of the errors of tile `i`.
+Msssim TileNorms(const TileSums &sums, size_t i) {
+  Msssim msssim;
+  for (const std::vector<MsssimSums> &scale : sums) {
+    msssim.scales.push_back(scale[i].Norms());
+  }
+  return msssim;
+}
+
+// Returns the norms of the errors of all tiles together.
+Msssim TotalNorms(const TileSums &sums) {
+  Msssim msssim;
+  for (const std::vector<MsssimSums> &scale : sums) {
+    MsssimSums total = {};
+    for (const MsssimSums &tile : scale) total.Add(tile);
+    msssim.scales.push_back(total.Norms());
+  }
+  return msssim;
+}
+
+// Temporary planes for comparing one pair of planes, reused for all planes
+// and scales.
+struct PlaneScratch {
+  // Number of xsize x ysize planes, which are carved out of `arena` unless it
+  // is null. `fast` selects the approximations of SSIMULACRA2Options::fast.
+  static const size_t kNumPlanes = 7;
+
+  PlaneScratch(size_t xsize, size_t ysize,
+               jxl::CacheAlignedArena *arena = nullptr, bool fast = false)
+      : mul(xsize, ysize, arena), sigma1_sq(xsize, ysize, arena),
+        sigma2_sq(xsize, ysize, arena), sigma12(xsize, ysize, arena),
+        mu1(xsize, ysize, arena), mu2(xsize, ysize, arena),
+        blur(xsize, ysize, arena, fast) {}
+
+  void ShrinkTo(size_t xsize, size_t ysize) {
+    mul.ShrinkTo(xsize, ysize);
+    sigma1_sq.ShrinkTo(xsize, ysize);
+    sigma2_sq.ShrinkTo(xsize, ysize);
+    sigma12.ShrinkTo(xsize, ysize);
+    mu1.ShrinkTo(xsize, ysize);
+    mu2.ShrinkTo(xsize, ysize);
+    blur.ShrinkTo(xsize, ysize);
+  }
+
+  // Returns `rect` of `image`, copied to `crop` unless it is the whole image.
+  static const ImageF &Crop(const ImageF &image, const jxl::Rect &rect,
+                            ImageF *crop) {
+    if (rect.x0() == 0 && rect.y0() == 0 && jxl::SameSize(rect, image)) {
+      return image;
+    }
+    if (!jxl::SameSize(rect, *crop)) {
+      *crop = ImageF(rect.xsize(), rect.ysize());
+    }
+    jxl::CopyImageTo(rect, image, crop);
+    return *crop;
+  }
+
+  ImageF mul, sigma1_sq, sigma2_sq, sigma12, mu1, mu2;
+  // Only allocated when comparing part of a plane.
+  ImageF crop1, crop2, crop_mu1, crop_sigma1_sq;
+  Blur blur;
+};
+
+// Finds the part of the planes that has to be compared for `roi`: only the
+// pixels of `roi` within the blur radius of differing pixels (`eval`) can
+// have nonzero errors, and they depend on `input`, which is `eval` plus the
+// blur radius. Returns false if there are no such pixels. Planes `c` for
+// which `skipped[c]` is true are not compared, hence ignored.
+template <class Image>
+bool ComparedRects(const Image &img1, const Image &img2, const jxl::Rect &roi,
+                   jxl::Rect *input, jxl::Rect *eval,
+                   const bool *skipped = nullptr) {
+  jxl::Rect differing;
+  for (size_t c = 0; c < NumPlanes(img1); ++c) {
+    if (skipped && skipped[c]) continue;
+    differing = Union(differing, jxl::DifferingRect(Plane(img1, c),
+                                                    Plane(img2, c),
+                                                    jxl::Rect(img1)));
+  }
+  if (differing.xsize() == 0) return false;
+  *eval = Extended(differing, Blur::Radius(), img1.xsize(), img1.ysize())
+              .Intersection(roi);
+  if (eval->xsize() == 0 || eval->ysize() == 0) return false;
+  *input = Extended(*eval, Blur::Radius(), img1.xsize(), img1.ysize());
+  return true;
+}
+
+// Vertical blur states of the strips of one scale, of `ysize` rows: five per
+// channel, in the order in which ComparePlanes blurs.
+struct StripBlurs {
+  explicit StripBlurs(size_t ysize) : ysize(ysize), states(3 * 5) {}
+
+  size_t ysize;
+  std::vector<jxl::FastGaussianRowsState> states;
+};
+
+// Adds the error map sums of channel `c` at `scale` over `eval` of `input`,
+// which contains all pixels with nonzero error, to the sums of their tiles,
+// and writes the error maps of `eval` to `maps` unless it is null. The planes
+// are the part `crop` of the whole scale. The blurred `full1` and its square
+// are computed unless they are given as `full_mu1` and `full_sigma1_sq`.
+// Adds the time spent in each stage to `stats` unless it is null. If `strip`
+// is not null, `input` is a strip of whole rows (plus the blur radius) that
+// follows the previous one, and the blurs continue from theirs.
+void ComparePlanes(const ImageF &full1, const ImageF &full2,
+                   const ImageF *full_mu1, const ImageF *full_sigma1_sq,
+                   const jxl::Rect &input, const jxl::Rect &eval, size_t c,
+                   const TileGrid &grid, size_t scale, const jxl::Rect &crop,
+                   PlaneScratch *s, std::vector<MsssimSums> *tiles,
+                   SSIMULACRA2Maps *maps,
+                   SSIMULACRA2Stats::Scale *stats = nullptr,
+                   StripBlurs *strip = nullptr) {
+  SSIMULACRA2Trace::Span span("ComparePlanes", scale, c);
+  SSIMULACRA2Stats::Scale unused;
+  StageTimer timer(stats != nullptr);
+  if (!stats) stats = &unused;
+  const ImageF &img1 = PlaneScratch::Crop(full1, input, &s->crop1);
+  const ImageF &img2 = PlaneScratch::Crop(full2, input, &s->crop2);
+  size_t num_blurs = 0;
+  const auto blur = [&](const ImageF &in, ImageF *out) {
+    if (strip) {
+      s->blur.Rows(in, crop.y0() + input.y0(), strip->ysize,
+                   crop.y0() + eval.y0() + eval.ysize(),
+                   &strip->states[c * 5 + num_blurs++], out);
+    } else {
+      s->blur(in, out);
+    }
+  };
+
+  const ImageF *mu1 = &s->mu1;
+  const ImageF *sigma1_sq = &s->sigma1_sq;
+  // The blur is linear, hence the fast one (which need not match the exact
+  // rounding) blurs the sum of the squares of both planes at once.
+  const bool summed_sigmas = s->blur.fast() && !full_mu1;
+  if (full_mu1) {
+    mu1 = &PlaneScratch::Crop(*full_mu1, input, &s->crop_mu1);
+    sigma1_sq =
+        &PlaneScratch::Crop(*full_sigma1_sq, input, &s->crop_sigma1_sq);
+  } else {
+    if (summed_sigmas) {
+      SumOfSquares(img1, img2, &s->mul);
+    } else {
+      Multiply(img1, img1, &s->mul);
+    }
+    timer.Lap(&stats->multiply);
+    blur(s->mul, &s->sigma1_sq);
+    blur(img1, &s->mu1);
+    timer.Lap(&stats->blur);
+  }
+
+  if (!summed_sigmas) {
+    Multiply(img2, img2, &s->mul);
+    timer.Lap(&stats->multiply);
+    blur(s->mul, &s->sigma2_sq);
+    timer.Lap(&stats->blur);
+  }
+
+  Multiply(img1, img2, &s->mul);
+  timer.Lap(&stats->multiply);
+  blur(s->mul, &s->sigma12);
+
+  blur(img2, &s->mu2);
+  timer.Lap(&stats->blur);
+
+  // Chosen once, so that the loops over the pixels have no branches.
+  const auto ssim_map_of_tile =
+      maps ? (summed_sigmas ? &SSIMMap<true, true> : &SSIMMap<true, false>)
+           : (summed_sigmas ? &SSIMMap<false, true> : &SSIMMap<false, false>);
+  ImageF *ssim_map = maps ? &maps->ssim[scale].Plane(c) : nullptr;
+  ImageF *ringing_map = maps ? &maps->ringing[scale].Plane(c) : nullptr;
+  ImageF *blurring_map = maps ? &maps->blurring[scale].Plane(c) : nullptr;
+
+  const jxl::Rect scale_eval = eval.Translate(crop.x0(), crop.y0());
+  size_t tx0, tx1, ty0, ty1;
+  grid.TilesOf(scale_eval, scale, &tx0, &tx1, &ty0, &ty1);
+  for (size_t ty = ty0; ty < ty1; ++ty) {
+    for (size_t tx = tx0; tx < tx1; ++tx) {
+      const jxl::Rect tile = grid.TileRect(tx, ty, scale, scale_eval);
+      if (tile.xsize() == 0 || tile.ysize() == 0) continue;
+      const jxl::Rect rect(tile.x0() - crop.x0() - input.x0(),
+                           tile.y0() - crop.y0() - input.y0(), tile.xsize(),
+                           tile.ysize());
+      MsssimSums &sums = (*tiles)[ty * grid.xsize() + tx];
+      ssim_map_of_tile(*mu1, s->mu2, *sigma1_sq, s->sigma2_sq, s->sigma12,
+                       rect, sums.ssim + c * 2, ssim_map, tile);
+      timer.Lap(&stats->ssim_map);
+      if (maps) {
+        EdgeDiffMap<true>(img1, *mu1, img2, s->mu2, rect,
+                          sums.edgediff + c * 4, ringing_map, blurring_map,
+                          tile);
+      } else {
+        EdgeDiffMap<false>(img1, *mu1, img2, s->mu2, rect,
+                           sums.edgediff + c * 4, nullptr, nullptr, tile);
+      }
+      timer.Lap(&stats->edge_diff_map);
+    }
+  }
+}
+
+bool SameColorEncoding(const jxl::ColorEncoding &a,
+                       const jxl::ColorEncoding &b) {
+  if (a.HaveFields() && b.HaveFields()) {
+    return a.SameColorEncoding(b) && a.rendering_intent == b.rendering_intent;
+  }
+  const jxl::PaddedBytes &icc_a = a.ICC();
+  const jxl::PaddedBytes &icc_b = b.ICC();
+  return icc_a.size() == icc_b.size() &&
+         memcmp(icc_a.data(), icc_b.data(), icc_a.size()) == 0;
+}
+
+// Returns whether the images have the same pixels in `rect` and are
+// interpreted the same way, hence the error maps are zero there.
+bool SameImage(const jxl::ImageBundle &a, const jxl::ImageBundle &b,
+               const jxl::Rect &rect) {
+  if (!jxl::SameSize(a, b) || a.IsGray() != b.IsGray() ||
+      a.HasAlpha() != b.HasAlpha() ||
+      a.metadata()->IntensityTarget() != b.metadata()->IntensityTarget() ||
+      !SameColorEncoding(a.c_current(), b.c_current())) {
+    return false;
+  }
+  for (size_t c = 0; c < 3; ++c) {
+    if (jxl::DifferingRect(a.color().Plane(c), b.color().Plane(c), rect)
+            .xsize()) {
+      return false;
+    }
+  }
+  return !a.HasAlpha() ||
+         jxl::DifferingRect(a.alpha(), b.alpha(), rect).xsize() == 0;
+}
+
+// Upper bound of the bytes of an xsize x ysize plane of `sample_bytes`
+// samples, including the row padding (for vectors of up to kAlignment bytes)
+// and the alignment of the allocation, in an arena or not.
+size_t PlaneBytes(size_t xsize, size_t ysize,
+                  size_t sample_bytes = sizeof(float)) {
+  const size_t align = jxl::CacheAligned::kAlignment;
+  const size_t row =
+      jxl::RoundUpTo(xsize * sample_bytes + align, align) + align;
+  return jxl::CacheAlignedArena::BytesFor(row * ysize);
+}
+
+// Returns the capacity of the arena of ComputeScales for a `crop` of the
+// images, with `planes` planes per image: linear (of `linear_bytes` samples)
+// and positive XYB of both images, their next scale and the PlaneScratch, and
+// the rows that half floats are converted in.
+size_t ScalesArenaBytes(const jxl::Rect &crop, size_t planes,
+                        size_t linear_bytes = sizeof(float)) {
+  const size_t xsize = crop.xsize();
+  const size_t ysize = crop.ysize();
+  const size_t rows =
+      linear_bytes == sizeof(float) ? 0 : planes * PlaneBytes(xsize, 3);
+  return (2 * planes + PlaneScratch::kNumPlanes) * PlaneBytes(xsize, ysize) +
+         2 * planes * PlaneBytes(xsize, ysize, linear_bytes) +
+         2 * planes *
+             PlaneBytes(DivCeil2(xsize), DivCeil2(ysize), linear_bytes) +
+         rows;
+}
+
+bool SkippedWhenFast(size_t c, size_t scale, size_t num_scales);
+
+// Image is Image3F for color, or ImageF for gray images, which only have the
+// Y channel. Linear is the same, or its half float version (Image3F16 or
+// ImageF16) for the linear sRGB images that the scales are downsampled from.
+// The bundles hold the rows of the images from `rows_y0` on.
+template <class Image, class Linear>
+TileSums ComputeScales(const jxl::ImageBundle &orig,
+                       const jxl::ImageBundle &dist,
+                       const std::vector<ScaleGeometry> &scales,
+                       const TileGrid &grid, float bg, SSIMULACRA2Maps *maps,
+                       SSIMULACRA2Stats *stats,
+                       const SSIMULACRA2Options &options,
+                       size_t rows_y0 = 0) {
+  TileSums sums = ZeroTileSums(scales, grid);
+  if (scales.empty()) return sums;
+  if (stats && stats->scales.size() < scales.size()) {
+    stats->scales.resize(scales.size());
+  }
+
+  // All planes that are kept for all scales are carved out of one arena,
+  // which is mapped once instead of allocating each of them.
+  const jxl::Rect &crop = scales[0].crop;
+  const size_t planes = NumPlanes(Image());
+  jxl::CacheAlignedArena arena(
+      ScalesArenaBytes(crop, planes, sizeof(typename Linear::T)));
+
+  // Downscaling is done in linear RGB, hence keep it along with the XYB.
+  // Each scale is downsampled from `linear*` into `next*`, then swapped.
+  // All of them only cover the crop of their scale.
+  Linear linear1(crop.xsize(), crop.ysize(), &arena);
+  Linear linear2(crop.xsize(), crop.ysize(), &arena);
+  Image img1(crop.xsize(), crop.ysize(), &arena);
+  Image img2(crop.xsize(), crop.ysize(), &arena);
+  const jxl::Rect input = crop.Translate(0, -static_cast<int64_t>(rows_y0));
+  JXL_CHECK(crop.y0() >= rows_y0 && input.IsInside(orig) &&
+            input.IsInside(dist));
+  // The planes of each scale that SSIMULACRA2Options::fast skips. At the first
+  // scale, they need not even be converted.
+  std::vector<std::array<bool, 3>> skipped(scales.size());
+  for (size_t scale = 0; scale < scales.size(); ++scale) {
+    for (size_t c = 0; c < NumPlanes(img1); ++c) {
+      skipped[scale][c] = options.fast && SkippedWhenFast(Channel(img1, c),
+                                                          scale, scales.size());
+    }
+  }
+  const bool y_only = NumPlanes(img1) == 3 && skipped[0][0] && skipped[0][2];
+  ToLinearAndPositiveXYB(orig, input, bg, &linear1, &img1, stats, options.fast,
+                         y_only);
+  ToLinearAndPositiveXYB(dist, input, bg, &linear2, &img2, stats, options.fast,
+                         y_only);
+  const float intensity_target1 = orig.metadata()->IntensityTarget();
+  const float intensity_target2 = dist.metadata()->IntensityTarget();
+  Linear next1(DivCeil2(img1.xsize()), DivCeil2(img1.ysize()), &arena);
+  Linear next2(next1.xsize(), next1.ysize(), &arena);
+  // Half floats are downsampled in rows of floats.
+  Image rows = sizeof(typename Linear::T) == sizeof(float)
+                   ? Image()
+                   : Image(crop.xsize(), 3, &arena);
+
+  PlaneScratch scratch(img1.xsize(), img1.ysize(), &arena, options.fast);
+
+  for (size_t scale = 0; scale < scales.size(); scale++) {
+    SSIMULACRA2Stats::Scale *scale_stats =
+        stats ? &stats->scales[scale] : nullptr;
+    if (scale) {
+      SSIMULACRA2Trace::Span span("Downsample", scale);
+      StageTimer timer(stats != nullptr);
+      const size_t xsize = DivCeil2(linear1.xsize());
+      const size_t ysize = DivCeil2(linear1.ysize());
+      next1.ShrinkTo(xsize, ysize);
+      next2.ShrinkTo(xsize, ysize);
+      img1.ShrinkTo(xsize, ysize);
+      img2.ShrinkTo(xsize, ysize);
+      Downsample2x2AndPositiveXYB(linear1, intensity_target1, &next1, &img1,
+                                  &rows, options.fast);
+      Downsample2x2AndPositiveXYB(linear2, intensity_target2, &next2, &img2,
+                                  &rows, options.fast);
+      linear1.Swap(next1);
+      linear2.Swap(next2);
+      if (stats) timer.Lap(&scale_stats->xyb);
+    }
+    const ScaleGeometry &g = scales[scale];
+    JXL_DASSERT(jxl::SameSize(g.crop, img1));
+    const jxl::Rect roi(g.roi.x0() - g.crop.x0(), g.roi.y0() - g.crop.y0(),
+                        g.roi.xsize(), g.roi.ysize());
+
+    // Identical regions (e.g. everything but an overlay) have zero error and
+    // are skipped.
+    jxl::Rect input, eval;
+    if (ComparedRects(img1, img2, roi, &input, &eval,
+                      skipped[scale].data())) {
+      scratch.ShrinkTo(input.xsize(), input.ysize());
+      if (stats) scale_stats->num_pixels += input.xsize() * input.ysize();
+      for (size_t c = 0; c < NumPlanes(img1); ++c) {
+        if (skipped[scale][c]) continue;
+        ComparePlanes(Plane(img1, c), Plane(img2, c), nullptr, nullptr, input,
+                      eval, Channel(img1, c), grid, scale, g.crop, &scratch,
+                      &sums[scale], maps, scale_stats);
+      }
+    }
+  }
+  return sums;
+}
+
+// Returns the error map sums of the tiles of `grid` within `roi`, writes
+// the error maps to `maps` and adds the time spent to `stats` unless they are
+// null.
+TileSums ComputeTileSums(const jxl::ImageBundle &orig,
+                         const jxl::ImageBundle &dist, const jxl::Rect &roi,
+                         const TileGrid &grid, float bg,
+                         SSIMULACRA2Maps *maps = nullptr,
+                         SSIMULACRA2Stats *stats = nullptr,
+                         const SSIMULACRA2Options &options =
+                             SSIMULACRA2Options()) {
+  SSIMULACRA2Trace::Span span("ComputeSSIMULACRA2");
+  JXL_CHECK(roi.xsize() != 0 && roi.ysize() != 0 && roi.IsInside(orig));
+  const std::vector<ScaleGeometry> scales =
+      ScaleGeometries(roi, orig.xsize(), orig.ysize());
+  if (maps) {
+    // Only the pixels with nonzero error are written.
+    for (std::vector<Image3F> *map :
+         {&maps->ssim, &maps->ringing, &maps->blurring}) {
+      map->clear();
+      for (const ScaleGeometry &g : scales) {
+        map->emplace_back(g.xsize, g.ysize);
+        jxl::ZeroFillImage(&map->back());
+      }
+    }
+  }
+  if (!scales.empty() && SameImage(orig, dist, scales[0].crop)) {
+    // All error maps are zero, no need to compute them.
+    return ZeroTileSums(scales, grid);
+  }
+  if (orig.IsGray() && dist.IsGray()) {
+    if (options.f16_pyramid) {
+      return ComputeScales<ImageF, ImageF16>(orig, dist, scales, grid, bg,
+                                             maps, stats, options);
+    }
+    return ComputeScales<ImageF, ImageF>(orig, dist, scales, grid, bg, maps,
+                                         stats, options);
+  }
+  if (options.f16_pyramid) {
+    return ComputeScales<Image3F, Image3F16>(orig, dist, scales, grid, bg,
+                                             maps, stats, options);
+  }
+  return ComputeScales<Image3F, Image3F>(orig, dist, scales, grid, bg, maps,
+                                         stats, options);
+}
+
+} // namespace
+
+// State of SSIMULACRA2Scorer, for color or gray images.
+struct SSIMULACRA2Scorer::Impl {
+  explicit Impl(const TileGrid &grid) : grid(grid) {}
+  virtual ~Impl() = default;
+
+  virtual void Update(const jxl::ImageBundle &dist, const jxl::Rect &dirty) = 0;
+
+  TileGrid grid;
+  TileSums sums;
+};
+
+namespace {
+
+// Linear RGB and positive XYB of all scales of both images, from which the
+// errors of any tile can be recomputed.
+template <class Image>
+class IncrementalScales : public SSIMULACRA2Scorer::Impl {
+public:
+  IncrementalScales(const jxl::ImageBundle &orig, const jxl::ImageBundle &dist,
+                    const std::vector<ScaleGeometry> &scales, size_t tile_size,
+                    float bg)
+      : Impl(TileGrid(tile_size, orig.xsize(), orig.ysize())), bg_(bg),
+        scales_(scales), scratch_(orig.xsize(), orig.ysize()) {
+    sums = ZeroTileSums(scales_, grid);
+    ToScales(orig, &linear1_, &xyb1_);
+    ToScales(dist, &linear2_, &xyb2_);
+    for (size_t scale = 0; scale < scales_.size(); ++scale) {
+      jxl::Rect input, eval;
+      if (!ComparedRects(xyb1_[scale], xyb2_[scale], jxl::Rect(xyb1_[scale]),
+                         &input, &eval)) {
+        continue;
+      }
+      Compare(scale, input, eval);
+    }
+  }
+
+  void Update(const jxl::ImageBundle &dist, const jxl::Rect &dirty) override {
+    jxl::Rect rect = dirty;
+    Image linear, xyb;
+    ToLinearAndPositiveXYB(dist, rect, bg_, &linear, &xyb);
+    const float intensity_target = dist.metadata()->IntensityTarget();
+    for (size_t scale = 0; scale < scales_.size(); ++scale) {
+      if (scale) {
+        // The changed pixels of this scale are downsampled from the 2x2
+        // blocks of the previous one.
+        rect = Downscaled(rect);
+        const jxl::Rect finer = Upscaled(rect).Crop(linear2_[scale - 1]);
+        Image in(finer.xsize(), finer.ysize());
+        jxl::CopyImageTo(finer, linear2_[scale - 1], &in);
+        linear = Image(rect.xsize(), rect.ysize());
+        xyb = Image(rect.xsize(), rect.ysize());
+        Downsample2x2AndPositiveXYB(in, intensity_target, &linear, &xyb);
+      }
+      jxl::CopyImageTo(linear, rect, &linear2_[scale]);
+      jxl::CopyImageTo(xyb, rect, &xyb2_[scale]);
+      CompareTiles(scale, rect);
+    }
+  }
+
+private:
+  void ToScales(const jxl::ImageBundle &in, std::vector<Image> *linear,
+                std::vector<Image> *xyb) {
+    if (scales_.empty()) return;
+    linear->resize(scales_.size());
+    xyb->resize(scales_.size());
+    ToLinearAndPositiveXYB(in, jxl::Rect(in), bg_, &(*linear)[0], &(*xyb)[0]);
+    for (size_t scale = 1; scale < scales_.size(); ++scale) {
+      const ScaleGeometry &g = scales_[scale];
+      (*linear)[scale] = Image(g.xsize, g.ysize);
+      (*xyb)[scale] = Image(g.xsize, g.ysize);
+      Downsample2x2AndPositiveXYB((*linear)[scale - 1],
+                                  in.metadata()->IntensityTarget(),
+                                  &(*linear)[scale], &(*xyb)[scale]);
+    }
+  }
+
+  // Recomputes the whole tiles whose errors depend on `changed` pixels.
+  void CompareTiles(size_t scale, const jxl::Rect &changed) {
+    const ScaleGeometry &g = scales_[scale];
+    const jxl::Rect affected =
+        Extended(changed, Blur::Radius(), g.xsize, g.ysize);
+    const jxl::Rect whole(xyb1_[scale]);
+    size_t tx0, tx1, ty0, ty1;
+    grid.TilesOf(affected, scale, &tx0, &tx1, &ty0, &ty1);
+    for (size_t ty = ty0; ty < ty1; ++ty) {
+      for (size_t tx = tx0; tx < tx1; ++tx) {
+        MsssimSums &tile = sums[scale][ty * grid.xsize() + tx];
+        const size_t num_pixels = tile.num_pixels;
+        tile = MsssimSums();
+        tile.num_pixels = num_pixels;
+      }
+    }
+    const jxl::Rect eval = Union(grid.TileRect(tx0, ty0, scale, whole),
+                                 grid.TileRect(tx1 - 1, ty1 - 1, scale, whole));
+    Compare(scale, Extended(eval, Blur::Radius(), g.xsize, g.ysize), eval);
+  }
+
+  // Adds the errors of `eval`, of which `input` contains the blur support.
+  void Compare(size_t scale, const jxl::Rect &input, const jxl::Rect &eval) {
+    const Image &img1 = xyb1_[scale];
+    const Image &img2 = xyb2_[scale];
+    scratch_.ShrinkTo(input.xsize(), input.ysize());
+    for (size_t c = 0; c < NumPlanes(img1); ++c) {
+      ComparePlanes(Plane(img1, c), Plane(img2, c), nullptr, nullptr, input,
+                    eval, Channel(img1, c), grid, scale, jxl::Rect(img1),
+                    &scratch_, &sums[scale], /*maps=*/nullptr);
+    }
+  }
+
+  float bg_;
+  std::vector<ScaleGeometry> scales_;
+  std::vector<Image> linear1_, xyb1_, linear2_, xyb2_;
+  PlaneScratch scratch_;
+};
+
+} // namespace
+
+/*
+The final score is based on a weighted sum of 108 sub-scores:
+- for 6 scales (1:1 to 1:32, downsampled in linear RGB)
+- for 3 components (X, Y, B-Y, rescaled to 0..1 range)
+- using 2 norms (the 1-norm and the 4-norm)
+- over 3 error maps:
+    - SSIM' (SSIM without the spurious gamma correction term)
+    - "ringing" (distorted edges where there are no orig edges)
+    - "blurring" (orig edges where there are no distorted edges)
+
+The weights were obtained by running Nelder-Mead simplex search,
+optimizing to minimize MSE for the CID22 training set and to
+maximize Kendall rank correlation (and with a lower weight,
+also Pearson correlation) with the CID22 training set and the
+TID2013, Kadid10k and KonFiG-IQA datasets.
+Validation was done on the CID22 validation set.
+
+Final results after tuning (Kendall | Spearman | Pearson):
+   CID22:     0.6903 | 0.8805 | 0.8583
+   TID2013:   0.6590 | 0.8445 | 0.8471
+   KADID-10k: 0.6175 | 0.8133 | 0.8030
+   KonFiG(F): 0.7668 | 0.9194 | 0.9136
+*/
+namespace {
+
+const double kWeight[108] = {
+    0.0,
+    0.0007376606707406586,
+    0.0,
+    0.0,
+    0.0007793481682867309,
+    0.0,
+    0.0,
+    0.0004371155730107379,
+    0.0,
+    1.1041726426657346,
+    0.00066284834129271,
+    0.00015231632783718752,
+    0.0,
+    0.0016406437456599754,
+    0.0,
+    1.8422455520539298,
+    11.441172603757666,
+    0.0,
+    0.0007989109436015163,
+    0.000176816438078653,
+    0.0,
+    1.8787594979546387,
+    10.94906990605142,
+    0.0,
+    0.0007289346991508072,
+    0.9677937080626833,
+    0.0,
+    0.00014003424285435884,
+    0.9981766977854967,
+    0.00031949755934435053,
+    0.0004550992113792063,
+    0.0,
+    0.0,
+    0.0013648766163243398,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    7.466890328078848,
+    0.0,
+    17.445833984131262,
+    0.0006235601634041466,
+    0.0,
+    0.0,
+    6.683678146179332,
+    0.00037724407979611296,
+    1.027889937768264,
+    225.20515300849274,
+    0.0,
+    0.0,
+    19.213238186143016,
+    0.0011401524586618361,
+    0.001237755635509985,
+    176.39317598450694,
+    0.0,
+    0.0,
+    24.43300999870476,
+    0.28520802612117757,
+    0.0004485436923833408,
+    0.0,
+    0.0,
+    0.0,
+    34.77906344483772,
+    44.835625328877896,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0008680556573291698,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0005313191874358747,
+    0.0,
+    0.00016533814161379112,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0,
+    0.0004179171803251336,
+    0.0017290828234722833,
+    0.0,
+    0.0020827005846636437,
+    0.0,
+    0.0,
+    8.826982764996862,
+    23.19243343998926,
+    0.0,
+    95.1080498811086,
+    0.9863978034400682,
+    0.9834382792465353,
+    0.0012286405048278493,
+    171.2667255897307,
+    0.9807858872435379,
+    0.0,
+    0.0,
+    0.0,
+    0.0005130064588990679,
+    0.0,
+    0.00010854057858411537,
+};
+
+// Returns the index in kWeight of the weight of error map `m` (SSIM',
+// ringing, blurring) of channel `c` at `scale`, with norm `n` (1- or 4-norm),
+// as enumerated by Msssim::Features.
+size_t WeightIndex(size_t c, size_t scale, size_t n, size_t m,
+                   size_t num_scales) {
+  return ((c * num_scales + scale) * 2 + n) * 3 + m;
+}
+
+// Returns whether SSIMULACRA2Options::fast skips comparing channel `c` at
+// `scale` of images with `num_scales` scales: those whose six weights are all
+// below 0.01. For six scales, these are X and B of the first scale, B of the
+// next two and all of the last one, whose weights add up to 0.008, while each
+// of the others adds up to 1.1 or more.
+bool SkippedWhenFast(size_t c, size_t scale, size_t num_scales) {
+  for (size_t n = 0; n < 2; ++n) {
+    for (size_t m = 0; m < 3; ++m) {
+      if (kWeight[WeightIndex(c, scale, n, m, num_scales)] >= 0.01) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+std::vector<double> Msssim::Features() const {
+  // The scales that the images have come first, in the order that the
+  // weights were tuned with, as in upstream SSIMULACRA 2.
+  std::vector<double> features(kSSIMULACRA2NumFeatures, 0.0);
+  JXL_ASSERT(scales.size() <= kNumScales);
+  size_t i = 0;
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t scale = 0; scale < scales.size(); ++scale) {
+      for (size_t n = 0; n < 2; n++) {
+        features[i++] = scales[scale].avg_ssim[c * 2 + n];
+        features[i++] = scales[scale].avg_edgediff[c * 4 + n];
+        features[i++] = scales[scale].avg_edgediff[c * 4 + 2 + n];
+      }
+    }
+  }
+  return features;
+}
+
+double Msssim::Score() const {
+  const std::vector<double> features = Features();
+#ifdef SSIMULACRA2_OUTPUT_RAW_SCORES_FOR_WEIGHT_TUNING
+  for (size_t i = 0; i < scales.size() * 3 * 2 * 3; ++i) {
+    printf("%.12f,", features[i]);
+  }
+#endif
+  return ScoreFromFeatures(features.data(), kWeight);
+}
+
+const double *SSIMULACRA2Weights() { return kWeight; }
+
+double ScoreFromFeatures(const double *features, const double *weights) {
+  double ssim = 0.0;
+
+  char ch[] = "XYB";
+  const char *map[] = {"ssim", "ringing", "blur"};
+  const bool verbose = false;
+  for (size_t i = 0; i < kSSIMULACRA2NumFeatures; ++i) {
+    if (verbose) {
+      printf("%f from channel %c %s, scale 1:%i, %zu-norm (weight %f)\n",
+             weights[i] * std::abs(features[i]), ch[i / 36], map[i % 3],
+             1 << (i / 6 % 6), i / 3 % 2 * 3 + 1, weights[i]);
+    }
+    ssim += weights[i] * std::abs(features[i]);
+  }
+
+  ssim = ssim * 0.9562382616834844;
+  ssim = 2.326765642916932 * ssim - 0.020884521182843837 * ssim * ssim +
+         6.248496625763138e-05 * ssim * ssim * ssim;
+  if (ssim > 0) {
+    ssim = 100.0 - 10.0 * pow(ssim, 0.6276336467831387);
   } else {
     ssim = 100.0;
   }
   return ssim;
 }
 
+jxl::Rect SSIMULACRA2InputRect(const jxl::Rect &roi, size_t xsize,
+                               size_t ysize) {
+  const std::vector<ScaleGeometry> scales = ScaleGeometries(roi, xsize, ysize);
+  return scales.empty() ? roi : scales[0].crop;
+}
+
 Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
-                          const jxl::ImageBundle &dist, float bg) {
-  Msssim msssim;
+                          const jxl::ImageBundle &dist, const jxl::Rect &roi,
+                          float bg) {
+  const TileGrid grid(0, orig.xsize(), orig.ysize());
+  return TotalNorms(ComputeTileSums(orig, dist, roi, grid, bg));
+}
+
+jxl::ImageF SSIMULACRA2Maps::Weighted() const {
+  JXL_CHECK(!ssim.empty());
+  const size_t num_scales = ssim.size();
+  jxl::ImageF weighted(ssim[0].xsize(), ssim[0].ysize());
+  jxl::ZeroFillImage(&weighted);
+  const std::vector<Image3F> *maps[3] = {&ssim, &ringing, &blurring};
+  for (size_t scale = 0; scale < num_scales; ++scale) {
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t m = 0; m < 3; ++m) {
+        const float w = kWeight[WeightIndex(c, scale, 0, m, num_scales)] +
+                        kWeight[WeightIndex(c, scale, 1, m, num_scales)];
+        if (w == 0) continue;
+        const ImageF &map = (*maps[m])[scale].Plane(c);
+        for (size_t y = 0; y < weighted.ysize(); ++y) {
+          const float *JXL_RESTRICT row_in = map.ConstRow(y >> scale);
+          float *JXL_RESTRICT row_out = weighted.Row(y);
+          for (size_t x = 0; x < weighted.xsize(); ++x) {
+            row_out[x] += w * row_in[x >> scale];
+          }
+        }
+      }
+    }
+  }
+  return weighted;
+}
+
+Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
+                          const jxl::ImageBundle &dist, float bg,
+                          SSIMULACRA2Maps *maps) {
+  const TileGrid grid(0, orig.xsize(), orig.ysize());
+  return TotalNorms(
+      ComputeTileSums(orig, dist, jxl::Rect(orig), grid, bg, maps));
+}
+
+Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
+                          const jxl::ImageBundle &dist, float bg,
+                          const SSIMULACRA2Options &options,
+                          SSIMULACRA2Stats *stats) {
+  const TileGrid grid(0, orig.xsize(), orig.ysize());
+  if (!stats) {
+    return TotalNorms(ComputeTileSums(orig, dist, jxl::Rect(orig), grid, bg,
+                                      /*maps=*/nullptr, nullptr, options));
+  }
+  // Only the allocations of this thread count, relative to those before.
+  const jxl::CacheAligned::ThreadPeak peak;
+  const jxl::CacheAligned::Stats before = jxl::CacheAligned::GetThreadStats();
+  const uint64_t bytes_in_use = jxl::CacheAligned::GetStats().bytes_in_use;
+  StageTimer timer(true);
+  const Msssim msssim =
+      TotalNorms(ComputeTileSums(orig, dist, jxl::Rect(orig), grid, bg,
+                                 /*maps=*/nullptr, stats, options));
+  timer.Lap(&stats->total);
+  const jxl::CacheAligned::Stats after = jxl::CacheAligned::GetThreadStats();
+  stats->num_allocations += after.num_allocations - before.num_allocations;
+  stats->num_frees += after.num_frees - before.num_frees;
+  stats->bytes_in_use = bytes_in_use;
+  stats->peak_bytes_in_use =
+      std::max<uint64_t>(stats->peak_bytes_in_use,
+                         bytes_in_use + (after.max_bytes_in_use -
+                                         before.bytes_in_use));
+  return msssim;
+}
+
+Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
+                          const jxl::ImageBundle &dist, float bg,
+                          size_t tile_size, jxl::ImageD *tile_scores) {
+  JXL_CHECK(tile_size != 0);
+  const TileGrid grid(tile_size, orig.xsize(), orig.ysize());
+  const TileSums sums =
+      ComputeTileSums(orig, dist, jxl::Rect(orig), grid, bg);
+  *tile_scores = jxl::ImageD(grid.xsize(), grid.ysize());
+  for (size_t ty = 0; ty < grid.ysize(); ++ty) {
+    double *JXL_RESTRICT row = tile_scores->Row(ty);
+    for (size_t tx = 0; tx < grid.xsize(); ++tx) {
+      row[tx] = TileNorms(sums, ty * grid.xsize() + tx).Score();
+    }
+  }
+  return TotalNorms(sums);
+}
 
-  jxl::Image3F img1(orig.xsize(), orig.ysize());
-  jxl::Image3F img2(img1.xsize(), img1.ysize());
+namespace {
+
+const char kBandSumsMagic[] = "ssimulacra2-band-sums";
+const size_t kBandSumsVersion = 1;
 
-  jxl::ImageBundle orig2 = orig.Copy();
-  jxl::ImageBundle dist2 = dist.Copy();
+// Band boundaries are multiples of this or the image height, hence a multiple
+// of 2^scale at all scales.
+const size_t kBandAlign = size_t(1) << (kNumScales - 1);
+
+// Returns the row of `scale` (with `scale_ysize` rows) at which a band starting
+// or ending at full-resolution row `y` of `ysize` starts or ends.
+size_t BandRow(size_t y, size_t ysize, size_t scale_ysize, size_t scale) {
+  return y == ysize ? scale_ysize : y >> scale;
+}
 
-  if (orig.HasAlpha())
-    AlphaBlend(orig2, bg);
-  if (dist.HasAlpha())
-    AlphaBlend(dist2, bg);
-  orig2.ClearExtraChannels();
-  dist2.ClearExtraChannels();
+// Parses the number at `*pos`, which must be followed by a space or the end,
+// and advances `*pos` past it.
+bool ParseNext(const char **pos, size_t *value) {
+  char *end;
+  const unsigned long long parsed = strtoull(*pos, &end, 10);
+  if (end == *pos || (*end != ' ' && *end != '\0')) return false;
+  *value = parsed;
+  *pos = end;
+  return true;
+}
 
-  JXL_CHECK(orig2.TransformTo(jxl::ColorEncoding::LinearSRGB(orig2.IsGray()),
-                              jxl::GetJxlCms()));
-  JXL_CHECK(dist2.TransformTo(jxl::ColorEncoding::LinearSRGB(dist2.IsGray()),
-                              jxl::GetJxlCms()));
+bool ParseNext(const char **pos, double *value) {
+  char *end;
+  *value = strtod(*pos, &end);
+  if (end == *pos || (*end != ' ' && *end != '\0')) return false;
+  *pos = end;
+  return true;
+}
 
-  jxl::ToXYB(orig2, nullptr, &img1, jxl::GetJxlCms(), nullptr);
-  jxl::ToXYB(dist2, nullptr, &img2, jxl::GetJxlCms(), nullptr);
-  MakePositiveXYB(img1);
-  MakePositiveXYB(img2);
+} // namespace
 
-  Image3F mul(img1.xsize(), img1.ysize());
-  Blur blur(img1.xsize(), img1.ysize());
+std::string SSIMULACRA2BandSums::Serialize() const {
+  // Doubles are written in hexadecimal so that they are read back exactly.
+  std::string line = kBandSumsMagic;
+  char buf[64];
+  snprintf(buf, sizeof(buf), " %zu %zu %zu %a %zu", kBandSumsVersion, xsize,
+           ysize, static_cast<double>(bg), scales.size());
+  line += buf;
+  for (const Scale &scale : scales) {
+    snprintf(buf, sizeof(buf), " %zu %zu %zu", scale.y0, scale.y1,
+             scale.num_pixels);
+    line += buf;
+    for (double sum : scale.ssim) {
+      snprintf(buf, sizeof(buf), " %a", sum);
+      line += buf;
+    }
+    for (double sum : scale.edgediff) {
+      snprintf(buf, sizeof(buf), " %a", sum);
+      line += buf;
+    }
+  }
+  return line;
+}
 
-  for (int scale = 0; scale < kNumScales; scale++) {
-    if (img1.xsize() < 8 || img1.ysize() < 8) {
-      break;
+jxl::Status SSIMULACRA2BandSums::Parse(const std::string &line,
+                                       SSIMULACRA2BandSums *sums) {
+  const size_t magic_size = strlen(kBandSumsMagic);
+  if (line.compare(0, magic_size, kBandSumsMagic) != 0) {
+    return JXL_FAILURE("Not SSIMULACRA 2 band sums");
+  }
+  const char *pos = line.c_str() + magic_size;
+  size_t version, num_scales;
+  double bg;
+  if (!ParseNext(&pos, &version) || version != kBandSumsVersion) {
+    return JXL_FAILURE("Unsupported band sums version");
+  }
+  if (!ParseNext(&pos, &sums->xsize) || !ParseNext(&pos, &sums->ysize) ||
+      !ParseNext(&pos, &bg) || !ParseNext(&pos, &num_scales) ||
+      num_scales > kNumScales) {
+    return JXL_FAILURE("Invalid band sums");
+  }
+  sums->bg = bg;
+  sums->scales.resize(num_scales);
+  for (Scale &scale : sums->scales) {
+    if (!ParseNext(&pos, &scale.y0) || !ParseNext(&pos, &scale.y1) ||
+        !ParseNext(&pos, &scale.num_pixels)) {
+      return JXL_FAILURE("Invalid band sums");
     }
-    if (scale) {
-      orig2.SetFromImage(Downsample(*orig2.color(), 2, 2),
-                         jxl::ColorEncoding::LinearSRGB(orig2.IsGray()));
-      dist2.SetFromImage(Downsample(*dist2.color(), 2, 2),
-                         jxl::ColorEncoding::LinearSRGB(dist2.IsGray()));
-      img1.ShrinkTo(orig2.xsize(), orig2.ysize());
-      img2.ShrinkTo(orig2.xsize(), orig2.ysize());
-      jxl::ToXYB(orig2, nullptr, &img1, jxl::GetJxlCms(), nullptr);
-      jxl::ToXYB(dist2, nullptr, &img2, jxl::GetJxlCms(), nullptr);
-      MakePositiveXYB(img1);
-      MakePositiveXYB(img2);
+    for (double &sum : scale.ssim) {
+      if (!ParseNext(&pos, &sum)) return JXL_FAILURE("Invalid band sums");
+    }
+    for (double &sum : scale.edgediff) {
+      if (!ParseNext(&pos, &sum)) return JXL_FAILURE("Invalid band sums");
+    }
+  }
+  if (*pos != '\0') return JXL_FAILURE("Trailing data after band sums");
+  return true;
+}
+
+jxl::Rect SSIMULACRA2Band(size_t band, size_t num_bands, size_t xsize,
+                          size_t ysize) {
+  JXL_CHECK(band < num_bands);
+  const auto boundary = [=](size_t i) -> size_t {
+    if (i == num_bands) return ysize;
+    const size_t y = i * ysize / num_bands;
+    return std::min(ysize, (y + kBandAlign / 2) / kBandAlign * kBandAlign);
+  };
+  const size_t y0 = boundary(band);
+  return jxl::Rect(0, y0, xsize, boundary(band + 1) - y0);
+}
+
+jxl::Status ComputeSSIMULACRA2BandSums(const jxl::ImageBundle &orig,
+                                       const jxl::ImageBundle &dist,
+                                       const jxl::Rect &band, float bg,
+                                       SSIMULACRA2BandSums *result) {
+  const size_t xsize = orig.xsize();
+  const size_t ysize = orig.ysize();
+  if (dist.xsize() != xsize || dist.ysize() != ysize) {
+    return JXL_FAILURE("Images of different sizes");
+  }
+  if (band.x0() != 0 || band.xsize() != xsize || band.y0() > ysize ||
+      band.ysize() > ysize - band.y0()) {
+    return JXL_FAILURE("Band is not full rows of the images");
+  }
+  const size_t y1 = band.y0() + band.ysize();
+  if ((band.y0() % kBandAlign != 0 && band.y0() != ysize) ||
+      (y1 % kBandAlign != 0 && y1 != ysize)) {
+    return JXL_FAILURE("Band boundaries are not multiples of %" PRIuS,
+                       kBandAlign);
+  }
+  result->xsize = xsize;
+  result->ysize = ysize;
+  result->bg = bg;
+  result->scales.clear();
+  // Aligned band boundaries make the roi of each scale exactly the rows of
+  // the band at that scale.
+  TileSums sums;
+  if (band.ysize() != 0) {
+    sums = ComputeTileSums(orig, dist, band, TileGrid(0, xsize, ysize), bg);
+  }
+  const std::vector<ScaleGeometry> scales =
+      ScaleGeometries(jxl::Rect(orig), xsize, ysize);
+  for (size_t scale = 0; scale < scales.size(); ++scale) {
+    const ScaleGeometry &g = scales[scale];
+    SSIMULACRA2BandSums::Scale out = {};
+    out.y0 = BandRow(band.y0(), ysize, g.ysize, scale);
+    out.y1 = BandRow(y1, ysize, g.ysize, scale);
+    if (!sums.empty()) {
+      const MsssimSums &in = sums[scale][0];
+      JXL_DASSERT(in.num_pixels == g.xsize * (out.y1 - out.y0));
+      std::copy(in.ssim, in.ssim + 3 * 2, out.ssim);
+      std::copy(in.edgediff, in.edgediff + 3 * 4, out.edgediff);
+      out.num_pixels = in.num_pixels;
+    }
+    result->scales.push_back(out);
+  }
+  return true;
+}
+
+jxl::Status MergeSSIMULACRA2BandSums(
+    const std::vector<SSIMULACRA2BandSums> &bands, Msssim *msssim) {
+  if (bands.empty()) return JXL_FAILURE("No bands to merge");
+  const SSIMULACRA2BandSums &first = bands[0];
+  const std::vector<ScaleGeometry> scales = ScaleGeometries(
+      jxl::Rect(0, 0, first.xsize, first.ysize), first.xsize, first.ysize);
+  for (const SSIMULACRA2BandSums &band : bands) {
+    if (band.xsize != first.xsize || band.ysize != first.ysize ||
+        band.bg != first.bg || band.scales.size() != scales.size()) {
+      return JXL_FAILURE("Bands of different images or backgrounds");
+    }
+  }
+  std::vector<const SSIMULACRA2BandSums *> sorted;
+  for (const SSIMULACRA2BandSums &band : bands) sorted.push_back(&band);
+  if (!scales.empty()) {
+    std::sort(sorted.begin(), sorted.end(),
+              [](const SSIMULACRA2BandSums *a, const SSIMULACRA2BandSums *b) {
+                return std::make_pair(a->scales[0].y0, a->scales[0].y1) <
+                       std::make_pair(b->scales[0].y0, b->scales[0].y1);
+              });
+  }
+  msssim->scales.clear();
+  for (size_t scale = 0; scale < scales.size(); ++scale) {
+    const ScaleGeometry &g = scales[scale];
+    MsssimSums total = {};
+    size_t y = 0;
+    for (const SSIMULACRA2BandSums *band : sorted) {
+      const SSIMULACRA2BandSums::Scale &in = band->scales[scale];
+      if (in.y0 != y || in.y1 < in.y0 ||
+          in.num_pixels != g.xsize * (in.y1 - in.y0)) {
+        return JXL_FAILURE("Bands do not cover the images exactly once");
+      }
+      y = in.y1;
+      MsssimSums sums;
+      std::copy(in.ssim, in.ssim + 3 * 2, sums.ssim);
+      std::copy(in.edgediff, in.edgediff + 3 * 4, sums.edgediff);
+      sums.num_pixels = in.num_pixels;
+      total.Add(sums);
+    }
+    if (y != g.ysize) {
+      return JXL_FAILURE("Bands do not cover the images exactly once");
+    }
+    msssim->scales.push_back(total.Norms());
+  }
+  return true;
+}
+
+namespace {
+
+// Provides rows [y0, y1) of both images: sets `orig` and `dist` to bundles
+// whose images hold the rows from `*rows_y0` on, which include [y0, y1).
+typedef std::function<jxl::Status(size_t y0, size_t y1,
+                                  const jxl::ImageBundle **orig,
+                                  const jxl::ImageBundle **dist,
+                                  size_t *rows_y0)>
+    RowsFunc;
+
+// Upper bound of the bytes that ComputeScales allocates for a `crop` of the
+// images: its arena, rounded up to huge pages, and besides that the crops of
+// two planes when comparing only part of them, or the cropped bundle (with
+// alpha) that is converted if the images are not sRGB.
+size_t ComputeScalesBytes(const jxl::Rect &crop, size_t planes) {
+  return jxl::RoundUpTo(ScalesArenaBytes(crop, planes),
+                        jxl::CacheAlignedArena::kHugePageSize) +
+         (planes + 1) * PlaneBytes(crop.xsize(), crop.ysize());
+}
+
+// Upper bound of the bytes that CompareInStrips allocates for strips of
+// `rows` rows of xsize x ysize images: the linear images of the second and
+// third scale, the StripBlurs, and for the strips of the first scale and
+// their halo, the linear and XYB images, the PlaneScratch and crops of
+// ComparePlanes, the downsampled rows, and the cropped bundle that is
+// converted if the images are not sRGB. `input_planes` planes of each image
+// hold the decoded rows.
+size_t StripsBytes(size_t xsize, size_t ysize, size_t rows, size_t planes,
+                   size_t input_planes) {
+  const size_t xsize1 = DivCeil2(xsize), ysize1 = DivCeil2(ysize);
+  const size_t halo_rows = std::min(ysize, rows + 2 * Blur::Radius());
+  const size_t strip = PlaneBytes(xsize, halo_rows);
+  // Three scans of the last few rows of each column, for vectors of up to
+  // kAlignment bytes.
+  const size_t lanes = jxl::CacheAligned::kAlignment / sizeof(float);
+  const size_t blurs =
+      3 * 5 * PlaneBytes(3 * 4 * jxl::RoundUpTo(xsize, lanes), 1);
+  return blurs + 2 * planes *
+             (PlaneBytes(xsize1, ysize1) +
+              PlaneBytes(DivCeil2(xsize1), DivCeil2(ysize1))) +
+         (4 * planes + PlaneScratch::kNumPlanes + 2 + 4 + 2 * input_planes) *
+             strip +
+         planes * (PlaneBytes(xsize, rows) +
+                   2 * PlaneBytes(xsize1, DivCeil2(rows)));
+}
+
+// Copies `rect` of `in` to `out`, which is reallocated if its size differs.
+template <class Image>
+void CopyRect(const Image &in, const jxl::Rect &rect, Image *out) {
+  if (!jxl::SameSize(rect, *out)) *out = Image(rect.xsize(), rect.ysize());
+  jxl::CopyImageTo(rect, in, out);
+}
+
+// Returns the norms of xsize x ysize images of which `rows` provides strips
+// of `strip_rows` rows (an even number) plus the blur radius. Each scale is
+// compared one strip at a time, and downsampled into the whole linear image
+// of the next scale, so that only the first scale needs all rows. The blurs
+// carry their state from strip to strip, so the norms equal those of the
+// whole images unless these skip identical margins, where the blurs start
+// later and round differently.
+template <class Image>
+jxl::Status CompareInStrips(size_t xsize, size_t ysize, size_t strip_rows,
+                            const RowsFunc &rows, float bg, Msssim *msssim) {
+  const std::vector<ScaleGeometry> scales =
+      ScaleGeometries(jxl::Rect(0, 0, xsize, ysize), xsize, ysize);
+  const TileGrid grid(0, xsize, ysize);
+  TileSums sums = ZeroTileSums(scales, grid);
+  const size_t halo_rows = std::min(ysize, strip_rows + 2 * Blur::Radius());
+  PlaneScratch scratch(xsize, halo_rows);
+  // Whole linear images of the current and next scale.
+  Image level1, level2, next1, next2;
+  // Of the strip and its halo.
+  Image linear1, linear2, img1, img2;
+  // Downsampled rows of the strip.
+  Image half, half_linear, half_img;
+  float intensity_target1 = 0.0f, intensity_target2 = 0.0f;
+  for (size_t scale = 0; scale < scales.size(); ++scale) {
+    const ScaleGeometry &g = scales[scale];
+    const bool has_next = scale + 1 < scales.size();
+    StripBlurs blurs(g.ysize);
+    if (has_next) {
+      next1 = Image(DivCeil2(g.xsize), DivCeil2(g.ysize));
+      next2 = Image(next1.xsize(), next1.ysize());
+    }
+    for (size_t y0 = 0; y0 < g.ysize; y0 += strip_rows) {
+      SSIMULACRA2Trace::Span span("CompareStrip", scale, /*plane=*/-1,
+                                  y0 / strip_rows);
+      const jxl::Rect strip(0, y0, g.xsize, strip_rows, g.xsize, g.ysize);
+      const jxl::Rect crop = Extended(strip, Blur::Radius(), g.xsize, g.ysize);
+      if (scale == 0) {
+        const jxl::ImageBundle *orig, *dist;
+        size_t rows_y0;
+        JXL_RETURN_IF_ERROR(
+            rows(crop.y0(), crop.y0() + crop.ysize(), &orig, &dist, &rows_y0));
+        const jxl::Rect input =
+            crop.Translate(0, -static_cast<int64_t>(rows_y0));
+        JXL_CHECK(crop.y0() >= rows_y0 && input.IsInside(*orig) &&
+                  input.IsInside(*dist));
+        ToLinearAndPositiveXYB(*orig, input, bg, &linear1, &img1);
+        ToLinearAndPositiveXYB(*dist, input, bg, &linear2, &img2);
+        intensity_target1 = orig->metadata()->IntensityTarget();
+        intensity_target2 = dist->metadata()->IntensityTarget();
+      } else {
+        CopyRect(level1, crop, &linear1);
+        CopyRect(level2, crop, &linear2);
+        if (!jxl::SameSize(crop, img1)) {
+          img1 = Image(crop.xsize(), crop.ysize());
+          img2 = Image(crop.xsize(), crop.ysize());
+        }
+        ssimulacra2_stages::PositiveXYBFromLinear(linear1, intensity_target1,
+                                                  &img1);
+        ssimulacra2_stages::PositiveXYBFromLinear(linear2, intensity_target2,
+                                                  &img2);
+      }
+
+      // All of the strip is compared, so that the blurs see the same rows as
+      // those of the whole images, which only skip identical margins.
+      const jxl::Rect roi =
+          strip.Translate(0, -static_cast<int64_t>(crop.y0()));
+      scratch.ShrinkTo(crop.xsize(), crop.ysize());
+      for (size_t c = 0; c < NumPlanes(img1); ++c) {
+        ComparePlanes(Plane(img1, c), Plane(img2, c), nullptr, nullptr,
+                      jxl::Rect(img1), roi, Channel(img1, c), grid, scale,
+                      crop, &scratch, &sums[scale], /*maps=*/nullptr,
+                      /*stats=*/nullptr, &blurs);
+      }
+
+      if (!has_next) continue;
+      // The rows of the strip are the 2x2 blocks of the whole image, as its
+      // first row and the number of rows are even except for the last strip.
+      const jxl::Rect half_rect(0, y0 / 2, next1.xsize(),
+                                DivCeil2(strip.ysize()));
+      for (size_t i = 0; i < 2; ++i) {
+        CopyRect(i == 0 ? linear1 : linear2, roi, &half);
+        if (!jxl::SameSize(half_rect, half_linear)) {
+          half_linear = Image(half_rect.xsize(), half_rect.ysize());
+          half_img = Image(half_rect.xsize(), half_rect.ysize());
+        }
+        Downsample2x2AndPositiveXYB(
+            half, i == 0 ? intensity_target1 : intensity_target2,
+            &half_linear, &half_img);
+        jxl::CopyImageTo(jxl::Rect(half_linear), half_linear, half_rect,
+                         i == 0 ? &next1 : &next2);
+      }
     }
-    mul.ShrinkTo(img1.xsize(), img1.ysize());
-    blur.ShrinkTo(img1.xsize(), img1.ysize());
+    // The previous scale is freed before the next one is allocated.
+    level1.Swap(next1);
+    level2.Swap(next2);
+    next1 = Image();
+    next2 = Image();
+  }
+  *msssim = TotalNorms(sums);
+  return true;
+}
+
+// Returns the halo around tiles away from the borders of xsize x ysize
+// images: the columns and rows of their crop beyond the tile.
+void TileHalo(size_t xsize, size_t ysize, size_t *halo_x, size_t *halo_y) {
+  const jxl::Rect middle(xsize / 2 / kBandAlign * kBandAlign,
+                         ysize / 2 / kBandAlign * kBandAlign, kBandAlign,
+                         kBandAlign, xsize, ysize);
+  const jxl::Rect crop = SSIMULACRA2InputRect(middle, xsize, ysize);
+  *halo_x = crop.xsize() - middle.xsize();
+  *halo_y = crop.ysize() - middle.ysize();
+}
+
+// Upper bound of the bytes that CompareInTiles allocates for square tiles of
+// `tile_size` pixels of xsize x ysize images: ComputeScales for the largest
+// tile plus its halo, and `input_planes` planes of each image that hold the
+// decoded rows of a row of tiles and their halo.
+size_t TilesBytes(size_t xsize, size_t ysize, size_t tile_size, size_t planes,
+                  size_t input_planes) {
+  size_t halo_x, halo_y;
+  TileHalo(xsize, ysize, &halo_x, &halo_y);
+  const size_t crop_ysize = std::min(ysize, tile_size + halo_y);
+  return ComputeScalesBytes(
+             jxl::Rect(0, 0, std::min(xsize, tile_size + halo_x), crop_ysize),
+             planes) +
+         2 * input_planes * PlaneBytes(xsize, crop_ysize);
+}
 
-    Multiply(img1, img1, &mul);
-    Image3F sigma1_sq = blur(mul);
+// Returns the norms of xsize x ysize images, of which `rows` provides the rows
+// of one row of square tiles of `tile_size` pixels (a multiple of kBandAlign,
+// so that the tiles split all scales) plus their halo at a time. Each tile is
+// compared with its halo, hence the norms match those of the whole images up
+// to the rounding of the blurs, as for bands (see MergeSSIMULACRA2BandSums),
+// but the halo of all scales is recomputed for each tile.
+template <class Image>
+jxl::Status CompareInTiles(size_t xsize, size_t ysize, size_t tile_size,
+                           const RowsFunc &rows, float bg, Msssim *msssim) {
+  const TileGrid grid(0, xsize, ysize);
+  // The sums of the tiles, including their pixel counts, add up to those of
+  // the whole images.
+  TileSums total;
+  for (size_t y0 = 0; y0 < ysize; y0 += tile_size) {
+    // All tiles of the row need the same rows, those of its crop.
+    const jxl::Rect row_rect(0, y0, xsize, tile_size, xsize, ysize);
+    const jxl::Rect crop = SSIMULACRA2InputRect(row_rect, xsize, ysize);
+    const jxl::ImageBundle *orig, *dist;
+    size_t rows_y0;
+    JXL_RETURN_IF_ERROR(
+        rows(crop.y0(), crop.y0() + crop.ysize(), &orig, &dist, &rows_y0));
+    for (size_t x0 = 0; x0 < xsize; x0 += tile_size) {
+      SSIMULACRA2Trace::Span span("CompareTile", /*scale=*/-1, /*plane=*/-1,
+                                  y0 / tile_size);
+      const jxl::Rect tile(x0, y0, tile_size, tile_size, xsize, ysize);
+      const TileSums sums = ComputeScales<Image, Image>(
+          *orig, *dist, ScaleGeometries(tile, xsize, ysize), grid, bg,
+          /*maps=*/nullptr, /*stats=*/nullptr, SSIMULACRA2Options(), rows_y0);
+      if (total.empty()) {
+        total = sums;
+        continue;
+      }
+      for (size_t scale = 0; scale < sums.size(); ++scale) {
+        total[scale][0].Add(sums[scale][0]);
+      }
+    }
+  }
+  *msssim = TotalNorms(total);
+  return true;
+}
 
-    Multiply(img2, img2, &mul);
-    Image3F sigma2_sq = blur(mul);
+// Computes the norms of xsize x ysize images, provided by `rows`, with at
+// most `max_bytes` (including `input_planes` planes of each image that hold
+// its rows): of the whole images if they fit, else in the tallest strips that
+// fit, but not shorter than twice the blur radius, which would mostly
+// compare the halo. Strips keep the linear images of the second and third
+// scale whole (7.5 bytes per pixel of color images), hence below that it
+// compares the largest square tiles that fit. Sets `*over_budget` if even the
+// smallest tiles do not fit. `planes` is 1 for gray images, else 3.
+jxl::Status ComputeWithinBudget(size_t xsize, size_t ysize, size_t planes,
+                                size_t input_planes, const RowsFunc &rows,
+                                float bg, size_t max_bytes, Msssim *msssim,
+                                bool *over_budget) {
+  *over_budget = false;
+  if (ComputeScalesBytes(jxl::Rect(0, 0, xsize, ysize), planes) +
+          2 * input_planes * PlaneBytes(xsize, ysize) <=
+      max_bytes) {
+    const jxl::ImageBundle *orig, *dist;
+    size_t rows_y0;
+    JXL_RETURN_IF_ERROR(rows(0, ysize, &orig, &dist, &rows_y0));
+    if (rows_y0 != 0 || orig->ysize() != ysize) {
+      return JXL_FAILURE("Rows do not cover the images");
+    }
+    *msssim = TotalNorms(ComputeTileSums(*orig, *dist, jxl::Rect(*orig),
+                                         TileGrid(0, xsize, ysize), bg));
+    return true;
+  }
+  const size_t min_rows = jxl::RoundUpTo(2 * Blur::Radius(), 2);
+  for (size_t strip_rows = jxl::RoundUpTo(DivCeil2(ysize), 2);
+       strip_rows >= min_rows;
+       strip_rows = jxl::RoundUpTo(DivCeil2(strip_rows), 2)) {
+    if (StripsBytes(xsize, ysize, strip_rows, planes, input_planes) >
+        max_bytes) {
+      if (strip_rows == min_rows) break;
+      continue;
+    }
+    if (planes == 1) {
+      return CompareInStrips<ImageF>(xsize, ysize, strip_rows, rows, bg,
+                                     msssim);
+    }
+    return CompareInStrips<Image3F>(xsize, ysize, strip_rows, rows, bg,
+                                    msssim);
+  }
+  for (size_t tile_size =
+           jxl::RoundUpTo(DivCeil2(std::max(xsize, ysize)), kBandAlign);
+       ; tile_size = jxl::RoundUpTo(DivCeil2(tile_size), kBandAlign)) {
+    if (TilesBytes(xsize, ysize, tile_size, planes, input_planes) <=
+        max_bytes) {
+      if (planes == 1) {
+        return CompareInTiles<ImageF>(xsize, ysize, tile_size, rows, bg,
+                                      msssim);
+      }
+      return CompareInTiles<Image3F>(xsize, ysize, tile_size, rows, bg,
+                                     msssim);
+    }
+    if (tile_size == kBandAlign) break;
+  }
+  *over_budget = true;
+  return JXL_FAILURE("Not enough memory for %" PRIuS "x%" PRIuS " images",
+                     xsize, ysize);
+}
 
-    Multiply(img1, img2, &mul);
-    Image3F sigma12 = blur(mul);
+} // namespace
 
-    Image3F mu1 = blur(img1);
-    Image3F mu2 = blur(img2);
+jxl::Status ComputeSSIMULACRA2WithinBudget(const jxl::ImageBundle &orig,
+                                           const jxl::ImageBundle &dist,
+                                           float bg, size_t max_bytes,
+                                           Msssim *msssim, bool *over_budget) {
+  bool exceeded;
+  const RowsFunc rows = [&](size_t, size_t, const jxl::ImageBundle **rows1,
+                            const jxl::ImageBundle **rows2, size_t *rows_y0) {
+    *rows1 = &orig;
+    *rows2 = &dist;
+    *rows_y0 = 0;
+    return jxl::Status(true);
+  };
+  const size_t planes = orig.IsGray() && dist.IsGray() ? 1 : 3;
+  return ComputeWithinBudget(orig.xsize(), orig.ysize(), planes,
+                             /*input_planes=*/0, rows, bg, max_bytes, msssim,
+                             over_budget ? over_budget : &exceeded);
+}
 
-    MsssimScale sscale;
-    SSIMMap(mu1, mu2, sigma1_sq, sigma2_sq, sigma12, sscale.avg_ssim);
-    EdgeDiffMap(img1, mu1, img2, mu2, sscale.avg_edgediff);
-    msssim.scales.push_back(sscale);
+jxl::Status ComputeSSIMULACRA2WithinBudget(size_t xsize, size_t ysize,
+                                           const SSIMULACRA2DecodeFunc &decode,
+                                           size_t max_bytes, Msssim *msssim,
+                                           bool *over_budget) {
+  bool exceeded;
+  if (!over_budget) over_budget = &exceeded;
+  *over_budget = false;
+  jxl::CodecInOut io1, io2;
+  const RowsFunc rows = [&](size_t y0, size_t y1,
+                            const jxl::ImageBundle **orig,
+                            const jxl::ImageBundle **dist, size_t *rows_y0) {
+    JXL_RETURN_IF_ERROR(decode(y0, y1, &io1, &io2));
+    if (io1.xsize() != xsize || io1.ysize() != ysize ||
+        io2.xsize() != xsize || io2.ysize() != ysize ||
+        !jxl::SameSize(io1.Main(), io2.Main()) ||
+        io1.Main().xsize() != xsize) {
+      return JXL_FAILURE("Decoded images of the wrong size");
+    }
+    // Codecs that cannot decode only some rows decode all of them.
+    *rows_y0 = io1.Main().ysize() == ysize ? 0 : y0;
+    if (io1.Main().ysize() != ysize && io1.Main().ysize() != y1 - y0) {
+      return JXL_FAILURE("Decoded the wrong rows");
+    }
+    *orig = &io1.Main();
+    *dist = &io2.Main();
+    return jxl::Status(true);
+  };
+  // The first row tells whether the images are gray or have alpha.
+  const jxl::ImageBundle *orig, *dist;
+  size_t rows_y0;
+  JXL_RETURN_IF_ERROR(rows(0, 1, &orig, &dist, &rows_y0));
+  const size_t planes = orig->IsGray() && dist->IsGray() ? 1 : 3;
+  // Codecs that decode all rows for each strip need them all in memory
+  // anyway, which is set aside up front instead of failing after decoding.
+  size_t input_planes = 4;
+  if (orig->ysize() == ysize && ysize != 1) {
+    const size_t input_bytes = 2 * input_planes * PlaneBytes(xsize, ysize);
+    if (input_bytes > max_bytes) {
+      *over_budget = true;
+      return JXL_FAILURE("Not enough memory for %" PRIuS "x%" PRIuS
+                         " images that are decoded whole",
+                         xsize, ysize);
+    }
+    max_bytes -= input_bytes;
+    input_planes = 0;
   }
-  return msssim;
+  // Each background decodes the images again, instead of keeping the linear
+  // images of both.
+  const std::vector<float> backgrounds = SSIMULACRA2Backgrounds(*orig);
+  std::vector<Msssim> all(backgrounds.size());
+  for (size_t i = 0; i < backgrounds.size(); ++i) {
+    JXL_RETURN_IF_ERROR(ComputeWithinBudget(xsize, ysize, planes, input_planes,
+                                            rows, backgrounds[i], max_bytes,
+                                            &all[i], over_budget));
+  }
+  // As WorstOverBackgrounds, whose bundle was replaced by later rows.
+  *msssim = all[0];
+  for (const Msssim &current : all) {
+    if (current.Score() < msssim->Score()) *msssim = current;
+  }
+  return true;
+}
+
+Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
+                          const jxl::ImageBundle &dist, float bg) {
+  return ComputeSSIMULACRA2(orig, dist, jxl::Rect(orig), bg);
 }
 
 Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
                           const jxl::ImageBundle &distorted) {
   return ComputeSSIMULACRA2(orig, distorted, 0.5f);
 }
+
+std::vector<float> SSIMULACRA2Backgrounds(const jxl::ImageBundle &orig) {
+  // In case of alpha transparency: blend against dark and bright backgrounds.
+  return orig.HasAlpha() ? std::vector<float>{0.1f, 0.9f}
+                         : std::vector<float>{0.5f};
+}
+
+Msssim WorstOverBackgrounds(const jxl::ImageBundle &orig,
+                            const std::function<Msssim(float bg)> &compute,
+                            size_t *worst) {
+  const std::vector<float> backgrounds = SSIMULACRA2Backgrounds(orig);
+  Msssim msssim;
+  double score = 0.0;
+  for (size_t i = 0; i < backgrounds.size(); ++i) {
+    Msssim current = compute(backgrounds[i]);
+    const double current_score = current.Score();
+    if (i == 0 || current_score < score) {
+      msssim = std::move(current);
+      score = current_score;
+      if (worst) *worst = i;
+    }
+  }
+  return msssim;
+}
+
+SSIMULACRA2Scorer::SSIMULACRA2Scorer(const jxl::ImageBundle &orig,
+                                     const jxl::ImageBundle &distorted,
+                                     float bg, size_t tile_size) {
+  JXL_CHECK(tile_size != 0 && jxl::SameSize(orig, distorted));
+  const std::vector<ScaleGeometry> scales =
+      ScaleGeometries(jxl::Rect(orig), orig.xsize(), orig.ysize());
+  if (orig.IsGray() && distorted.IsGray()) {
+    impl_.reset(new IncrementalScales<jxl::ImageF>(orig, distorted, scales,
+                                                   tile_size, bg));
+  } else {
+    impl_.reset(new IncrementalScales<jxl::Image3F>(orig, distorted, scales,
+                                                    tile_size, bg));
+  }
+}
+
+SSIMULACRA2Scorer::~SSIMULACRA2Scorer() = default;
+
+void SSIMULACRA2Scorer::Update(const jxl::ImageBundle &distorted,
+                               const jxl::Rect &dirty) {
+  JXL_CHECK(dirty.IsInside(distorted));
+  if (dirty.xsize() == 0 || dirty.ysize() == 0) return;
+  impl_->Update(distorted, dirty);
+}
+
+Msssim SSIMULACRA2Scorer::Current() const { return TotalNorms(impl_->sums); }
+
+// State of SSIMULACRA2Reference, for color or gray originals.
+struct SSIMULACRA2Reference::Impl {
+  Impl(size_t xsize, size_t ysize, float bg)
+      : xsize(xsize), ysize(ysize), bg(bg),
+        scales(ScaleGeometries(jxl::Rect(0, 0, xsize, ysize), xsize, ysize)) {}
+  virtual ~Impl() = default;
+
+  virtual bool IsGray() const = 0;
+
+  // Returns the error sums of `dist`, which has the size of the original, as
+  // a single tile.
+  virtual TileSums Compare(const jxl::ImageBundle &dist) const = 0;
+
+  // Return all planes, in the order in which they are stored in files.
+  virtual std::vector<const ImageF *> Planes() const = 0;
+  virtual std::vector<ImageF *> MutablePlanes() = 0;
+
+  size_t xsize;
+  size_t ysize;
+  float bg;
+  std::vector<ScaleGeometry> scales;
+};
+
+namespace {
+
+/* Reference files (all numbers little-endian):
+   - "SSIM2REF", u32 version, u32 number of references, u64 key, 8 zero bytes
+   - for each reference: u64 xsize, u64 ysize, f32 bg, u32 1 if gray else 0,
+     u32 number of scales, 4 zero bytes
+   - for each reference, for each scale, the planes of the XYB image, of its
+     blurred values and of its blurred squares (only Y if gray), each as
+     rows of f32 starting at a multiple of kReferencePlaneAlign bytes, with
+     ReferenceRowSize bytes per row (zero-padded). */
+const char kReferenceMagic[8] = {'S', 'S', 'I', 'M', '2', 'R', 'E', 'F'};
+const uint32_t kReferenceVersion = 2;
+const size_t kReferenceHeaderSize = 32;
+const size_t kReferenceEntrySize = 32;
+const size_t kReferencePlaneAlign = 64;
+
+size_t AlignPlane(size_t pos) {
+  return (pos + kReferencePlaneAlign - 1) / kReferencePlaneAlign *
+         kReferencePlaneAlign;
+}
+
+// Rows are aligned and padded like those of planes for vectors of up to
+// kReferencePlaneAlign bytes, so that mapped files can be used in place.
+size_t ReferenceRowSize(size_t xsize) {
+  return AlignPlane(xsize * sizeof(float) + kReferencePlaneAlign -
+                    sizeof(float));
+}
+
+jxl::Status MapImage(const uint8_t *data, size_t xsize, size_t ysize,
+                     size_t *pos, ImageF *out) {
+  *pos = AlignPlane(*pos);
+  const size_t row_size = ReferenceRowSize(xsize);
+  JXL_RETURN_IF_ERROR(
+      ImageF::View(xsize, ysize, reinterpret_cast<const float *>(data + *pos),
+                   row_size, out));
+  *pos += row_size * ysize;
+  return true;
+}
+
+jxl::Status MapImage(const uint8_t *data, size_t xsize, size_t ysize,
+                     size_t *pos, Image3F *out) {
+  ImageF planes[3];
+  for (ImageF &plane : planes) {
+    JXL_RETURN_IF_ERROR(MapImage(data, xsize, ysize, pos, &plane));
+  }
+  *out = Image3F(std::move(planes[0]), std::move(planes[1]),
+                 std::move(planes[2]));
+  return true;
+}
+
+// Positive XYB of the original at all scales, and the blurred planes and
+// squared planes that the SSIM of any distorted image needs.
+template <class Image>
+class ReferenceScales : public SSIMULACRA2Reference::Impl {
+public:
+  ReferenceScales(size_t xsize, size_t ysize, float bg)
+      : Impl(xsize, ysize, bg) {}
+
+  // Allocates the planes, to be filled from a file.
+  void Allocate() {
+    for (const ScaleGeometry &g : scales) {
+      xyb_.emplace_back(g.xsize, g.ysize);
+      mu_.emplace_back(g.xsize, g.ysize);
+      sigma_sq_.emplace_back(g.xsize, g.ysize);
+    }
+  }
+
+  // Makes the planes views of those stored in `file` from `*pos` on, and
+  // advances `*pos` past them. Fails if they are not aligned for vectors.
+  jxl::Status Map(std::shared_ptr<const jxl::MappedFile> file, size_t *pos) {
+    for (const ScaleGeometry &g : scales) {
+      for (std::vector<Image> *images : {&xyb_, &mu_, &sigma_sq_}) {
+        images->emplace_back();
+        JXL_RETURN_IF_ERROR(MapImage(file->data(), g.xsize, g.ysize, pos,
+                                     &images->back()));
+      }
+    }
+    file_ = std::move(file);
+    return true;
+  }
+
+  // Computes the planes of `orig`, as ComputeScales does for the whole image.
+  void Compute(const jxl::ImageBundle &orig) {
+    if (scales.empty()) return;
+    Image linear;
+    xyb_.resize(1);
+    ToLinearAndPositiveXYB(orig, jxl::Rect(orig), bg, &linear, &xyb_[0]);
+    const float intensity_target = orig.metadata()->IntensityTarget();
+    ImageF mul(xsize, ysize);
+    Blur blur(xsize, ysize);
+    for (size_t scale = 0; scale < scales.size(); ++scale) {
+      const ScaleGeometry &g = scales[scale];
+      if (scale) {
+        Image next(g.xsize, g.ysize);
+        xyb_.emplace_back(g.xsize, g.ysize);
+        Downsample2x2AndPositiveXYB(linear, intensity_target, &next,
+                                    &xyb_[scale]);
+        linear = std::move(next);
+      }
+      mu_.emplace_back(g.xsize, g.ysize);
+      sigma_sq_.emplace_back(g.xsize, g.ysize);
+      mul.ShrinkTo(g.xsize, g.ysize);
+      blur.ShrinkTo(g.xsize, g.ysize);
+      for (size_t c = 0; c < NumPlanes(xyb_[scale]); ++c) {
+        const ImageF &plane = Plane(xyb_[scale], c);
+        Multiply(plane, plane, &mul);
+        blur(mul, &Plane(sigma_sq_[scale], c));
+        blur(plane, &Plane(mu_[scale], c));
+      }
+    }
+  }
+
+  bool IsGray() const override { return NumPlanes(Image()) == 1; }
+
+  TileSums Compare(const jxl::ImageBundle &dist) const override {
+    const TileGrid grid(0, xsize, ysize);
+    TileSums sums = ZeroTileSums(scales, grid);
+    if (scales.empty()) return sums;
+
+    // As in ComputeScales, but only for the distorted image.
+    Image linear, img;
+    ToLinearAndPositiveXYB(dist, jxl::Rect(dist), bg, &linear, &img);
+    const float intensity_target = dist.metadata()->IntensityTarget();
+    Image next(DivCeil2(img.xsize()), DivCeil2(img.ysize()));
+    PlaneScratch scratch(img.xsize(), img.ysize());
+    for (size_t scale = 0; scale < scales.size(); ++scale) {
+      if (scale) {
+        const ScaleGeometry &g = scales[scale];
+        next.ShrinkTo(g.xsize, g.ysize);
+        img.ShrinkTo(g.xsize, g.ysize);
+        Downsample2x2AndPositiveXYB(linear, intensity_target, &next, &img);
+        linear.Swap(next);
+      }
+      const Image &ref = xyb_[scale];
+      jxl::Rect input, eval;
+      if (!ComparedRects(ref, img, jxl::Rect(ref), &input, &eval)) continue;
+      scratch.ShrinkTo(input.xsize(), input.ysize());
+      for (size_t c = 0; c < NumPlanes(ref); ++c) {
+        ComparePlanes(Plane(ref, c), Plane(img, c), &Plane(mu_[scale], c),
+                      &Plane(sigma_sq_[scale], c), input, eval,
+                      Channel(ref, c), grid, scale, jxl::Rect(ref), &scratch,
+                      &sums[scale], /*maps=*/nullptr);
+      }
+    }
+    return sums;
+  }
+
+  std::vector<const ImageF *> Planes() const override {
+    return CollectPlanes<const ImageF>(*this);
+  }
+  std::vector<ImageF *> MutablePlanes() override {
+    return CollectPlanes<ImageF>(*this);
+  }
+
+private:
+  template <class P, class Self>
+  static std::vector<P *> CollectPlanes(Self &self) {
+    std::vector<P *> planes;
+    for (size_t scale = 0; scale < self.xyb_.size(); ++scale) {
+      for (auto *images : {&self.xyb_, &self.mu_, &self.sigma_sq_}) {
+        for (size_t c = 0; c < NumPlanes((*images)[scale]); ++c) {
+          planes.push_back(&Plane((*images)[scale], c));
+        }
+      }
+    }
+    return planes;
+  }
+
+  // Of the planes if they are views, which must not outlive it.
+  std::shared_ptr<const jxl::MappedFile> file_;
+  std::vector<Image> xyb_, mu_, sigma_sq_;
+};
+
+template <class Image>
+std::unique_ptr<SSIMULACRA2Reference::Impl>
+ComputeReference(const jxl::ImageBundle &orig, float bg) {
+  ReferenceScales<Image> *ref =
+      new ReferenceScales<Image>(orig.xsize(), orig.ysize(), bg);
+  std::unique_ptr<SSIMULACRA2Reference::Impl> impl(ref);
+  ref->Compute(orig);
+  return impl;
+}
+
+template <class Image>
+std::unique_ptr<SSIMULACRA2Reference::Impl>
+AllocateReference(size_t xsize, size_t ysize, float bg) {
+  ReferenceScales<Image> *ref = new ReferenceScales<Image>(xsize, ysize, bg);
+  std::unique_ptr<SSIMULACRA2Reference::Impl> impl(ref);
+  ref->Allocate();
+  return impl;
+}
+
+template <class Image>
+jxl::Status MapReference(size_t xsize, size_t ysize, float bg,
+                         std::shared_ptr<const jxl::MappedFile> file,
+                         size_t *pos,
+                         std::unique_ptr<SSIMULACRA2Reference::Impl> *impl) {
+  ReferenceScales<Image> *ref = new ReferenceScales<Image>(xsize, ysize, bg);
+  impl->reset(ref);
+  return ref->Map(std::move(file), pos);
+}
+
+jxl::Status WriteBytes(FILE *f, const void *bytes, size_t size, size_t *pos) {
+  if (size != 0 && fwrite(bytes, 1, size, f) != size) {
+    return JXL_FAILURE("Failed to write");
+  }
+  *pos += size;
+  return true;
+}
+
+jxl::Status
+WriteReferences(const std::vector<const SSIMULACRA2Reference::Impl *> &refs,
+                uint64_t key, FILE *f) {
+  std::vector<uint8_t> header(
+      kReferenceHeaderSize + refs.size() * kReferenceEntrySize, 0);
+  memcpy(header.data(), kReferenceMagic, sizeof(kReferenceMagic));
+  StoreLE32(kReferenceVersion, &header[8]);
+  StoreLE32(refs.size(), &header[12]);
+  StoreLE64(key, &header[16]);
+  for (size_t i = 0; i < refs.size(); ++i) {
+    uint8_t *entry = &header[kReferenceHeaderSize + i * kReferenceEntrySize];
+    uint32_t bg_bits;
+    memcpy(&bg_bits, &refs[i]->bg, sizeof(bg_bits));
+    StoreLE64(refs[i]->xsize, entry);
+    StoreLE64(refs[i]->ysize, entry + 8);
+    StoreLE32(bg_bits, entry + 16);
+    StoreLE32(refs[i]->IsGray(), entry + 20);
+    StoreLE32(refs[i]->scales.size(), entry + 24);
+  }
+  size_t pos = 0;
+  JXL_RETURN_IF_ERROR(WriteBytes(f, header.data(), header.size(), &pos));
+  const uint8_t zeros[kReferencePlaneAlign] = {};
+  std::vector<uint8_t> row;
+  for (const SSIMULACRA2Reference::Impl *ref : refs) {
+    for (const ImageF *plane : ref->Planes()) {
+      JXL_RETURN_IF_ERROR(WriteBytes(f, zeros, AlignPlane(pos) - pos, &pos));
+      // Only the pixels are overwritten, the padding stays zero.
+      row.assign(ReferenceRowSize(plane->xsize()), 0);
+      for (size_t y = 0; y < plane->ysize(); ++y) {
+        const float *JXL_RESTRICT in = plane->ConstRow(y);
+        if (JXL_BYTE_ORDER_LITTLE) {
+          memcpy(row.data(), in, plane->xsize() * sizeof(float));
+        } else {
+          for (size_t x = 0; x < plane->xsize(); ++x) {
+            uint32_t bits;
+            memcpy(&bits, &in[x], sizeof(bits));
+            StoreLE32(bits, &row[x * sizeof(float)]);
+          }
+        }
+        JXL_RETURN_IF_ERROR(WriteBytes(f, row.data(), row.size(), &pos));
+      }
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+SSIMULACRA2Reference::SSIMULACRA2Reference(const jxl::ImageBundle &orig,
+                                           float bg)
+    : impl_(orig.IsGray() ? ComputeReference<jxl::ImageF>(orig, bg)
+                          : ComputeReference<jxl::Image3F>(orig, bg)) {}
+
+SSIMULACRA2Reference::SSIMULACRA2Reference(std::unique_ptr<Impl> impl)
+    : impl_(std::move(impl)) {}
+
+SSIMULACRA2Reference::SSIMULACRA2Reference(SSIMULACRA2Reference &&other) =
+    default;
+SSIMULACRA2Reference &
+SSIMULACRA2Reference::operator=(SSIMULACRA2Reference &&other) = default;
+SSIMULACRA2Reference::~SSIMULACRA2Reference() = default;
+
+size_t SSIMULACRA2Reference::xsize() const { return impl_->xsize; }
+size_t SSIMULACRA2Reference::ysize() const { return impl_->ysize; }
+float SSIMULACRA2Reference::bg() const { return impl_->bg; }
+
+jxl::Status SSIMULACRA2Reference::Compare(const jxl::ImageBundle &distorted,
+                                          Msssim *msssim) const {
+  if (distorted.xsize() != impl_->xsize || distorted.ysize() != impl_->ysize) {
+    return JXL_FAILURE("Image size mismatch");
+  }
+  if (impl_->IsGray() && !distorted.IsGray()) {
+    return JXL_FAILURE("Reference of a gray image for a color image");
+  }
+  *msssim = TotalNorms(impl_->Compare(distorted));
+  return true;
+}
+
+jxl::Status
+SSIMULACRA2Reference::WriteFile(const std::vector<SSIMULACRA2Reference> &refs,
+                                uint64_t key, const std::string &pathname) {
+  std::vector<const Impl *> impls;
+  for (const SSIMULACRA2Reference &ref : refs) impls.push_back(ref.impl_.get());
+  const std::string temp_pathname =
+      pathname + ".tmp" + std::to_string(std::random_device()());
+  jxl::Status ok = true;
+  {
+    jxl::FileWrapper f(temp_pathname, "wb");
+    if (f == nullptr) {
+      return JXL_FAILURE("Failed to open %s for writing",
+                         temp_pathname.c_str());
+    }
+    ok = WriteReferences(impls, key, f);
+  }
+  if (ok && rename(temp_pathname.c_str(), pathname.c_str()) != 0) {
+    ok = JXL_FAILURE("Failed to rename %s", temp_pathname.c_str());
+  }
+  if (!ok) remove(temp_pathname.c_str());
+  return ok;
+}
+
+jxl::Status SSIMULACRA2Reference::LoadFile(
+    const std::string &pathname, uint64_t *key,
+    std::vector<SSIMULACRA2Reference> *refs) {
+  jxl::FileWrapper f(pathname, "rb");
+  if (f == nullptr) {
+    return JXL_FAILURE("Failed to open %s for reading", pathname.c_str());
+  }
+  if (f.size() < 0) {
+    return JXL_FAILURE("Not a regular file: %s", pathname.c_str());
+  }
+  const size_t size = static_cast<size_t>(f.size());
+  uint8_t header[kReferenceHeaderSize];
+  if (size < kReferenceHeaderSize ||
+      fread(header, 1, kReferenceHeaderSize, f) != kReferenceHeaderSize ||
+      memcmp(header, kReferenceMagic, sizeof(kReferenceMagic)) != 0) {
+    return JXL_FAILURE("Not a SSIMULACRA 2 reference file");
+  }
+  if (LoadLE32(header + 8) != kReferenceVersion) {
+    return JXL_FAILURE("Unsupported reference file version");
+  }
+  const size_t num_refs = LoadLE32(header + 12);
+  *key = LoadLE64(header + 16);
+  if (num_refs > (size - kReferenceHeaderSize) / kReferenceEntrySize) {
+    return JXL_FAILURE("Truncated reference file");
+  }
+  std::vector<uint8_t> entries(num_refs * kReferenceEntrySize);
+  if (fread(entries.data(), 1, entries.size(), f) != entries.size()) {
+    return JXL_FAILURE("Truncated reference file");
+  }
+
+  // The size of the file that the entries describe, checked before anything
+  // is mapped or allocated.
+  size_t pos = kReferenceHeaderSize + entries.size();
+  for (size_t i = 0; i < num_refs; ++i) {
+    const uint8_t *entry = &entries[i * kReferenceEntrySize];
+    const uint64_t xsize = LoadLE64(entry);
+    const uint64_t ysize = LoadLE64(entry + 8);
+    // Each plane is at most full-size, which fits in the file.
+    if (xsize == 0 || ysize == 0 || xsize > size / sizeof(float) / ysize) {
+      return JXL_FAILURE("Invalid reference file");
+    }
+    const std::vector<ScaleGeometry> scales =
+        ScaleGeometries(jxl::Rect(0, 0, xsize, ysize), xsize, ysize);
+    if (scales.size() != LoadLE32(entry + 24)) {
+      return JXL_FAILURE("Invalid reference file");
+    }
+    // XYB, blurred and blurred squares, of each channel.
+    const size_t num_planes = LoadLE32(entry + 20) != 0 ? 3 : 3 * 3;
+    for (const ScaleGeometry &g : scales) {
+      const size_t row_size = ReferenceRowSize(g.xsize);
+      for (size_t p = 0; p < num_planes; ++p) {
+        pos = AlignPlane(pos);
+        if (pos > size || (size - pos) / row_size < g.ysize) {
+          return JXL_FAILURE("Truncated reference file");
+        }
+        pos += row_size * g.ysize;
+      }
+    }
+  }
+  if (pos != size) return JXL_FAILURE("Trailing data in reference file");
+
+  const auto entry_bg = [&](size_t i) {
+    const uint32_t bg_bits = LoadLE32(&entries[i * kReferenceEntrySize + 16]);
+    float bg;
+    memcpy(&bg, &bg_bits, sizeof(bg));
+    return bg;
+  };
+
+  // Where possible, the planes are used in place in the mapped file: only the
+  // pages that are compared are read, and they are shared with other
+  // processes that load the same file.
+  if (JXL_BYTE_ORDER_LITTLE) {
+    std::shared_ptr<jxl::MappedFile> file = std::make_shared<jxl::MappedFile>();
+    bool mapped = file->Map(pathname) && file->size() == size;
+    std::vector<SSIMULACRA2Reference> views;
+    pos = kReferenceHeaderSize + entries.size();
+    for (size_t i = 0; mapped && i < num_refs; ++i) {
+      const uint8_t *entry = &entries[i * kReferenceEntrySize];
+      std::unique_ptr<Impl> impl;
+      mapped = LoadLE32(entry + 20) != 0
+                   ? MapReference<jxl::ImageF>(LoadLE64(entry),
+                                               LoadLE64(entry + 8),
+                                               entry_bg(i), file, &pos, &impl)
+                   : MapReference<jxl::Image3F>(LoadLE64(entry),
+                                                LoadLE64(entry + 8),
+                                                entry_bg(i), file, &pos, &impl);
+      views.push_back(SSIMULACRA2Reference(std::move(impl)));
+    }
+    if (mapped) {
+      *refs = std::move(views);
+      return true;
+    }
+  }
+
+  // Otherwise the rows are read into allocated planes.
+  refs->clear();
+  pos = kReferenceHeaderSize + entries.size();
+  uint8_t padding[kReferencePlaneAlign];
+  std::vector<uint8_t> row;
+  for (size_t i = 0; i < num_refs; ++i) {
+    const uint8_t *entry = &entries[i * kReferenceEntrySize];
+    std::unique_ptr<Impl> impl =
+        LoadLE32(entry + 20) != 0
+            ? AllocateReference<jxl::ImageF>(LoadLE64(entry),
+                                             LoadLE64(entry + 8), entry_bg(i))
+            : AllocateReference<jxl::Image3F>(
+                  LoadLE64(entry), LoadLE64(entry + 8), entry_bg(i));
+    for (ImageF *plane : impl->MutablePlanes()) {
+      const size_t skip = AlignPlane(pos) - pos;
+      if (fread(padding, 1, skip, f) != skip) {
+        return JXL_FAILURE("Failed to read %s", pathname.c_str());
+      }
+      row.resize(ReferenceRowSize(plane->xsize()));
+      for (size_t y = 0; y < plane->ysize(); ++y) {
+        if (fread(row.data(), 1, row.size(), f) != row.size()) {
+          return JXL_FAILURE("Failed to read %s", pathname.c_str());
+        }
+        float *JXL_RESTRICT out = plane->Row(y);
+        if (JXL_BYTE_ORDER_LITTLE) {
+          memcpy(out, row.data(), plane->xsize() * sizeof(float));
+          continue;
+        }
+        for (size_t x = 0; x < plane->xsize(); ++x) {
+          const uint32_t bits = LoadLE32(&row[x * sizeof(float)]);
+          memcpy(&out[x], &bits, sizeof(bits));
+        }
+      }
+      pos = AlignPlane(pos) + row.size() * plane->ysize();
+    }
+    refs->push_back(SSIMULACRA2Reference(std::move(impl)));
+  }
+  return true;
+}
+
+namespace ssimulacra2_stages {
+
+void ToLinearAndPositiveXYB(const jxl::ImageBundle &in, float bg,
+                            Image3F *linear, Image3F *xyb) {
+  ::ToLinearAndPositiveXYB(in, jxl::Rect(in), bg, linear, xyb);
+}
+
+void ToLinearAndPositiveXYB(const jxl::ImageBundle &in, float bg,
+                            ImageF *linear, ImageF *y) {
+  ::ToLinearAndPositiveXYB(in, jxl::Rect(in), bg, linear, y);
+}
+
+void PositiveXYBFromLinear(const Image3F &linear, float intensity_target,
+                           Image3F *xyb) {
+  jxl::PositiveXYBFromLinear(linear, intensity_target, xyb);
+}
+
+void PositiveXYBFromLinear(const ImageF &linear, float intensity_target,
+                           ImageF *y) {
+  jxl::PositiveYFromLinear(linear, intensity_target, y);
+}
+
+void Downsample2x2AndPositiveXYB(const Image3F &in, float intensity_target,
+                                 Image3F *out, Image3F *xyb) {
+  ::Downsample2x2AndPositiveXYB(in, intensity_target, out, xyb);
+}
+
+void Downsample2x2AndPositiveXYB(const ImageF &in, float intensity_target,
+                                 ImageF *out, ImageF *y) {
+  ::Downsample2x2AndPositiveXYB(in, intensity_target, out, y);
+}
+
+void DemoteToF16(const ImageF &in, jxl::Plane<hwy::float16_t> *out) {
+  jxl::DemoteToF16(in, out);
+}
+
+void TruncatedGaussianBlur(const ImageF &in, ImageF *temp, ImageF *out) {
+  jxl::TruncatedGaussianBlur(in, temp, out);
+}
+
+void Multiply(const ImageF &a, const ImageF &b, ImageF *mul) {
+  ::Multiply(a, b, mul);
+}
+
+void SSIMMap(const ImageF &m1, const ImageF &m2, const ImageF &s11,
+             const ImageF &s22, const ImageF &s12, double sums[2]) {
+  ::SSIMMap</*kWriteMaps=*/false>(m1, m2, s11, s22, s12, jxl::Rect(m1), sums,
+                                  nullptr, jxl::Rect(m1));
+}
+
+void EdgeDiffMap(const ImageF &img1, const ImageF &mu1, const ImageF &img2,
+                 const ImageF &mu2, double sums[4]) {
+  ::EdgeDiffMap</*kWriteMaps=*/false>(img1, mu1, img2, mu2, jxl::Rect(img1),
+                                      sums, nullptr, nullptr, jxl::Rect(img1));
+}
+
+} // namespace ssimulacra2_stages
+#endif  // HWY_ONCE
@@ -6,8 +6,14 @@
 #ifndef TOOLS_SSIMULACRA2_H_
 #define TOOLS_SSIMULACRA2_H_
 
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "lib/jxl/codec_in_out.h"
 #include "lib/jxl/image_bundle.h"
 
 struct MsssimScale {
@@ -15,12 +21,29 @@ struct MsssimScale {
   double avg_edgediff[3 * 4];
 };
 
+// Number of norms that the score is computed from: for 6 scales, 3 planes
+// and 3 error maps, the 1-norm and the 4-norm.
+static const size_t kSSIMULACRA2NumFeatures = 6 * 3 * 3 * 2;
+
 struct Msssim {
   std::vector<MsssimScale> scales;
 
   double Score() const;
+
+  // Returns the kSSIMULACRA2NumFeatures norms in the order of the weights:
+  // for X, Y and B, for each scale, for the 1-norm and 4-norm, the norms of
+  // the SSIM', ringing and blurring maps. Images with fewer than 6 scales
+  // have zeros at the end.
+  std::vector<double> Features() const;
 };
 
+// Returns the score computed from 'features' as returned by
+// Msssim::Features, with the given kSSIMULACRA2NumFeatures 'weights'.
+double ScoreFromFeatures(const double *features, const double *weights);
+
+// Returns the kSSIMULACRA2NumFeatures weights that Msssim::Score uses.
+const double *SSIMULACRA2Weights();
+
 // Computes the SSIMULACRA 2 score between reference image 'orig' and
 // distorted image 'distorted'. In case of alpha transparency, assume
 // a gray background if intensity 'bg' (in range 0..1).
@@ -29,4 +52,300 @@ Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
 Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
                           const jxl::ImageBundle &distorted);
 
+// Returns the backgrounds that the score of 'orig' is the worst of: a gray
+// one if it is opaque, a dark and a bright one if it has alpha.
+std::vector<float> SSIMULACRA2Backgrounds(const jxl::ImageBundle &orig);
+
+// Returns what 'compute' returns for the background of SSIMULACRA2Backgrounds
+// with the worst score (the first of equal ones), and sets 'worst' to its
+// index unless it is null.
+Msssim WorstOverBackgrounds(const jxl::ImageBundle &orig,
+                            const std::function<Msssim(float bg)> &compute,
+                            size_t *worst = nullptr);
+
+// Computes the score of the region 'roi' (non-empty, within the images):
+// only errors within it count, but the pixels around it are taken into
+// account as when scoring the whole images. Only the part of the images
+// returned by SSIMULACRA2InputRect is read.
+Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
+                          const jxl::ImageBundle &distorted,
+                          const jxl::Rect &roi, float bg);
+
+// Also writes the score of each tile_size x tile_size tile of the images to
+// 'tile_scores', one pixel per tile; the tiles in the last row and column may
+// be smaller. If tile_size is a multiple of 32, each is the score of its tile
+// as region of interest, up to rounding in the blurs. Otherwise the pixels of
+// the coarser scales count for the tile of their top-left full-resolution
+// pixel.
+Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
+                          const jxl::ImageBundle &distorted, float bg,
+                          size_t tile_size, jxl::ImageD *tile_scores);
+
+// Per-pixel error maps, optionally written while computing the score.
+struct SSIMULACRA2Maps {
+  // For each scale, the SSIM', ringing and blurring error of each pixel of
+  // the X, Y and B planes, at the resolution of that scale. Gray images only
+  // have errors in Y.
+  std::vector<jxl::Image3F> ssim;
+  std::vector<jxl::Image3F> ringing;
+  std::vector<jxl::Image3F> blurring;
+
+  // Returns a full-resolution map of the errors of all scales and planes,
+  // each weighted with the sum of the weights of its two norms in the score.
+  jxl::ImageF Weighted() const;
+};
+
+// Also writes the error maps to 'maps' unless it is null.
+Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
+                          const jxl::ImageBundle &distorted, float bg,
+                          SSIMULACRA2Maps *maps);
+
+// Time spent in the stages of the computation, in seconds of a monotonic
+// clock, to find out which of them dominate, and the memory it allocates.
+struct SSIMULACRA2Stats {
+  struct Scale {
+    // Pixels of each plane that were compared, including the border needed by
+    // the blurs; zero if the images are identical at this scale.
+    size_t num_pixels = 0;
+    // Conversion of both images to positive XYB: at the first scale, blending
+    // and linearization (but not TransformTo), at the others, downsampling.
+    double xyb = 0;
+    double multiply = 0;
+    double blur = 0;
+    double ssim_map = 0;
+    double edge_diff_map = 0;
+  };
+
+  // Decoding both images; only set by callers that decode them.
+  double decode = 0;
+  // TransformTo of images that are neither sRGB nor linear sRGB.
+  double transform = 0;
+  // All of ComputeSSIMULACRA2, including the stages of all scales.
+  double total = 0;
+  std::vector<Scale> scales;
+
+  // Allocations and frees through jxl::CacheAligned, which holds all image
+  // planes, by the calling thread during ComputeSSIMULACRA2; those of other
+  // threads at the same time are not counted.
+  uint64_t num_allocations = 0;
+  uint64_t num_frees = 0;
+  // Bytes in use by the whole process before, and at most during,
+  // ComputeSSIMULACRA2, the latter counting only the calling thread's
+  // allocations during it.
+  uint64_t bytes_in_use = 0;
+  uint64_t peak_bytes_in_use = 0;
+};
+
+// Ways to trade the accuracy of the score for memory or speed. The defaults
+// compute the exact score.
+struct SSIMULACRA2Options {
+  // Keeps the linear sRGB images from which each scale is downsampled as half
+  // floats, rounded to nearest (ties to even) on every target; all arithmetic
+  // stays in float, and the first scale is converted to XYB before rounding.
+  // This saves 18% of the memory for color images and 11% for gray ones. On
+  // the 104 pairs of ssimulacra2_corpus (scores -25 to 97), the score
+  // deviated by 0.02 on average and by at most 0.14. The blurred planes stay
+  // float: their differences (e.g. sigma^2 = blur(x^2) - mu^2) would lose
+  // most of the 11 bits of precision of half floats.
+  bool f16_pyramid = false;
+
+  // Approximates the score faster, e.g. to pre-filter candidate encodings:
+  // skips the planes of scales whose weights are all below 0.01 (0.008 of the
+  // total of 888, X and B of the first scale among them, hence only Y is
+  // converted there), blurs with a 9-tap FIR instead of the recursive
+  // Gaussian and the sum of both squares at once (4 blurs instead of 5), and
+  // approximates sRGB with a quartic and the cube roots of XYB with one
+  // Newton iteration fewer. On the pairs of ssimulacra2_corpus, the score
+  // deviated by 0.22 on average, by at most 2.6 (on a blur scoring 97) and by
+  // at most 0.85 for scores below 95, mostly upwards. On 3000x2000 color
+  // images, it takes about a third of the time: 2.6x to 3.1x faster over
+  // repeated runs, measured only with a scalar (non-SIMD) build.
+  bool fast = false;
+};
+
+// Same as ComputeSSIMULACRA2 with 'bg', with 'options' (SSIMULACRA2Options()
+// for the exact score). Unless 'stats' is null, also adds the time spent in
+// each stage and the allocations to it, which may hold the stats of earlier
+// calls (e.g. for another background); the peak is the maximum of all calls.
+Msssim ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
+                          const jxl::ImageBundle &distorted, float bg,
+                          const SSIMULACRA2Options &options,
+                          SSIMULACRA2Stats *stats = nullptr);
+
+// Same as ComputeSSIMULACRA2 with 'bg', but allocates at most 'max_bytes' in
+// addition to the images themselves. If comparing the whole images needs more,
+// each scale is compared in strips of rows plus the few rows that the blurs
+// see, whose state carries over from strip to strip, so that the norms match
+// up to the order of the sums. Strips keep the linear images of the second
+// and third scale whole (7.5 bytes per pixel of color images), hence below
+// that budget, square tiles of the images plus their halo are compared one at
+// a time, whose norms match up to the rounding of the blurs, as for bands.
+// Fails if even the smallest tiles do not fit, and then sets '*over_budget'
+// unless it is null, which tells that from other failures.
+jxl::Status ComputeSSIMULACRA2WithinBudget(const jxl::ImageBundle &orig,
+                                           const jxl::ImageBundle &distorted,
+                                           float bg, size_t max_bytes,
+                                           Msssim *msssim,
+                                           bool *over_budget = nullptr);
+
+// Decodes rows [y0, y1) of the original and distorted images into 'orig' and
+// 'distorted', e.g. with jxl::SetStripFromBytes, whose images then hold only
+// those rows, or all rows if the codec cannot decode fewer.
+typedef std::function<jxl::Status(size_t y0, size_t y1, jxl::CodecInOut *orig,
+                                  jxl::CodecInOut *distorted)>
+    SSIMULACRA2DecodeFunc;
+
+// Same as above for 'xsize' x 'ysize' images, worst over the backgrounds of
+// the original, but the images are decoded by 'decode' for one strip of rows
+// of the first scale at a time, and 'max_bytes' also covers the decoded rows
+// (not the encoded images, nor the buffers of the codecs). Codecs decode from
+// the first row for each strip (or tile row), hence this takes longer the
+// more strips there are. If the first rows decode to whole images, the codec
+// cannot decode fewer rows, and all of them count against 'max_bytes', which
+// fails up front if they exceed it.
+jxl::Status ComputeSSIMULACRA2WithinBudget(size_t xsize, size_t ysize,
+                                           const SSIMULACRA2DecodeFunc &decode,
+                                           size_t max_bytes, Msssim *msssim,
+                                           bool *over_budget = nullptr);
+
+// Returns the part of 'xsize' x 'ysize' images that the score of 'roi' depends
+// on: 'roi' plus the halo needed by the blurs and downsampling. Sizes that are
+// too large (e.g. SIZE_MAX if not known yet) give a superset.
+jxl::Rect SSIMULACRA2InputRect(const jxl::Rect &roi, size_t xsize,
+                               size_t ysize);
+
+// Error sums of a band of rows of the images. Sums of bands that cover the
+// images exactly once add up to nearly those of the whole images (see
+// MergeSSIMULACRA2BandSums for how nearly), hence the bands can be scored
+// separately (e.g. on different machines) and merged afterwards.
+struct SSIMULACRA2BandSums {
+  struct Scale {
+    // Rows [y0, y1) of this scale.
+    size_t y0;
+    size_t y1;
+    size_t num_pixels;
+    // Sums of the error maps and of their 4th powers, laid out like
+    // MsssimScale.
+    double ssim[3 * 2];
+    double edgediff[3 * 4];
+  };
+
+  // Of the whole images.
+  size_t xsize;
+  size_t ysize;
+  // Background intensity for alpha blending.
+  float bg;
+  std::vector<Scale> scales;
+
+  // Returns a single line of text (without newline) that Parse reads back
+  // exactly.
+  std::string Serialize() const;
+  static jxl::Status Parse(const std::string &line, SSIMULACRA2BandSums *sums);
+};
+
+// Returns band 'band' out of 'num_bands' bands of rows of about equal height
+// of 'xsize' x 'ysize' images. Their boundaries are multiples of 32, so that
+// they also split the rows of all coarser scales; some bands are empty if the
+// images have fewer than 32 * num_bands rows.
+jxl::Rect SSIMULACRA2Band(size_t band, size_t num_bands, size_t xsize,
+                          size_t ysize);
+
+// Computes the error sums of 'band' as returned by SSIMULACRA2Band, with 'bg'
+// as for ComputeSSIMULACRA2. Only the part of the images returned by
+// SSIMULACRA2InputRect for 'band' is read. Fails unless the images are of the
+// same size and 'band' is full rows whose boundaries are multiples of 32 (or
+// the bottom of the images).
+jxl::Status ComputeSSIMULACRA2BandSums(const jxl::ImageBundle &orig,
+                                       const jxl::ImageBundle &distorted,
+                                       const jxl::Rect &band, float bg,
+                                       SSIMULACRA2BandSums *sums);
+
+// Adds up the sums of bands (in any order, with the same result for all
+// orders) and computes the norms. Fails unless the bands are of the same
+// images and background and cover them exactly once.
+// The norms are close to those of ComputeSSIMULACRA2, but not equal: like a
+// region of interest, each band is blurred from its own input rect, and the
+// rounding errors of the scans of the recursive Gaussian depend on all rows
+// they went through, not only on those within the blur radius. Matching them
+// exactly would take scanning all rows above each band. This changes the
+// norms by about 1e-5 and the score by about 1e-3.
+jxl::Status MergeSSIMULACRA2BandSums(
+    const std::vector<SSIMULACRA2BandSums> &bands, Msssim *msssim);
+
+// Scores successive versions of a distorted image against the same original,
+// e.g. while an encoder refines some blocks. Keeps the images at all scales
+// and the error sums of tile_size x tile_size tiles, so that after a local
+// change only the tiles within the blur radius of the changed pixels are
+// recomputed at each scale.
+class SSIMULACRA2Scorer {
+public:
+  // Scores 'distorted' against 'orig', with 'bg' as for ComputeSSIMULACRA2.
+  SSIMULACRA2Scorer(const jxl::ImageBundle &orig,
+                    const jxl::ImageBundle &distorted, float bg,
+                    size_t tile_size = 64);
+  ~SSIMULACRA2Scorer();
+
+  // Replaces the distorted image with 'distorted', which has the same size
+  // and kind (gray or color, alpha) and differs from the previous one only
+  // within 'dirty'.
+  void Update(const jxl::ImageBundle &distorted, const jxl::Rect &dirty);
+
+  // Returns the norms for the current distorted image, which match those of
+  // ComputeSSIMULACRA2 up to rounding in the blurs.
+  Msssim Current() const;
+
+  struct Impl;
+
+private:
+  std::unique_ptr<Impl> impl_;
+};
+
+// Precomputed data of an original image for one background: its positive XYB
+// planes and their blurred values and squares at all scales. Comparing
+// distorted images against it skips decoding and preprocessing the original.
+// It can be stored in a file, e.g. to reuse it in later jobs.
+class SSIMULACRA2Reference {
+public:
+  // Precomputes the data of 'orig', with 'bg' as for ComputeSSIMULACRA2.
+  SSIMULACRA2Reference(const jxl::ImageBundle &orig, float bg);
+  SSIMULACRA2Reference(SSIMULACRA2Reference &&other);
+  SSIMULACRA2Reference &operator=(SSIMULACRA2Reference &&other);
+  ~SSIMULACRA2Reference();
+
+  size_t xsize() const;
+  size_t ysize() const;
+  float bg() const;
+
+  // Computes the norms of 'distorted' against the original, which match
+  // those of ComputeSSIMULACRA2 up to rounding in the blurs. Fails if the
+  // sizes differ, or if the original is gray and 'distorted' is not.
+  jxl::Status Compare(const jxl::ImageBundle &distorted, Msssim *msssim) const;
+
+  // Writes 'refs' (e.g. for several backgrounds) to a file along with 'key',
+  // which identifies the original (e.g. a hash of its encoded bytes). The file
+  // is written under a temporary name and then renamed, so that concurrent
+  // readers never see a partial file.
+  static jxl::Status WriteFile(const std::vector<SSIMULACRA2Reference> &refs,
+                               uint64_t key, const std::string &pathname);
+
+  // Reads a file written by WriteFile. The planes are stored as f32, hence
+  // files take about 48 bytes per pixel of the original (16 if gray) per
+  // background; their total size is checked first. Where supported (on
+  // little-endian POSIX systems), the file is memory-mapped and the planes
+  // are used in place: only the pages that Compare reads are loaded, they are
+  // shared with other processes that load the same file, and they are not
+  // allocated. The file must then not be modified in place while the
+  // references exist (WriteFile replaces files by renaming). Otherwise the
+  // planes are allocated and read.
+  static jxl::Status LoadFile(const std::string &pathname, uint64_t *key,
+                              std::vector<SSIMULACRA2Reference> *refs);
+
+  struct Impl;
+
+private:
+  explicit SSIMULACRA2Reference(std::unique_ptr<Impl> impl);
+
+  std::unique_ptr<Impl> impl_;
+};
+
 #endif  // TOOLS_SSIMULACRA2_H_
@@ -5,25 +5,59 @@
 
 #include "ssimulacra2_c_api.h"
 #include "ssimulacra2.h"
+#include "ssimulacra2_cache.h"
 
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
+#include <vector>
 #include <iomanip>
 
 #include "lib/extras/codec.h"
+#include "lib/extras/time.h"
+#include "lib/jxl/base/cache_aligned.h"
+#include "lib/jxl/base/file_io.h"
+#include "lib/jxl/base/hash.h"
 #include "lib/jxl/color_management.h"
 #include "lib/jxl/enc_color_management.h"
+#include "lib/jxl/memory_manager_internal.h"
+
+static_assert(SSIMULACRA2_NUM_FEATURES == kSSIMULACRA2NumFeatures,
+              "Feature count of the C API does not match the library");
+
+struct ssimulacra2_context {
+    // With the default functions if none were given.
+    JxlMemoryManager memory_manager;
+    // Whether the image memory comes from memory_manager.
+    bool custom_memory_manager;
+    bool huge_pages;
+    // -1 if not pinned.
+    int numa_node;
+    SSIMULACRA2Options options;
+};
 
 namespace {
 
-ssimulacra2_result LoadImageFromFile(const char* path, jxl::CodecInOut* io) {
+// Only rows [y0, y1) are needed; the others may be left undecoded.
+ssimulacra2_result LoadImageFromFile(const char* path, jxl::CodecInOut* io,
+                                     size_t y0 = 0, size_t y1 = SIZE_MAX) {
     if (!path || !io) {
         return SSIMULACRA2_ERROR_INVALID_INPUT;
     }
 
-    if (!SetFromFile(path, jxl::extras::ColorHints(), io)) {
+    if (!SetRowsFromFile(path, jxl::extras::ColorHints(), y0, y1, io)) {
         return SSIMULACRA2_ERROR_FILE_NOT_FOUND;
     }
 
@@ -34,7 +68,8 @@ ssimulacra2_result LoadImageFromFile(const char* path, jxl::CodecInOut* io) {
     return SSIMULACRA2_OK;
 }
 
-ssimulacra2_result LoadImageFromMemory(const uint8_t* data, size_t size, jxl::CodecInOut* io) {
+ssimulacra2_result LoadImageFromMemory(const uint8_t* data, size_t size, jxl::CodecInOut* io,
+                                       size_t y0 = 0, size_t y1 = SIZE_MAX) {
     if (!data || size == 0 || !io) {
         return SSIMULACRA2_ERROR_INVALID_INPUT;
     }
@@ -45,7 +80,7 @@ ssimulacra2_result LoadImageFromMemory(const uint8_t* data, size_t size, jxl::Co
 
     try {
         jxl::Span<const uint8_t> span(data, size);
-        if (!SetFromBytes(span, jxl::extras::ColorHints(), io)) {
+        if (!SetRowsFromBytes(span, jxl::extras::ColorHints(), y0, y1, io)) {
             return SSIMULACRA2_ERROR_DECODE_FAILED;
         }
 
@@ -62,19 +97,301 @@ ssimulacra2_result LoadImageFromMemory(const uint8_t* data, size_t size, jxl::Co
     }
 }
 
-double ComputeScore(const jxl::CodecInOut& io1, const jxl::CodecInOut& io2, float bg_intensity) {
-    if (!io1.Main().HasAlpha()) {
-        Msssim msssim = ComputeSSIMULACRA2(io1.Main(), io2.Main());
-        return msssim.Score();
-    } else {
-        // For alpha transparency: blend against dark and bright backgrounds
-        // and return the worst of both scores
-        Msssim msssim0 = ComputeSSIMULACRA2(io1.Main(), io2.Main(), 0.1f);
-        Msssim msssim1 = ComputeSSIMULACRA2(io1.Main(), io2.Main(), 0.9f);
-        return std::min(msssim0.Score(), msssim1.Score());
+// Decodes both images as above and checks that they have the same size.
+ssimulacra2_result LoadPair(const char* original_path, const char* distorted_path,
+                            jxl::CodecInOut* io1, jxl::CodecInOut* io2,
+                            size_t y0 = 0, size_t y1 = SIZE_MAX) {
+    ssimulacra2_result load_result = LoadImageFromFile(original_path, io1, y0, y1);
+    if (load_result != SSIMULACRA2_OK) return load_result;
+    load_result = LoadImageFromFile(distorted_path, io2, y0, y1);
+    if (load_result != SSIMULACRA2_OK) return load_result;
+    if (io1->xsize() != io2->xsize() || io1->ysize() != io2->ysize()) {
+        return SSIMULACRA2_ERROR_SIZE_MISMATCH;
+    }
+    return SSIMULACRA2_OK;
+}
+
+ssimulacra2_result LoadPair(const uint8_t* original_data, size_t original_size,
+                            const uint8_t* distorted_data, size_t distorted_size,
+                            jxl::CodecInOut* io1, jxl::CodecInOut* io2,
+                            size_t y0 = 0, size_t y1 = SIZE_MAX) {
+    ssimulacra2_result load_result = LoadImageFromMemory(original_data, original_size, io1, y0, y1);
+    if (load_result != SSIMULACRA2_OK) return load_result;
+    load_result = LoadImageFromMemory(distorted_data, distorted_size, io2, y0, y1);
+    if (load_result != SSIMULACRA2_OK) return load_result;
+    if (io1->xsize() != io2->xsize() || io1->ysize() != io2->ysize()) {
+        return SSIMULACRA2_ERROR_SIZE_MISMATCH;
+    }
+    return SSIMULACRA2_OK;
+}
+
+// Score caches by directory, kept for the whole process so that each lookup
+// only reads the entries appended since the previous one.
+std::mutex score_caches_mutex;
+std::map<std::string, std::unique_ptr<SSIMULACRA2ScoreCache>> score_caches;
+
+SSIMULACRA2ScoreCache& ScoreCache(const std::string& cache_dir) {
+    std::unique_ptr<SSIMULACRA2ScoreCache>& cache = score_caches[cache_dir];
+    if (!cache) cache.reset(new SSIMULACRA2ScoreCache(cache_dir));
+    return *cache;
+}
+
+bool LookupScore(const std::string& cache_dir, uint64_t key, std::vector<double>* values) {
+    std::lock_guard<std::mutex> lock(score_caches_mutex);
+    return ScoreCache(cache_dir).Lookup(key, values);
+}
+
+jxl::Status InsertScore(const std::string& cache_dir, uint64_t key,
+                        const std::vector<double>& values) {
+    std::lock_guard<std::mutex> lock(score_caches_mutex);
+    return ScoreCache(cache_dir).Insert(key, values);
+}
+
+double ComputeScore(const jxl::CodecInOut& io1, const jxl::CodecInOut& io2, const jxl::Rect& roi) {
+    return WorstOverBackgrounds(io1.Main(), [&](float bg) {
+               return ComputeSSIMULACRA2(io1.Main(), io2.Main(), roi, bg);
+           }).Score();
+}
+
+// Stats of the last score of ssimulacra2_compute_from_files/memory
+thread_local ssimulacra2_stats last_stats;
+thread_local bool has_last_stats = false;
+
+// Options of the context of the computation on this thread, if any
+thread_local const SSIMULACRA2Options* context_options = nullptr;
+
+// Computes the score with bg, or the worst over the backgrounds if it is
+// negative, and keeps its stats for ssimulacra2_get_stats
+double ComputeScoreAndStats(const jxl::CodecInOut& io1, const jxl::CodecInOut& io2, float bg,
+                            double decode_seconds) {
+    SSIMULACRA2Stats all;
+    all.decode = decode_seconds;
+    const auto compute = [&](float b) {
+        return ComputeSSIMULACRA2(io1.Main(), io2.Main(), b,
+                                  context_options ? *context_options : SSIMULACRA2Options(),
+                                  &all);
+    };
+    const double score =
+        (bg < 0.0f ? WorstOverBackgrounds(io1.Main(), compute) : compute(bg)).Score();
+
+    ssimulacra2_stats* stats = &last_stats;
+    memset(stats, 0, sizeof(*stats));
+    stats->decode_seconds = all.decode;
+    stats->transform_seconds = all.transform;
+    stats->total_seconds = all.total;
+    stats->num_allocations = all.num_allocations;
+    stats->num_frees = all.num_frees;
+    stats->bytes_in_use = all.bytes_in_use;
+    stats->peak_bytes_in_use = all.peak_bytes_in_use;
+    stats->num_scales = std::min<size_t>(all.scales.size(), SSIMULACRA2_NUM_SCALES);
+    for (size_t i = 0; i < stats->num_scales; ++i) {
+        const SSIMULACRA2Stats::Scale& scale = all.scales[i];
+        stats->scales[i].pixels = scale.num_pixels;
+        stats->scales[i].xyb_seconds = scale.xyb;
+        stats->scales[i].multiply_seconds = scale.multiply;
+        stats->scales[i].blur_seconds = scale.blur;
+        stats->scales[i].ssim_map_seconds = scale.ssim_map;
+        stats->scales[i].edge_diff_map_seconds = scale.edge_diff_map;
+    }
+    has_last_stats = true;
+    return score;
+}
+
+// Returns the score and fills `tiles` with newly allocated tile scores.
+ssimulacra2_result ComputeTileScores(const jxl::CodecInOut& io1, const jxl::CodecInOut& io2,
+                                     size_t tile_size, double* score,
+                                     ssimulacra2_tile_scores* tiles) {
+    // As for the whole image, take the worst of the backgrounds per tile
+    std::vector<jxl::ImageD> all_tile_scores;
+    *score = WorstOverBackgrounds(io1.Main(), [&](float bg) {
+                 all_tile_scores.emplace_back();
+                 return ComputeSSIMULACRA2(io1.Main(), io2.Main(), bg, tile_size,
+                                           &all_tile_scores.back());
+             }).Score();
+    jxl::ImageD& tile_scores = all_tile_scores[0];
+    for (size_t i = 1; i < all_tile_scores.size(); ++i) {
+        for (size_t y = 0; y < tile_scores.ysize(); ++y) {
+            double* row = tile_scores.Row(y);
+            const double* row1 = all_tile_scores[i].ConstRow(y);
+            for (size_t x = 0; x < tile_scores.xsize(); ++x) {
+                row[x] = std::min(row[x], row1[x]);
+            }
+        }
+    }
+
+    const size_t xtiles = tile_scores.xsize();
+    const size_t ytiles = tile_scores.ysize();
+    double* scores = static_cast<double*>(malloc(xtiles * ytiles * sizeof(double)));
+    if (!scores) {
+        return SSIMULACRA2_ERROR_OUT_OF_MEMORY;
     }
+    for (size_t y = 0; y < ytiles; ++y) {
+        memcpy(scores + y * xtiles, tile_scores.ConstRow(y), xtiles * sizeof(double));
+    }
+    tiles->xtiles = xtiles;
+    tiles->ytiles = ytiles;
+    tiles->scores = scores;
+    return SSIMULACRA2_OK;
 }
 
+// Returns the score and writes the features it is computed from.
+double ComputeFeatures(const jxl::CodecInOut& io1, const jxl::CodecInOut& io2, double* features) {
+    // The features of the background that gives the worse score
+    const Msssim msssim = WorstOverBackgrounds(io1.Main(), [&](float bg) {
+        return ComputeSSIMULACRA2(io1.Main(), io2.Main(), bg);
+    });
+    const std::vector<double> all = msssim.Features();
+    std::copy(all.begin(), all.end(), features);
+    return msssim.Score();
+}
+
+bool IsValidRoi(const ssimulacra2_rect* roi) {
+    return roi && roi->xsize != 0 && roi->ysize != 0;
+}
+
+bool RoiInside(const ssimulacra2_rect* roi, const jxl::CodecInOut& io) {
+    return roi->x0 < io.xsize() && roi->xsize <= io.xsize() - roi->x0 &&
+           roi->y0 < io.ysize() && roi->ysize <= io.ysize() - roi->y0;
+}
+
+#if defined(__linux__)
+// Reads a list of ids from sysfs, e.g. "0-7,16-23". Returns false if there is
+// none.
+bool ReadIdList(const char* path, std::vector<unsigned>* ids) {
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    ids->clear();
+    unsigned first, last;
+    while (fscanf(f, "%u", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%u", &last) != 1) break;
+            c = fgetc(f);
+        }
+        for (unsigned id = first; id <= last && id < (1u << 16); ++id) {
+            ids->push_back(id);
+        }
+        if (c != ',') break;
+    }
+    fclose(f);
+    return !ids->empty();
+}
+
+// Returns the online NUMA nodes, whose ids may have gaps.
+std::vector<unsigned> OnlineNumaNodes() {
+    std::vector<unsigned> nodes;
+    ReadIdList("/sys/devices/system/node/online", &nodes);
+    return nodes;
+}
+
+bool IsOnlineNumaNode(int node) {
+    const std::vector<unsigned> nodes = OnlineNumaNodes();
+    return node >= 0 &&
+           std::find(nodes.begin(), nodes.end(), static_cast<unsigned>(node)) != nodes.end();
+}
+
+// Reads the CPUs of NUMA node `node`, of which memory-only nodes have none.
+bool NumaNodeCpus(int node, cpu_set_t* cpus) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    std::vector<unsigned> ids;
+    if (!ReadIdList(path, &ids)) return false;
+    CPU_ZERO(cpus);
+    for (unsigned cpu : ids) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, cpus);
+    }
+    return CPU_COUNT(cpus) != 0;
+}
+
+// Memory policy of the calling thread, as with set_mempolicy(2), which libc
+// does not wrap. MPOL_PREFERRED of <numaif.h>, which is part of libnuma.
+const int kMemoryPolicyPreferred = 1;
+struct MemoryPolicy {
+    int mode;
+    unsigned long nodes[1024 / (8 * sizeof(unsigned long))];
+};
+const unsigned long kMaxNodes = 1024;
+
+bool GetMemoryPolicy(MemoryPolicy* policy) {
+    return syscall(SYS_get_mempolicy, &policy->mode, policy->nodes, kMaxNodes, nullptr, 0) == 0;
+}
+
+bool SetMemoryPolicy(const MemoryPolicy& policy) {
+    return syscall(SYS_set_mempolicy, policy.mode, policy.nodes, kMaxNodes) == 0;
+}
+#endif
+
+// While it exists, pins the calling thread to the CPUs of a NUMA node (unless
+// it is negative) and makes it prefer the memory of the node for the pages it
+// touches first, which are those of the images and planes of computations in
+// the meantime. Pages that malloc reuses, the data that is passed in and
+// memory of a memory manager may already be on another node. If the kernel
+// does not allow the memory policy, pages are placed on the node of the CPU
+// that touches them first.
+class ScopedNumaNode {
+public:
+    explicit ScopedNumaNode(int node) : pinned_(false), preferred_(false) {
+#if defined(__linux__)
+        if (node < 0) return;
+        cpu_set_t cpus;
+        if (NumaNodeCpus(node, &cpus) &&
+            sched_getaffinity(0, sizeof(previous_cpus_), &previous_cpus_) == 0) {
+            pinned_ = sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+        }
+        if (static_cast<unsigned long>(node) >= kMaxNodes || !GetMemoryPolicy(&previous_policy_)) {
+            return;
+        }
+        MemoryPolicy policy = {};
+        policy.mode = kMemoryPolicyPreferred;
+        policy.nodes[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+        preferred_ = SetMemoryPolicy(policy);
+#endif
+    }
+
+    ~ScopedNumaNode() {
+#if defined(__linux__)
+        if (pinned_) sched_setaffinity(0, sizeof(previous_cpus_), &previous_cpus_);
+        if (preferred_) SetMemoryPolicy(previous_policy_);
+#endif
+    }
+
+    ScopedNumaNode(const ScopedNumaNode&) = delete;
+    ScopedNumaNode& operator=(const ScopedNumaNode&) = delete;
+
+private:
+    bool pinned_;
+    bool preferred_;
+#if defined(__linux__)
+    cpu_set_t previous_cpus_;
+    MemoryPolicy previous_policy_;
+#endif
+};
+
+// Applies the settings of a context to the computations on the calling thread
+// while it exists. All images are allocated and freed within them.
+class ContextScope {
+public:
+    explicit ContextScope(const ssimulacra2_context* context)
+        : numa_node_(context->numa_node),
+          memory_manager_(context->custom_memory_manager ? &context->memory_manager : nullptr),
+          huge_pages_(context->huge_pages),
+          previous_options_(context_options) {
+        context_options = &context->options;
+    }
+
+    ~ContextScope() { context_options = previous_options_; }
+
+    ContextScope(const ContextScope&) = delete;
+    ContextScope& operator=(const ContextScope&) = delete;
+
+private:
+    ScopedNumaNode numa_node_;
+    jxl::CacheAligned::ScopedMemoryManager memory_manager_;
+    jxl::CacheAligned::ScopedHugePages huge_pages_;
+    const SSIMULACRA2Options* previous_options_;
+};
+
 } // namespace
 
 extern "C" {
@@ -90,26 +407,81 @@ double ssimulacra2_compute_from_files(
     }
 
     try {
+        const double decode_start = jxl::Now();
         jxl::CodecInOut io1, io2;
 
-        ssimulacra2_result load_result = LoadImageFromFile(original_path, &io1);
+        ssimulacra2_result load_result = LoadPair(original_path, distorted_path, &io1, &io2);
         if (load_result != SSIMULACRA2_OK) {
             if (result) *result = load_result;
             return -1.0;
         }
 
-        load_result = LoadImageFromFile(distorted_path, &io2);
+        double score = ComputeScoreAndStats(io1, io2, -1.0f, jxl::Now() - decode_start);
+        if (result) *result = SSIMULACRA2_OK;
+        return score;
+
+    } catch (...) {
+        if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
+        return -1.0;
+    }
+}
+
+double ssimulacra2_compute_from_files_with_background(
+    const char* original_path,
+    const char* distorted_path,
+    float bg_intensity,
+    ssimulacra2_result* result) {
+
+    if (!original_path || !distorted_path || bg_intensity < 0.0f || bg_intensity > 1.0f) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    try {
+        const double decode_start = jxl::Now();
+        jxl::CodecInOut io1, io2;
+
+        ssimulacra2_result load_result = LoadPair(original_path, distorted_path, &io1, &io2);
         if (load_result != SSIMULACRA2_OK) {
             if (result) *result = load_result;
             return -1.0;
         }
 
-        if (io1.xsize() != io2.xsize() || io1.ysize() != io2.ysize()) {
-            if (result) *result = SSIMULACRA2_ERROR_SIZE_MISMATCH;
+        double score = ComputeScoreAndStats(io1, io2, bg_intensity, jxl::Now() - decode_start);
+
+        if (result) *result = SSIMULACRA2_OK;
+        return score;
+
+    } catch (...) {
+        if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
+        return -1.0;
+    }
+}
+
+double ssimulacra2_compute_from_memory(
+    const uint8_t* original_data,
+    size_t original_size,
+    const uint8_t* distorted_data,
+    size_t distorted_size,
+    ssimulacra2_result* result) {
+
+    if (!original_data || !distorted_data || original_size == 0 || distorted_size == 0) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    try {
+        const double decode_start = jxl::Now();
+        jxl::CodecInOut io1, io2;
+
+        ssimulacra2_result load_result = LoadPair(original_data, original_size,
+                                                  distorted_data, distorted_size, &io1, &io2);
+        if (load_result != SSIMULACRA2_OK) {
+            if (result) *result = load_result;
             return -1.0;
         }
 
-        double score = ComputeScore(io1, io2, 0.5f);
+        double score = ComputeScoreAndStats(io1, io2, -1.0f, jxl::Now() - decode_start);
         if (result) *result = SSIMULACRA2_OK;
         return score;
 
@@ -119,40 +491,73 @@ double ssimulacra2_compute_from_files(
     }
 }
 
-double ssimulacra2_compute_from_files_with_background(
-    const char* original_path,
-    const char* distorted_path,
+double ssimulacra2_compute_from_memory_with_background(
+    const uint8_t* original_data,
+    size_t original_size,
+    const uint8_t* distorted_data,
+    size_t distorted_size,
     float bg_intensity,
     ssimulacra2_result* result) {
 
-    if (!original_path || !distorted_path || bg_intensity < 0.0f || bg_intensity > 1.0f) {
+    if (!original_data || !distorted_data || original_size == 0 || distorted_size == 0 ||
+        bg_intensity < 0.0f || bg_intensity > 1.0f) {
         if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
         return -1.0;
     }
 
     try {
+        const double decode_start = jxl::Now();
         jxl::CodecInOut io1, io2;
 
-        ssimulacra2_result load_result = LoadImageFromFile(original_path, &io1);
+        ssimulacra2_result load_result = LoadPair(original_data, original_size,
+                                                  distorted_data, distorted_size, &io1, &io2);
         if (load_result != SSIMULACRA2_OK) {
             if (result) *result = load_result;
             return -1.0;
         }
 
-        load_result = LoadImageFromFile(distorted_path, &io2);
+        double score = ComputeScoreAndStats(io1, io2, bg_intensity, jxl::Now() - decode_start);
+
+        if (result) *result = SSIMULACRA2_OK;
+        return score;
+
+    } catch (...) {
+        if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
+        return -1.0;
+    }
+}
+
+double ssimulacra2_compute_from_files_with_roi(
+    const char* original_path,
+    const char* distorted_path,
+    const ssimulacra2_rect* roi,
+    ssimulacra2_result* result) {
+
+    if (!original_path || !distorted_path || !IsValidRoi(roi)) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    try {
+        const jxl::Rect rect(roi->x0, roi->y0, roi->xsize, roi->ysize);
+        // The image size is not known before decoding, assume the largest.
+        const jxl::Rect rows = SSIMULACRA2InputRect(rect, SIZE_MAX, SIZE_MAX);
+        const size_t y0 = rows.y0();
+        const size_t y1 = rows.y0() + rows.ysize();
+        jxl::CodecInOut io1, io2;
+
+        ssimulacra2_result load_result = LoadPair(original_path, distorted_path, &io1, &io2, y0, y1);
         if (load_result != SSIMULACRA2_OK) {
             if (result) *result = load_result;
             return -1.0;
         }
 
-        if (io1.xsize() != io2.xsize() || io1.ysize() != io2.ysize()) {
-            if (result) *result = SSIMULACRA2_ERROR_SIZE_MISMATCH;
+        if (!RoiInside(roi, io1)) {
+            if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
             return -1.0;
         }
 
-        Msssim msssim = ComputeSSIMULACRA2(io1.Main(), io2.Main(), bg_intensity);
-        double score = msssim.Score();
-
+        double score = ComputeScore(io1, io2, rect);
         if (result) *result = SSIMULACRA2_OK;
         return score;
 
@@ -162,39 +567,147 @@ double ssimulacra2_compute_from_files_with_background(
     }
 }
 
-double ssimulacra2_compute_from_memory(
+double ssimulacra2_compute_from_memory_with_roi(
     const uint8_t* original_data,
     size_t original_size,
     const uint8_t* distorted_data,
     size_t distorted_size,
+    const ssimulacra2_rect* roi,
     ssimulacra2_result* result) {
 
-    if (!original_data || !distorted_data || original_size == 0 || distorted_size == 0) {
+    if (!original_data || !distorted_data || original_size == 0 || distorted_size == 0 ||
+        !IsValidRoi(roi)) {
         if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
         return -1.0;
     }
 
     try {
+        const jxl::Rect rect(roi->x0, roi->y0, roi->xsize, roi->ysize);
+        // The image size is not known before decoding, assume the largest.
+        const jxl::Rect rows = SSIMULACRA2InputRect(rect, SIZE_MAX, SIZE_MAX);
+        const size_t y0 = rows.y0();
+        const size_t y1 = rows.y0() + rows.ysize();
         jxl::CodecInOut io1, io2;
 
-        ssimulacra2_result load_result = LoadImageFromMemory(original_data, original_size, &io1);
+        ssimulacra2_result load_result = LoadPair(original_data, original_size,
+                                                  distorted_data, distorted_size, &io1, &io2, y0, y1);
         if (load_result != SSIMULACRA2_OK) {
             if (result) *result = load_result;
             return -1.0;
         }
 
-        load_result = LoadImageFromMemory(distorted_data, distorted_size, &io2);
+        if (!RoiInside(roi, io1)) {
+            if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+            return -1.0;
+        }
+
+        double score = ComputeScore(io1, io2, rect);
+        if (result) *result = SSIMULACRA2_OK;
+        return score;
+
+    } catch (...) {
+        if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
+        return -1.0;
+    }
+}
+
+double ssimulacra2_compute_tile_scores_from_files(
+    const char* original_path,
+    const char* distorted_path,
+    size_t tile_size,
+    ssimulacra2_tile_scores* tiles,
+    ssimulacra2_result* result) {
+
+    if (!original_path || !distorted_path || tile_size == 0 || !tiles) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    try {
+        jxl::CodecInOut io1, io2;
+
+        ssimulacra2_result load_result = LoadPair(original_path, distorted_path, &io1, &io2);
         if (load_result != SSIMULACRA2_OK) {
             if (result) *result = load_result;
             return -1.0;
         }
 
-        if (io1.xsize() != io2.xsize() || io1.ysize() != io2.ysize()) {
-            if (result) *result = SSIMULACRA2_ERROR_SIZE_MISMATCH;
+        double score;
+        ssimulacra2_result tiles_result = ComputeTileScores(io1, io2, tile_size, &score, tiles);
+        if (result) *result = tiles_result;
+        return tiles_result == SSIMULACRA2_OK ? score : -1.0;
+
+    } catch (...) {
+        if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
+        return -1.0;
+    }
+}
+
+double ssimulacra2_compute_tile_scores_from_memory(
+    const uint8_t* original_data,
+    size_t original_size,
+    const uint8_t* distorted_data,
+    size_t distorted_size,
+    size_t tile_size,
+    ssimulacra2_tile_scores* tiles,
+    ssimulacra2_result* result) {
+
+    if (!original_data || !distorted_data || original_size == 0 || distorted_size == 0 ||
+        tile_size == 0 || !tiles) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    try {
+        jxl::CodecInOut io1, io2;
+
+        ssimulacra2_result load_result = LoadPair(original_data, original_size,
+                                                  distorted_data, distorted_size, &io1, &io2);
+        if (load_result != SSIMULACRA2_OK) {
+            if (result) *result = load_result;
+            return -1.0;
+        }
+
+        double score;
+        ssimulacra2_result tiles_result = ComputeTileScores(io1, io2, tile_size, &score, tiles);
+        if (result) *result = tiles_result;
+        return tiles_result == SSIMULACRA2_OK ? score : -1.0;
+
+    } catch (...) {
+        if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
+        return -1.0;
+    }
+}
+
+void ssimulacra2_free_tile_scores(ssimulacra2_tile_scores* tiles) {
+    if (!tiles) return;
+    free(tiles->scores);
+    tiles->scores = nullptr;
+    tiles->xtiles = 0;
+    tiles->ytiles = 0;
+}
+
+double ssimulacra2_compute_features_from_files(
+    const char* original_path,
+    const char* distorted_path,
+    double* features,
+    ssimulacra2_result* result) {
+
+    if (!original_path || !distorted_path || !features) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    try {
+        jxl::CodecInOut io1, io2;
+
+        ssimulacra2_result load_result = LoadPair(original_path, distorted_path, &io1, &io2);
+        if (load_result != SSIMULACRA2_OK) {
+            if (result) *result = load_result;
             return -1.0;
         }
 
-        double score = ComputeScore(io1, io2, 0.5f);
+        double score = ComputeFeatures(io1, io2, features);
         if (result) *result = SSIMULACRA2_OK;
         return score;
 
@@ -204,16 +717,16 @@ double ssimulacra2_compute_from_memory(
     }
 }
 
-double ssimulacra2_compute_from_memory_with_background(
+double ssimulacra2_compute_features_from_memory(
     const uint8_t* original_data,
     size_t original_size,
     const uint8_t* distorted_data,
     size_t distorted_size,
-    float bg_intensity,
+    double* features,
     ssimulacra2_result* result) {
 
     if (!original_data || !distorted_data || original_size == 0 || distorted_size == 0 ||
-        bg_intensity < 0.0f || bg_intensity > 1.0f) {
+        !features) {
         if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
         return -1.0;
     }
@@ -221,28 +734,242 @@ double ssimulacra2_compute_from_memory_with_background(
     try {
         jxl::CodecInOut io1, io2;
 
-        ssimulacra2_result load_result = LoadImageFromMemory(original_data, original_size, &io1);
+        ssimulacra2_result load_result = LoadPair(original_data, original_size,
+                                                  distorted_data, distorted_size, &io1, &io2);
         if (load_result != SSIMULACRA2_OK) {
             if (result) *result = load_result;
             return -1.0;
         }
 
-        load_result = LoadImageFromMemory(distorted_data, distorted_size, &io2);
+        double score = ComputeFeatures(io1, io2, features);
+        if (result) *result = SSIMULACRA2_OK;
+        return score;
+
+    } catch (...) {
+        if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
+        return -1.0;
+    }
+}
+
+double ssimulacra2_score_from_features(
+    const double* features,
+    const double* weights,
+    ssimulacra2_result* result) {
+
+    if (!features) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    if (result) *result = SSIMULACRA2_OK;
+    return ScoreFromFeatures(features, weights ? weights : SSIMULACRA2Weights());
+}
+
+const double* ssimulacra2_get_default_weights(void) {
+    return SSIMULACRA2Weights();
+}
+
+ssimulacra2_result ssimulacra2_write_reference(
+    const char* original_path,
+    const char* reference_path) {
+
+    if (!original_path || !reference_path) {
+        return SSIMULACRA2_ERROR_INVALID_INPUT;
+    }
+
+    try {
+        std::vector<uint8_t> bytes;
+        if (!jxl::ReadFile(original_path, &bytes)) {
+            return SSIMULACRA2_ERROR_FILE_NOT_FOUND;
+        }
+
+        jxl::CodecInOut io;
+        ssimulacra2_result load_result = LoadImageFromMemory(bytes.data(), bytes.size(), &io);
+        if (load_result != SSIMULACRA2_OK) {
+            return load_result;
+        }
+
+        // Both backgrounds for alpha, as for the score of the whole image
+        std::vector<SSIMULACRA2Reference> refs;
+        for (float bg : SSIMULACRA2Backgrounds(io.Main())) {
+            refs.emplace_back(io.Main(), bg);
+        }
+        const uint64_t key = jxl::HashBytes(bytes.data(), bytes.size());
+        if (!SSIMULACRA2Reference::WriteFile(refs, key, reference_path)) {
+            return SSIMULACRA2_ERROR_UNKNOWN;
+        }
+        return SSIMULACRA2_OK;
+
+    } catch (...) {
+        return SSIMULACRA2_ERROR_UNKNOWN;
+    }
+}
+
+double ssimulacra2_compute_from_reference(
+    const char* reference_path,
+    const char* distorted_path,
+    unsigned long long* original_hash,
+    ssimulacra2_result* result) {
+
+    if (!reference_path || !distorted_path) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    try {
+        if (jxl::FileWrapper(reference_path, "rb") == nullptr) {
+            if (result) *result = SSIMULACRA2_ERROR_FILE_NOT_FOUND;
+            return -1.0;
+        }
+        std::vector<SSIMULACRA2Reference> refs;
+        uint64_t key;
+        if (!SSIMULACRA2Reference::LoadFile(reference_path, &key, &refs) || refs.empty()) {
+            if (result) *result = SSIMULACRA2_ERROR_CORRUPT_DATA;
+            return -1.0;
+        }
+
+        jxl::CodecInOut io;
+        ssimulacra2_result load_result = LoadImageFromFile(distorted_path, &io);
+        if (load_result != SSIMULACRA2_OK) {
+            if (result) *result = load_result;
+            return -1.0;
+        }
+
+        if (io.xsize() != refs[0].xsize() || io.ysize() != refs[0].ysize()) {
+            if (result) *result = SSIMULACRA2_ERROR_SIZE_MISMATCH;
+            return -1.0;
+        }
+
+        // The worst score of the backgrounds counts
+        double score = 100.0;
+        for (const SSIMULACRA2Reference& ref : refs) {
+            Msssim msssim;
+            if (!ref.Compare(io.Main(), &msssim)) {
+                if (result) *result = SSIMULACRA2_ERROR_UNSUPPORTED_FORMAT;
+                return -1.0;
+            }
+            score = std::min(score, msssim.Score());
+        }
+        if (original_hash) *original_hash = key;
+        if (result) *result = SSIMULACRA2_OK;
+        return score;
+
+    } catch (...) {
+        if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
+        return -1.0;
+    }
+}
+
+double ssimulacra2_compute_from_files_with_cache(
+    const char* original_path,
+    const char* distorted_path,
+    const char* cache_dir,
+    ssimulacra2_result* result) {
+
+    if (!original_path || !distorted_path || !cache_dir) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    try {
+        std::vector<uint8_t> bytes1, bytes2;
+        if (!jxl::ReadFile(original_path, &bytes1) || !jxl::ReadFile(distorted_path, &bytes2)) {
+            if (result) *result = SSIMULACRA2_ERROR_FILE_NOT_FOUND;
+            return -1.0;
+        }
+
+        // Same entries as the command-line tool: the score and the features
+        const uint64_t key = SSIMULACRA2ScoreCache::Key(bytes1.data(), bytes1.size(),
+                                                        bytes2.data(), bytes2.size(), "");
+        std::vector<double> values;
+        if (LookupScore(cache_dir, key, &values) &&
+            values.size() == 1 + SSIMULACRA2_NUM_FEATURES) {
+            if (result) *result = SSIMULACRA2_OK;
+            return values[0];
+        }
+
+        jxl::CodecInOut io1, io2;
+        ssimulacra2_result load_result = LoadPair(bytes1.data(), bytes1.size(),
+                                                  bytes2.data(), bytes2.size(), &io1, &io2);
         if (load_result != SSIMULACRA2_OK) {
             if (result) *result = load_result;
             return -1.0;
         }
 
+        values.resize(1 + SSIMULACRA2_NUM_FEATURES);
+        values[0] = ComputeFeatures(io1, io2, values.data() + 1);
+        // A score that cannot be cached is still valid
+        (void)InsertScore(cache_dir, key, values);
+        if (result) *result = SSIMULACRA2_OK;
+        return values[0];
+
+    } catch (...) {
+        if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
+        return -1.0;
+    }
+}
+
+ssimulacra2_result ssimulacra2_get_stats(ssimulacra2_stats* stats) {
+    if (!stats || !has_last_stats) return SSIMULACRA2_ERROR_INVALID_INPUT;
+    *stats = last_stats;
+    return SSIMULACRA2_OK;
+}
+
+double ssimulacra2_compute_from_files_with_max_bytes(
+    const char* original_path,
+    const char* distorted_path,
+    size_t max_bytes,
+    ssimulacra2_result* result) {
+
+    if (!original_path || !distorted_path) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+
+    try {
+        std::vector<uint8_t> bytes1, bytes2;
+        if (!jxl::ReadFile(original_path, &bytes1) || !jxl::ReadFile(distorted_path, &bytes2)) {
+            if (result) *result = SSIMULACRA2_ERROR_FILE_NOT_FOUND;
+            return -1.0;
+        }
+
+        // Only strips of rows are decoded, the first one to know the size.
+        const SSIMULACRA2DecodeFunc decode = [&](size_t y0, size_t y1, jxl::CodecInOut* io1,
+                                                 jxl::CodecInOut* io2) {
+            return jxl::Status(SetStripFromBytes(jxl::Span<const uint8_t>(bytes1),
+                                                 jxl::extras::ColorHints(), y0, y1, io1) &&
+                               SetStripFromBytes(jxl::Span<const uint8_t>(bytes2),
+                                                 jxl::extras::ColorHints(), y0, y1, io2));
+        };
+        jxl::CodecInOut io1, io2;
+        if (!decode(0, 1, &io1, &io2)) {
+            if (result) *result = SSIMULACRA2_ERROR_DECODE_FAILED;
+            return -1.0;
+        }
+        if (io1.xsize() < 8 || io1.ysize() < 8) {
+            if (result) *result = SSIMULACRA2_ERROR_TOO_SMALL;
+            return -1.0;
+        }
         if (io1.xsize() != io2.xsize() || io1.ysize() != io2.ysize()) {
             if (result) *result = SSIMULACRA2_ERROR_SIZE_MISMATCH;
             return -1.0;
         }
 
-        Msssim msssim = ComputeSSIMULACRA2(io1.Main(), io2.Main(), bg_intensity);
-        double score = msssim.Score();
+        // Strips that decode to other sizes or rows than the first one are
+        // decoding failures too.
+        Msssim msssim;
+        bool over_budget;
+        if (!ComputeSSIMULACRA2WithinBudget(io1.xsize(), io1.ysize(), decode, max_bytes,
+                                            &msssim, &over_budget)) {
+            if (result) {
+                *result = over_budget ? SSIMULACRA2_ERROR_OUT_OF_MEMORY
+                                      : SSIMULACRA2_ERROR_DECODE_FAILED;
+            }
+            return -1.0;
+        }
 
         if (result) *result = SSIMULACRA2_OK;
-        return score;
+        return msssim.Score();
 
     } catch (...) {
         if (result) *result = SSIMULACRA2_ERROR_UNKNOWN;
@@ -250,6 +977,110 @@ double ssimulacra2_compute_from_memory_with_background(
     }
 }
 
+ssimulacra2_context* ssimulacra2_context_create(
+    const JxlMemoryManager* memory_manager) {
+
+    JxlMemoryManager local_memory_manager;
+    if (!jxl::MemoryManagerInit(&local_memory_manager, memory_manager)) {
+        return nullptr;
+    }
+    void* allocated = jxl::MemoryManagerAlloc(&local_memory_manager, sizeof(ssimulacra2_context));
+    if (!allocated) return nullptr;
+    ssimulacra2_context* context = new (allocated) ssimulacra2_context();
+    context->memory_manager = local_memory_manager;
+    context->custom_memory_manager = memory_manager && memory_manager->alloc;
+    context->huge_pages = false;
+    context->numa_node = -1;
+    return context;
+}
+
+void ssimulacra2_context_destroy(ssimulacra2_context* context) {
+    if (!context) return;
+    const JxlMemoryManager local_memory_manager = context->memory_manager;
+    context->~ssimulacra2_context();
+    jxl::MemoryManagerFree(&local_memory_manager, context);
+}
+
+ssimulacra2_result ssimulacra2_context_set_huge_pages(
+    ssimulacra2_context* context,
+    int enabled) {
+
+    if (!context) return SSIMULACRA2_ERROR_INVALID_INPUT;
+    context->huge_pages = enabled != 0;
+    return SSIMULACRA2_OK;
+}
+
+ssimulacra2_result ssimulacra2_context_set_f16_pyramid(
+    ssimulacra2_context* context,
+    int enabled) {
+
+    if (!context) return SSIMULACRA2_ERROR_INVALID_INPUT;
+    context->options.f16_pyramid = enabled != 0;
+    return SSIMULACRA2_OK;
+}
+
+ssimulacra2_result ssimulacra2_context_set_fast(
+    ssimulacra2_context* context,
+    int enabled) {
+
+    if (!context) return SSIMULACRA2_ERROR_INVALID_INPUT;
+    context->options.fast = enabled != 0;
+    return SSIMULACRA2_OK;
+}
+
+ssimulacra2_result ssimulacra2_context_set_numa_node(
+    ssimulacra2_context* context,
+    int node) {
+
+    if (!context || node < -1) return SSIMULACRA2_ERROR_INVALID_INPUT;
+#if defined(__linux__)
+    if (node >= 0 && !IsOnlineNumaNode(node)) return SSIMULACRA2_ERROR_INVALID_INPUT;
+#else
+    if (node >= 0) return SSIMULACRA2_ERROR_INVALID_INPUT;
+#endif
+    context->numa_node = node;
+    return SSIMULACRA2_OK;
+}
+
+int ssimulacra2_get_numa_node_count(void) {
+#if defined(__linux__)
+    return static_cast<int>(OnlineNumaNodes().size());
+#else
+    return 0;
+#endif
+}
+
+double ssimulacra2_compute_from_files_with_context(
+    const ssimulacra2_context* context,
+    const char* original_path,
+    const char* distorted_path,
+    ssimulacra2_result* result) {
+
+    if (!context) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+    ContextScope scope(context);
+    return ssimulacra2_compute_from_files(original_path, distorted_path, result);
+}
+
+double ssimulacra2_compute_from_memory_with_context(
+    const ssimulacra2_context* context,
+    const uint8_t* original_data,
+    size_t original_size,
+    const uint8_t* distorted_data,
+    size_t distorted_size,
+    ssimulacra2_result* result) {
+
+    if (!context) {
+        if (result) *result = SSIMULACRA2_ERROR_INVALID_INPUT;
+        return -1.0;
+    }
+    ContextScope scope(context);
+    return ssimulacra2_compute_from_memory(original_data, original_size, distorted_data,
+                                           distorted_size, result);
+}
+
 const char* ssimulacra2_get_error_message(ssimulacra2_result result) {
     switch (result) {
         case SSIMULACRA2_OK:
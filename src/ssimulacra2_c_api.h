@@ -38,6 +38,14 @@ typedef enum {
     SSIMULACRA2_ERROR_UNKNOWN = -99
 } ssimulacra2_result;
 
+// Rectangle in pixels, with top-left corner (x0, y0)
+typedef struct {
+    size_t x0;
+    size_t y0;
+    size_t xsize;
+    size_t ysize;
+} ssimulacra2_rect;
+
 // Compute SSIMULACRA2 score from file paths
 // Returns the score (range -inf to 100) on success, or negative error code on failure
 SSIMULACRA2_API double ssimulacra2_compute_from_files(
@@ -74,6 +82,261 @@ SSIMULACRA2_API double ssimulacra2_compute_from_memory_with_background(
     ssimulacra2_result* result
 );
 
+// Compute SSIMULACRA2 score of a region of interest from file paths
+// Only errors within roi count, but the pixels around it are taken into account
+// as when scoring the whole images. PNG and JPEG decoding skips the rows that
+// are not needed. roi must be non-empty and lie within the images.
+SSIMULACRA2_API double ssimulacra2_compute_from_files_with_roi(
+    const char* original_path,
+    const char* distorted_path,
+    const ssimulacra2_rect* roi,
+    ssimulacra2_result* result
+);
+
+// Compute SSIMULACRA2 score of a region of interest from memory buffers
+SSIMULACRA2_API double ssimulacra2_compute_from_memory_with_roi(
+    const unsigned char* original_data,
+    size_t original_size,
+    const unsigned char* distorted_data,
+    size_t distorted_size,
+    const ssimulacra2_rect* roi,
+    ssimulacra2_result* result
+);
+
+// Scores of the tile_size x tile_size tiles of the images; the tiles in the
+// last row and column may be smaller
+typedef struct {
+    size_t xtiles;   // ceil(width / tile_size)
+    size_t ytiles;   // ceil(height / tile_size)
+    double* scores;  // xtiles * ytiles scores, row by row
+} ssimulacra2_tile_scores;
+
+// Compute SSIMULACRA2 score from file paths, and along with it the scores of
+// the tile_size x tile_size tiles. The tile scores have to be released with
+// ssimulacra2_free_tile_scores. With a tile_size that is a multiple of 32,
+// each tile score matches using the tile as region of interest.
+SSIMULACRA2_API double ssimulacra2_compute_tile_scores_from_files(
+    const char* original_path,
+    const char* distorted_path,
+    size_t tile_size,
+    ssimulacra2_tile_scores* tiles,
+    ssimulacra2_result* result
+);
+
+// Compute SSIMULACRA2 score and tile scores from memory buffers
+SSIMULACRA2_API double ssimulacra2_compute_tile_scores_from_memory(
+    const unsigned char* original_data,
+    size_t original_size,
+    const unsigned char* distorted_data,
+    size_t distorted_size,
+    size_t tile_size,
+    ssimulacra2_tile_scores* tiles,
+    ssimulacra2_result* result
+);
+
+// Release the scores of tiles computed by ssimulacra2_compute_tile_scores_*
+SSIMULACRA2_API void ssimulacra2_free_tile_scores(ssimulacra2_tile_scores* tiles);
+
+// Number of features (error norms) that the score is computed from
+#define SSIMULACRA2_NUM_FEATURES 108
+
+// Compute SSIMULACRA2 score from file paths, and write the features it is
+// computed from to features[SSIMULACRA2_NUM_FEATURES]: for X, Y and B, for
+// each of 6 scales, for the 1-norm and 4-norm, the norms of the SSIM',
+// ringing and blurring maps. Images with fewer scales have zeros at the end.
+// For images with alpha, these are the features of the worse background.
+SSIMULACRA2_API double ssimulacra2_compute_features_from_files(
+    const char* original_path,
+    const char* distorted_path,
+    double* features,
+    ssimulacra2_result* result
+);
+
+// Compute SSIMULACRA2 score and features from memory buffers
+SSIMULACRA2_API double ssimulacra2_compute_features_from_memory(
+    const unsigned char* original_data,
+    size_t original_size,
+    const unsigned char* distorted_data,
+    size_t distorted_size,
+    double* features,
+    ssimulacra2_result* result
+);
+
+// Compute the score from stored features with SSIMULACRA2_NUM_FEATURES
+// weights, or with the default weights if weights is NULL
+SSIMULACRA2_API double ssimulacra2_score_from_features(
+    const double* features,
+    const double* weights,
+    ssimulacra2_result* result
+);
+
+// Get the SSIMULACRA2_NUM_FEATURES default weights
+SSIMULACRA2_API const double* ssimulacra2_get_default_weights(void);
+
+// Preprocess the original image file and write the result to reference_path,
+// keyed by a hash of the original file. Scoring against it later with
+// ssimulacra2_compute_from_reference skips decoding and preprocessing the
+// original.
+SSIMULACRA2_API ssimulacra2_result ssimulacra2_write_reference(
+    const char* original_path,
+    const char* reference_path
+);
+
+// Compute SSIMULACRA2 score of the distorted image file against an original
+// preprocessed by ssimulacra2_write_reference. If original_hash is not NULL,
+// it receives the hash of the original file that the reference was written
+// for. A reference of a gray original cannot be used for a color image.
+SSIMULACRA2_API double ssimulacra2_compute_from_reference(
+    const char* reference_path,
+    const char* distorted_path,
+    unsigned long long* original_hash,
+    ssimulacra2_result* result
+);
+
+// Compute SSIMULACRA2 score from file paths, looking it up first in the
+// score cache in cache_dir (an existing directory), keyed by a hash of both
+// files. The images are only decoded if it is not found, and the score is then
+// stored there. The cache may be shared with the command-line tool and by
+// concurrent processes.
+SSIMULACRA2_API double ssimulacra2_compute_from_files_with_cache(
+    const char* original_path,
+    const char* distorted_path,
+    const char* cache_dir,
+    ssimulacra2_result* result
+);
+
+// Number of scales of the stats; smaller images have fewer
+#define SSIMULACRA2_NUM_SCALES 6
+
+// Time spent in the stages of one computation, in seconds, and memory used
+typedef struct {
+    double decode_seconds;     // decoding both images
+    double transform_seconds;  // color transform of images that are not sRGB
+    double total_seconds;      // everything after decoding
+    // Allocations and frees of image memory by the calling thread while
+    // computing the score; bytes are those in use by the process before, and
+    // at most during it counting only this thread's allocations
+    unsigned long long num_allocations;
+    unsigned long long num_frees;
+    unsigned long long bytes_in_use;
+    unsigned long long peak_bytes_in_use;
+    size_t num_scales;
+    struct {
+        size_t pixels;                 // compared pixels of each plane
+        double xyb_seconds;            // conversion to XYB or downsampling
+        double multiply_seconds;
+        double blur_seconds;
+        double ssim_map_seconds;
+        double edge_diff_map_seconds;
+    } scales[SSIMULACRA2_NUM_SCALES];
+} ssimulacra2_stats;
+
+// Get the stats of the last score that ssimulacra2_compute_from_files or
+// ssimulacra2_compute_from_memory (also with a background or a context)
+// returned on the calling thread. For images with alpha, the stats of both
+// backgrounds are added up. Fails with SSIMULACRA2_ERROR_INVALID_INPUT if
+// there is none.
+SSIMULACRA2_API ssimulacra2_result ssimulacra2_get_stats(ssimulacra2_stats* stats);
+
+// Compute SSIMULACRA2 score from file paths, allocating at most about
+// max_bytes for the decoded rows and the comparison: larger images are
+// decoded and compared in strips of rows, which gives the same score up to
+// the order of the sums, or below the budget of the shortest strips in square
+// tiles, which changes the score by about 0.01. Only PNG and JPEG files are
+// decoded one strip at a time; others are decoded whole, and their decoded
+// images count against max_bytes. The encoded files are kept in memory
+// besides max_bytes. Fails with SSIMULACRA2_ERROR_OUT_OF_MEMORY if even the
+// smallest tiles need more, or with SSIMULACRA2_ERROR_DECODE_FAILED if a
+// strip fails to decode or decodes to other sizes.
+SSIMULACRA2_API double ssimulacra2_compute_from_files_with_max_bytes(
+    const char* original_path,
+    const char* distorted_path,
+    size_t max_bytes,
+    ssimulacra2_result* result
+);
+
+// Defined in jxl/memory_manager.h of libjxl
+struct JxlMemoryManagerStruct;
+
+// Settings shared by several computations, which may run concurrently
+typedef struct ssimulacra2_context ssimulacra2_context;
+
+// Create a context for the functions that end in _with_context; the other
+// functions do not use one. If memory_manager is not NULL, the image memory of
+// the computations with this context, which is most of their memory, and the
+// context itself come from its alloc and free functions instead of malloc and
+// free, e.g. to use the pools of the host. They must be thread-safe if the
+// context is used by several threads. Returns NULL if only one of them is set,
+// or if out of memory.
+SSIMULACRA2_API ssimulacra2_context* ssimulacra2_context_create(
+    const struct JxlMemoryManagerStruct* memory_manager
+);
+
+// Destroy a context created by ssimulacra2_context_create (NULL is ignored)
+SSIMULACRA2_API void ssimulacra2_context_destroy(ssimulacra2_context* context);
+
+// Advise the kernel to back large image memory of computations with this
+// context with transparent huge pages (Linux only), which reduces TLB misses.
+// Off by default, as it may increase memory use. Memory of the memory manager
+// of the context is left alone. Like the other setters, this is not
+// thread-safe: do not call it while other threads compute with the context.
+SSIMULACRA2_API ssimulacra2_result ssimulacra2_context_set_huge_pages(
+    ssimulacra2_context* context,
+    int enabled
+);
+
+// Keep the linear images of the scales of computations with this context as
+// half floats (SSIMULACRA2Options::f16_pyramid, which states how much the
+// score deviates), to save memory. Off by default. Not thread-safe, like
+// ssimulacra2_context_set_huge_pages.
+SSIMULACRA2_API ssimulacra2_result ssimulacra2_context_set_f16_pyramid(
+    ssimulacra2_context* context,
+    int enabled
+);
+
+// Approximate the score of computations with this context faster
+// (SSIMULACRA2Options::fast, which states how far it deviates), e.g. to
+// pre-filter candidates. Off by default. Not thread-safe, like
+// ssimulacra2_context_set_huge_pages.
+SSIMULACRA2_API ssimulacra2_result ssimulacra2_context_set_fast(
+    ssimulacra2_context* context,
+    int enabled
+);
+
+// Pin the threads that compute with this context to the CPUs of NUMA node
+// node (one of the online nodes, whose ids may have gaps) while they do, and
+// make them prefer the memory of the node for the pages they touch first;
+// -1 unpins. E.g. create one context per node and run each worker thread with
+// the context of its node. Only memory that is new to the process is placed:
+// pages that malloc reuses, the images passed in and memory of the memory
+// manager stay where they were touched first. Linux only; not thread-safe,
+// like ssimulacra2_context_set_huge_pages.
+SSIMULACRA2_API ssimulacra2_result ssimulacra2_context_set_numa_node(
+    ssimulacra2_context* context,
+    int node
+);
+
+// Number of online NUMA nodes, or 0 if unknown
+SSIMULACRA2_API int ssimulacra2_get_numa_node_count(void);
+
+// Same as ssimulacra2_compute_from_files, with the settings of context
+SSIMULACRA2_API double ssimulacra2_compute_from_files_with_context(
+    const ssimulacra2_context* context,
+    const char* original_path,
+    const char* distorted_path,
+    ssimulacra2_result* result
+);
+
+// Same as ssimulacra2_compute_from_memory, with the settings of context
+SSIMULACRA2_API double ssimulacra2_compute_from_memory_with_context(
+    const ssimulacra2_context* context,
+    const unsigned char* original_data,
+    size_t original_size,
+    const unsigned char* distorted_data,
+    size_t distorted_size,
+    ssimulacra2_result* result
+);
+
 // Get error message for result code
 SSIMULACRA2_API const char* ssimulacra2_get_error_message(ssimulacra2_result result);
 
@@ -0,0 +1,334 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "ssimulacra2_c_api.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "jxl/memory_manager.h"
+#include "lib/jxl/base/file_io.h"
+#include "lib/jxl/codec_in_out.h"
+#include "ssimulacra2_test_utils.h"
+
+namespace {
+
+using ssimulacra2_test::Distort;
+using ssimulacra2_test::EncodePNG;
+using ssimulacra2_test::TestImage;
+
+// PNG files of an image and a distorted version of it.
+struct EncodedPair {
+  EncodedPair(size_t xsize, size_t ysize, size_t channels) {
+    jxl::CodecInOut orig, dist;
+    TestImage(xsize, ysize, channels, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    original = EncodePNG(orig);
+    distorted = EncodePNG(dist);
+  }
+
+  std::vector<uint8_t> original;
+  std::vector<uint8_t> distorted;
+};
+
+// A JxlMemoryManager that keeps track of what it allocated.
+class CountingMemoryManager {
+public:
+  CountingMemoryManager() {
+    manager_.opaque = this;
+    manager_.alloc = &Alloc;
+    manager_.free = &Free;
+  }
+
+  const JxlMemoryManager *get() const { return &manager_; }
+
+  size_t num_allocations() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_allocations_;
+  }
+  size_t max_size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return max_size_;
+  }
+  size_t num_live() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return live_.size();
+  }
+
+private:
+  static void *Alloc(void *opaque, size_t size) {
+    CountingMemoryManager *self = static_cast<CountingMemoryManager *>(opaque);
+    void *p = malloc(size);
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    ++self->num_allocations_;
+    self->max_size_ = std::max(self->max_size_, size);
+    self->live_[p] = size;
+    return p;
+  }
+  static void Free(void *opaque, void *address) {
+    CountingMemoryManager *self = static_cast<CountingMemoryManager *>(opaque);
+    {
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      EXPECT_EQ(1u, self->live_.erase(address));
+    }
+    free(address);
+  }
+
+  JxlMemoryManager manager_;
+  std::mutex mutex_;
+  size_t num_allocations_ = 0;
+  size_t max_size_ = 0;
+  std::map<void *, size_t> live_;
+};
+
+TEST(SSIMULACRA2CApiTest, AlphaScoreIsWorstOverBackgrounds) {
+  const EncodedPair pair(90, 70, 4);
+  ssimulacra2_result result;
+  const double score = ssimulacra2_compute_from_memory(
+      pair.original.data(), pair.original.size(), pair.distorted.data(),
+      pair.distorted.size(), &result);
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  double worst = 100.0;
+  for (float bg : {0.1f, 0.9f}) {
+    worst = std::min(worst, ssimulacra2_compute_from_memory_with_background(
+                                pair.original.data(), pair.original.size(),
+                                pair.distorted.data(), pair.distorted.size(),
+                                bg, &result));
+    ASSERT_EQ(SSIMULACRA2_OK, result);
+  }
+  EXPECT_EQ(worst, score);
+
+  double features[SSIMULACRA2_NUM_FEATURES];
+  EXPECT_EQ(score, ssimulacra2_compute_features_from_memory(
+                       pair.original.data(), pair.original.size(),
+                       pair.distorted.data(), pair.distorted.size(), features,
+                       &result));
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  EXPECT_EQ(score, ssimulacra2_score_from_features(features, nullptr, &result));
+
+  ssimulacra2_tile_scores tiles;
+  EXPECT_EQ(score, ssimulacra2_compute_tile_scores_from_memory(
+                       pair.original.data(), pair.original.size(),
+                       pair.distorted.data(), pair.distorted.size(), 32,
+                       &tiles, &result));
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  EXPECT_EQ(3u, tiles.xtiles);
+  EXPECT_EQ(3u, tiles.ytiles);
+  ssimulacra2_free_tile_scores(&tiles);
+}
+
+TEST(SSIMULACRA2CApiTest, StatsOfLastScore) {
+  const EncodedPair pair(120, 90, 3);
+  ssimulacra2_result result;
+  ssimulacra2_compute_from_memory(pair.original.data(), pair.original.size(),
+                                  pair.distorted.data(), pair.distorted.size(),
+                                  &result);
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  ssimulacra2_stats stats;
+  ASSERT_EQ(SSIMULACRA2_OK, ssimulacra2_get_stats(&stats));
+  EXPECT_GT(stats.decode_seconds, 0.0);
+  EXPECT_GT(stats.total_seconds, 0.0);
+  ASSERT_EQ(4u, stats.num_scales);
+  EXPECT_EQ(120u * 90u, stats.scales[0].pixels);
+  EXPECT_EQ(60u * 45u, stats.scales[1].pixels);
+
+  // Stats are kept per thread.
+  std::thread([] {
+    ssimulacra2_stats stats;
+    EXPECT_EQ(SSIMULACRA2_ERROR_INVALID_INPUT, ssimulacra2_get_stats(&stats));
+  }).join();
+  EXPECT_EQ(SSIMULACRA2_ERROR_INVALID_INPUT, ssimulacra2_get_stats(nullptr));
+}
+
+TEST(SSIMULACRA2CApiTest, SizeMismatchIsAnError) {
+  const EncodedPair small(64, 48, 3);
+  const EncodedPair large(64, 50, 3);
+  ssimulacra2_result result = SSIMULACRA2_OK;
+  EXPECT_EQ(-1.0, ssimulacra2_compute_from_memory(
+                      small.original.data(), small.original.size(),
+                      large.distorted.data(), large.distorted.size(), &result));
+  EXPECT_EQ(SSIMULACRA2_ERROR_SIZE_MISMATCH, result);
+
+  double features[SSIMULACRA2_NUM_FEATURES];
+  result = SSIMULACRA2_OK;
+  EXPECT_EQ(-1.0, ssimulacra2_compute_features_from_memory(
+                      small.original.data(), small.original.size(),
+                      large.distorted.data(), large.distorted.size(), features,
+                      &result));
+  EXPECT_EQ(SSIMULACRA2_ERROR_SIZE_MISMATCH, result);
+
+  const ssimulacra2_rect roi = {0, 0, 16, 16};
+  result = SSIMULACRA2_OK;
+  EXPECT_EQ(-1.0, ssimulacra2_compute_from_memory_with_roi(
+                      small.original.data(), small.original.size(),
+                      large.distorted.data(), large.distorted.size(), &roi,
+                      &result));
+  EXPECT_EQ(SSIMULACRA2_ERROR_SIZE_MISMATCH, result);
+}
+
+TEST(SSIMULACRA2CApiTest, MaxBytesGivesTheSameScore) {
+  const EncodedPair pair(600, 450, 4);
+  const std::string original = testing::TempDir() + "ssimulacra2_orig.png";
+  const std::string distorted = testing::TempDir() + "ssimulacra2_dist.png";
+  ASSERT_TRUE(jxl::WriteFile(pair.original, original));
+  ASSERT_TRUE(jxl::WriteFile(pair.distorted, distorted));
+  ssimulacra2_result result;
+  const double score = ssimulacra2_compute_from_files(
+      original.c_str(), distorted.c_str(), &result);
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  // Large enough for the whole images, then only for strips of them.
+  for (size_t max_bytes : {size_t(1) << 30, size_t(8) << 20}) {
+    EXPECT_NEAR(score,
+                ssimulacra2_compute_from_files_with_max_bytes(
+                    original.c_str(), distorted.c_str(), max_bytes, &result),
+                1e-9)
+        << max_bytes;
+    EXPECT_EQ(SSIMULACRA2_OK, result);
+  }
+  EXPECT_EQ(-1.0, ssimulacra2_compute_from_files_with_max_bytes(
+                      original.c_str(), distorted.c_str(), 1 << 20, &result));
+  EXPECT_EQ(SSIMULACRA2_ERROR_OUT_OF_MEMORY, result);
+  remove(original.c_str());
+  remove(distorted.c_str());
+}
+
+TEST(SSIMULACRA2CApiTest, ContextAllocatesThroughMemoryManager) {
+  const EncodedPair pair(120, 90, 3);
+  ssimulacra2_result result;
+  const double score = ssimulacra2_compute_from_memory(
+      pair.original.data(), pair.original.size(), pair.distorted.data(),
+      pair.distorted.size(), &result);
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+
+  CountingMemoryManager manager;
+  ssimulacra2_context *context = ssimulacra2_context_create(manager.get());
+  ASSERT_NE(nullptr, context);
+  EXPECT_EQ(1u, manager.num_allocations());
+  EXPECT_EQ(score, ssimulacra2_compute_from_memory_with_context(
+                       context, pair.original.data(), pair.original.size(),
+                       pair.distorted.data(), pair.distorted.size(),
+                       &result));
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  // The decoded images and the planes of the comparison, whose arena is
+  // not rounded up to huge pages.
+  EXPECT_GT(manager.num_allocations(), 3u);
+  EXPECT_LT(manager.max_size(), size_t(2) << 20);
+  EXPECT_EQ(1u, manager.num_live());
+  ssimulacra2_context_destroy(context);
+  EXPECT_EQ(0u, manager.num_live());
+
+  // Without a context, the memory manager is not used.
+  const size_t num_allocations = manager.num_allocations();
+  ssimulacra2_compute_from_memory(pair.original.data(), pair.original.size(),
+                                  pair.distorted.data(),
+                                  pair.distorted.size(), &result);
+  EXPECT_EQ(num_allocations, manager.num_allocations());
+
+  // Both functions or none.
+  JxlMemoryManager only_alloc = *manager.get();
+  only_alloc.free = nullptr;
+  EXPECT_EQ(nullptr, ssimulacra2_context_create(&only_alloc));
+}
+
+TEST(SSIMULACRA2CApiTest, ContextSettingsKeepTheScore) {
+  const EncodedPair pair(120, 90, 3);
+  ssimulacra2_result result;
+  const double score = ssimulacra2_compute_from_memory(
+      pair.original.data(), pair.original.size(), pair.distorted.data(),
+      pair.distorted.size(), &result);
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  ssimulacra2_context *context = ssimulacra2_context_create(nullptr);
+  ASSERT_NE(nullptr, context);
+  const auto compute = [&] {
+    const double with_context = ssimulacra2_compute_from_memory_with_context(
+        context, pair.original.data(), pair.original.size(),
+        pair.distorted.data(), pair.distorted.size(), &result);
+    EXPECT_EQ(SSIMULACRA2_OK, result);
+    return with_context;
+  };
+
+  ASSERT_EQ(SSIMULACRA2_OK, ssimulacra2_context_set_huge_pages(context, 1));
+  EXPECT_EQ(score, compute());
+  ASSERT_EQ(SSIMULACRA2_OK, ssimulacra2_context_set_huge_pages(context, 0));
+
+  EXPECT_EQ(SSIMULACRA2_ERROR_INVALID_INPUT,
+            ssimulacra2_context_set_numa_node(context, -2));
+  EXPECT_EQ(SSIMULACRA2_ERROR_INVALID_INPUT,
+            ssimulacra2_context_set_numa_node(context, 99999));
+  EXPECT_EQ(SSIMULACRA2_OK, ssimulacra2_context_set_numa_node(context, -1));
+#if defined(__linux__)
+  // The first online node, e.g. of "0-3" or "0,2".
+  std::string online;
+  if (jxl::ReadFile("/sys/devices/system/node/online", &online)) {
+    EXPECT_GE(ssimulacra2_get_numa_node_count(), 1);
+    const int node = atoi(online.c_str());
+    ASSERT_EQ(SSIMULACRA2_OK, ssimulacra2_context_set_numa_node(context, node));
+    cpu_set_t before, after;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(before), &before));
+    EXPECT_EQ(score, compute());
+    // The calling thread is unpinned afterwards.
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(after), &after));
+    EXPECT_TRUE(CPU_EQUAL(&before, &after));
+  }
+#endif
+  ssimulacra2_context_destroy(context);
+}
+
+TEST(SSIMULACRA2CApiTest, ContextOptionsApproximateScore) {
+  const EncodedPair pair(120, 90, 4);
+  ssimulacra2_result result;
+  const double score = ssimulacra2_compute_from_memory(
+      pair.original.data(), pair.original.size(), pair.distorted.data(),
+      pair.distorted.size(), &result);
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  ssimulacra2_context *context = ssimulacra2_context_create(nullptr);
+  ASSERT_NE(nullptr, context);
+  EXPECT_EQ(SSIMULACRA2_ERROR_INVALID_INPUT,
+            ssimulacra2_context_set_f16_pyramid(nullptr, 1));
+  ASSERT_EQ(SSIMULACRA2_OK, ssimulacra2_context_set_f16_pyramid(context, 1));
+  const double f16 = ssimulacra2_compute_from_memory_with_context(
+      context, pair.original.data(), pair.original.size(),
+      pair.distorted.data(), pair.distorted.size(), &result);
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  EXPECT_NE(score, f16);
+  EXPECT_NEAR(score, f16, 0.15);
+
+  EXPECT_EQ(SSIMULACRA2_ERROR_INVALID_INPUT,
+            ssimulacra2_context_set_fast(nullptr, 1));
+  ASSERT_EQ(SSIMULACRA2_OK, ssimulacra2_context_set_fast(context, 1));
+  const double fast = ssimulacra2_compute_from_memory_with_context(
+      context, pair.original.data(), pair.original.size(),
+      pair.distorted.data(), pair.distorted.size(), &result);
+  ASSERT_EQ(SSIMULACRA2_OK, result);
+  EXPECT_NE(f16, fast);
+  EXPECT_NEAR(score, fast, 0.9);
+  ASSERT_EQ(SSIMULACRA2_OK, ssimulacra2_context_set_fast(context, 0));
+
+  // Only within the context.
+  EXPECT_EQ(score, ssimulacra2_compute_from_memory(
+                       pair.original.data(), pair.original.size(),
+                       pair.distorted.data(), pair.distorted.size(), &result));
+  ASSERT_EQ(SSIMULACRA2_OK, ssimulacra2_context_set_f16_pyramid(context, 0));
+  EXPECT_EQ(score, ssimulacra2_compute_from_memory_with_context(
+                       context, pair.original.data(), pair.original.size(),
+                       pair.distorted.data(), pair.distorted.size(),
+                       &result));
+  ssimulacra2_context_destroy(context);
+}
+
+}  // namespace
@@ -0,0 +1,103 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "ssimulacra2_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <utility>
+
+#include "lib/jxl/base/file_io.h"
+#include "lib/jxl/base/hash.h"
+
+namespace {
+
+// Changes whenever the scores or the values stored for them change.
+const char kCacheVersion[] = "SSIMULACRA 2.1, cache 3";
+
+} // namespace
+
+SSIMULACRA2ScoreCache::SSIMULACRA2ScoreCache(const std::string &cache_dir)
+    : pathname_(cache_dir + "/scores") {}
+
+uint64_t SSIMULACRA2ScoreCache::Key(const uint8_t *orig, size_t orig_size,
+                                    const uint8_t *distorted,
+                                    size_t distorted_size,
+                                    const std::string &options) {
+  uint64_t key = jxl::HashBytes(kCacheVersion, sizeof(kCacheVersion));
+  key = jxl::HashBytes(orig, orig_size, key);
+  key = jxl::HashBytes(distorted, distorted_size, key);
+  return jxl::HashBytes(options.data(), options.size(), key);
+}
+
+// Each entry is a line with the key and the values in hexadecimal, so that
+// they are read back exactly. Incomplete lines (from an interrupted append)
+// are skipped.
+void SSIMULACRA2ScoreCache::ReadNewEntries() {
+  jxl::FileWrapper f(pathname_, "rb");
+  if (f == nullptr || f.size() < 0) return;
+  if (static_cast<size_t>(f.size()) < read_size_) {
+    // Replaced by a new file.
+    entries_.clear();
+    read_size_ = 0;
+  }
+  if (fseek(f, static_cast<long>(read_size_), SEEK_SET) != 0) return;
+  std::string contents(static_cast<size_t>(f.size()) - read_size_, '\0');
+  contents.resize(fread(&contents[0], 1, contents.size(), f));
+  size_t pos = 0;
+  while (pos < contents.size()) {
+    const size_t end = contents.find('\n', pos);
+    if (end == std::string::npos) break;
+    const std::string line = contents.substr(pos, end - pos);
+    pos = end + 1;
+    const char *p = line.c_str();
+    char *next;
+    const uint64_t key = strtoull(p, &next, 16);
+    if (next == p) continue;
+    std::vector<double> parsed;
+    for (p = next; *p == ' '; p = next) {
+      parsed.push_back(strtod(p, &next));
+      if (next == p) break;
+    }
+    if (*p != '\0') continue;
+    entries_[key] = std::move(parsed);
+  }
+  // An entry that is being appended is read next time.
+  read_size_ += pos;
+}
+
+bool SSIMULACRA2ScoreCache::Lookup(uint64_t key,
+                                   std::vector<double> *values) {
+  ReadNewEntries();
+  const auto it = entries_.find(key);
+  if (it == entries_.end()) return false;
+  *values = it->second;
+  return true;
+}
+
+jxl::Status SSIMULACRA2ScoreCache::Insert(uint64_t key,
+                                          const std::vector<double> &values) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(key));
+  std::string line = buf;
+  for (double value : values) {
+    snprintf(buf, sizeof(buf), " %a", value);
+    line += buf;
+  }
+  line += '\n';
+  // Buffered whole and written once in append mode, so that concurrent
+  // entries do not mix.
+  jxl::FileWrapper f(pathname_, "ab");
+  if (f == nullptr) {
+    return JXL_FAILURE("Failed to open %s for appending", pathname_.c_str());
+  }
+  setvbuf(f, nullptr, _IOFBF, line.size() + 1);
+  if (fwrite(line.data(), 1, line.size(), f) != line.size()) {
+    return JXL_FAILURE("Failed to write %s", pathname_.c_str());
+  }
+  return true;
+}
@@ -0,0 +1,55 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_SSIMULACRA2_CACHE_H_
+#define TOOLS_SSIMULACRA2_CACHE_H_
+
+// Local cache of results, so that pairs of images that were scored before
+// are not decoded again.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lib/jxl/base/status.h"
+
+// Append-only file of results, each a list of values (e.g. the score and the
+// features), keyed by a hash of the encoded images and of everything else the
+// result depends on. Several processes may use the same file concurrently.
+// The entries are read into an index once, and afterwards only those that were
+// appended since; an object is not thread-safe.
+class SSIMULACRA2ScoreCache {
+public:
+  // Uses the file "scores" in the existing directory 'cache_dir'.
+  explicit SSIMULACRA2ScoreCache(const std::string &cache_dir);
+
+  // Returns the key of the result for the encoded images 'orig' and
+  // 'distorted' with 'options', a description of the other inputs (e.g. a
+  // region of interest). The version of the metric is included.
+  static uint64_t Key(const uint8_t *orig, size_t orig_size,
+                      const uint8_t *distorted, size_t distorted_size,
+                      const std::string &options);
+
+  // Sets 'values' to the ones last stored for 'key', or returns false if
+  // there are none.
+  bool Lookup(uint64_t key, std::vector<double> *values);
+
+  // Appends 'values' for 'key' to the file.
+  jxl::Status Insert(uint64_t key, const std::vector<double> &values);
+
+private:
+  // Adds the entries that were appended to the file since the last call.
+  void ReadNewEntries();
+
+  std::string pathname_;
+  std::unordered_map<uint64_t, std::vector<double>> entries_;
+  // Bytes of the file up to the last complete entry read so far.
+  size_t read_size_ = 0;
+};
+
+#endif  // TOOLS_SSIMULACRA2_CACHE_H_
@@ -0,0 +1,98 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "ssimulacra2_cache.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "lib/jxl/base/file_io.h"
+
+namespace {
+
+// A cache in the temporary directory, empty at first.
+class SSIMULACRA2ScoreCacheTest : public testing::Test {
+protected:
+  void SetUp() override { remove(Pathname().c_str()); }
+  void TearDown() override { remove(Pathname().c_str()); }
+
+  static std::string Dir() { return testing::TempDir(); }
+  static std::string Pathname() { return Dir() + "/scores"; }
+};
+
+TEST_F(SSIMULACRA2ScoreCacheTest, KeyDependsOnAllInputs) {
+  const uint8_t a[] = {1, 2, 3};
+  const uint8_t b[] = {1, 2, 4};
+  const uint64_t key = SSIMULACRA2ScoreCache::Key(a, 3, b, 3, "");
+  EXPECT_EQ(key, SSIMULACRA2ScoreCache::Key(a, 3, b, 3, ""));
+  EXPECT_NE(key, SSIMULACRA2ScoreCache::Key(b, 3, a, 3, ""));
+  EXPECT_NE(key, SSIMULACRA2ScoreCache::Key(a, 3, b, 2, ""));
+  EXPECT_NE(key, SSIMULACRA2ScoreCache::Key(a, 3, b, 3, "roi"));
+}
+
+TEST_F(SSIMULACRA2ScoreCacheTest, LookupFindsInsertedValues) {
+  SSIMULACRA2ScoreCache cache(Dir());
+  std::vector<double> values;
+  EXPECT_FALSE(cache.Lookup(1, &values));
+  const std::vector<double> stored = {87.5, 0.1, 1.0 / 3};
+  ASSERT_TRUE(cache.Insert(1, stored));
+  ASSERT_TRUE(cache.Lookup(1, &values));
+  EXPECT_EQ(stored, values);
+  EXPECT_FALSE(cache.Lookup(2, &values));
+
+  // The last stored values win, also when another object (e.g. of another
+  // process) stored them after this one indexed the file.
+  SSIMULACRA2ScoreCache other(Dir());
+  ASSERT_TRUE(other.Insert(1, {50.0}));
+  ASSERT_TRUE(other.Insert(2, {60.0}));
+  ASSERT_TRUE(cache.Lookup(1, &values));
+  EXPECT_EQ(std::vector<double>{50.0}, values);
+  ASSERT_TRUE(cache.Lookup(2, &values));
+  EXPECT_EQ(std::vector<double>{60.0}, values);
+}
+
+TEST_F(SSIMULACRA2ScoreCacheTest, IncompleteEntriesAreReadOnceComplete) {
+  SSIMULACRA2ScoreCache cache(Dir());
+  ASSERT_TRUE(cache.Insert(1, {70.0}));
+  std::vector<double> values;
+  ASSERT_TRUE(cache.Lookup(1, &values));
+
+  // Another process in the middle of appending an entry.
+  std::string line = "0000000000000003 0x1.2p+6";
+  {
+    jxl::FileWrapper f(Pathname(), "ab");
+    ASSERT_EQ(line.size(), fwrite(line.data(), 1, line.size(), f));
+  }
+  EXPECT_FALSE(cache.Lookup(3, &values));
+  {
+    jxl::FileWrapper f(Pathname(), "ab");
+    ASSERT_EQ(1u, fwrite("\n", 1, 1, f));
+  }
+  ASSERT_TRUE(cache.Lookup(3, &values));
+  EXPECT_EQ(std::vector<double>{72.0}, values);
+  ASSERT_TRUE(cache.Lookup(1, &values));
+  EXPECT_EQ(std::vector<double>{70.0}, values);
+}
+
+TEST_F(SSIMULACRA2ScoreCacheTest, CorruptEntriesAreSkipped) {
+  const std::string contents = "0000000000000001 0x1p+6\n"
+                               "0000000000000002 garbage\n"
+                               "not a key\n"
+                               "0000000000000004 0x1p+5\n";
+  ASSERT_TRUE(jxl::WriteFile(contents, Pathname()));
+  SSIMULACRA2ScoreCache cache(Dir());
+  std::vector<double> values;
+  ASSERT_TRUE(cache.Lookup(1, &values));
+  EXPECT_EQ(std::vector<double>{64.0}, values);
+  EXPECT_FALSE(cache.Lookup(2, &values));
+  ASSERT_TRUE(cache.Lookup(4, &values));
+  EXPECT_EQ(std::vector<double>{32.0}, values);
+}
+
+}  // namespace
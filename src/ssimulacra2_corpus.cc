@@ -0,0 +1,266 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Measures how far the score computed with SSIMULACRA2Options deviates from
+// the exact score, on a synthetic corpus that is generated the same way on
+// every run: 8 color originals of 512x384 with smooth areas, edges and
+// textures, each compared with
+//   - JPEG at quality 10, 25, 45, 65, 80, 90 and 95,
+//   - Gaussian noise of sigma 2 and 6 (of 255),
+//   - a horizontal [1 2 1] / 4 blur,
+// and their gray versions with JPEG at quality 45 and noise of sigma 2, and
+// versions with a varying alpha with noise of sigma 2: 104 pairs. Prints the
+// exact and approximate score of each pair, then the mean and largest
+// deviation, and the largest for exact scores below 95. The deviations
+// stated in ssimulacra2.h are those of this corpus.
+//
+// Usage: ssimulacra2_corpus [--f16] [--fast]
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lib/extras/codec.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/codec_in_out.h"
+#include "lib/jxl/image_ops.h"
+#include "ssimulacra2.h"
+
+namespace {
+
+const size_t kXSize = 512;
+const size_t kYSize = 384;
+
+float Hash(int x, int y, int seed) {
+  uint32_t h = x * 374761393u + y * 668265263u + seed * 2246822519u;
+  h = (h ^ (h >> 13)) * 1274126177u;
+  return (h ^ (h >> 16)) / 4294967296.0f;
+}
+
+// Smoothly interpolated noise of period 1.
+float ValueNoise(float x, float y, int seed) {
+  const int xi = static_cast<int>(floorf(x));
+  const int yi = static_cast<int>(floorf(y));
+  float fx = x - xi;
+  float fy = y - yi;
+  fx = fx * fx * (3 - 2 * fx);
+  fy = fy * fy * (3 - 2 * fy);
+  const float top = Hash(xi, yi, seed) +
+                    (Hash(xi + 1, yi, seed) - Hash(xi, yi, seed)) * fx;
+  const float bottom =
+      Hash(xi, yi + 1, seed) +
+      (Hash(xi + 1, yi + 1, seed) - Hash(xi, yi + 1, seed)) * fx;
+  return top + (bottom - top) * fy;
+}
+
+float FractalNoise(float x, float y, int seed, int octaves) {
+  float v = 0.0f, amplitude = 0.5f, frequency = 1.0f;
+  for (int i = 0; i < octaves; ++i) {
+    v += amplitude * ValueNoise(x * frequency, y * frequency, seed + i);
+    amplitude *= 0.5f;
+    frequency *= 2.0f;
+  }
+  return v;
+}
+
+float Quantize(float v) {
+  return std::min(std::max(roundf(255.0f * v), 0.0f), 255.0f) / 255.0f;
+}
+
+// Sets 'io' to an 8-bit sRGB image: gray (with three equal planes) if
+// 'is_gray', with the alpha of 'alpha' unless it is null.
+void SetImage(jxl::Image3F &&color, bool is_gray, const jxl::ImageF *alpha,
+              jxl::CodecInOut *io) {
+  const jxl::ColorEncoding &c_srgb = jxl::ColorEncoding::SRGB(is_gray);
+  io->metadata.m.SetUintSamples(8);
+  io->metadata.m.color_encoding = c_srgb;
+  if (alpha) io->metadata.m.SetAlphaBits(8);
+  io->SetFromImage(std::move(color), c_srgb);
+  if (alpha) {
+    io->Main().SetAlpha(jxl::CopyImage(*alpha),
+                        /*alpha_is_premultiplied=*/false);
+  }
+}
+
+// Original number 'k' of the corpus.
+jxl::Image3F Original(int k) {
+  jxl::Image3F color(kXSize, kYSize);
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < kYSize; ++y) {
+      float *JXL_RESTRICT row = color.PlaneRow(c, y);
+      for (size_t x = 0; x < kXSize; ++x) {
+        const float scale = 0.004f * (1 + k % 4);
+        float v = FractalNoise(x * scale, y * scale, k * 10 + c, 3 + k % 5);
+        if (k % 3 == 0) {  // Edges
+          v = 0.6f * v + 0.4f * ((x / (8 + 4 * k) + y / (12 + 2 * k)) % 2);
+        }
+        if (k % 3 == 1) v += 0.15f * sinf(x * 0.3f + y * 0.05f * k);
+        if (k % 4 == 2) v = 0.3f + 0.5f * v * v;  // Dark
+        if (k == 7) v = 0.9f * v + 0.1f * (c == 0);  // Tinted
+        row[x] = Quantize(v);
+      }
+    }
+  }
+  return color;
+}
+
+// Gray version of 'color', as three equal planes.
+jxl::Image3F Gray(const jxl::Image3F &color) {
+  jxl::Image3F gray(color.xsize(), color.ysize());
+  for (size_t y = 0; y < color.ysize(); ++y) {
+    for (size_t x = 0; x < color.xsize(); ++x) {
+      const float v = Quantize(0.3f * color.ConstPlaneRow(0, y)[x] +
+                               0.6f * color.ConstPlaneRow(1, y)[x] +
+                               0.1f * color.ConstPlaneRow(2, y)[x]);
+      for (size_t c = 0; c < 3; ++c) gray.PlaneRow(c, y)[x] = v;
+    }
+  }
+  return gray;
+}
+
+jxl::ImageF Alpha() {
+  jxl::ImageF alpha(kXSize, kYSize);
+  for (size_t y = 0; y < kYSize; ++y) {
+    for (size_t x = 0; x < kXSize; ++x) {
+      alpha.Row(y)[x] = Quantize(0.5f + 0.5f * sinf(0.05f * (x + 2 * y)));
+    }
+  }
+  return alpha;
+}
+
+// Adds Gaussian noise of 'sigma' (of 255), the same to all planes if
+// 'is_gray'.
+jxl::Image3F Noisy(const jxl::Image3F &color, bool is_gray, float sigma,
+                   jxl::Rng *rng) {
+  jxl::Image3F noisy = jxl::CopyImage(color);
+  for (size_t y = 0; y < color.ysize(); ++y) {
+    for (size_t x = 0; x < color.xsize(); ++x) {
+      float noise = 0.0f;
+      for (size_t c = 0; c < 3; ++c) {
+        if (c == 0 || !is_gray) {
+          // Sum of 12 uniform values, of variance 1.
+          noise = -6.0f;
+          for (int i = 0; i < 12; ++i) noise += rng->UniformF(0.0f, 1.0f);
+        }
+        float &v = noisy.PlaneRow(c, y)[x];
+        v = Quantize(v + noise * sigma / 255.0f);
+      }
+    }
+  }
+  return noisy;
+}
+
+jxl::Image3F Blurred(const jxl::Image3F &color) {
+  jxl::Image3F blurred = jxl::CopyImage(color);
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < color.ysize(); ++y) {
+      const float *JXL_RESTRICT row = color.ConstPlaneRow(c, y);
+      float *JXL_RESTRICT row_out = blurred.PlaneRow(c, y);
+      for (size_t x = 1; x + 1 < color.xsize(); ++x) {
+        row_out[x] = Quantize((row[x - 1] + 2 * row[x] + row[x + 1]) / 4);
+      }
+    }
+  }
+  return blurred;
+}
+
+// Encodes 'io' as JPEG of 'quality' and decodes it into 'out'.
+bool JPEG(const jxl::CodecInOut &io, size_t quality, jxl::CodecInOut *out) {
+  jxl::CodecInOut copy;
+  copy.metadata = io.metadata;
+  copy.SetFromImage(jxl::CopyImage(io.Main().color()), io.Main().c_current());
+  copy.jpeg_quality = quality;
+  std::vector<uint8_t> bytes;
+  return jxl::Encode(copy, jxl::extras::Codec::kJPG, copy.Main().c_current(),
+                     /*bits_per_sample=*/8, &bytes) &&
+         jxl::SetFromBytes(jxl::Span<const uint8_t>(bytes), out);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  SSIMULACRA2Options options;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--f16") == 0) {
+      options.f16_pyramid = true;
+    } else if (strcmp(argv[i], "--fast") == 0) {
+      options.fast = true;
+    } else {
+      fprintf(stderr, "Usage: %s [--f16] [--fast]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  jxl::Rng rng(7);
+  const jxl::ImageF alpha = Alpha();
+  size_t num_pairs = 0;
+  double sum = 0.0, max = 0.0, max_below_95 = 0.0;
+  std::string worst;
+  const auto compare = [&](const std::string &name, const jxl::CodecInOut &orig,
+                           const jxl::CodecInOut &dist) {
+    const double exact =
+        WorstOverBackgrounds(orig.Main(), [&](float bg) {
+          return ComputeSSIMULACRA2(orig.Main(), dist.Main(), bg);
+        }).Score();
+    const double approx =
+        WorstOverBackgrounds(orig.Main(), [&](float bg) {
+          return ComputeSSIMULACRA2(orig.Main(), dist.Main(), bg, options);
+        }).Score();
+    printf("%-14s %12.8f %12.8f\n", name.c_str(), exact, approx);
+    const double deviation = fabs(approx - exact);
+    ++num_pairs;
+    sum += deviation;
+    if (exact < 95.0) max_below_95 = std::max(max_below_95, deviation);
+    if (deviation > max) {
+      max = deviation;
+      worst = name;
+    }
+  };
+
+  for (int k = 0; k < 8; ++k) {
+    const std::string name = "o" + std::to_string(k);
+    const jxl::Image3F color = Original(k);
+    jxl::CodecInOut orig, dist;
+    SetImage(jxl::CopyImage(color), /*is_gray=*/false, nullptr, &orig);
+    for (size_t quality : {10, 25, 45, 65, 80, 90, 95}) {
+      if (!JPEG(orig, quality, &dist)) {
+        fprintf(stderr, "Failed to encode JPEG\n");
+        return 1;
+      }
+      compare(name + "_q" + std::to_string(quality), orig, dist);
+    }
+    for (int sigma : {2, 6}) {
+      SetImage(Noisy(color, /*is_gray=*/false, sigma, &rng), false, nullptr,
+               &dist);
+      compare(name + "_n" + std::to_string(sigma), orig, dist);
+    }
+    SetImage(Blurred(color), false, nullptr, &dist);
+    compare(name + "_blur", orig, dist);
+
+    const jxl::Image3F gray = Gray(color);
+    SetImage(jxl::CopyImage(gray), /*is_gray=*/true, nullptr, &orig);
+    if (!JPEG(orig, 45, &dist)) {
+      fprintf(stderr, "Failed to encode JPEG\n");
+      return 1;
+    }
+    compare(name + "_gray_q45", orig, dist);
+    SetImage(Noisy(gray, /*is_gray=*/true, 2, &rng), true, nullptr, &dist);
+    compare(name + "_gray_n2", orig, dist);
+
+    SetImage(jxl::CopyImage(color), /*is_gray=*/false, &alpha, &orig);
+    SetImage(Noisy(color, /*is_gray=*/false, 2, &rng), false, &alpha, &dist);
+    compare(name + "_alpha_n2", orig, dist);
+  }
+  printf("pairs %zu, deviation mean %.4f, max %.4f (%s), below 95 max %.4f\n",
+         num_pairs, sum / num_pairs, max, worst.c_str(), max_below_95);
+  return 0;
+}
@@ -0,0 +1,327 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Benchmarks of the stages of SSIMULACRA 2 and of the whole computation, on
+// synthetic images. Throughput is reported as pixels/s of the input, over
+// sizes from 64x64 to 8K and for gray, color and color with alpha.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/extras/codec.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/codec_in_out.h"
+#include "lib/jxl/enc_color_management.h"
+#include "lib/jxl/gauss_blur.h"
+#include "lib/jxl/image_ops.h"
+#include "ssimulacra2.h"
+#include "ssimulacra2_stages.h"
+
+namespace {
+
+using jxl::Image3F;
+using jxl::ImageF;
+
+// Sizes of the sweep, up to 8K UHD.
+const int64_t kSizes[][2] = {{64, 64},     {256, 256},   {1024, 1024},
+                             {1920, 1080}, {3840, 2160}, {7680, 4320}};
+
+void SizeArgs(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"xsize", "ysize"});
+  for (const auto &size : kSizes) b->Args({size[0], size[1]});
+}
+
+// Gray (1), color (3) and color with alpha (4).
+void SizeAndChannelsArgs(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"xsize", "ysize", "channels"});
+  for (const auto &size : kSizes) {
+    for (int64_t channels : {1, 3, 4}) b->Args({size[0], size[1], channels});
+  }
+}
+
+// Same, without alpha, for the stages after blending.
+void SizeAndPlanesArgs(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"xsize", "ysize", "channels"});
+  for (const auto &size : kSizes) {
+    for (int64_t channels : {1, 3}) b->Args({size[0], size[1], channels});
+  }
+}
+
+void SetPixelsProcessed(benchmark::State &state, size_t xsize, size_t ysize) {
+  state.counters["pixels"] = benchmark::Counter(
+      static_cast<double>(xsize * ysize),
+      benchmark::Counter::kIsIterationInvariantRate);
+}
+
+void FillRandom(jxl::Rng *rng, float lo, float hi, ImageF *plane) {
+  for (size_t y = 0; y < plane->ysize(); ++y) {
+    float *JXL_RESTRICT row = plane->Row(y);
+    for (size_t x = 0; x < plane->xsize(); ++x) {
+      row[x] = rng->UniformF(lo, hi);
+    }
+  }
+}
+
+// Returns uniform noise in 0..1 in every plane.
+Image3F RandomImage(size_t xsize, size_t ysize, uint64_t seed) {
+  jxl::Rng rng(seed);
+  Image3F image(xsize, ysize);
+  for (size_t c = 0; c < 3; ++c) FillRandom(&rng, 0.f, 1.f, &image.Plane(c));
+  return image;
+}
+
+ImageF RandomPlane(size_t xsize, size_t ysize, float lo, float hi,
+                   uint64_t seed) {
+  jxl::Rng rng(seed);
+  ImageF plane(xsize, ysize);
+  FillRandom(&rng, lo, hi, &plane);
+  return plane;
+}
+
+// Sets 'io' to an 8-bit sRGB image with 'channels' channels as above;
+// gray images have three equal planes.
+void RandomCodecInOut(size_t xsize, size_t ysize, size_t channels,
+                      uint64_t seed, jxl::CodecInOut *io) {
+  jxl::Rng rng(seed);
+  const bool is_gray = channels == 1;
+  Image3F color(xsize, ysize);
+  FillRandom(&rng, 0.f, 1.f, &color.Plane(0));
+  for (size_t c = 1; c < 3; ++c) {
+    if (is_gray) {
+      jxl::CopyImageTo(color.Plane(0), &color.Plane(c));
+    } else {
+      FillRandom(&rng, 0.f, 1.f, &color.Plane(c));
+    }
+  }
+  const jxl::ColorEncoding &c_srgb = jxl::ColorEncoding::SRGB(is_gray);
+  io->metadata.m.SetUintSamples(8);
+  io->metadata.m.color_encoding = c_srgb;
+  if (channels == 4) io->metadata.m.SetAlphaBits(8);
+  io->SetFromImage(std::move(color), c_srgb);
+  if (channels == 4) {
+    io->Main().SetAlpha(RandomPlane(xsize, ysize, 0.f, 1.f, seed + 1),
+                        /*alpha_is_premultiplied=*/false);
+  }
+}
+
+// Sets 'dist' to 'orig' with small noise added.
+void Distort(const jxl::CodecInOut &orig, uint64_t seed,
+             jxl::CodecInOut *dist) {
+  jxl::Rng rng(seed);
+  const jxl::ImageBundle &ib = orig.Main();
+  Image3F color = jxl::CopyImage(ib.color());
+  ImageF noise(ib.xsize(), ib.ysize());
+  FillRandom(&rng, -0.05f, 0.05f, &noise);
+  for (size_t c = 0; c < 3; ++c) {
+    // Gray images get the same noise in all planes, so that they stay gray.
+    if (!ib.IsGray() && c != 0) FillRandom(&rng, -0.05f, 0.05f, &noise);
+    jxl::AddTo(noise, &color.Plane(c));
+  }
+  dist->metadata = orig.metadata;
+  dist->SetFromImage(std::move(color), ib.c_current());
+  if (ib.HasAlpha()) {
+    dist->Main().SetAlpha(jxl::CopyImage(ib.alpha()),
+                          /*alpha_is_premultiplied=*/false);
+  }
+}
+
+void BM_Decode(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  jxl::CodecInOut io;
+  RandomCodecInOut(xsize, ysize, state.range(2), 1, &io);
+  std::vector<uint8_t> bytes;
+  JXL_CHECK(jxl::Encode(io, jxl::extras::Codec::kPNM, io.Main().c_current(),
+                        /*bits_per_sample=*/8, &bytes));
+  // PNM has no color encoding.
+  jxl::extras::ColorHints hints;
+  hints.Add("color_space", jxl::Description(io.Main().c_current()));
+  for (auto _ : state) {
+    jxl::CodecInOut decoded;
+    JXL_CHECK(
+        jxl::SetFromBytes(jxl::Span<const uint8_t>(bytes), hints, &decoded));
+    benchmark::DoNotOptimize(decoded.Main().color());
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_Decode)->Apply(SizeAndChannelsArgs);
+
+void BM_TransformTo(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  jxl::CodecInOut io;
+  RandomCodecInOut(xsize, ysize, state.range(2), 1, &io);
+  const jxl::ColorEncoding &c_linear =
+      jxl::ColorEncoding::LinearSRGB(io.Main().IsGray());
+  for (auto _ : state) {
+    state.PauseTiming();
+    jxl::ImageBundle ib = io.Main().Copy();
+    state.ResumeTiming();
+    JXL_CHECK(ib.TransformTo(c_linear, jxl::GetJxlCms()));
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_TransformTo)->Apply(SizeAndPlanesArgs);
+
+// Blending, linearization and positive XYB of sRGB input, which skip
+// TransformTo.
+void BM_ToLinearAndPositiveXYB(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  jxl::CodecInOut io;
+  RandomCodecInOut(xsize, ysize, state.range(2), 1, &io);
+  for (auto _ : state) {
+    if (io.Main().IsGray()) {
+      ImageF linear, y;
+      ssimulacra2_stages::ToLinearAndPositiveXYB(io.Main(), 0.5f, &linear, &y);
+      benchmark::DoNotOptimize(y.Row(0));
+    } else {
+      Image3F linear, xyb;
+      ssimulacra2_stages::ToLinearAndPositiveXYB(io.Main(), 0.5f, &linear,
+                                                 &xyb);
+      benchmark::DoNotOptimize(xyb.PlaneRow(0, 0));
+    }
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_ToLinearAndPositiveXYB)->Apply(SizeAndChannelsArgs);
+
+// ToXYB followed by MakePositiveXYB, which are done in a single pass.
+void BM_PositiveXYBFromLinear(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  const Image3F linear = RandomImage(xsize, ysize, 1);
+  Image3F xyb(xsize, ysize);
+  ImageF y(xsize, ysize);
+  for (auto _ : state) {
+    if (state.range(2) == 1) {
+      ssimulacra2_stages::PositiveXYBFromLinear(linear.Plane(1), 255.f, &y);
+    } else {
+      ssimulacra2_stages::PositiveXYBFromLinear(linear, 255.f, &xyb);
+    }
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_PositiveXYBFromLinear)->Apply(SizeAndPlanesArgs);
+
+// Downsampling of linear RGB to the next scale and its positive XYB. The
+// pixels are those of the finer scale.
+void BM_Downsample(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  const size_t out_xsize = (xsize + 1) / 2;
+  const size_t out_ysize = (ysize + 1) / 2;
+  const Image3F linear = RandomImage(xsize, ysize, 1);
+  Image3F out(out_xsize, out_ysize), xyb(out_xsize, out_ysize);
+  ImageF out_y(out_xsize, out_ysize), y(out_xsize, out_ysize);
+  for (auto _ : state) {
+    if (state.range(2) == 1) {
+      ssimulacra2_stages::Downsample2x2AndPositiveXYB(linear.Plane(1), 255.f,
+                                                      &out_y, &y);
+    } else {
+      ssimulacra2_stages::Downsample2x2AndPositiveXYB(linear, 255.f, &out,
+                                                      &xyb);
+    }
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_Downsample)->Apply(SizeAndPlanesArgs);
+
+// The remaining stages run once per plane; the pixels are those of one plane.
+
+void BM_Multiply(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  const ImageF a = RandomPlane(xsize, ysize, 0.f, 1.f, 1);
+  const ImageF b = RandomPlane(xsize, ysize, 0.f, 1.f, 2);
+  ImageF mul(xsize, ysize);
+  for (auto _ : state) {
+    ssimulacra2_stages::Multiply(a, b, &mul);
+    benchmark::DoNotOptimize(mul.Row(0));
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_Multiply)->Apply(SizeArgs);
+
+void BM_FastGaussian(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  const ImageF in = RandomPlane(xsize, ysize, 0.f, 1.f, 1);
+  ImageF temp(xsize, ysize), out(xsize, ysize);
+  const hwy::AlignedUniquePtr<jxl::RecursiveGaussian> rg =
+      jxl::CreateRecursiveGaussian(ssimulacra2_stages::kBlurSigma);
+  jxl::ThreadPool *null_pool = nullptr;
+  for (auto _ : state) {
+    jxl::FastGaussian(rg, in, null_pool, &temp, &out);
+    benchmark::DoNotOptimize(out.Row(0));
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_FastGaussian)->Apply(SizeArgs);
+
+void BM_SSIMMap(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  const ImageF m1 = RandomPlane(xsize, ysize, 0.f, 1.f, 1);
+  const ImageF m2 = RandomPlane(xsize, ysize, 0.f, 1.f, 2);
+  const ImageF s11 = RandomPlane(xsize, ysize, 0.f, 1.f, 3);
+  const ImageF s22 = RandomPlane(xsize, ysize, 0.f, 1.f, 4);
+  const ImageF s12 = RandomPlane(xsize, ysize, 0.f, 1.f, 5);
+  for (auto _ : state) {
+    double sums[2] = {0.0};
+    ssimulacra2_stages::SSIMMap(m1, m2, s11, s22, s12, sums);
+    benchmark::DoNotOptimize(sums);
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_SSIMMap)->Apply(SizeArgs);
+
+void BM_EdgeDiffMap(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  const ImageF img1 = RandomPlane(xsize, ysize, 0.f, 1.f, 1);
+  const ImageF mu1 = RandomPlane(xsize, ysize, 0.f, 1.f, 2);
+  const ImageF img2 = RandomPlane(xsize, ysize, 0.f, 1.f, 3);
+  const ImageF mu2 = RandomPlane(xsize, ysize, 0.f, 1.f, 4);
+  for (auto _ : state) {
+    double sums[4] = {0.0};
+    ssimulacra2_stages::EdgeDiffMap(img1, mu1, img2, mu2, sums);
+    benchmark::DoNotOptimize(sums);
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_EdgeDiffMap)->Apply(SizeArgs);
+
+// ComputeSSIMULACRA2 from decoded images; images with alpha are scored
+// against a dark and a bright background, as by the command-line tool.
+void BM_EndToEnd(benchmark::State &state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = state.range(1);
+  jxl::CodecInOut orig, dist;
+  RandomCodecInOut(xsize, ysize, state.range(2), 1, &orig);
+  Distort(orig, 3, &dist);
+  for (auto _ : state) {
+    if (orig.Main().HasAlpha()) {
+      benchmark::DoNotOptimize(
+          ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.1f).Score());
+      benchmark::DoNotOptimize(
+          ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.9f).Score());
+    } else {
+      benchmark::DoNotOptimize(
+          ComputeSSIMULACRA2(orig.Main(), dist.Main()).Score());
+    }
+  }
+  SetPixelsProcessed(state, xsize, ysize);
+}
+BENCHMARK(BM_EndToEnd)->Apply(SizeAndChannelsArgs)->Unit(
+    benchmark::kMillisecond);
+
+} // namespace
+
+BENCHMARK_MAIN();
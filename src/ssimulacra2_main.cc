@@ -3,13 +3,30 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <hwy/targets.h>
 
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "lib/extras/codec.h"
+#include "lib/extras/enc/encode.h"
+#include "lib/extras/time.h"
+#include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/file_io.h"
+#include "lib/jxl/base/hash.h"
+#include "lib/jxl/base/scope_guard.h"
 #include "lib/jxl/color_management.h"
 #include "lib/jxl/enc_color_management.h"
 #include "ssimulacra2.h"
+#include "ssimulacra2_cache.h"
+#include "ssimulacra2_trace.h"
 
 int PrintUsage(char **argv) {
   std::string config;
@@ -28,7 +45,69 @@ int PrintUsage(char **argv) {
   config += "]";
 
   fprintf(stderr, "SSIMULACRA 2.1 %s\n", config.c_str());
-  fprintf(stderr, "Usage: %s original.png distorted.png\n", argv[0]);
+  fprintf(stderr,
+          "Usage: %s [--features] [--stats] [--f16] [--fast] "
+          "[--roi x0,y0,xsize,ysize | "
+          "--tiles size | --maps prefix.ext --heatmap map.ext | --band i/n | "
+          "--ref-cache dir | --max-bytes n] [--score-cache dir] "
+          "[--trace out.json] "
+          "original.png distorted.png\n"
+          "       %s --merge bands.txt...\n",
+          argv[0], argv[0]);
+  fprintf(stderr,
+          "  --features: also print the 108 norms that the score is computed "
+          "from, comma-separated\n");
+  fprintf(stderr,
+          "  --stats: also print the time spent in each stage to stderr; not "
+          "with --roi, --tiles, --maps, --band, --ref-cache or "
+          "--score-cache\n");
+  fprintf(stderr,
+          "  --f16: keep the linear images of the scales as half floats, "
+          "which saves memory but changes the score slightly; not with "
+          "--roi, --tiles, --maps, --band or --ref-cache\n");
+  fprintf(stderr,
+          "  --fast: approximate the score faster, e.g. to pre-filter "
+          "candidates (see SSIMULACRA2Options in ssimulacra2.h for how far "
+          "it deviates); not with the same options as --f16\n");
+  fprintf(stderr,
+          "  --trace: write a timeline of the stages as Chrome trace-event "
+          "JSON, e.g. for Perfetto\n");
+  fprintf(stderr,
+          "  --roi: only count errors in this rectangle; the rows not needed "
+          "for it are not decoded if possible\n");
+  fprintf(stderr,
+          "  --tiles: also print the scores of size x size tiles, one row of "
+          "tiles per line\n");
+  fprintf(stderr,
+          "  --maps: write the error maps of each kind, plane and scale to "
+          "prefix-ssim-Y-1.ext etc.\n");
+  fprintf(stderr,
+          "  --heatmap: write the weighted sum of all error maps at full "
+          "resolution\n");
+  fprintf(stderr,
+          "  --band: instead of the score, print the error sums of band i (0 "
+          "to n-1) of n bands of rows; only the rows needed for it are "
+          "decoded if possible\n");
+  fprintf(stderr,
+          "  --merge: print the score of the band sums in the given files, "
+          "which must cover the images exactly once; it differs from the "
+          "score of the whole images by about 0.001\n");
+  fprintf(stderr,
+          "  --ref-cache: load the preprocessed original from dir instead of "
+          "decoding it, keyed by a hash of its file; store it there first if "
+          "missing\n");
+  fprintf(stderr,
+          "  --max-bytes: decode and compare the images in strips of rows "
+          "that need at most about n bytes besides the encoded files, with "
+          "the same score, or in tiles below the budget of the shortest "
+          "strips; PNG and JPEG are decoded one strip at a time\n");
+  fprintf(stderr,
+          "  --score-cache: look up the score (and features) in dir before "
+          "decoding, keyed by a hash of both files and the options; store it "
+          "there if missing\n");
+  fprintf(stderr,
+          "  Maps are written as .pfm or .npy floats, or scaled to the largest "
+          "error in .png/.pgm\n");
   fprintf(stderr,
           "Returns a score in range -inf..100, which correlates to subjective "
           "visual quality:\n");
@@ -74,16 +153,579 @@ int PrintUsage(char **argv) {
   return 1;
 }
 
+// Writes an error map to `pathname`, in the format given by its extension.
+// PFM and NPY store the errors as they are, integer formats such as PNG store
+// them scaled so that the largest one is white.
+bool WriteMap(const jxl::ImageF &map, const std::string &pathname) {
+  std::unique_ptr<jxl::extras::Encoder> encoder =
+      jxl::extras::Encoder::FromExtension(jxl::Extension(pathname));
+  if (!encoder) return false;
+  JxlPixelFormat format = {1, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  for (const JxlPixelFormat &accepted : encoder->AcceptedFormats()) {
+    if (accepted.num_channels != 1) continue;
+    // Prefer float, then 16 bits.
+    if (accepted.data_type == JXL_TYPE_FLOAT ||
+        (accepted.data_type == JXL_TYPE_UINT16 &&
+         format.data_type != JXL_TYPE_FLOAT)) {
+      format = accepted;
+    }
+  }
+  const bool is_float = format.data_type == JXL_TYPE_FLOAT;
+  const bool is_16bit = format.data_type == JXL_TYPE_UINT16;
+  float max_error = 0.0f;
+  for (size_t y = 0; y < map.ysize(); ++y) {
+    const float *row = map.ConstRow(y);
+    for (size_t x = 0; x < map.xsize(); ++x) {
+      max_error = std::max(max_error, row[x]);
+    }
+  }
+  const float max_value = is_16bit ? 65535.0f : 255.0f;
+  const float scale = max_error > 0 ? max_value / max_error : 0.0f;
+
+  jxl::extras::PackedPixelFile ppf;
+  ppf.info.xsize = map.xsize();
+  ppf.info.ysize = map.ysize();
+  ppf.info.num_color_channels = 1;
+  ppf.info.bits_per_sample = is_float ? 32 : is_16bit ? 16 : 8;
+  ppf.info.exponent_bits_per_sample = is_float ? 8 : 0;
+  ppf.color_encoding.color_space = JXL_COLOR_SPACE_GRAY;
+  ppf.color_encoding.white_point = JXL_WHITE_POINT_D65;
+  ppf.color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_LINEAR;
+  ppf.frames.emplace_back(map.xsize(), map.ysize(), format);
+  jxl::extras::PackedImage &image = ppf.frames.back().color;
+  for (size_t y = 0; y < map.ysize(); ++y) {
+    const float *row = map.ConstRow(y);
+    uint8_t *out = static_cast<uint8_t *>(image.pixels()) + y * image.stride;
+    for (size_t x = 0; x < map.xsize(); ++x) {
+      if (is_float) {
+        const float v = row[x];
+        if (format.endianness == JXL_BIG_ENDIAN) {
+          uint32_t bits;
+          memcpy(&bits, &v, 4);
+          StoreBE32(bits, out + 4 * x);
+        } else {
+          memcpy(out + 4 * x, &v, 4);
+        }
+      } else {
+        const uint32_t v = static_cast<uint32_t>(row[x] * scale + 0.5f);
+        if (is_16bit) {
+          StoreBE16(v, out + 2 * x);
+        } else {
+          out[x] = v;
+        }
+      }
+    }
+  }
+  jxl::extras::EncodedImage encoded;
+  return encoder->Encode(ppf, &encoded) && encoded.bitstreams.size() == 1 &&
+         jxl::WriteFile(encoded.bitstreams[0], pathname);
+}
+
+// Writes the maps of all scales, planes and kinds of error to files named
+// after `pattern` (e.g. prefix.pfm gives prefix-ssim-Y-1.pfm, ...), and their
+// weighted combination to `heatmap`; either may be null.
+int ComputeAndWriteMaps(const jxl::CodecInOut &io1, const jxl::CodecInOut &io2,
+                        const char *pattern, const char *heatmap) {
+  // Keep the maps of the background that gives the worse score.
+  std::vector<SSIMULACRA2Maps> all_maps;
+  size_t worst;
+  const double score =
+      WorstOverBackgrounds(io1.Main(),
+                           [&](float bg) {
+                             all_maps.emplace_back();
+                             return ComputeSSIMULACRA2(io1.Main(), io2.Main(),
+                                                       bg, &all_maps.back());
+                           },
+                           &worst)
+          .Score();
+  const SSIMULACRA2Maps &maps = all_maps[worst];
+  printf("%.8f\n", score);
+
+  if (heatmap && !WriteMap(maps.Weighted(), heatmap)) {
+    fprintf(stderr, "Could not write heatmap: %s\n", heatmap);
+    return 1;
+  }
+  if (!pattern) return 0;
+  const std::string extension = jxl::Extension(pattern);
+  const std::string prefix(pattern, strlen(pattern) - extension.size());
+  const char *kinds[3] = {"ssim", "ringing", "blurring"};
+  const std::vector<jxl::Image3F> *kind_maps[3] = {&maps.ssim, &maps.ringing,
+                                                   &maps.blurring};
+  for (size_t k = 0; k < 3; ++k) {
+    for (size_t scale = 0; scale < kind_maps[k]->size(); ++scale) {
+      for (size_t c = 0; c < 3; ++c) {
+        const std::string pathname = prefix + "-" + kinds[k] + "-" + "XYB"[c] +
+                                     "-" + std::to_string(1 << scale) +
+                                     extension;
+        if (!WriteMap((*kind_maps[k])[scale].Plane(c), pathname)) {
+          fprintf(stderr, "Could not write error map: %s\n", pathname.c_str());
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// Prints the score, followed by the scores of the tiles, one row per line.
+int PrintTileScores(const jxl::CodecInOut &io1, const jxl::CodecInOut &io2,
+                    size_t tile_size) {
+  // As for the whole image, take the worst of the backgrounds per tile.
+  std::vector<jxl::ImageD> all_tile_scores;
+  const double score =
+      WorstOverBackgrounds(io1.Main(), [&](float bg) {
+        all_tile_scores.emplace_back();
+        return ComputeSSIMULACRA2(io1.Main(), io2.Main(), bg, tile_size,
+                                  &all_tile_scores.back());
+      }).Score();
+  jxl::ImageD &tile_scores = all_tile_scores[0];
+  for (size_t i = 1; i < all_tile_scores.size(); ++i) {
+    for (size_t y = 0; y < tile_scores.ysize(); ++y) {
+      double *row = tile_scores.Row(y);
+      const double *row1 = all_tile_scores[i].ConstRow(y);
+      for (size_t x = 0; x < tile_scores.xsize(); ++x) {
+        row[x] = std::min(row[x], row1[x]);
+      }
+    }
+  }
+  printf("%.8f\n", score);
+  for (size_t y = 0; y < tile_scores.ysize(); ++y) {
+    const double *row = tile_scores.ConstRow(y);
+    for (size_t x = 0; x < tile_scores.xsize(); ++x) {
+      printf(x ? " %.8f" : "%.8f", row[x]);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+// Returns the norms of the region `roi`; for images with alpha, those of the
+// background that gives the worse score.
+Msssim ComputeMsssim(const jxl::CodecInOut &io1, const jxl::CodecInOut &io2,
+                     const jxl::Rect &roi) {
+  return WorstOverBackgrounds(io1.Main(), [&](float bg) {
+    return ComputeSSIMULACRA2(io1.Main(), io2.Main(), roi, bg);
+  });
+}
+
+// Same for the whole images with `options`, adding the time spent to `stats`
+// unless it is null.
+Msssim ComputeMsssim(const jxl::CodecInOut &io1, const jxl::CodecInOut &io2,
+                     const SSIMULACRA2Options &options,
+                     SSIMULACRA2Stats *stats) {
+  return WorstOverBackgrounds(io1.Main(), [&](float bg) {
+    return ComputeSSIMULACRA2(io1.Main(), io2.Main(), bg, options, stats);
+  });
+}
+
+// Prints the time spent in each stage in milliseconds, the throughput of
+// each scale in compared pixels per second and the allocations.
+void PrintStats(const SSIMULACRA2Stats &stats) {
+  fprintf(stderr, "decode %.3f ms, transform %.3f ms, total %.3f ms\n",
+          stats.decode * 1e3, stats.transform * 1e3, stats.total * 1e3);
+  fprintf(stderr,
+          "%" PRIu64 " allocations, %" PRIu64
+          " frees, %.3f MiB in use before, peak %.3f MiB\n",
+          stats.num_allocations, stats.num_frees,
+          stats.bytes_in_use / 1048576.0,
+          stats.peak_bytes_in_use / 1048576.0);
+  fprintf(stderr, "scale %10s %9s %9s %9s %9s %9s %9s\n", "pixels", "xyb",
+          "multiply", "blur", "ssim", "edgediff", "MP/s");
+  for (size_t i = 0; i < stats.scales.size(); ++i) {
+    const SSIMULACRA2Stats::Scale &s = stats.scales[i];
+    const double seconds =
+        s.xyb + s.multiply + s.blur + s.ssim_map + s.edge_diff_map;
+    fprintf(stderr, "%5zu %10zu %9.3f %9.3f %9.3f %9.3f %9.3f %9.2f\n", i,
+            s.num_pixels, s.xyb * 1e3, s.multiply * 1e3, s.blur * 1e3,
+            s.ssim_map * 1e3, s.edge_diff_map * 1e3,
+            seconds > 0 ? s.num_pixels / seconds * 1e-6 : 0.0);
+  }
+}
+
+// Decodes the rows of the image file that `needed_rows` selects.
+jxl::Status DecodeRows(const char *pathname,
+                       const jxl::extras::NeededRowsFunc &needed_rows,
+                       jxl::CodecInOut *io) {
+  SSIMULACRA2Trace::Span span("Decode");
+  return SetRowsFromFile(pathname, jxl::extras::ColorHints(), needed_rows, io);
+}
+
+// Returns the score followed by the features, as stored in the score cache.
+std::vector<double> ScoreAndFeatures(const Msssim &msssim) {
+  std::vector<double> values = msssim.Features();
+  values.insert(values.begin(), msssim.Score());
+  return values;
+}
+
+// Prints the score, followed by the features if requested.
+int PrintScore(const std::vector<double> &score_and_features,
+               bool print_features) {
+  printf("%.8f\n", score_and_features[0]);
+  if (print_features) {
+    for (size_t i = 1; i < score_and_features.size(); ++i) {
+      printf(i > 1 ? ",%.12f" : "%.12f", score_and_features[i]);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+// Sets `msssim` to the norms against the reference with the worse score.
+// Returns false if a reference cannot be used for `dist`.
+bool CompareToReferences(const std::vector<SSIMULACRA2Reference> &refs,
+                         const jxl::ImageBundle &dist, Msssim *msssim) {
+  for (size_t i = 0; i < refs.size(); ++i) {
+    Msssim current;
+    if (!refs[i].Compare(dist, &current)) return false;
+    if (i == 0 || current.Score() < msssim->Score()) *msssim = current;
+  }
+  return !refs.empty();
+}
+
+// Computes the norms of the worst background in strips of rows that need at
+// most `max_bytes`, of which only the rows are decoded.
+int ComputeWithMaxBytes(const char *orig_path, const char *dist_path,
+                        size_t max_bytes, Msssim *msssim) {
+  std::vector<uint8_t> orig_bytes, dist_bytes;
+  if (!jxl::ReadFile(orig_path, &orig_bytes)) {
+    fprintf(stderr, "Could not load original image: %s\n", orig_path);
+    return 1;
+  }
+  if (!jxl::ReadFile(dist_path, &dist_bytes)) {
+    fprintf(stderr, "Could not load distorted image: %s\n", dist_path);
+    return 1;
+  }
+  const SSIMULACRA2DecodeFunc decode = [&](size_t y0, size_t y1,
+                                           jxl::CodecInOut *io1,
+                                           jxl::CodecInOut *io2) {
+    SSIMULACRA2Trace::Span span("Decode");
+    return jxl::Status(
+        SetStripFromBytes(jxl::Span<const uint8_t>(orig_bytes),
+                          jxl::extras::ColorHints(), y0, y1, io1) &&
+        SetStripFromBytes(jxl::Span<const uint8_t>(dist_bytes),
+                          jxl::extras::ColorHints(), y0, y1, io2));
+  };
+  // The first row tells the size.
+  jxl::CodecInOut io1, io2;
+  if (!decode(0, 1, &io1, &io2)) {
+    fprintf(stderr, "Could not decode the images\n");
+    return 1;
+  }
+  if (io1.xsize() < 8 || io1.ysize() < 8) {
+    fprintf(stderr, "Minimum image size is 8x8 pixels\n");
+    return 1;
+  }
+  if (io1.xsize() != io2.xsize() || io1.ysize() != io2.ysize()) {
+    fprintf(stderr, "Image size mismatch\n");
+    return 1;
+  }
+  bool over_budget;
+  if (!ComputeSSIMULACRA2WithinBudget(io1.xsize(), io1.ysize(), decode,
+                                      max_bytes, msssim, &over_budget)) {
+    fprintf(stderr, over_budget ? "Not enough memory for the images\n"
+                                : "Could not decode the images\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Computes the norms against the preprocessed original in `cache_dir`, which
+// is keyed by a hash of the original file. If it is missing, the original is
+// decoded and preprocessed, and stored there for the next time.
+int ComputeWithReferenceCache(const char *orig_path, const char *dist_path,
+                              const std::string &cache_dir, Msssim *msssim) {
+  std::vector<uint8_t> orig_bytes;
+  if (!jxl::ReadFile(orig_path, &orig_bytes)) {
+    fprintf(stderr, "Could not load original image: %s\n", orig_path);
+    return 1;
+  }
+  const uint64_t key = jxl::HashBytes(orig_bytes.data(), orig_bytes.size());
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.ssim2ref",
+           static_cast<unsigned long long>(key));
+  const std::string ref_path = cache_dir + name;
+
+  jxl::CodecInOut io2;
+  if (!SetFromFile(dist_path, jxl::extras::ColorHints(), &io2)) {
+    fprintf(stderr, "Could not load distorted image: %s\n", dist_path);
+    return 1;
+  }
+
+  std::vector<SSIMULACRA2Reference> refs;
+  uint64_t stored_key;
+  const bool loaded =
+      SSIMULACRA2Reference::LoadFile(ref_path, &stored_key, &refs) &&
+      stored_key == key;
+  if (loaded && CompareToReferences(refs, io2.Main(), msssim)) return 0;
+
+  jxl::CodecInOut io1;
+  if (!SetFromBytes(jxl::Span<const uint8_t>(orig_bytes),
+                    jxl::extras::ColorHints(), &io1)) {
+    fprintf(stderr, "Could not load original image: %s\n", orig_path);
+    return 1;
+  }
+  if (io1.xsize() < 8 || io1.ysize() < 8) {
+    fprintf(stderr, "Minimum image size is 8x8 pixels\n");
+    return 1;
+  }
+  if (io1.xsize() != io2.xsize() || io1.ysize() != io2.ysize()) {
+    fprintf(stderr, "Image size mismatch\n");
+    return 1;
+  }
+  if (!loaded) {
+    refs.clear();
+    for (float bg : SSIMULACRA2Backgrounds(io1.Main())) {
+      refs.emplace_back(io1.Main(), bg);
+    }
+    if (!SSIMULACRA2Reference::WriteFile(refs, key, ref_path)) {
+      fprintf(stderr, "Could not write reference data: %s\n",
+              ref_path.c_str());
+    }
+  }
+  // References of gray originals cannot be used for color images.
+  if (!CompareToReferences(refs, io2.Main(), msssim)) {
+    *msssim = ComputeMsssim(io1, io2, jxl::Rect(io1.Main()));
+  }
+  return 0;
+}
+
+// Prints the score of the band sums in `files`, one per line as printed by
+// --band.
+int MergeBands(int num_files, char **files) {
+  // Images with alpha have the sums for two backgrounds.
+  std::map<float, std::vector<SSIMULACRA2BandSums>> bands_by_bg;
+  for (int i = 0; i < num_files; ++i) {
+    std::vector<uint8_t> contents;
+    if (!jxl::ReadFile(files[i], &contents)) {
+      fprintf(stderr, "Could not read band sums: %s\n", files[i]);
+      return 1;
+    }
+    const std::string text(contents.begin(), contents.end());
+    size_t pos = 0;
+    while (pos < text.size()) {
+      size_t end = text.find('\n', pos);
+      if (end == std::string::npos) end = text.size();
+      std::string line = text.substr(pos, end - pos);
+      pos = end + 1;
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      if (line.empty()) continue;
+      SSIMULACRA2BandSums band;
+      if (!SSIMULACRA2BandSums::Parse(line, &band)) {
+        fprintf(stderr, "Invalid band sums in %s\n", files[i]);
+        return 1;
+      }
+      bands_by_bg[band.bg].push_back(band);
+    }
+  }
+  if (bands_by_bg.empty()) {
+    fprintf(stderr, "No band sums to merge\n");
+    return 1;
+  }
+  // As for the whole images, take the worst of the backgrounds.
+  double score = 100.0;
+  for (const auto &bands : bands_by_bg) {
+    Msssim msssim;
+    if (!MergeSSIMULACRA2BandSums(bands.second, &msssim)) {
+      fprintf(stderr, "Band sums do not cover the images exactly once\n");
+      return 1;
+    }
+    score = std::min(score, msssim.Score());
+  }
+  printf("%.8f\n", score);
+  return 0;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 3)
-    return PrintUsage(argv);
+  if (argc > 2 && strcmp(argv[1], "--merge") == 0) {
+    return MergeBands(argc - 2, argv + 2);
+  }
+  bool has_roi = false;
+  jxl::Rect roi;
+  size_t tile_size = 0;
+  const char *maps_pattern = nullptr;
+  const char *heatmap = nullptr;
+  bool print_features = false;
+  bool print_stats = false;
+  SSIMULACRA2Options options;
+  size_t band = 0, num_bands = 0;
+  const char *ref_cache = nullptr;
+  const char *score_cache_dir = nullptr;
+  const char *trace_path = nullptr;
+  size_t max_bytes = 0;
+  int arg = 1;
+  for (; argc - arg > 2; arg += 2) {
+    char end;
+    if (strcmp(argv[arg], "--features") == 0) {
+      print_features = true;
+      --arg;  // No value.
+    } else if (strcmp(argv[arg], "--stats") == 0) {
+      print_stats = true;
+      --arg;  // No value.
+    } else if (strcmp(argv[arg], "--f16") == 0) {
+      options.f16_pyramid = true;
+      --arg;  // No value.
+    } else if (strcmp(argv[arg], "--fast") == 0) {
+      options.fast = true;
+      --arg;  // No value.
+    } else if (strcmp(argv[arg], "--roi") == 0) {
+      size_t x0, y0, xsize, ysize;
+      if (sscanf(argv[arg + 1], "%zu,%zu,%zu,%zu%c", &x0, &y0, &xsize, &ysize,
+                 &end) != 4 ||
+          xsize == 0 || ysize == 0) {
+        fprintf(stderr, "Invalid region of interest: %s\n", argv[arg + 1]);
+        return 1;
+      }
+      has_roi = true;
+      roi = jxl::Rect(x0, y0, xsize, ysize);
+    } else if (strcmp(argv[arg], "--tiles") == 0) {
+      if (sscanf(argv[arg + 1], "%zu%c", &tile_size, &end) != 1 ||
+          tile_size == 0) {
+        fprintf(stderr, "Invalid tile size: %s\n", argv[arg + 1]);
+        return 1;
+      }
+    } else if (strcmp(argv[arg], "--band") == 0) {
+      if (sscanf(argv[arg + 1], "%zu/%zu%c", &band, &num_bands, &end) != 2 ||
+          band >= num_bands) {
+        fprintf(stderr, "Invalid band: %s\n", argv[arg + 1]);
+        return 1;
+      }
+    } else if (strcmp(argv[arg], "--max-bytes") == 0) {
+      if (sscanf(argv[arg + 1], "%zu%c", &max_bytes, &end) != 1 ||
+          max_bytes == 0) {
+        fprintf(stderr, "Invalid number of bytes: %s\n", argv[arg + 1]);
+        return 1;
+      }
+    } else if (strcmp(argv[arg], "--ref-cache") == 0) {
+      ref_cache = argv[arg + 1];
+    } else if (strcmp(argv[arg], "--score-cache") == 0) {
+      score_cache_dir = argv[arg + 1];
+    } else if (strcmp(argv[arg], "--trace") == 0) {
+      trace_path = argv[arg + 1];
+    } else if (strcmp(argv[arg], "--maps") == 0) {
+      maps_pattern = argv[arg + 1];
+    } else if (strcmp(argv[arg], "--heatmap") == 0) {
+      heatmap = argv[arg + 1];
+    } else {
+      return PrintUsage(argv);
+    }
+  }
+  if (argc - arg != 2) return PrintUsage(argv);
+  const bool write_maps = maps_pattern || heatmap;
+  const bool has_band = num_bands != 0;
+  const bool has_ref_cache = ref_cache != nullptr;
+  const bool has_max_bytes = max_bytes != 0;
+  const bool only_score = tile_size == 0 && !write_maps && !has_band;
+  if (has_roi + (tile_size != 0) + write_maps + has_band + has_ref_cache +
+              has_max_bytes >
+          1 ||
+      ((print_features || score_cache_dir) && !only_score) ||
+      (print_stats && (has_roi || !only_score || has_ref_cache ||
+                       has_max_bytes || score_cache_dir)) ||
+      ((options.f16_pyramid || options.fast) &&
+       (has_roi || !only_score || has_ref_cache || has_max_bytes))) {
+    fprintf(stderr,
+            "--roi, --tiles, --maps/--heatmap, --band, --ref-cache and "
+            "--max-bytes cannot be combined, --features and --score-cache not "
+            "with --tiles, --maps/--heatmap or --band, --stats, --f16 and "
+            "--fast with none of them, and --stats not with --score-cache\n");
+    return 1;
+  }
+  const char *orig_path = argv[arg];
+  const char *dist_path = argv[arg + 1];
+
+  // Written on every return from here on, also after failures.
+  if (trace_path) SSIMULACRA2Trace::Start();
+  const auto write_trace = jxl::MakeScopeGuard([&] {
+    if (trace_path && !SSIMULACRA2Trace::WriteFile(trace_path)) {
+      fprintf(stderr, "Could not write trace: %s\n", trace_path);
+    }
+  });
+
+  // Pairs of files that were scored before are not decoded.
+  std::unique_ptr<SSIMULACRA2ScoreCache> score_cache;
+  uint64_t score_key = 0;
+  if (score_cache_dir) {
+    std::vector<uint8_t> orig_bytes, dist_bytes;
+    if (!jxl::ReadFile(orig_path, &orig_bytes)) {
+      fprintf(stderr, "Could not load original image: %s\n", orig_path);
+      return 1;
+    }
+    if (!jxl::ReadFile(dist_path, &dist_bytes)) {
+      fprintf(stderr, "Could not load distorted image: %s\n", dist_path);
+      return 1;
+    }
+    std::string key_options;
+    if (has_roi) {
+      key_options = "roi " + std::to_string(roi.x0()) + "," +
+                    std::to_string(roi.y0()) + "," +
+                    std::to_string(roi.xsize()) + "," +
+                    std::to_string(roi.ysize());
+    } else if (has_ref_cache) {
+      // Differs from the full computation by rounding.
+      key_options = "reference";
+    } else if (has_max_bytes) {
+      // Strips differ from the full computation by rounding.
+      key_options = "max-bytes " + std::to_string(max_bytes);
+    } else {
+      // Half floats are rounded the same on every target.
+      if (options.f16_pyramid) key_options = "f16";
+      if (options.fast) key_options += key_options.empty() ? "fast" : " fast";
+    }
+    score_cache.reset(new SSIMULACRA2ScoreCache(score_cache_dir));
+    score_key = SSIMULACRA2ScoreCache::Key(orig_bytes.data(), orig_bytes.size(),
+                                           dist_bytes.data(), dist_bytes.size(),
+                                           key_options);
+    std::vector<double> values;
+    if (score_cache->Lookup(score_key, &values) &&
+        values.size() == 1 + kSSIMULACRA2NumFeatures) {
+      return PrintScore(values, print_features);
+    }
+  }
+  // Prints the score and stores it in the score cache.
+  const auto finish = [&](const Msssim &msssim) -> int {
+    const std::vector<double> values = ScoreAndFeatures(msssim);
+    if (score_cache && !score_cache->Insert(score_key, values)) {
+      fprintf(stderr, "Could not write to the score cache\n");
+    }
+    return PrintScore(values, print_features);
+  };
 
+  if (has_ref_cache) {
+    Msssim msssim;
+    if (ComputeWithReferenceCache(orig_path, dist_path, ref_cache, &msssim)) {
+      return 1;
+    }
+    return finish(msssim);
+  }
+  if (has_max_bytes) {
+    Msssim msssim;
+    if (ComputeWithMaxBytes(orig_path, dist_path, max_bytes, &msssim)) {
+      return 1;
+    }
+    return finish(msssim);
+  }
 
+  // Only the rows needed for the roi or band are decoded, once the image size
+  // is known.
+  const jxl::extras::NeededRowsFunc needed_rows =
+      [&](size_t xsize, size_t ysize, size_t *y0, size_t *y1) {
+        jxl::Rect rect(0, 0, xsize, ysize);
+        if (has_roi && roi.IsInside(rect)) {
+          rect = roi;
+        } else if (has_band) {
+          rect = SSIMULACRA2Band(band, num_bands, xsize, ysize);
+        }
+        const jxl::Rect rows = SSIMULACRA2InputRect(rect, xsize, ysize);
+        *y0 = rows.y0();
+        *y1 = rows.y0() + rows.ysize();
+      };
 
+  SSIMULACRA2Stats stats;
+  const double decode_start = jxl::Now();
   jxl::CodecInOut io1;
   jxl::CodecInOut io2;
-  if (!SetFromFile(argv[1], jxl::extras::ColorHints(), &io1)) {
-    fprintf(stderr, "Could not load original image: %s\n", argv[1]);
+  if (!DecodeRows(orig_path, needed_rows, &io1)) {
+    fprintf(stderr, "Could not load original image: %s\n", orig_path);
     return 1;
   }
 
@@ -92,25 +734,53 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if (!SetFromFile(argv[2], jxl::extras::ColorHints(), &io2)) {
-    fprintf(stderr, "Could not load distorted image: %s\n", argv[2]);
+  if (!DecodeRows(dist_path, needed_rows, &io2)) {
+    fprintf(stderr, "Could not load distorted image: %s\n", dist_path);
     return 1;
   }
+  stats.decode = jxl::Now() - decode_start;
 
   if (io1.xsize() != io2.xsize() || io1.ysize() != io2.ysize()) {
     fprintf(stderr, "Image size mismatch\n");
     return 1;
   }
 
-  if (!io1.Main().HasAlpha()) {
-    Msssim msssim = ComputeSSIMULACRA2(io1.Main(), io2.Main());
-    printf("%.8f\n", msssim.Score());
-  } else {
-    // in case of alpha transparency: blend against dark and bright backgrounds
-    // and return the worst of both scores
-    Msssim msssim0 = ComputeSSIMULACRA2(io1.Main(), io2.Main(), 0.1f);
-    Msssim msssim1 = ComputeSSIMULACRA2(io1.Main(), io2.Main(), 0.9f);
-    printf("%.8f\n", std::min(msssim0.Score(), msssim1.Score()));
+  if (!has_roi) {
+    roi = jxl::Rect(io1.Main());
+  } else if (roi.x0() >= io1.xsize() || roi.y0() >= io1.ysize() ||
+             roi.xsize() > io1.xsize() - roi.x0() ||
+             roi.ysize() > io1.ysize() - roi.y0()) {
+    fprintf(stderr, "Region of interest is outside the image\n");
+    return 1;
   }
-  return 0;
+
+  if (has_band) {
+    const jxl::Rect rows =
+        SSIMULACRA2Band(band, num_bands, io1.xsize(), io1.ysize());
+    // Images with alpha are merged for both backgrounds, as below.
+    for (float bg : SSIMULACRA2Backgrounds(io1.Main())) {
+      SSIMULACRA2BandSums sums;
+      if (!ComputeSSIMULACRA2BandSums(io1.Main(), io2.Main(), rows, bg,
+                                      &sums)) {
+        fprintf(stderr, "Computing the band failed\n");
+        return 1;
+      }
+      printf("%s\n", sums.Serialize().c_str());
+    }
+    return 0;
+  }
+  if (tile_size != 0) {
+    return PrintTileScores(io1, io2, tile_size);
+  }
+  if (write_maps) {
+    return ComputeAndWriteMaps(io1, io2, maps_pattern, heatmap);
+  }
+
+  if (!has_roi) {
+    const int ret = finish(
+        ComputeMsssim(io1, io2, options, print_stats ? &stats : nullptr));
+    if (print_stats) PrintStats(stats);
+    return ret;
+  }
+  return finish(ComputeMsssim(io1, io2, roi));
 }
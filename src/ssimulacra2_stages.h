@@ -0,0 +1,68 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_SSIMULACRA2_STAGES_H_
+#define TOOLS_SSIMULACRA2_STAGES_H_
+
+// The stages that ComputeSSIMULACRA2 runs for each scale and plane, exposed
+// for benchmarking them separately. Not part of the API.
+
+#include "lib/jxl/image.h"
+#include "lib/jxl/image_bundle.h"
+
+namespace ssimulacra2_stages {
+
+// Sigma of the Gaussian blur applied to the planes and their products.
+static const double kBlurSigma = 1.5;
+
+// Blends 'in' against 'bg', converts it to linear sRGB (with TransformTo if
+// it is not already sRGB or linear sRGB) and to positive XYB. The gray version
+// only keeps Y; 'in' must be gray.
+void ToLinearAndPositiveXYB(const jxl::ImageBundle &in, float bg,
+                            jxl::Image3F *linear, jxl::Image3F *xyb);
+void ToLinearAndPositiveXYB(const jxl::ImageBundle &in, float bg,
+                            jxl::ImageF *linear, jxl::ImageF *y);
+
+// Converts linear sRGB to positive XYB (or its Y) in a single pass.
+void PositiveXYBFromLinear(const jxl::Image3F &linear, float intensity_target,
+                           jxl::Image3F *xyb);
+void PositiveXYBFromLinear(const jxl::ImageF &linear, float intensity_target,
+                           jxl::ImageF *y);
+
+// Downsamples linear 'in' 2x2 to 'out' (of half the size, rounded up) and
+// converts the result to positive XYB (or its Y).
+void Downsample2x2AndPositiveXYB(const jxl::Image3F &in,
+                                 float intensity_target, jxl::Image3F *out,
+                                 jxl::Image3F *xyb);
+void Downsample2x2AndPositiveXYB(const jxl::ImageF &in, float intensity_target,
+                                 jxl::ImageF *out, jxl::ImageF *y);
+
+// Rounds 'in' to the nearest half floats, ties to even, on every target, as
+// SSIMULACRA2Options::f16_pyramid does with the linear images.
+void DemoteToF16(const jxl::ImageF &in, jxl::Plane<hwy::float16_t> *out);
+
+// The blur of SSIMULACRA2Options::fast: a separable FIR approximation of the
+// Gaussian, with 'temp' (of the size of 'in') for the horizontal pass.
+void TruncatedGaussianBlur(const jxl::ImageF &in, jxl::ImageF *temp,
+                           jxl::ImageF *out);
+
+void Multiply(const jxl::ImageF &a, const jxl::ImageF &b, jxl::ImageF *mul);
+
+// Adds the sum of the SSIM' error map of one plane and of its 4th powers to
+// 'sums', given the blurred planes 'm1', 'm2' and blurred products 's11',
+// 's22' and 's12'.
+void SSIMMap(const jxl::ImageF &m1, const jxl::ImageF &m2,
+             const jxl::ImageF &s11, const jxl::ImageF &s22,
+             const jxl::ImageF &s12, double sums[2]);
+
+// Adds the sums of the ringing and blurring maps of one plane and of their
+// 4th powers to 'sums'.
+void EdgeDiffMap(const jxl::ImageF &img1, const jxl::ImageF &mu1,
+                 const jxl::ImageF &img2, const jxl::ImageF &mu2,
+                 double sums[4]);
+
+} // namespace ssimulacra2_stages
+
+#endif  // TOOLS_SSIMULACRA2_STAGES_H_
@@ -0,0 +1,1250 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "ssimulacra2.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "lib/jxl/base/cache_aligned.h"
+#include "lib/jxl/base/file_io.h"
+#include "lib/jxl/codec_in_out.h"
+#include "lib/jxl/enc_color_management.h"
+#include "lib/jxl/enc_xyb.h"
+#include "lib/jxl/gauss_blur.h"
+#include "lib/jxl/image_ops.h"
+#include "ssimulacra2_stages.h"
+#include "ssimulacra2_test_utils.h"
+
+namespace {
+
+using jxl::Image3F;
+using jxl::ImageF;
+using ssimulacra2_test::Distort;
+using ssimulacra2_test::TestImage;
+
+// Returns the largest difference between the pixels of 'a' and 'b'.
+float MaxAbsDiff(const Image3F &a, const Image3F &b) {
+  float max_diff = 0.0f;
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < a.ysize(); ++y) {
+      for (size_t x = 0; x < a.xsize(); ++x) {
+        max_diff = std::max(max_diff, std::abs(a.ConstPlaneRow(c, y)[x] -
+                                               b.ConstPlaneRow(c, y)[x]));
+      }
+    }
+  }
+  return max_diff;
+}
+
+// Returns the positive XYB of 'in' blended against 'bg' the way it was
+// computed before the conversion was fused into one pass.
+Image3F UnfusedPositiveXYB(const jxl::ImageBundle &in, float bg) {
+  jxl::ImageBundle copy = in.Copy();
+  if (copy.HasAlpha()) {
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t y = 0; y < copy.ysize(); ++y) {
+        float *JXL_RESTRICT row = copy.color()->PlaneRow(c, y);
+        const float *JXL_RESTRICT alpha = copy.alpha()->ConstRow(y);
+        for (size_t x = 0; x < copy.xsize(); ++x) {
+          row[x] = alpha[x] * row[x] + (1.f - alpha[x]) * bg;
+        }
+      }
+    }
+  }
+  copy.ClearExtraChannels();
+  Image3F xyb(copy.xsize(), copy.ysize());
+  jxl::ToXYB(copy, nullptr, &xyb, jxl::GetJxlCms(), nullptr);
+  for (size_t y = 0; y < xyb.ysize(); ++y) {
+    float *JXL_RESTRICT row_x = xyb.PlaneRow(0, y);
+    float *JXL_RESTRICT row_y = xyb.PlaneRow(1, y);
+    float *JXL_RESTRICT row_b = xyb.PlaneRow(2, y);
+    for (size_t x = 0; x < xyb.xsize(); ++x) {
+      row_b[x] = (row_b[x] - row_y[x]) + 0.55f;
+      row_x[x] = row_x[x] * 14.f + 0.42f;
+      row_y[x] += 0.01f;
+    }
+  }
+  return xyb;
+}
+
+// Returns the 2x2 averages of 'in', repeating its last row and column if
+// its size is odd.
+Image3F Downsample2x2(const Image3F &in) {
+  Image3F out((in.xsize() + 1) / 2, (in.ysize() + 1) / 2);
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t oy = 0; oy < out.ysize(); ++oy) {
+      float *JXL_RESTRICT row_out = out.PlaneRow(c, oy);
+      for (size_t ox = 0; ox < out.xsize(); ++ox) {
+        float sum = 0.0f;
+        for (size_t iy = 0; iy < 2; ++iy) {
+          for (size_t ix = 0; ix < 2; ++ix) {
+            const size_t x = std::min(ox * 2 + ix, in.xsize() - 1);
+            const size_t y = std::min(oy * 2 + iy, in.ysize() - 1);
+            sum += in.ConstPlaneRow(c, y)[x];
+          }
+        }
+        row_out[ox] = sum * 0.25f;
+      }
+    }
+  }
+  return out;
+}
+
+TEST(SSIMULACRA2Test, FusedConversionMatchesUnfused) {
+  for (size_t channels : {3, 4}) {
+    jxl::CodecInOut io;
+    TestImage(67, 45, channels, 1, &io);
+    for (float bg : {0.1f, 0.9f}) {
+      Image3F linear, xyb;
+      ssimulacra2_stages::ToLinearAndPositiveXYB(io.Main(), bg, &linear, &xyb);
+      EXPECT_LT(MaxAbsDiff(xyb, UnfusedPositiveXYB(io.Main(), bg)), 1e-4f)
+          << channels << " channels, bg " << bg;
+    }
+  }
+}
+
+TEST(SSIMULACRA2Test, OpaqueAlphaDoesNotChangeScore) {
+  jxl::CodecInOut orig, dist;
+  TestImage(64, 48, 3, 1, &orig);
+  Distort(orig, 0.1f, 2, &dist);
+  const double score = ComputeSSIMULACRA2(orig.Main(), dist.Main()).Score();
+  for (jxl::CodecInOut *io : {&orig, &dist}) {
+    io->metadata.m.SetAlphaBits(8);
+    ImageF alpha(io->xsize(), io->ysize());
+    jxl::FillImage(1.0f, &alpha);
+    io->Main().SetAlpha(std::move(alpha), /*alpha_is_premultiplied=*/false);
+  }
+  for (float bg : {0.1f, 0.9f}) {
+    EXPECT_NEAR(ComputeSSIMULACRA2(orig.Main(), dist.Main(), bg).Score(),
+                score, 1e-6);
+  }
+}
+
+TEST(SSIMULACRA2Test, FusedDownsampleMatchesUnfused) {
+  for (size_t xsize : {64, 67}) {
+    for (size_t ysize : {48, 45}) {
+      jxl::CodecInOut io;
+      TestImage(xsize, ysize, 3, 1, &io);
+      Image3F linear, xyb;
+      ssimulacra2_stages::ToLinearAndPositiveXYB(io.Main(), 0.5f, &linear,
+                                                 &xyb);
+      const float intensity_target = io.metadata.m.IntensityTarget();
+      Image3F half((xsize + 1) / 2, (ysize + 1) / 2);
+      Image3F half_xyb(half.xsize(), half.ysize());
+      ssimulacra2_stages::Downsample2x2AndPositiveXYB(linear, intensity_target,
+                                                      &half, &half_xyb);
+      const Image3F expected = Downsample2x2(linear);
+      Image3F expected_xyb(half.xsize(), half.ysize());
+      ssimulacra2_stages::PositiveXYBFromLinear(expected, intensity_target,
+                                                &expected_xyb);
+      EXPECT_LT(MaxAbsDiff(half, expected), 1e-6f) << xsize << "x" << ysize;
+      EXPECT_LT(MaxAbsDiff(half_xyb, expected_xyb), 1e-6f)
+          << xsize << "x" << ysize;
+    }
+  }
+}
+
+TEST(SSIMULACRA2Test, DemoteToF16RoundsToNearestEven) {
+  const float ulp = 1.0f / 2048;     // Half the spacing of half floats at 1.
+  const float tiny = 1.0f / (1 << 24);  // The smallest subnormal half float.
+  const std::vector<std::pair<float, uint16_t>> cases = {
+      {0.75f, 0x3A00},
+      {1.0f + ulp, 0x3C00},  // Ties go to the even neighbor, ...
+      {1.0f + 3 * ulp, 0x3C02},
+      {-1.0f - 3 * ulp, 0xBC02},
+      {1.0f + ulp + ulp / 512, 0x3C01},  // ... the others to the nearest.
+      {1.0f - ulp / 2, 0x3C00},          // Carries into the exponent.
+      {0.5f * tiny, 0x0000},
+      {1.5f * tiny, 0x0002},
+      {2.5f * tiny, 0x0002},
+      {1023.5f * tiny, 0x0400},  // From subnormal to normal.
+  };
+  ImageF in(cases.size(), 1);
+  for (size_t x = 0; x < cases.size(); ++x) in.Row(0)[x] = cases[x].first;
+  jxl::Plane<hwy::float16_t> out(in.xsize(), 1);
+  ssimulacra2_stages::DemoteToF16(in, &out);
+  for (size_t x = 0; x < cases.size(); ++x) {
+    uint16_t bits;
+    memcpy(&bits, &out.ConstRow(0)[x], sizeof(bits));
+    EXPECT_EQ(cases[x].second, bits) << cases[x].first;
+  }
+}
+
+TEST(SSIMULACRA2Test, F16PyramidStaysNearExactScore) {
+  SSIMULACRA2Options options;
+  options.f16_pyramid = true;
+  for (size_t channels : {1, 3, 4}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(200, 150, channels, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    for (float bg : {0.1f, 0.9f}) {
+      const double exact =
+          ComputeSSIMULACRA2(orig.Main(), dist.Main(), bg).Score();
+      const double f16 =
+          ComputeSSIMULACRA2(orig.Main(), dist.Main(), bg, options).Score();
+      EXPECT_NEAR(exact, f16, 0.15) << channels << " channels, bg " << bg;
+      EXPECT_NE(exact, f16) << channels << " channels, bg " << bg;
+    }
+  }
+}
+
+TEST(SSIMULACRA2Test, FastStaysNearExactScore) {
+  SSIMULACRA2Options options;
+  options.fast = true;
+  for (size_t channels : {1, 3, 4}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(200, 150, channels, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    for (float bg : {0.1f, 0.9f}) {
+      const double exact =
+          ComputeSSIMULACRA2(orig.Main(), dist.Main(), bg).Score();
+      const double fast =
+          ComputeSSIMULACRA2(orig.Main(), dist.Main(), bg, options).Score();
+      EXPECT_LT(exact, 95.0);
+      EXPECT_NEAR(exact, fast, 0.9) << channels << " channels, bg " << bg;
+      EXPECT_NE(exact, fast) << channels << " channels, bg " << bg;
+    }
+  }
+}
+
+// The computation of the score before it was optimized, as a reference: all
+// three planes of the whole images at each scale, in separate passes.
+class ReferenceSSIMULACRA2 {
+ public:
+  static Msssim Compute(const jxl::ImageBundle &orig,
+                        const jxl::ImageBundle &dist, float bg) {
+    jxl::ImageBundle orig2 = orig.Copy();
+    jxl::ImageBundle dist2 = dist.Copy();
+    for (jxl::ImageBundle *ib : {&orig2, &dist2}) {
+      if (ib->HasAlpha()) AlphaBlend(bg, ib);
+      ib->ClearExtraChannels();
+      JXL_CHECK(ib->TransformTo(jxl::ColorEncoding::LinearSRGB(ib->IsGray()),
+                                jxl::GetJxlCms()));
+    }
+    Msssim msssim;
+    for (size_t scale = 0; scale < 6; ++scale) {
+      if (scale) {
+        for (jxl::ImageBundle *ib : {&orig2, &dist2}) {
+          ib->SetFromImage(Downsample2x2(*ib->color()),
+                           jxl::ColorEncoding::LinearSRGB(ib->IsGray()));
+        }
+      }
+      if (orig2.xsize() < 8 || orig2.ysize() < 8) break;
+      const Image3F img1 = PositiveXYB(orig2);
+      const Image3F img2 = PositiveXYB(dist2);
+      const Image3F mu1 = Blur(img1);
+      const Image3F mu2 = Blur(img2);
+      const Image3F sigma11 = Blur(Multiply(img1, img1));
+      const Image3F sigma22 = Blur(Multiply(img2, img2));
+      const Image3F sigma12 = Blur(Multiply(img1, img2));
+      MsssimScale sscale;
+      SSIMMap(mu1, mu2, sigma11, sigma22, sigma12, sscale.avg_ssim);
+      EdgeDiffMap(img1, mu1, img2, mu2, sscale.avg_edgediff);
+      msssim.scales.push_back(sscale);
+    }
+    return msssim;
+  }
+
+ private:
+  static void AlphaBlend(float bg, jxl::ImageBundle *ib) {
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t y = 0; y < ib->ysize(); ++y) {
+        float *JXL_RESTRICT row = ib->color()->PlaneRow(c, y);
+        const float *JXL_RESTRICT alpha = ib->alpha()->ConstRow(y);
+        for (size_t x = 0; x < ib->xsize(); ++x) {
+          row[x] = alpha[x] * row[x] + (1.f - alpha[x]) * bg;
+        }
+      }
+    }
+  }
+
+  static Image3F PositiveXYB(const jxl::ImageBundle &linear) {
+    Image3F xyb(linear.xsize(), linear.ysize());
+    jxl::ToXYB(linear, nullptr, &xyb, jxl::GetJxlCms(), nullptr);
+    for (size_t y = 0; y < xyb.ysize(); ++y) {
+      float *JXL_RESTRICT row_x = xyb.PlaneRow(0, y);
+      float *JXL_RESTRICT row_y = xyb.PlaneRow(1, y);
+      float *JXL_RESTRICT row_b = xyb.PlaneRow(2, y);
+      for (size_t x = 0; x < xyb.xsize(); ++x) {
+        row_b[x] = (row_b[x] - row_y[x]) + 0.55f;
+        row_x[x] = row_x[x] * 14.f + 0.42f;
+        row_y[x] += 0.01f;
+      }
+    }
+    return xyb;
+  }
+
+  static Image3F Multiply(const Image3F &a, const Image3F &b) {
+    Image3F mul(a.xsize(), a.ysize());
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t y = 0; y < a.ysize(); ++y) {
+        for (size_t x = 0; x < a.xsize(); ++x) {
+          mul.PlaneRow(c, y)[x] =
+              a.ConstPlaneRow(c, y)[x] * b.ConstPlaneRow(c, y)[x];
+        }
+      }
+    }
+    return mul;
+  }
+
+  static Image3F Blur(const Image3F &in) {
+    const auto rg = jxl::CreateRecursiveGaussian(1.5);
+    ImageF temp(in.xsize(), in.ysize());
+    Image3F out(in.xsize(), in.ysize());
+    for (size_t c = 0; c < 3; ++c) {
+      jxl::FastGaussian(rg, in.Plane(c), nullptr, &temp, &out.Plane(c));
+    }
+    return out;
+  }
+
+  static double ToThe4th(double x) { return x * x * x * x; }
+
+  static void SSIMMap(const Image3F &m1, const Image3F &m2,
+                      const Image3F &s11, const Image3F &s22,
+                      const Image3F &s12, double *plane_averages) {
+    const double one_per_pixels = 1.0 / (m1.ysize() * m1.xsize());
+    for (size_t c = 0; c < 3; ++c) {
+      double sums[2] = {0.0};
+      for (size_t y = 0; y < m1.ysize(); ++y) {
+        for (size_t x = 0; x < m1.xsize(); ++x) {
+          const float mu1 = m1.ConstPlaneRow(c, y)[x];
+          const float mu2 = m2.ConstPlaneRow(c, y)[x];
+          const float num_m = 1.0 - (mu1 - mu2) * (mu1 - mu2);
+          const float num_s =
+              2 * (s12.ConstPlaneRow(c, y)[x] - mu1 * mu2) + 0.0009f;
+          const float denom_s = (s11.ConstPlaneRow(c, y)[x] - mu1 * mu1) +
+                                (s22.ConstPlaneRow(c, y)[x] - mu2 * mu2) +
+                                0.0009f;
+          const double d = std::max(1.0 - (num_m * num_s / denom_s), 0.0);
+          sums[0] += d;
+          sums[1] += ToThe4th(d);
+        }
+      }
+      plane_averages[c * 2] = one_per_pixels * sums[0];
+      plane_averages[c * 2 + 1] = sqrt(sqrt(one_per_pixels * sums[1]));
+    }
+  }
+
+  static void EdgeDiffMap(const Image3F &img1, const Image3F &mu1,
+                          const Image3F &img2, const Image3F &mu2,
+                          double *plane_averages) {
+    const double one_per_pixels = 1.0 / (img1.ysize() * img1.xsize());
+    for (size_t c = 0; c < 3; ++c) {
+      double sums[4] = {0.0};
+      for (size_t y = 0; y < img1.ysize(); ++y) {
+        for (size_t x = 0; x < img1.xsize(); ++x) {
+          const double d1 = (1.0 + std::abs(img2.ConstPlaneRow(c, y)[x] -
+                                            mu2.ConstPlaneRow(c, y)[x])) /
+                                (1.0 + std::abs(img1.ConstPlaneRow(c, y)[x] -
+                                                mu1.ConstPlaneRow(c, y)[x])) -
+                            1.0;
+          const double artifact = std::max(d1, 0.0);
+          const double detail_lost = std::max(-d1, 0.0);
+          sums[0] += artifact;
+          sums[1] += ToThe4th(artifact);
+          sums[2] += detail_lost;
+          sums[3] += ToThe4th(detail_lost);
+        }
+      }
+      for (size_t i = 0; i < 4; i += 2) {
+        plane_averages[c * 4 + i] = one_per_pixels * sums[i];
+        plane_averages[c * 4 + i + 1] =
+            sqrt(sqrt(one_per_pixels * sums[i + 1]));
+      }
+    }
+  }
+};
+
+// Expects the norms of 'actual' to match those of 'expected' within
+// 'tolerance'.
+void ExpectNear(const Msssim &expected, const Msssim &actual,
+                double tolerance) {
+  const std::vector<double> expected_features = expected.Features();
+  const std::vector<double> actual_features = actual.Features();
+  for (size_t i = 0; i < kSSIMULACRA2NumFeatures; ++i) {
+    EXPECT_NEAR(expected_features[i], actual_features[i], tolerance)
+        << "feature " << i;
+  }
+  EXPECT_NEAR(expected.Score(), actual.Score(), 1000 * tolerance);
+}
+
+// The stages that the benchmarks time, composed by hand, give the norms of
+// the first scale.
+TEST(SSIMULACRA2Test, StagesComposeToFirstScale) {
+  jxl::CodecInOut orig, dist;
+  TestImage(120, 90, 3, 1, &orig);
+  Distort(orig, 0.1f, 2, &dist);
+  Image3F linear1, linear2, xyb1, xyb2;
+  ssimulacra2_stages::ToLinearAndPositiveXYB(orig.Main(), 0.5f, &linear1,
+                                             &xyb1);
+  ssimulacra2_stages::ToLinearAndPositiveXYB(dist.Main(), 0.5f, &linear2,
+                                             &xyb2);
+  const auto rg = jxl::CreateRecursiveGaussian(ssimulacra2_stages::kBlurSigma);
+  const size_t xsize = orig.xsize(), ysize = orig.ysize();
+  ImageF temp(xsize, ysize), mul(xsize, ysize);
+  const auto blur = [&](const ImageF &in) {
+    ImageF out(xsize, ysize);
+    jxl::FastGaussian(rg, in, nullptr, &temp, &out);
+    return out;
+  };
+  MsssimScale expected = {};
+  for (size_t c = 0; c < 3; ++c) {
+    const ImageF &img1 = xyb1.Plane(c);
+    const ImageF &img2 = xyb2.Plane(c);
+    ssimulacra2_stages::Multiply(img1, img1, &mul);
+    const ImageF s11 = blur(mul);
+    ssimulacra2_stages::Multiply(img2, img2, &mul);
+    const ImageF s22 = blur(mul);
+    ssimulacra2_stages::Multiply(img1, img2, &mul);
+    const ImageF s12 = blur(mul);
+    const ImageF mu1 = blur(img1);
+    const ImageF mu2 = blur(img2);
+    double ssim[2] = {}, edgediff[4] = {};
+    ssimulacra2_stages::SSIMMap(mu1, mu2, s11, s22, s12, ssim);
+    ssimulacra2_stages::EdgeDiffMap(img1, mu1, img2, mu2, edgediff);
+    const double pixels = xsize * ysize;
+    expected.avg_ssim[c * 2] = ssim[0] / pixels;
+    expected.avg_ssim[c * 2 + 1] = std::pow(ssim[1] / pixels, 0.25);
+    for (size_t i = 0; i < 4; i += 2) {
+      expected.avg_edgediff[c * 4 + i] = edgediff[i] / pixels;
+      expected.avg_edgediff[c * 4 + i + 1] =
+          std::pow(edgediff[i + 1] / pixels, 0.25);
+    }
+  }
+  const Msssim msssim = ComputeSSIMULACRA2(orig.Main(), dist.Main());
+  const MsssimScale &actual = msssim.scales[0];
+  for (size_t i = 0; i < 3 * 2; ++i) {
+    EXPECT_NEAR(expected.avg_ssim[i], actual.avg_ssim[i], 1e-6) << i;
+  }
+  for (size_t i = 0; i < 3 * 4; ++i) {
+    EXPECT_NEAR(expected.avg_edgediff[i], actual.avg_edgediff[i], 1e-6) << i;
+  }
+}
+
+TEST(SSIMULACRA2Test, MatchesReference) {
+  for (size_t channels : {3, 4}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(90, 70, channels, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    const float bg = channels == 4 ? 0.1f : 0.5f;
+    const Msssim msssim = ComputeSSIMULACRA2(orig.Main(), dist.Main(), bg);
+    EXPECT_LT(msssim.Score(), 90.0);
+    ExpectNear(ReferenceSSIMULACRA2::Compute(orig.Main(), dist.Main(), bg),
+               msssim, 1e-5);
+  }
+}
+
+// Sets the norms of the X and B planes to zero.
+void ZeroXB(Msssim *msssim) {
+  for (MsssimScale &scale : msssim->scales) {
+    for (size_t c : {0, 2}) {
+      std::fill(scale.avg_ssim + c * 2, scale.avg_ssim + c * 2 + 2, 0.0);
+      std::fill(scale.avg_edgediff + c * 4, scale.avg_edgediff + c * 4 + 4,
+                0.0);
+    }
+  }
+}
+
+// Only the Y plane of gray images is compared: X and B are constant, hence
+// the norms of their maps in the reference are only rounding errors.
+TEST(SSIMULACRA2Test, GrayMatchesReference) {
+  for (size_t channels : {1, 2}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(90, 70, 1, 1, &orig);
+    if (channels == 2) {
+      orig.metadata.m.SetAlphaBits(8);
+      ImageF alpha(orig.xsize(), orig.ysize());
+      jxl::FillImage(0.5f, &alpha);
+      orig.Main().SetAlpha(std::move(alpha), /*alpha_is_premultiplied=*/false);
+    }
+    Distort(orig, 0.1f, 2, &dist);
+    ASSERT_TRUE(orig.Main().IsGray());
+    const Msssim msssim = ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.9f);
+    Msssim reference =
+        ReferenceSSIMULACRA2::Compute(orig.Main(), dist.Main(), 0.9f);
+    ZeroXB(&reference);
+    ExpectNear(reference, msssim, 1e-5);
+  }
+}
+
+// The norms of the error maps are the features, and the mean of the weighted
+// map is the sum of the 1-norms, each with both weights of its feature.
+TEST(SSIMULACRA2Test, MapsSumBackToScore) {
+  for (size_t channels : {1, 3}) {
+    jxl::CodecInOut orig, dist;
+    // A multiple of 32 in both dimensions, so that each pixel of every scale
+    // covers the same number of full-resolution pixels.
+    TestImage(256, 256, channels, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    SSIMULACRA2Maps maps;
+    const Msssim msssim =
+        ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.5f, &maps);
+    ExpectNear(ComputeSSIMULACRA2(orig.Main(), dist.Main()), msssim, 0);
+    // Without maps.
+    ExpectNear(msssim,
+               ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.5f, nullptr), 0);
+    ASSERT_EQ(6u, maps.ssim.size());
+
+    const double *weights = SSIMULACRA2Weights();
+    std::vector<double> features(kSSIMULACRA2NumFeatures);
+    double expected_mean = 0;
+    const std::vector<Image3F> *kinds[3] = {&maps.ssim, &maps.ringing,
+                                            &maps.blurring};
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t scale = 0; scale < 6; ++scale) {
+        for (size_t m = 0; m < 3; ++m) {
+          const ImageF &map = (*kinds[m])[scale].Plane(c);
+          double sum = 0, sum4 = 0;
+          for (size_t y = 0; y < map.ysize(); ++y) {
+            for (size_t x = 0; x < map.xsize(); ++x) {
+              const double d = map.ConstRow(y)[x];
+              sum += d;
+              sum4 += d * d * d * d;
+            }
+          }
+          const double pixels = map.xsize() * map.ysize();
+          const size_t i = (c * 6 + scale) * 6 + m;
+          features[i] = sum / pixels;
+          features[i + 3] = std::pow(sum4 / pixels, 0.25);
+          expected_mean += (weights[i] + weights[i + 3]) * features[i];
+        }
+      }
+    }
+    const std::vector<double> expected = msssim.Features();
+    for (size_t i = 0; i < kSSIMULACRA2NumFeatures; ++i) {
+      EXPECT_NEAR(expected[i], features[i], 1e-6) << i;
+    }
+    EXPECT_NEAR(msssim.Score(), ScoreFromFeatures(features.data(), weights),
+                1e-3);
+
+    const ImageF weighted = maps.Weighted();
+    double sum = 0;
+    for (size_t y = 0; y < weighted.ysize(); ++y) {
+      for (size_t x = 0; x < weighted.xsize(); ++x) {
+        sum += weighted.ConstRow(y)[x];
+      }
+    }
+    EXPECT_NEAR(expected_mean, sum / (weighted.xsize() * weighted.ysize()),
+                1e-4 * expected_mean);
+  }
+}
+
+// The score as the baseline computed it: the weights are taken in order
+// over the scales that the images have.
+double BaselineScore(const Msssim &msssim) {
+  const double *weight = SSIMULACRA2Weights();
+  double ssim = 0.0;
+  size_t i = 0;
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t scale = 0; scale < msssim.scales.size(); ++scale) {
+      for (size_t n = 0; n < 2; n++) {
+        const MsssimScale &norms = msssim.scales[scale];
+        ssim += weight[i++] * std::abs(norms.avg_ssim[c * 2 + n]);
+        ssim += weight[i++] * std::abs(norms.avg_edgediff[c * 4 + n]);
+        ssim += weight[i++] * std::abs(norms.avg_edgediff[c * 4 + n + 2]);
+      }
+    }
+  }
+  ssim = ssim * 0.9562382616834844;
+  ssim = 2.326765642916932 * ssim - 0.020884521182843837 * ssim * ssim +
+         6.248496625763138e-05 * ssim * ssim * ssim;
+  if (ssim > 0) {
+    ssim = 100.0 - 10.0 * pow(ssim, 0.6276336467831387);
+  } else {
+    ssim = 100.0;
+  }
+  return ssim;
+}
+
+// Images too small for some scales have the features of the scales they have
+// first, followed by zeros, and are scored exactly as by the baseline.
+TEST(SSIMULACRA2Test, SmallImagesScoreAsBaseline) {
+  const size_t sizes[][3] = {
+      {40, 30, 3}, {90, 70, 4}, {200, 150, 5}, {256, 256, 6}};
+  for (const auto &size : sizes) {
+    jxl::CodecInOut orig, dist;
+    TestImage(size[0], size[1], 3, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    const Msssim msssim = ComputeSSIMULACRA2(orig.Main(), dist.Main());
+    ASSERT_EQ(size[2], msssim.scales.size());
+    const std::vector<double> features = msssim.Features();
+    ASSERT_EQ(kSSIMULACRA2NumFeatures, features.size());
+    const size_t num_scales = msssim.scales.size();
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t scale = 0; scale < num_scales; ++scale) {
+        for (size_t n = 0; n < 2; ++n) {
+          const double *f = &features[((c * num_scales + scale) * 2 + n) * 3];
+          const MsssimScale &norms = msssim.scales[scale];
+          EXPECT_EQ(norms.avg_ssim[c * 2 + n], f[0]);
+          EXPECT_EQ(norms.avg_edgediff[c * 4 + n], f[1]);
+          EXPECT_EQ(norms.avg_edgediff[c * 4 + 2 + n], f[2]);
+        }
+      }
+    }
+    for (size_t i = num_scales * 18; i < kSSIMULACRA2NumFeatures; ++i) {
+      EXPECT_EQ(0.0, features[i]) << i;
+    }
+    EXPECT_EQ(BaselineScore(msssim), msssim.Score()) << size[0];
+    EXPECT_EQ(msssim.Score(),
+              ScoreFromFeatures(features.data(), SSIMULACRA2Weights()));
+  }
+}
+
+TEST(SSIMULACRA2Test, WorstOverBackgroundsTakesLowestScore) {
+  jxl::CodecInOut opaque, alpha, dist;
+  TestImage(90, 70, 3, 1, &opaque);
+  TestImage(90, 70, 4, 1, &alpha);
+  EXPECT_EQ(std::vector<float>{0.5f}, SSIMULACRA2Backgrounds(opaque.Main()));
+  const std::vector<float> backgrounds = SSIMULACRA2Backgrounds(alpha.Main());
+  ASSERT_EQ(2u, backgrounds.size());
+
+  Distort(alpha, 0.1f, 2, &dist);
+  std::vector<double> scores;
+  for (float bg : backgrounds) {
+    scores.push_back(
+        ComputeSSIMULACRA2(alpha.Main(), dist.Main(), bg).Score());
+  }
+  size_t worst = 2;
+  const Msssim msssim = WorstOverBackgrounds(
+      alpha.Main(),
+      [&](float bg) {
+        return ComputeSSIMULACRA2(alpha.Main(), dist.Main(), bg);
+      },
+      &worst);
+  const size_t expected = scores[1] < scores[0] ? 1 : 0;
+  EXPECT_EQ(expected, worst);
+  EXPECT_EQ(scores[expected], msssim.Score());
+}
+
+TEST(SSIMULACRA2Test, StatsCountAllocationsOfThisThread) {
+  jxl::CodecInOut orig, dist;
+  TestImage(120, 90, 3, 1, &orig);
+  Distort(orig, 0.1f, 2, &dist);
+  SSIMULACRA2Stats stats;
+  ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.5f, SSIMULACRA2Options(),
+                     &stats);
+  EXPECT_GT(stats.num_allocations, 0u);
+  EXPECT_EQ(stats.num_allocations, stats.num_frees);
+  EXPECT_GT(stats.peak_bytes_in_use, stats.bytes_in_use);
+
+  // Another thread holding an image during the computation does not count.
+  const jxl::CacheAligned::Stats before = jxl::CacheAligned::GetThreadStats();
+  jxl::ImageF held;
+  std::thread([&] { held = jxl::ImageF(1024, 1024); }).join();
+  const jxl::CacheAligned::Stats after = jxl::CacheAligned::GetThreadStats();
+  EXPECT_EQ(before.num_allocations, after.num_allocations);
+  EXPECT_EQ(before.bytes_in_use, after.bytes_in_use);
+  SSIMULACRA2Stats again;
+  ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.5f, SSIMULACRA2Options(),
+                     &again);
+  EXPECT_EQ(stats.num_allocations, again.num_allocations);
+  EXPECT_LE(stats.bytes_in_use + 1024 * held.bytes_per_row(),
+            again.bytes_in_use);
+  EXPECT_EQ(stats.peak_bytes_in_use - stats.bytes_in_use,
+            again.peak_bytes_in_use - again.bytes_in_use);
+}
+
+TEST(SSIMULACRA2Test, ArenaCarvesPlanesUntilFull) {
+  const jxl::CacheAligned::Stats before = jxl::CacheAligned::GetThreadStats();
+  {
+    jxl::CacheAlignedArena arena(1 << 20);
+    ASSERT_GE(arena.capacity(), 1u << 20);
+    const size_t num_allocations = before.num_allocations + 1;
+    EXPECT_EQ(num_allocations,
+              jxl::CacheAligned::GetThreadStats().num_allocations);
+    jxl::ImageF a(256, 256, &arena), b(256, 256, &arena);
+    EXPECT_EQ(num_allocations,
+              jxl::CacheAligned::GetThreadStats().num_allocations);
+    const uintptr_t row_a = reinterpret_cast<uintptr_t>(a.Row(0));
+    const uintptr_t row_b = reinterpret_cast<uintptr_t>(b.Row(0));
+    EXPECT_EQ(0u, row_a % jxl::CacheAligned::kAlignment);
+    EXPECT_EQ(0u, row_b % jxl::CacheAligned::kAlignment);
+    // Staggered, so that the same rows of both do not alias in the caches.
+    EXPECT_NE(row_a % jxl::CacheAligned::kAlias,
+              row_b % jxl::CacheAligned::kAlias);
+    EXPECT_GE(row_b, row_a + a.ysize() * a.bytes_per_row());
+    EXPECT_LE(arena.used(), arena.capacity());
+
+    // Planes that do not fit any more are allocated.
+    jxl::ImageF large(2048, 2048, &arena);
+    EXPECT_EQ(num_allocations + 1,
+              jxl::CacheAligned::GetThreadStats().num_allocations);
+    large.Row(2047)[2047] = 1.0f;
+  }
+  EXPECT_EQ(before.num_frees + 2,
+            jxl::CacheAligned::GetThreadStats().num_frees);
+  EXPECT_EQ(before.bytes_in_use,
+            jxl::CacheAligned::GetThreadStats().bytes_in_use);
+}
+
+TEST(SSIMULACRA2Test, ArenaOfMemoryManagerIsNotRoundedUp) {
+  struct Sizes {
+    std::vector<size_t> allocated;
+    size_t num_freed = 0;
+  } sizes;
+  JxlMemoryManager manager;
+  manager.opaque = &sizes;
+  manager.alloc = [](void *opaque, size_t size) {
+    static_cast<Sizes *>(opaque)->allocated.push_back(size);
+    return malloc(size);
+  };
+  manager.free = [](void *opaque, void *address) {
+    ++static_cast<Sizes *>(opaque)->num_freed;
+    free(address);
+  };
+  {
+    const jxl::CacheAligned::ScopedMemoryManager scope(&manager);
+    jxl::CacheAlignedArena arena(100000);
+    EXPECT_EQ(100000u, arena.capacity());
+    ASSERT_EQ(1u, sizes.allocated.size());
+    EXPECT_LE(sizes.allocated[0], 100000 + jxl::CacheAligned::kAlias);
+    jxl::ImageF plane(100, 100, &arena);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(plane.Row(0)) %
+                      jxl::CacheAligned::kAlignment);
+    EXPECT_EQ(1u, sizes.allocated.size());
+  }
+  EXPECT_EQ(1u, sizes.num_freed);
+}
+
+TEST(SSIMULACRA2Test, AllocationsDoNotDependOnImageSize) {
+  size_t num_allocations[2];
+  const size_t sizes[2][2] = {{64, 64}, {600, 450}};
+  for (size_t i = 0; i < 2; ++i) {
+    jxl::CodecInOut orig, dist;
+    TestImage(sizes[i][0], sizes[i][1], 3, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    const size_t before = jxl::CacheAligned::GetThreadStats().num_allocations;
+    ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.5f);
+    num_allocations[i] =
+        jxl::CacheAligned::GetThreadStats().num_allocations - before;
+  }
+  // The planes of all scales are carved out of one arena.
+  EXPECT_EQ(1u, num_allocations[0]);
+  EXPECT_EQ(num_allocations[0], num_allocations[1]);
+}
+
+TEST(SSIMULACRA2Test, IdenticalImagesScore100) {
+  for (size_t channels : {1, 3, 4}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(90, 70, channels, 1, &orig);
+    Distort(orig, jxl::Rect(0, 0, 0, 0), 0.1f, 2, &dist);
+    const Msssim msssim = ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.1f);
+    EXPECT_EQ(100.0, msssim.Score());
+    for (double feature : msssim.Features()) EXPECT_EQ(0.0, feature);
+  }
+}
+
+// Only the region around the changed pixels is compared; the others have no
+// errors. In the reference, they have some: the recursive Gaussian carries
+// rounding noise from the changed pixels into them.
+TEST(SSIMULACRA2Test, LocalChangeMatchesReference) {
+  for (size_t channels : {1, 3}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(200, 150, channels, 1, &orig);
+    Distort(orig, jxl::Rect(130, 20, 17, 9), 0.3f, 2, &dist);
+    const Msssim msssim = ComputeSSIMULACRA2(orig.Main(), dist.Main());
+    EXPECT_LT(msssim.Score(), 100.0);
+    Msssim reference =
+        ReferenceSSIMULACRA2::Compute(orig.Main(), dist.Main(), 0.5f);
+    if (channels == 1) ZeroXB(&reference);
+    ExpectNear(reference, msssim, 1e-4);
+  }
+}
+
+TEST(SSIMULACRA2Test, WholeImageRoiMatchesWholeImage) {
+  for (size_t channels : {1, 4}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(90, 70, channels, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    const Msssim whole = ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.1f);
+    const Msssim roi = ComputeSSIMULACRA2(orig.Main(), dist.Main(),
+                                          jxl::Rect(orig.Main()), 0.1f);
+    ExpectNear(whole, roi, 1e-6);
+  }
+}
+
+// The score of a region only depends on the pixels in SSIMULACRA2InputRect.
+TEST(SSIMULACRA2Test, RoiOnlyReadsInputRect) {
+  jxl::CodecInOut orig, dist;
+  TestImage(1000, 700, 3, 1, &orig);
+  Distort(orig, 0.1f, 2, &dist);
+  const jxl::Rect roi(40, 630, 40, 30);
+  const jxl::Rect input =
+      SSIMULACRA2InputRect(roi, orig.xsize(), orig.ysize());
+  ASSERT_TRUE(roi.IsInside(input));
+  ASSERT_LT(input.xsize() * input.ysize(), orig.xsize() * orig.ysize());
+  const Msssim msssim =
+      ComputeSSIMULACRA2(orig.Main(), dist.Main(), roi, 0.5f);
+  EXPECT_LT(msssim.Score(), 90.0);
+
+  // Change all pixels outside the input rect of both images.
+  for (jxl::CodecInOut *io : {&orig, &dist}) {
+    Image3F *color = io->Main().color();
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t y = 0; y < color->ysize(); ++y) {
+        float *JXL_RESTRICT row = color->PlaneRow(c, y);
+        for (size_t x = 0; x < color->xsize(); ++x) {
+          const bool inside = x >= input.x0() &&
+                              x < input.x0() + input.xsize() &&
+                              y >= input.y0() && y < input.y0() + input.ysize();
+          if (!inside) row[x] = (io == &orig) ? 0.0f : 1.0f;
+        }
+      }
+    }
+  }
+  const Msssim changed =
+      ComputeSSIMULACRA2(orig.Main(), dist.Main(), roi, 0.5f);
+  EXPECT_EQ(msssim.Features(), changed.Features());
+}
+
+TEST(SSIMULACRA2Test, TileScoresMatchRoiScores) {
+  jxl::CodecInOut orig, dist;
+  TestImage(200, 150, 3, 1, &orig);
+  Distort(orig, jxl::Rect(0, 0, 150, 150), 0.1f, 2, &dist);
+  const size_t tile_size = 64;
+  jxl::ImageD tile_scores;
+  const Msssim msssim = ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.5f,
+                                           tile_size, &tile_scores);
+  ExpectNear(ComputeSSIMULACRA2(orig.Main(), dist.Main()), msssim, 1e-6);
+  ASSERT_EQ(4u, tile_scores.xsize());
+  ASSERT_EQ(3u, tile_scores.ysize());
+  for (size_t ty = 0; ty < tile_scores.ysize(); ++ty) {
+    for (size_t tx = 0; tx < tile_scores.xsize(); ++tx) {
+      const jxl::Rect tile = jxl::Rect(tx * tile_size, ty * tile_size,
+                                       tile_size, tile_size, orig.xsize(),
+                                       orig.ysize());
+      const double expected =
+          ComputeSSIMULACRA2(orig.Main(), dist.Main(), tile, 0.5f).Score();
+      // The recursive Gaussian of the cropped region rounds differently,
+      // which dominates the scores of nearly unchanged tiles, and matters
+      // most at the coarsest scale of tiles across the edge of the noise.
+      const double tolerance = expected < 99.0 ? 0.1 : 0.5;
+      EXPECT_NEAR(expected, tile_scores.ConstRow(ty)[tx], tolerance)
+          << "tile " << tx << "," << ty;
+    }
+  }
+  // Only the left three quarters are distorted.
+  EXPECT_LT(tile_scores.ConstRow(0)[0], 90.0);
+  EXPECT_GT(tile_scores.ConstRow(0)[3], 99.0);
+}
+
+TEST(SSIMULACRA2Test, BandSumsRoundTrip) {
+  jxl::CodecInOut orig, dist;
+  TestImage(200, 150, 3, 1, &orig);
+  Distort(orig, 0.1f, 2, &dist);
+  const jxl::Rect band = SSIMULACRA2Band(1, 3, orig.xsize(), orig.ysize());
+  SSIMULACRA2BandSums sums;
+  ASSERT_TRUE(
+      ComputeSSIMULACRA2BandSums(orig.Main(), dist.Main(), band, 0.5f, &sums));
+  const std::string line = sums.Serialize();
+  SSIMULACRA2BandSums parsed;
+  ASSERT_TRUE(SSIMULACRA2BandSums::Parse(line, &parsed));
+  EXPECT_EQ(line, parsed.Serialize());
+  EXPECT_EQ(sums.xsize, parsed.xsize);
+  EXPECT_EQ(sums.ysize, parsed.ysize);
+  EXPECT_EQ(sums.bg, parsed.bg);
+  ASSERT_EQ(sums.scales.size(), parsed.scales.size());
+  for (size_t scale = 0; scale < sums.scales.size(); ++scale) {
+    const SSIMULACRA2BandSums::Scale &a = sums.scales[scale];
+    const SSIMULACRA2BandSums::Scale &b = parsed.scales[scale];
+    EXPECT_EQ(a.y0, b.y0);
+    EXPECT_EQ(a.y1, b.y1);
+    EXPECT_EQ(a.num_pixels, b.num_pixels);
+    for (size_t i = 0; i < 3 * 2; ++i) EXPECT_EQ(a.ssim[i], b.ssim[i]);
+    for (size_t i = 0; i < 3 * 4; ++i) EXPECT_EQ(a.edgediff[i], b.edgediff[i]);
+  }
+
+  EXPECT_FALSE(SSIMULACRA2BandSums::Parse("", &parsed));
+  EXPECT_FALSE(SSIMULACRA2BandSums::Parse(line + " 1", &parsed));
+  EXPECT_FALSE(SSIMULACRA2BandSums::Parse(line.substr(0, line.size() / 2),
+                                          &parsed));
+}
+
+TEST(SSIMULACRA2Test, InvalidBandsAreRejected) {
+  jxl::CodecInOut orig, dist;
+  TestImage(200, 150, 3, 1, &orig);
+  Distort(orig, 0.1f, 2, &dist);
+  SSIMULACRA2BandSums sums;
+  // Boundaries that are not multiples of 32, except at the bottom.
+  EXPECT_FALSE(ComputeSSIMULACRA2BandSums(
+      orig.Main(), dist.Main(), jxl::Rect(0, 16, 200, 48), 0.5f, &sums));
+  EXPECT_FALSE(ComputeSSIMULACRA2BandSums(
+      orig.Main(), dist.Main(), jxl::Rect(0, 32, 200, 40), 0.5f, &sums));
+  EXPECT_TRUE(ComputeSSIMULACRA2BandSums(
+      orig.Main(), dist.Main(), jxl::Rect(0, 128, 200, 22), 0.5f, &sums));
+  // Not full rows, or beyond the images.
+  EXPECT_FALSE(ComputeSSIMULACRA2BandSums(
+      orig.Main(), dist.Main(), jxl::Rect(8, 32, 192, 32), 0.5f, &sums));
+  EXPECT_FALSE(ComputeSSIMULACRA2BandSums(
+      orig.Main(), dist.Main(), jxl::Rect(0, 128, 200, 32), 0.5f, &sums));
+  jxl::CodecInOut small;
+  TestImage(200, 100, 3, 1, &small);
+  EXPECT_FALSE(ComputeSSIMULACRA2BandSums(
+      orig.Main(), small.Main(), jxl::Rect(0, 0, 200, 32), 0.5f, &sums));
+}
+
+TEST(SSIMULACRA2Test, MergedBandsMatchWholeImage) {
+  jxl::CodecInOut orig, dist;
+  TestImage(200, 150, 3, 1, &orig);
+  Distort(orig, 0.1f, 2, &dist);
+  const size_t num_bands = 4;
+  std::vector<SSIMULACRA2BandSums> bands;
+  for (size_t i = 0; i < num_bands; ++i) {
+    // Through text, as when the bands are scored by other processes.
+    const jxl::Rect band =
+        SSIMULACRA2Band(i, num_bands, orig.xsize(), orig.ysize());
+    SSIMULACRA2BandSums sums, parsed;
+    ASSERT_TRUE(ComputeSSIMULACRA2BandSums(orig.Main(), dist.Main(), band,
+                                           0.5f, &sums));
+    ASSERT_TRUE(SSIMULACRA2BandSums::Parse(sums.Serialize(), &parsed));
+    bands.push_back(parsed);
+  }
+  Msssim merged;
+  ASSERT_TRUE(MergeSSIMULACRA2BandSums(bands, &merged));
+  // Not exact: each band is blurred from its own input rect.
+  const Msssim whole = ComputeSSIMULACRA2(orig.Main(), dist.Main());
+  ExpectNear(whole, merged, 5e-5);
+  EXPECT_NEAR(whole.Score(), merged.Score(), 1e-2);
+
+  // The order of the bands does not matter, not even for rounding.
+  std::reverse(bands.begin(), bands.end());
+  Msssim reversed;
+  ASSERT_TRUE(MergeSSIMULACRA2BandSums(bands, &reversed));
+  ExpectNear(merged, reversed, 0);
+
+  // Each band has to be there exactly once, for the same background.
+  std::vector<SSIMULACRA2BandSums> missing(bands.begin() + 1, bands.end());
+  EXPECT_FALSE(MergeSSIMULACRA2BandSums(missing, &merged));
+  std::vector<SSIMULACRA2BandSums> twice = bands;
+  twice.push_back(bands[0]);
+  EXPECT_FALSE(MergeSSIMULACRA2BandSums(twice, &merged));
+  std::vector<SSIMULACRA2BandSums> other_bg = bands;
+  other_bg[0].bg = 0.1f;
+  EXPECT_FALSE(MergeSSIMULACRA2BandSums(other_bg, &merged));
+}
+
+// Returns the bytes that `compute` allocates at most on this thread.
+size_t PeakBytes(const std::function<void()> &compute) {
+  const jxl::CacheAligned::ThreadPeak peak;
+  const jxl::CacheAligned::Stats before = jxl::CacheAligned::GetThreadStats();
+  compute();
+  return jxl::CacheAligned::GetThreadStats().max_bytes_in_use -
+         before.bytes_in_use;
+}
+
+TEST(SSIMULACRA2Test, TruncatedGaussianBlurApproximatesFastGaussian) {
+  const float kPadding = 1E30f;
+  for (size_t xsize : {1, 3, 37, 64}) {
+    const size_t ysize = 29;
+    ImageF in(xsize, ysize);
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        in.Row(y)[x] = ((x * 7 + y * 13) % 17) / 17.0f;
+      }
+    }
+    const auto rg =
+        jxl::CreateRecursiveGaussian(ssimulacra2_stages::kBlurSigma);
+    ImageF temp(xsize, ysize), expected(xsize, ysize);
+    jxl::FastGaussian(rg, in, nullptr, &temp, &expected);
+
+    // Neither pass may read or write the padding of the rows.
+    ImageF out(xsize, ysize);
+    for (ImageF *image : {&temp, &out}) {
+      for (size_t y = 0; y < ysize; ++y) {
+        std::fill(image->Row(y), image->Row(y) + image->PixelsPerRow(),
+                  kPadding);
+      }
+    }
+    ssimulacra2_stages::TruncatedGaussianBlur(in, &temp, &out);
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        EXPECT_NEAR(expected.Row(y)[x], out.Row(y)[x], 1e-4f)
+            << xsize << "x" << ysize << " at " << x << "," << y;
+      }
+      for (intptr_t x = xsize; x < out.PixelsPerRow(); ++x) {
+        EXPECT_EQ(kPadding, out.Row(y)[x]) << xsize << " at " << x << "," << y;
+      }
+    }
+  }
+}
+
+TEST(SSIMULACRA2Test, FastGaussianRowsMatchWholeImage) {
+  const size_t xsize = 70, ysize = 300;
+  ImageF in(xsize, ysize);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      in.Row(y)[x] = ((x * 7 + y * 13) % 17) / 17.0f;
+    }
+  }
+  const auto rg = jxl::CreateRecursiveGaussian(ssimulacra2_stages::kBlurSigma);
+  ImageF temp(xsize, ysize), whole(xsize, ysize);
+  jxl::FastGaussian(rg, in, nullptr, &temp, &whole);
+
+  const size_t halo = rg->radius + 1;
+  for (size_t strip_rows : {1, 2, 37, 150}) {
+    jxl::FastGaussianRowsState state;
+    for (size_t y0 = 0; y0 < ysize; y0 += strip_rows) {
+      const size_t y1 = std::min(ysize, y0 + strip_rows);
+      const size_t in_y0 = y0 < halo ? 0 : y0 - halo;
+      const jxl::Rect rows(0, in_y0, xsize, y1 + halo - in_y0, xsize, ysize);
+      const ImageF strip = jxl::CopyImage(rows, in);
+      ImageF strip_temp(xsize, rows.ysize()), out(xsize, rows.ysize());
+      jxl::FastGaussianRows(rg, strip, in_y0, ysize, y1, nullptr, &strip_temp,
+                            &state, &out);
+      for (size_t y = y0; y < y1; ++y) {
+        for (size_t x = 0; x < xsize; ++x) {
+          ASSERT_EQ(whole.Row(y)[x], out.Row(y - in_y0)[x])
+              << strip_rows << " " << x << " " << y;
+        }
+      }
+    }
+  }
+}
+
+TEST(SSIMULACRA2Test, MaxBytesStripsMatchWholeImage) {
+  for (size_t channels : {1, 3}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(600, 450, channels, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    const Msssim whole = ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.5f);
+    const size_t whole_bytes = PeakBytes(
+        [&] { ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.5f); });
+    for (size_t max_bytes :
+         {whole_bytes * 2, whole_bytes / 2, whole_bytes / 4}) {
+      Msssim msssim;
+      bool fits = false;
+      const size_t peak = PeakBytes([&] {
+        fits = ComputeSSIMULACRA2WithinBudget(orig.Main(), dist.Main(), 0.5f,
+                                              max_bytes, &msssim);
+      });
+      ASSERT_TRUE(fits) << channels << " " << max_bytes;
+      EXPECT_LE(peak, max_bytes);
+      // The blurs continue from strip to strip, so only the order in which
+      // the errors are summed differs.
+      ExpectNear(whole, msssim, 1e-12);
+    }
+    Msssim msssim;
+    bool over_budget = false;
+    EXPECT_FALSE(ComputeSSIMULACRA2WithinBudget(orig.Main(), dist.Main(), 0.5f,
+                                                1 << 20, &msssim,
+                                                &over_budget));
+    EXPECT_TRUE(over_budget);
+  }
+}
+
+TEST(SSIMULACRA2Test, MaxBytesTilesBelowStripsBudget) {
+  // Strips keep 7.5 bytes per pixel of the second and third scale, tiles of
+  // 192 pixels plus their halo need about 30 MB.
+  jxl::CodecInOut orig, dist;
+  TestImage(3072, 2048, 3, 1, &orig);
+  Distort(orig, 0.1f, 2, &dist);
+  Msssim strips, tiles;
+  ASSERT_TRUE(ComputeSSIMULACRA2WithinBudget(orig.Main(), dist.Main(), 0.5f,
+                                             size_t(100) << 20, &strips));
+  const size_t max_bytes = size_t(40) << 20;
+  bool fits = false;
+  const size_t peak = PeakBytes([&] {
+    fits = ComputeSSIMULACRA2WithinBudget(orig.Main(), dist.Main(), 0.5f,
+                                          max_bytes, &tiles);
+  });
+  ASSERT_TRUE(fits);
+  EXPECT_LE(peak, max_bytes);
+  // As for bands, the blurs of each tile start at its halo. Of the many tiles,
+  // those of the coarsest scale are 6x6 pixels, whose fourth root norms of
+  // near zero errors deviate the most (by 1e-4).
+  ExpectNear(strips, tiles, 2e-4);
+}
+
+TEST(SSIMULACRA2Test, MaxBytesCountsDecodedRows) {
+  jxl::CodecInOut orig, dist;
+  TestImage(600, 450, 3, 1, &orig);
+  Distort(orig, 0.1f, 2, &dist);
+  const Msssim whole = ComputeSSIMULACRA2(orig.Main(), dist.Main());
+  // Decodes rows [y0, y1) by copying them from the whole images.
+  size_t max_rows = 0;
+  const SSIMULACRA2DecodeFunc decode = [&](size_t y0, size_t y1,
+                                           jxl::CodecInOut *io1,
+                                           jxl::CodecInOut *io2) {
+    max_rows = std::max(max_rows, y1 - y0);
+    const jxl::Rect rect(0, y0, orig.xsize(), y1 - y0);
+    for (std::pair<const jxl::CodecInOut *, jxl::CodecInOut *> io :
+         {std::make_pair(&orig, io1), std::make_pair(&dist, io2)}) {
+      io.second->metadata = io.first->metadata;
+      io.second->SetSize(io.first->xsize(), io.first->ysize());
+      jxl::Image3F color(rect.xsize(), rect.ysize());
+      jxl::CopyImageTo(rect, io.first->Main().color(), &color);
+      io.second->Main().SetFromImage(std::move(color),
+                                     io.first->Main().c_current());
+    }
+    return true;
+  };
+  Msssim msssim;
+  ASSERT_TRUE(
+      ComputeSSIMULACRA2WithinBudget(600, 450, decode, 1 << 30, &msssim));
+  EXPECT_EQ(450u, max_rows);
+  ExpectNear(whole, msssim, 1e-12);
+
+  // Within a budget, only strips of the rows are decoded at a time, and
+  // they are counted.
+  const size_t whole_bytes = PeakBytes(
+      [&] { ComputeSSIMULACRA2(orig.Main(), dist.Main()); });
+  max_rows = 0;
+  bool fits = false;
+  const size_t peak = PeakBytes([&] {
+    fits = ComputeSSIMULACRA2WithinBudget(600, 450, decode, whole_bytes / 2,
+                                          &msssim);
+  });
+  ASSERT_TRUE(fits);
+  EXPECT_LE(peak, whole_bytes / 2);
+  EXPECT_LT(max_rows, 450u);
+  ExpectNear(whole, msssim, 1e-12);
+  bool over_budget = false;
+  EXPECT_FALSE(ComputeSSIMULACRA2WithinBudget(600, 450, decode, 1 << 20,
+                                              &msssim, &over_budget));
+  EXPECT_TRUE(over_budget);
+
+  // Codecs that decode all rows for each strip fail up front when these do
+  // not fit.
+  const SSIMULACRA2DecodeFunc decode_all = [&](size_t, size_t,
+                                               jxl::CodecInOut *io1,
+                                               jxl::CodecInOut *io2) {
+    return decode(0, 450, io1, io2);
+  };
+  max_rows = 0;
+  over_budget = false;
+  EXPECT_FALSE(ComputeSSIMULACRA2WithinBudget(600, 450, decode_all,
+                                              5 * 600 * 450 * 4, &msssim,
+                                              &over_budget));
+  EXPECT_TRUE(over_budget);
+  ASSERT_TRUE(ComputeSSIMULACRA2WithinBudget(600, 450, decode_all,
+                                             1 << 30, &msssim));
+  ExpectNear(whole, msssim, 1e-12);
+
+  // Decoding failures and rows of other sizes are not over the budget.
+  const SSIMULACRA2DecodeFunc decode_wrong = [&](size_t y0, size_t y1,
+                                                 jxl::CodecInOut *io1,
+                                                 jxl::CodecInOut *io2) {
+    if (y1 - y0 == 1) return decode(y0, y1, io1, io2);
+    return decode(y0, y1 - 1, io1, io2);
+  };
+  over_budget = true;
+  EXPECT_FALSE(ComputeSSIMULACRA2WithinBudget(600, 450, decode_wrong,
+                                              1 << 30, &msssim, &over_budget));
+  EXPECT_FALSE(over_budget);
+}
+
+TEST(SSIMULACRA2Test, ReferenceFileRoundTrip) {
+  for (size_t channels : {1, 4}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(90, 70, channels, 1, &orig);
+    Distort(orig, 0.1f, 2, &dist);
+    std::vector<SSIMULACRA2Reference> refs;
+    for (float bg : SSIMULACRA2Backgrounds(orig.Main())) {
+      refs.emplace_back(orig.Main(), bg);
+    }
+    const std::string path = testing::TempDir() + "ssimulacra2_test.ref";
+    ASSERT_TRUE(SSIMULACRA2Reference::WriteFile(refs, 1234, path));
+    uint64_t key;
+    std::vector<SSIMULACRA2Reference> loaded;
+    ASSERT_TRUE(SSIMULACRA2Reference::LoadFile(path, &key, &loaded));
+    EXPECT_EQ(1234u, key);
+    ASSERT_EQ(refs.size(), loaded.size());
+    for (size_t i = 0; i < refs.size(); ++i) {
+      EXPECT_EQ(refs[i].bg(), loaded[i].bg());
+      Msssim expected, actual;
+      ASSERT_TRUE(refs[i].Compare(dist.Main(), &expected));
+      ASSERT_TRUE(loaded[i].Compare(dist.Main(), &actual));
+      ExpectNear(expected, actual, 0);
+      ExpectNear(ComputeSSIMULACRA2(orig.Main(), dist.Main(), refs[i].bg()),
+                 actual, 1e-5);
+    }
+#ifndef _WIN32
+    // The planes are used in place in the mapped file, not allocated.
+    if (JXL_BYTE_ORDER_LITTLE) {
+      loaded.clear();
+      EXPECT_EQ(0u, PeakBytes([&] {
+        ASSERT_TRUE(SSIMULACRA2Reference::LoadFile(path, &key, &loaded));
+      }));
+      ASSERT_EQ(refs.size(), loaded.size());
+      Msssim actual;
+      ASSERT_TRUE(loaded[0].Compare(dist.Main(), &actual));
+      ExpectNear(ComputeSSIMULACRA2(orig.Main(), dist.Main(), refs[0].bg()),
+                 actual, 1e-5);
+    }
+#endif
+    remove(path.c_str());
+  }
+}
+
+TEST(SSIMULACRA2Test, InvalidReferenceFilesAreRejected) {
+  jxl::CodecInOut orig;
+  TestImage(90, 70, 3, 1, &orig);
+  std::vector<SSIMULACRA2Reference> refs;
+  refs.emplace_back(orig.Main(), 0.5f);
+  const std::string path = testing::TempDir() + "ssimulacra2_test.ref";
+  ASSERT_TRUE(SSIMULACRA2Reference::WriteFile(refs, 1, path));
+  std::vector<uint8_t> bytes;
+  ASSERT_TRUE(jxl::ReadFile(path, &bytes));
+  uint64_t key;
+  std::vector<SSIMULACRA2Reference> loaded;
+
+  std::vector<uint8_t> truncated(bytes.begin(), bytes.end() - 1);
+  ASSERT_TRUE(jxl::WriteFile(truncated, path));
+  EXPECT_FALSE(SSIMULACRA2Reference::LoadFile(path, &key, &loaded));
+
+  std::vector<uint8_t> trailing = bytes;
+  trailing.push_back(0);
+  ASSERT_TRUE(jxl::WriteFile(trailing, path));
+  EXPECT_FALSE(SSIMULACRA2Reference::LoadFile(path, &key, &loaded));
+
+  // A header that claims a huge image fails before the planes are allocated.
+  std::vector<uint8_t> huge = bytes;
+  huge[32 + 5] = 1;  // xsize of the first reference
+  ASSERT_TRUE(jxl::WriteFile(huge, path));
+  EXPECT_FALSE(SSIMULACRA2Reference::LoadFile(path, &key, &loaded));
+  std::vector<uint8_t> wider = bytes;
+  // Planes that fit in the file, but not all of them: rows are padded to 64
+  // bytes, hence 16 more pixels.
+  wider[32] += 16;
+  ASSERT_TRUE(jxl::WriteFile(wider, path));
+  EXPECT_FALSE(SSIMULACRA2Reference::LoadFile(path, &key, &loaded));
+  remove(path.c_str());
+}
+
+TEST(SSIMULACRA2Test, ScorerUpdateMatchesFullComputation) {
+  for (size_t channels : {1, 3, 4}) {
+    jxl::CodecInOut orig, dist;
+    TestImage(200, 150, channels, 1, &orig);
+    Distort(orig, 0.05f, 2, &dist);
+    SSIMULACRA2Scorer scorer(orig.Main(), dist.Main(), 0.1f);
+    ExpectNear(ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.1f),
+               scorer.Current(), 1e-5);
+
+    // Distort a block further, as an encoder refining it would.
+    const double score = scorer.Current().Score();
+    const jxl::Rect dirty(70, 40, 24, 16);
+    jxl::CodecInOut edited;
+    Distort(dist, dirty, 0.3f, 3, &edited);
+    scorer.Update(edited.Main(), dirty);
+    const Msssim full = ComputeSSIMULACRA2(orig.Main(), edited.Main(), 0.1f);
+    EXPECT_LT(full.Score(), score);
+    ExpectNear(full, scorer.Current(), 1e-5);
+  }
+}
+
+}  // namespace
@@ -0,0 +1,110 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_SSIMULACRA2_TEST_UTILS_H_
+#define TOOLS_SSIMULACRA2_TEST_UTILS_H_
+
+// Synthetic images for the tests of SSIMULACRA 2.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "lib/extras/codec.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/codec_in_out.h"
+#include "lib/jxl/image_ops.h"
+
+namespace ssimulacra2_test {
+
+// Sets 'io' to an 8-bit sRGB image of waves with some noise, in 0..1:
+// gray if 'channels' is 1 (with three equal planes), color if 3, and color
+// with a varying alpha if 4.
+inline void TestImage(size_t xsize, size_t ysize, size_t channels,
+                      uint64_t seed, jxl::CodecInOut *io) {
+  jxl::Rng rng(seed);
+  const bool is_gray = channels == 1;
+  jxl::Image3F color(xsize, ysize);
+  for (size_t c = 0; c < 3; ++c) {
+    if (is_gray && c != 0) {
+      jxl::CopyImageTo(color.Plane(0), &color.Plane(c));
+      continue;
+    }
+    const float fx = rng.UniformF(0.02f, 0.2f);
+    const float fy = rng.UniformF(0.02f, 0.2f);
+    const float phase = rng.UniformF(0.f, 6.f);
+    for (size_t y = 0; y < ysize; ++y) {
+      float *JXL_RESTRICT row = color.PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        const float v = 0.5f + 0.3f * sinf(fx * x + phase) * cosf(fy * y) +
+                        rng.UniformF(-0.1f, 0.1f);
+        row[x] = std::min(std::max(v, 0.f), 1.f);
+      }
+    }
+  }
+  const jxl::ColorEncoding &c_srgb = jxl::ColorEncoding::SRGB(is_gray);
+  io->metadata.m.SetUintSamples(8);
+  io->metadata.m.color_encoding = c_srgb;
+  if (channels == 4) io->metadata.m.SetAlphaBits(8);
+  io->SetFromImage(std::move(color), c_srgb);
+  if (channels == 4) {
+    jxl::ImageF alpha(xsize, ysize);
+    for (size_t y = 0; y < ysize; ++y) {
+      float *JXL_RESTRICT row = alpha.Row(y);
+      for (size_t x = 0; x < xsize; ++x) {
+        row[x] = 0.5f + 0.5f * sinf(0.05f * (x + 2 * y));
+      }
+    }
+    io->Main().SetAlpha(std::move(alpha), /*alpha_is_premultiplied=*/false);
+  }
+}
+
+// Sets 'dist' to 'orig' with uniform noise of up to 'amount' added within
+// 'rect'. Gray images get the same noise in all planes, so that they stay
+// gray.
+inline void Distort(const jxl::CodecInOut &orig, const jxl::Rect &rect,
+                    float amount, uint64_t seed, jxl::CodecInOut *dist) {
+  jxl::Rng rng(seed);
+  const jxl::ImageBundle &ib = orig.Main();
+  jxl::Image3F color = jxl::CopyImage(ib.color());
+  for (size_t y = 0; y < rect.ysize(); ++y) {
+    for (size_t x = 0; x < rect.xsize(); ++x) {
+      const float noise = rng.UniformF(-amount, amount);
+      for (size_t c = 0; c < 3; ++c) {
+        float &v = rect.PlaneRow(&color, c, y)[x];
+        const float delta =
+            ib.IsGray() || c == 0 ? noise : rng.UniformF(-amount, amount);
+        v = std::min(std::max(v + delta, 0.f), 1.f);
+      }
+    }
+  }
+  dist->metadata = orig.metadata;
+  dist->SetFromImage(std::move(color), ib.c_current());
+  if (ib.HasAlpha()) {
+    dist->Main().SetAlpha(jxl::CopyImage(ib.alpha()),
+                          /*alpha_is_premultiplied=*/false);
+  }
+}
+
+inline void Distort(const jxl::CodecInOut &orig, float amount, uint64_t seed,
+                    jxl::CodecInOut *dist) {
+  Distort(orig, jxl::Rect(orig.Main()), amount, seed, dist);
+}
+
+// Returns 'io' encoded as a PNG file.
+inline std::vector<uint8_t> EncodePNG(const jxl::CodecInOut &io) {
+  std::vector<uint8_t> bytes;
+  JXL_CHECK(jxl::Encode(io, jxl::extras::Codec::kPNG, io.Main().c_current(),
+                        /*bits_per_sample=*/8, &bytes));
+  return bytes;
+}
+
+}  // namespace ssimulacra2_test
+
+#endif  // TOOLS_SSIMULACRA2_TEST_UTILS_H_
@@ -0,0 +1,116 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "ssimulacra2_trace.h"
+
+#include <stdio.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lib/jxl/base/file_io.h"
+
+namespace {
+
+struct TraceEvent {
+  const char *name;
+  int scale;
+  int plane;
+  int strip;
+  double begin;
+  double end;
+};
+
+// Spans of one thread, which is the only one that appends to them. The lock
+// is only contended by Start and WriteFile.
+struct ThreadEvents {
+  std::mutex mutex;
+  std::vector<TraceEvent> events;
+  size_t tid;
+};
+
+// The buffers of all threads that ever recorded a span, in the order in which
+// they first did, kept so that they outlive their threads until they are
+// written.
+std::mutex threads_mutex;
+std::vector<std::unique_ptr<ThreadEvents>> threads;
+double start_time = 0.0;
+thread_local ThreadEvents *thread_events = nullptr;
+
+ThreadEvents *ThisThread() {
+  if (thread_events) return thread_events;
+  std::lock_guard<std::mutex> lock(threads_mutex);
+  threads.emplace_back(new ThreadEvents());
+  thread_events = threads.back().get();
+  thread_events->tid = threads.size();
+  return thread_events;
+}
+
+void AppendArg(const char *name, int value, bool *first, std::string *out) {
+  if (value < 0) return;
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%s\"%s\":%d", *first ? "" : ",", name, value);
+  *out += buf;
+  *first = false;
+}
+
+} // namespace
+
+std::atomic<bool> SSIMULACRA2Trace::enabled_{false};
+
+void SSIMULACRA2Trace::Start() {
+  std::lock_guard<std::mutex> lock(threads_mutex);
+  for (const auto &t : threads) {
+    std::lock_guard<std::mutex> thread_lock(t->mutex);
+    t->events.clear();
+  }
+  start_time = jxl::Now();
+  enabled_.store(true, std::memory_order_release);
+}
+
+void SSIMULACRA2Trace::Record(const char *name, int scale, int plane,
+                              int strip, double begin) {
+  const double end = jxl::Now();
+  ThreadEvents *t = ThisThread();
+  std::lock_guard<std::mutex> lock(t->mutex);
+  t->events.push_back({name, scale, plane, strip, begin, end});
+}
+
+jxl::Status SSIMULACRA2Trace::WriteFile(const std::string &pathname) {
+  enabled_.store(false, std::memory_order_relaxed);
+  // Complete events ("X") with times in microseconds since Start, on a track
+  // per thread that is named after the order in which it first recorded.
+  std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  char buf[256];
+  bool first_event = true;
+  std::lock_guard<std::mutex> lock(threads_mutex);
+  for (const auto &t : threads) {
+    std::lock_guard<std::mutex> thread_lock(t->mutex);
+    if (t->events.empty()) continue;
+    snprintf(buf, sizeof(buf),
+             "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+             "\"tid\":%zu,\"args\":{\"name\":\"thread %zu\"}}",
+             first_event ? "" : ",", t->tid, t->tid);
+    json += buf;
+    first_event = false;
+    for (const TraceEvent &e : t->events) {
+      snprintf(buf, sizeof(buf),
+               ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+               "\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+               e.name, t->tid, (e.begin - start_time) * 1e6,
+               (e.end - e.begin) * 1e6);
+      json += buf;
+      bool first_arg = true;
+      AppendArg("scale", e.scale, &first_arg, &json);
+      AppendArg("plane", e.plane, &first_arg, &json);
+      AppendArg("strip", e.strip, &first_arg, &json);
+      json += "}}";
+    }
+  }
+  json += "\n]}\n";
+  return jxl::WriteFile(json, pathname);
+}
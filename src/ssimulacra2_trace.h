@@ -0,0 +1,63 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_SSIMULACRA2_TRACE_H_
+#define TOOLS_SSIMULACRA2_TRACE_H_
+
+// Opt-in timeline of the computation, written as Chrome trace-event JSON that
+// chrome://tracing and Perfetto can show, e.g. to see where time goes.
+
+#include <atomic>
+#include <string>
+
+#include "lib/extras/time.h"
+#include "lib/jxl/base/status.h"
+
+// Spans are recorded by each thread into its own buffer, under a lock of that
+// buffer that only Start and WriteFile contend for, and are shown on a track
+// per thread, so that the work of concurrent comparisons or of strips can be
+// told apart.
+class SSIMULACRA2Trace {
+public:
+  // Begins recording, discarding earlier spans.
+  static void Start();
+
+  static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Stops recording and writes the spans of all threads to 'pathname'.
+  static jxl::Status WriteFile(const std::string &pathname);
+
+  // Records the time from construction to destruction as a span named 'name'
+  // (a string literal), if recording. The scale, plane and strip (row band)
+  // are shown with it, unless they are negative.
+  class Span {
+  public:
+    explicit Span(const char *name, int scale = -1, int plane = -1,
+                  int strip = -1)
+        : name_(name), scale_(scale), plane_(plane), strip_(strip),
+          begin_(Enabled() ? jxl::Now() : -1.0) {}
+    ~Span() {
+      if (begin_ >= 0.0) Record(name_, scale_, plane_, strip_, begin_);
+    }
+
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+  private:
+    const char *name_;
+    int scale_;
+    int plane_;
+    int strip_;
+    double begin_;
+  };
+
+private:
+  static void Record(const char *name, int scale, int plane, int strip,
+                     double begin);
+
+  static std::atomic<bool> enabled_;
+};
+
+#endif  // TOOLS_SSIMULACRA2_TRACE_H_
@@ -0,0 +1,131 @@
+// Copyright (c) Jon Sneyers, Cloudinary. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "ssimulacra2_trace.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "lib/jxl/base/cache_aligned.h"
+#include "lib/jxl/base/file_io.h"
+#include "lib/jxl/codec_in_out.h"
+#include "ssimulacra2.h"
+#include "ssimulacra2_test_utils.h"
+
+namespace {
+
+// Returns the number of occurrences of 'needle' in 'haystack'.
+size_t Count(const std::string &haystack, const std::string &needle) {
+  size_t count = 0;
+  for (size_t pos = haystack.find(needle); pos != std::string::npos;
+       pos = haystack.find(needle, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+// Stops recording and returns the written trace.
+std::string WriteTrace() {
+  const std::string path = testing::TempDir() + "ssimulacra2_trace.json";
+  std::string json;
+  EXPECT_TRUE(SSIMULACRA2Trace::WriteFile(path));
+  EXPECT_TRUE(jxl::ReadFile(path, &json));
+  remove(path.c_str());
+  return json;
+}
+
+TEST(SSIMULACRA2TraceTest, WritesSpansOfComputation) {
+  jxl::CodecInOut orig, dist;
+  ssimulacra2_test::TestImage(64, 64, 3, 1, &orig);
+  ssimulacra2_test::Distort(orig, 0.1f, 2, &dist);
+  EXPECT_FALSE(SSIMULACRA2Trace::Enabled());
+
+  SSIMULACRA2Trace::Start();
+  EXPECT_TRUE(SSIMULACRA2Trace::Enabled());
+  ComputeSSIMULACRA2(orig.Main(), dist.Main());
+  std::thread([] { SSIMULACRA2Trace::Span span("OtherThread", 7, 1); })
+      .join();
+  const std::string path = testing::TempDir() + "ssimulacra2_trace.json";
+  ASSERT_TRUE(SSIMULACRA2Trace::WriteFile(path));
+  EXPECT_FALSE(SSIMULACRA2Trace::Enabled());
+  // Not recorded after WriteFile.
+  { SSIMULACRA2Trace::Span span("AfterWrite"); }
+
+  std::string json;
+  ASSERT_TRUE(jxl::ReadFile(path, &json));
+  remove(path.c_str());
+  EXPECT_EQ(0u, json.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+  EXPECT_EQ(json.size() - 4, json.rfind("\n]}\n"));
+  EXPECT_EQ(1u, Count(json, "\"name\":\"ComputeSSIMULACRA2\""));
+  // 64x64 images have 4 scales, of 3 planes each.
+  EXPECT_EQ(4u * 3, Count(json, "\"name\":\"ComparePlanes\""));
+  EXPECT_EQ(1u, Count(json, "\"args\":{\"scale\":3,\"plane\":2}"));
+  EXPECT_EQ(1u, Count(json, "\"name\":\"OtherThread\""));
+  EXPECT_EQ(1u, Count(json, "\"args\":{\"scale\":7,\"plane\":1}}"));
+  EXPECT_EQ(0u, Count(json, "AfterWrite"));
+}
+
+// Concurrent comparisons are shown on a track per thread.
+TEST(SSIMULACRA2TraceTest, RecordsThreadsSeparately) {
+  jxl::CodecInOut orig, dist;
+  ssimulacra2_test::TestImage(64, 64, 3, 1, &orig);
+  ssimulacra2_test::Distort(orig, 0.1f, 2, &dist);
+
+  SSIMULACRA2Trace::Start();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 2; ++i) {
+    threads.emplace_back([&] { ComputeSSIMULACRA2(orig.Main(), dist.Main()); });
+  }
+  for (std::thread &thread : threads) thread.join();
+  const std::string json = WriteTrace();
+
+  EXPECT_EQ(2u, Count(json, "\"name\":\"thread_name\""));
+  EXPECT_EQ(2u, Count(json, "\"name\":\"ComputeSSIMULACRA2\""));
+  // The spans of each thread follow its name, with its own tid.
+  const std::string thread_name = "\"name\":\"thread_name\"";
+  std::vector<std::string> tids;
+  for (size_t pos = json.find(thread_name); pos != std::string::npos;) {
+    const size_t tid = json.find("\"tid\":", pos);
+    tids.push_back(json.substr(tid, json.find(',', tid) - tid));
+    const size_t next = json.find(thread_name, pos + 1);
+    const std::string track = json.substr(pos, next - pos);
+    pos = next;
+    EXPECT_EQ(1u, Count(track, "\"name\":\"ComputeSSIMULACRA2\""));
+    EXPECT_EQ(Count(track, "\"pid\":1,"), Count(track, tids.back() + ","));
+  }
+  ASSERT_EQ(2u, tids.size());
+  EXPECT_NE(tids[0], tids[1]);
+}
+
+// Comparing in strips records a span per strip of each scale.
+TEST(SSIMULACRA2TraceTest, RecordsStrips) {
+  jxl::CodecInOut orig, dist;
+  ssimulacra2_test::TestImage(600, 450, 3, 1, &orig);
+  ssimulacra2_test::Distort(orig, 0.1f, 2, &dist);
+  size_t whole_bytes;
+  {
+    const jxl::CacheAligned::ThreadPeak peak;
+    const size_t before = jxl::CacheAligned::GetThreadStats().bytes_in_use;
+    ComputeSSIMULACRA2(orig.Main(), dist.Main(), 0.5f);
+    whole_bytes = jxl::CacheAligned::GetThreadStats().max_bytes_in_use - before;
+  }
+
+  SSIMULACRA2Trace::Start();
+  Msssim msssim;
+  ASSERT_TRUE(ComputeSSIMULACRA2WithinBudget(orig.Main(), dist.Main(), 0.5f,
+                                             whole_bytes / 4, &msssim));
+  const std::string json = WriteTrace();
+
+  const size_t strips = Count(json, "\"name\":\"CompareStrip\"");
+  EXPECT_GT(strips, 6u);
+  EXPECT_EQ(1u, Count(json, "\"args\":{\"scale\":0,\"strip\":0}}"));
+  EXPECT_EQ(1u, Count(json, "\"args\":{\"scale\":0,\"strip\":1}}"));
+}
+
+}  // namespace